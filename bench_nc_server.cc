@@ -0,0 +1,469 @@
+//              Copyright (C) by UCAR
+//
+// Description:
+//   Microbenchmarks of the netCDF write engine of nc_server.  Records are
+//   written with FileGroup::put_rec() and NS_NcFile::put_rec() in this
+//   process, without RPC, so changes to the storage code can be measured
+//   apart from the transport.
+
+#include "nc_server.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+using nidas::util::UTime;
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+/**
+ * The definition of a variable group, with the storage for its strings.
+ */
+class BenchGroup
+{
+public:
+    /**
+     * @param prefix Prefix of the variable names.
+     * @param nvars Number of variables.
+     * @param interval Interval of the records.
+     * @param nstations Size of a station dimension, or 0 for none.
+     * @param counts Whether the group has a counts variable.
+     */
+    BenchGroup(const string& prefix, int nvars, double interval,
+               int nstations, bool counts);
+
+    const datadef* def() const { return &_dd; }
+
+    int nvars() const { return _names.size(); }
+
+    int nstations() const { return _nstations; }
+
+    bool counts() const { return _counts; }
+
+private:
+    vector<string> _names;
+
+    string _units;
+
+    string _countsAttr;
+
+    string _countsName;
+
+    string _stationName;
+
+    vector<variable> _vars;
+
+    vector<str_attr> _attrs;
+
+    dimension _stationDim;
+
+    int _nstations;
+
+    bool _counts;
+
+    datadef _dd;
+};
+
+BenchGroup::BenchGroup(const string& prefix, int nvars, double interval,
+                       int nstations, bool counts):
+    _names(nvars), _units("V"), _countsAttr("counts"),
+    _countsName("counts_" + prefix), _stationName("station"),
+    _vars(nvars), _attrs(nvars), _stationDim(), _nstations(nstations),
+    _counts(counts), _dd()
+{
+    for (int iv = 0; iv < nvars; iv++) {
+        std::ostringstream ost;
+        ost << prefix << '_' << iv;
+        _names[iv] = ost.str();
+        _vars[iv].name = (char*) _names[iv].c_str();
+        _vars[iv].units = (char*) _units.c_str();
+        _vars[iv].attrs.attrs_len = 0;
+        _vars[iv].attrs.attrs_val = 0;
+        if (counts) {
+            _attrs[iv].name = (char*) _countsAttr.c_str();
+            _attrs[iv].value = (char*) _countsName.c_str();
+            _vars[iv].attrs.attrs_len = 1;
+            _vars[iv].attrs.attrs_val = &_attrs[iv];
+        }
+    }
+    _stationDim.name = (char*) _stationName.c_str();
+    _stationDim.size = nstations;
+
+    memset(&_dd, 0, sizeof(_dd));
+    _dd.interval = interval;
+    _dd.rectype = NS_TIMESERIES;
+    _dd.datatype = NS_FLOAT;
+    _dd.variables.variables_len = nvars;
+    _dd.variables.variables_val = &_vars.front();
+    _dd.dimensions.dimensions_len = nstations > 0 ? 1 : 0;
+    _dd.dimensions.dimensions_val = nstations > 0 ? &_stationDim : 0;
+    _dd.floatFill = 1.e37;
+    _dd.fillmissingrecords = 1;
+}
+
+/**
+ * A float data record of a group, whose time and station are set
+ * before each write.
+ */
+class BenchRecord
+{
+public:
+    BenchRecord(const BenchGroup& group, int groupid);
+
+    datarec_float* set(double t, int station);
+
+private:
+    vector<float> _data;
+
+    int _cnts;
+
+    int _start;
+
+    int _count;
+
+    datarec_float _rec;
+
+    BenchRecord(const BenchRecord&);
+    BenchRecord& operator=(const BenchRecord&);
+};
+
+BenchRecord::BenchRecord(const BenchGroup& group, int groupid):
+    _data(group.nvars()), _cnts(0), _start(0), _count(1), _rec()
+{
+    memset(&_rec, 0, sizeof(_rec));
+    _rec.datarecId = groupid;
+    _rec.data.data_len = _data.size();
+    _rec.data.data_val = &_data.front();
+    if (group.counts()) {
+        _rec.cnts.cnts_len = 1;
+        _rec.cnts.cnts_val = &_cnts;
+    }
+    if (group.nstations() > 0) {
+        _rec.start.start_len = 1;
+        _rec.start.start_val = &_start;
+        _rec.count.count_len = 1;
+        _rec.count.count_val = &_count;
+    }
+}
+
+datarec_float* BenchRecord::set(double t, int station)
+{
+    _rec.time = t;
+    _start = station;
+    _cnts = 10 + (int)t % 5;
+    for (unsigned int i = 0; i < _data.size(); i++)
+        _data[i] = sin(t * 0.001 + i) * 10.0 + station;
+    return &_rec;
+}
+
+struct BenchOptions
+{
+    BenchOptions(): outputDir("."), resultsFile(), nrecs(20000),
+        recordBuffer(1), noFill(false), only()
+    {
+    }
+
+    string outputDir;
+
+    string resultsFile;
+
+    /** Records written by each case. */
+    int nrecs;
+
+    unsigned int recordBuffer;
+
+    bool noFill;
+
+    /** If not empty, run only the case with this name. */
+    string only;
+};
+
+/**
+ * Times the cases and prints their results.
+ */
+class Bench
+{
+public:
+    Bench(const BenchOptions& opts);
+
+    /**
+     * Write records of the groups with FileGroup::put_rec(), each group
+     * at each time, and each station of a group, with a time step of dt
+     * and skipping every gap'th step if gap is positive.
+     */
+    void put_recs(const string& name, const vector<BenchGroup*>& groups,
+                  double fileInterval, double fileLength, double dt,
+                  int gap = 0);
+
+    /**
+     * The cost of the first record of a group in a file, when get_vars()
+     * defines its variables, compared to the records after it.
+     */
+    void first_record(int ngroups, int nvars);
+
+    bool selected(const string& name) const
+    {
+        return _opts.only.empty() || _opts.only == name;
+    }
+
+    /**
+     * @param nrecs Number of records, the divisor of the time per record.
+     */
+    void result(const string& name, unsigned long nrecs, double secs);
+
+private:
+    void remove_files(const string& prefix);
+
+    const BenchOptions& _opts;
+
+    std::ofstream _results;
+
+    Bench(const Bench&);
+    Bench& operator=(const Bench&);
+};
+
+Bench::Bench(const BenchOptions& opts): _opts(opts), _results()
+{
+    if (!_opts.resultsFile.empty())
+        _results.open(_opts.resultsFile.c_str(), std::ios::app);
+    std::cout << std::left << std::setw(24) << "case" << std::right <<
+        std::setw(10) << "records" << std::setw(12) << "secs" <<
+        std::setw(14) << "records/s" << std::setw(12) << "usecs/rec" <<
+        std::endl;
+}
+
+void Bench::remove_files(const string& prefix)
+{
+    string cmd = "/bin/rm -f " + _opts.outputDir + "/bench_" + prefix +
+        "_*.nc";
+    if (system(cmd.c_str()) != 0)
+        std::cerr << cmd << " failed" << std::endl;
+}
+
+void Bench::result(const string& name, unsigned long nrecs, double secs)
+{
+    double usecs = nrecs > 0 ? secs * 1.e6 / nrecs : 0.0;
+    std::cout << std::left << std::setw(24) << name << std::right <<
+        std::setw(10) << nrecs << std::setw(12) << std::fixed <<
+        std::setprecision(4) << secs << std::setw(14) <<
+        std::setprecision(0) << nrecs / secs << std::setw(12) <<
+        std::setprecision(2) << usecs << std::endl;
+    if (_results.is_open()) {
+        _results << "{\"case\":\"" << name << "\",\"records\":" << nrecs <<
+            ",\"seconds\":" << secs << ",\"usecs_per_record\":" << usecs <<
+            ",\"record_buffer\":" << _opts.recordBuffer <<
+            ",\"nofill\":" << (_opts.noFill ? "true" : "false") << "}" <<
+            std::endl;
+    }
+}
+
+void Bench::put_recs(const string& name, const vector<BenchGroup*>& groups,
+                     double fileInterval, double fileLength, double dt,
+                     int gap)
+{
+    remove_files(name);
+    string fmt = "bench_" + name + "_%Y%m%d_%H%M%S.nc";
+    string cdlfile;
+    connection conn;
+    conn.filelength = fileLength;
+    conn.interval = fileInterval;
+    conn.filenamefmt = (char*) fmt.c_str();
+    conn.outputdir = (char*) _opts.outputDir.c_str();
+    conn.cdlfile = (char*) cdlfile.c_str();
+
+    FileGroup fgroup(&conn);
+    vector<BenchRecord*> recs;
+    for (unsigned int i = 0; i < groups.size(); i++)
+        recs.push_back(new BenchRecord(*groups[i],
+                                       fgroup.add_var_group(groups[i]->def())));
+
+    double t0 = UTime(true, 2024, 1, 1, 0, 0, 0).toDoubleSecs();
+    vector<NS_NcFile*> hotFiles;
+    unsigned long nrecs = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (int it = 0; nrecs < (unsigned long)_opts.nrecs; it++) {
+        if (gap > 0 && it % gap == gap - 1) continue;
+        double t = t0 + it * dt;
+        for (unsigned int ig = 0; ig < groups.size(); ig++) {
+            int nstations = std::max(groups[ig]->nstations(), 1);
+            for (int istn = 0; istn < nstations; istn++) {
+                fgroup.put_rec<datarec_float,float>(recs[ig]->set(t, istn),
+                                                    hotFiles);
+                nrecs++;
+            }
+        }
+    }
+    fgroup.close();
+    double secs = std::chrono::duration<double>(bench_clock::now() - start).count();
+    result(name, nrecs, secs);
+
+    for (unsigned int i = 0; i < recs.size(); i++) delete recs[i];
+}
+
+void Bench::first_record(int ngroups, int nvars)
+{
+    string name = "first_record";
+    remove_files(name);
+    string fmt = "bench_" + name + "_%Y%m%d_%H%M%S.nc";
+    string cdlfile;
+    connection conn;
+    conn.filelength = 3600;
+    conn.interval = 1.0;
+    conn.filenamefmt = (char*) fmt.c_str();
+    conn.outputdir = (char*) _opts.outputDir.c_str();
+    conn.cdlfile = (char*) cdlfile.c_str();
+    FileGroup fgroup(&conn);
+
+    vector<BenchGroup*> groups;
+    vector<VariableGroup*> vgroups;
+    vector<BenchRecord*> recs;
+    for (int ig = 0; ig < ngroups; ig++) {
+        std::ostringstream prefix;
+        prefix << 'f' << ig;
+        groups.push_back(new BenchGroup(prefix.str(), nvars, 1.0, 0, false));
+        vgroups.push_back(new VariableGroup(groups[ig]->def(), ig, 1.0));
+        recs.push_back(new BenchRecord(*groups[ig], ig));
+    }
+
+    double t0 = UTime(true, 2024, 1, 1, 0, 0, 0).toDoubleSecs();
+    double firstSecs = 0.0;
+    double restSecs = 0.0;
+    unsigned long nrest = 0;
+    int nfiles = std::max(_opts.nrecs / 2000, 1);
+    for (int ifile = 0; ifile < nfiles; ifile++) {
+        double tfile = t0 + ifile * 3600;
+        // Write each group to its own NS_NcFile, as FileGroup::put_rec
+        // would, without the file lookup.
+        NS_NcFile* f = fgroup.open_file(tfile);
+        for (int ig = 0; ig < ngroups; ig++) {
+            bench_clock::time_point start = bench_clock::now();
+            f->put_rec<datarec_float,float>(recs[ig]->set(tfile, 0),
+                                            vgroups[ig], tfile);
+            firstSecs += std::chrono::duration<double>(
+                bench_clock::now() - start).count();
+        }
+        bench_clock::time_point start = bench_clock::now();
+        for (int it = 1; it < 100; it++) {
+            for (int ig = 0; ig < ngroups; ig++) {
+                f->put_rec<datarec_float,float>(recs[ig]->set(tfile + it, 0),
+                                                vgroups[ig], tfile + it);
+                nrest++;
+            }
+        }
+        restSecs += std::chrono::duration<double>(
+            bench_clock::now() - start).count();
+        delete f;
+    }
+    result("first_record", nfiles * ngroups, firstSecs);
+    result("after_first_record", nrest, restSecs);
+
+    for (int ig = 0; ig < ngroups; ig++) {
+        delete recs[ig];
+        delete vgroups[ig];
+        delete groups[ig];
+    }
+}
+
+void usage(const char* argv0)
+{
+    std::cerr << "\
+Microbenchmarks of the nc_server netCDF write engine, without RPC.\n\
+Usage: " << argv0 << " [-d dir] [-N nrecs] [-b nrecs] [-n] [-c case] [-o file]\n\
+    -d dir: directory for the files, default .\n\
+    -N nrecs: records written by each case, default 20000\n\
+    -b nrecs: record buffer size, as nc_server -b, default 1\n\
+    -n: NC_NOFILL mode, as nc_server -n\n\
+    -c case: run only one case: scalar, station, samples, counts,\n\
+       gap_fill, rollover or first_record\n\
+    -o file: append the results to file, one line of JSON per case" <<
+        std::endl;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions opts;
+    int c;
+    while ((c = getopt(argc, argv, "b:c:d:nN:o:")) != -1) {
+        switch (c) {
+        case 'b': opts.recordBuffer = atoi(optarg); break;
+        case 'c': opts.only = optarg; break;
+        case 'd': opts.outputDir = optarg; break;
+        case 'n': opts.noFill = true; break;
+        case 'N': opts.nrecs = atoi(optarg); break;
+        case 'o': opts.resultsFile = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.nrecs < 1 || opts.recordBuffer < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    nidas::util::Logger* logger = nidas::util::Logger::createInstance(&std::cerr);
+    nidas::util::LogScheme logscheme("bench_nc_server");
+    nidas::util::LogConfig lc;
+    lc.parse("warning");
+    logscheme.addConfig(lc);
+    logger->setScheme(logscheme);
+
+    NS_NcFile::setRecordBuffer(opts.recordBuffer, 10);
+    NS_NcFile::setNoFill(opts.noFill);
+
+    Bench bench(opts);
+    try {
+        if (bench.selected("scalar")) {
+            BenchGroup g0("s0", 10, 1.0, 0, false);
+            BenchGroup g1("s1", 10, 1.0, 0, false);
+            bench.put_recs("scalar", { &g0, &g1 }, 1.0, 86400, 1.0);
+        }
+        if (bench.selected("station")) {
+            BenchGroup g("st", 10, 1.0, 20, false);
+            bench.put_recs("station", { &g }, 1.0, 86400, 1.0);
+        }
+        if (bench.selected("samples")) {
+            // 20 samples per file record in the sample dimension
+            BenchGroup g("sa", 10, 0.05, 0, false);
+            bench.put_recs("samples", { &g }, 1.0, 86400, 0.05);
+        }
+        if (bench.selected("counts")) {
+            BenchGroup g("co", 10, 300.0, 0, true);
+            bench.put_recs("counts", { &g }, 300.0, 86400 * 31, 300.0);
+        }
+        if (bench.selected("gap_fill")) {
+            // every 4th record is missing, and filled by put_time
+            BenchGroup g("gf", 10, 1.0, 0, false);
+            bench.put_recs("gap_fill", { &g }, 1.0, 86400, 1.0, 4);
+        }
+        if (bench.selected("rollover")) {
+            // a new file every 1000 records
+            BenchGroup g("ro", 10, 1.0, 0, false);
+            bench.put_recs("rollover", { &g }, 1.0, 1000, 1.0);
+        }
+        if (bench.selected("first_record"))
+            bench.first_record(10, 50);
+    }
+    catch (const nidas::util::Exception& e) {
+        std::cerr << e.what() << std::endl;
+        AllFiles::Instance()->close();
+        return 1;
+    }
+    AllFiles::Instance()->close();
+    return 0;
+}
@@ -41,6 +41,13 @@
 #include <nidas/util/util.h>
 
 #include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
 
 using namespace nidas::dynld::isff;
 using namespace std;
@@ -60,7 +67,19 @@ NetcdfRPCChannel::NetcdfRPCChannel():
     _clnt(0), _connectionId(0), _rpcBatchPeriod(300),
     _rpcWriteTimeout(),_rpcOtherTimeout(),_rpcBatchTimeout(),
     _ntry(0),_lastNonBatchWrite(0),
+    _rpcBatchMsecs(0),_rpcBatchBytes(65536),_arrayWrites(true),_bulkSetup(true),
+    _pending(),_npending(0),_pendingBytes(0),_pendingTime(),_pendingRecs(),
+    _queueLength(0),_overflow(OVERFLOW_BLOCK),_spillFileName(),
+    _queue(),_qhead(0),_qtail(0),_queueMutex(),_queueCond(),_spaceCond(),
+    _quit(false),_senderError(),_sender(),
+    _spillFd(-1),_spillWritten(0),_spillRead(0),_spilling(false),
+    _ndropped(0),_nspilled(0),
+    _ackWrites(false),_seqWrites(false),_ackWindow(10000),_seq(0),
+    _unacked(),_prevGroupIds(),_nunconfirmed(0),
+    _spoolFileName(),_spoolSize(64 * 1024 * 1024),_reconnectSecs(30),
+    _spool(),_outage(false),_nextReconnect(0),
     _groupById(),_stationIndexById(),_groups(),
+    _groupsBySignature(),_projectVars(),
     _sampleTags(), _constSampleTags(),
     _timeInterval(300)
 {
@@ -86,7 +105,22 @@ NetcdfRPCChannel::NetcdfRPCChannel(const NetcdfRPCChannel& x):
     _rpcOtherTimeout(x._rpcOtherTimeout),
     _rpcBatchTimeout(x._rpcBatchTimeout),
     _ntry(0),_lastNonBatchWrite(0),
+    _rpcBatchMsecs(x._rpcBatchMsecs),_rpcBatchBytes(x._rpcBatchBytes),
+    _arrayWrites(true),_bulkSetup(true),
+    _pending(),_npending(0),_pendingBytes(0),_pendingTime(),_pendingRecs(),
+    _queueLength(x._queueLength),_overflow(x._overflow),
+    _spillFileName(x._spillFileName),
+    _queue(),_qhead(0),_qtail(0),_queueMutex(),_queueCond(),_spaceCond(),
+    _quit(false),_senderError(),_sender(),
+    _spillFd(-1),_spillWritten(0),_spillRead(0),_spilling(false),
+    _ndropped(0),_nspilled(0),
+    _ackWrites(x._ackWrites),_seqWrites(false),_ackWindow(x._ackWindow),
+    _seq(0),_unacked(),_prevGroupIds(),_nunconfirmed(0),
+    _spoolFileName(x._spoolFileName),_spoolSize(x._spoolSize),
+    _reconnectSecs(x._reconnectSecs),
+    _spool(),_outage(false),_nextReconnect(0),
     _groupById(),_stationIndexById(),_groups(),
+    _groupsBySignature(),_projectVars(),
     _sampleTags(), _constSampleTags(),
     _timeInterval(x._timeInterval)
 {
@@ -96,6 +130,7 @@ NetcdfRPCChannel::NetcdfRPCChannel(const NetcdfRPCChannel& x):
 
 NetcdfRPCChannel::~NetcdfRPCChannel()
 {
+    stopSender();
     list<SampleTag*>::iterator si = _sampleTags.begin();
     for ( ; si != _sampleTags.end(); ++si) delete *si;
 }
@@ -166,6 +201,26 @@ int NetcdfRPCChannel::getRPCBatchPeriod() const
     return _rpcBatchPeriod;
 }
 
+void NetcdfRPCChannel::setRPCBatchMsecs(int val)
+{
+    _rpcBatchMsecs = val;
+}
+
+int NetcdfRPCChannel::getRPCBatchMsecs() const
+{
+    return _rpcBatchMsecs;
+}
+
+void NetcdfRPCChannel::setRPCBatchBytes(int val)
+{
+    _rpcBatchBytes = val;
+}
+
+int NetcdfRPCChannel::getRPCBatchBytes() const
+{
+    return _rpcBatchBytes;
+}
+
 void NetcdfRPCChannel::requestConnection(IOChannelRequester* rqstr)
 {
     connect();
@@ -191,7 +246,7 @@ IOChannel* NetcdfRPCChannel::connect()
     _clnt = nc_server_client_create(getServer());
     if (_clnt == (CLIENT *) NULL)
     {
-        throw n_u::IOException(getName(),"clnt_create",
+        throw RPCCallFailed(getName(),"clnt_create",
             clnt_spcreateerror(_server.c_str()));
     }
 
@@ -212,7 +267,7 @@ IOChannel* NetcdfRPCChannel::connect()
                                (xdrproc_t) xdr_int,  (caddr_t) &result,
                                _rpcOtherTimeout)) != RPC_SUCCESS)
     {
-        n_u::IOException e(getName(), "open",
+        RPCCallFailed e(getName(), "open",
                            clnt_sperror(_clnt,_server.c_str()));
         nc_server_client_destroy(_clnt);
         _clnt = 0;
@@ -236,13 +291,41 @@ IOChannel* NetcdfRPCChannel::connect()
 
     _lastNonBatchWrite = time((time_t *)0);
 
+    _bulkSetup = true;
+    _seq = 0;
+    _seqWrites = false;
+    if (_ackWrites && _rpcBatchPeriod > 0) {
+        _seqWrites = ackThrough();
+        if (!_seqWrites)
+            WLOG(("%s: nc_server does not support ACK_THROUGH, "
+                  "records will not be acknowledged", getName().c_str()));
+    }
+
     return this;
 }
 
 
+namespace {
+/**
+ * Period and variable names of a SampleTag, which are the same for all
+ * the SampleTags of a NcVarGroupFloat.
+ */
+string groupSignature(const SampleTag* stag)
+{
+    ostringstream ost;
+    ost << stag->getPeriod();
+    for (VariableIterator vi = stag->getVariableIterator(); vi.hasNext(); )
+        ost << ' ' << vi.next()->getName();
+    return ost.str();
+}
+}
+
 void NetcdfRPCChannel::defineData()
 {
     Project* project = Project::getInstance();
+    std::chrono::steady_clock::time_point t0 =
+        std::chrono::steady_clock::now();
+    indexProjectVariables();
 
     unsigned int nstations = 0;
     if (project->getMaxSiteNumber() > 0)
@@ -308,8 +391,9 @@ void NetcdfRPCChannel::defineData()
                 grp = new NcVarGroupFloat(noStnDims,stag,_fillValue);
             else
                 grp = new NcVarGroupFloat(dims,stag,_fillValue);
-            grp->connect(this,_fillValue);
+            grp->encode(this,_fillValue);
             _groups.push_back(grp);
+            _groupsBySignature.insert(make_pair(groupSignature(stag), grp));
         }
         VLOG(("adding to groupById, tag=")
              << stag->getDSMId() << ',' << stag->getSpSId()
@@ -317,7 +401,45 @@ void NetcdfRPCChannel::defineData()
         _groupById[stag->getId()] = grp;
     }
 
-    writeGlobalAttr("NIDAS_version", Version::getSoftwareVersion());
+    defineGroups();
+    writeGlobalAttrs();
+
+    // The project variables are only needed to define the groups.
+    size_t nvars = _projectVars.size();
+    _projectVars.clear();
+
+    std::chrono::duration<double> secs =
+        std::chrono::steady_clock::now() - t0;
+    ILOG(("%s: defined %zu variable groups for %zu sample tags, "
+          "%zu project variables, in %.3f secs", getName().c_str(),
+          _groups.size(), tags.size(), nvars, secs.count()));
+}
+
+void NetcdfRPCChannel::indexProjectVariables()
+{
+    _projectVars.clear();
+    VariableIterator vit(Project::getInstance());
+    while (vit.hasNext()) {
+        const Variable* vp = vit.next();
+        // keep the first, as the search of the project did
+        _projectVars.insert(make_pair(vp->getName(), vp));
+    }
+}
+
+const Variable*
+NetcdfRPCChannel::getProjectVariable(const string& name) const
+{
+    map<string, const Variable*>::const_iterator vi = _projectVars.find(name);
+    if (vi == _projectVars.end()) return 0;
+    return vi->second;
+}
+
+void NetcdfRPCChannel::writeGlobalAttrs()
+{
+    vector<pair<string, string> > attrs;
+    vector<pair<string, int> > intAttrs;
+
+    attrs.push_back(make_pair("NIDAS_version", Version::getSoftwareVersion()));
 
     // previously project_config had the form <config>=<version>, where
     // <config> was the expanded xml file path and <version> was generated
@@ -337,36 +459,37 @@ void NetcdfRPCChannel::defineData()
     if (configName.empty())
         configName = Project::getInstance()->getConfigName();
     if (configName.length() > 0) {
-        writeGlobalAttr("project_config", configName);
+        attrs.push_back(make_pair("project_config", configName));
     }
 
     if ((env = getenv("ISFS_CONFIG_VERSION")))
     {
-        writeGlobalAttr("project_version", env);
+        attrs.push_back(make_pair("project_version", env));
     }
     if ((env = getenv("ISFS_CONFIG_BEGIN")))
     {
-        writeGlobalAttr("isfs_config_begin", env);
+        attrs.push_back(make_pair("isfs_config_begin", env));
     }
     if ((env = getenv("ISFS_CONFIG_END")))
     {
-        writeGlobalAttr("isfs_config_end", env);
+        attrs.push_back(make_pair("isfs_config_end", env));
     }
 
     const Dataset& dataset = Project::getInstance()->getDataset();
 
     if (dataset.getName().length() > 0) {
-        writeGlobalAttr("dataset", dataset.getName());
+        attrs.push_back(make_pair("dataset", dataset.getName()));
         if (dataset.getDescription().length() > 0)
-            writeGlobalAttr("dataset_description", dataset.getDescription());
+            attrs.push_back(make_pair("dataset_description",
+                                      dataset.getDescription()));
     }
     else if ((env = getenv("DATASET")))
     {
         // fall back to the name in the environment, assuming it must be the
         // active settings.  however, the description is not available.
-        writeGlobalAttr("dataset", env);
+        attrs.push_back(make_pair("dataset", env));
         if ((env = getenv("DATASET_DESCRIPTION")))
-            writeGlobalAttr("dataset_description", env);
+            attrs.push_back(make_pair("dataset_description", env));
     }
 
     // Write some string project parameters as NetCDF global attributes
@@ -378,7 +501,7 @@ void NetcdfRPCChannel::defineData()
         if (parm && parm->getType() == Parameter::STRING_PARAM &&
                 parm->getLength() == 1) {
             string val = parm->getStringValue(0);
-            writeGlobalAttr(*pstr, val);
+            attrs.push_back(make_pair(*pstr, val));
         }
     }
 
@@ -394,7 +517,7 @@ void NetcdfRPCChannel::defineData()
                 parm->getType() == Parameter::FLOAT_PARAM) &&
                 parm->getLength() == 1)) {
             int val = (int) parm->getNumericValue(0);
-            writeGlobalAttr(*pstr, val);
+            intAttrs.push_back(make_pair(*pstr, val));
         }
     }
 
@@ -408,7 +531,7 @@ void NetcdfRPCChannel::defineData()
     // remain.
 
     // Write file length as a global attribute
-    writeGlobalAttr("file_length_seconds", getFileLength());
+    intAttrs.push_back(make_pair("file_length_seconds", getFileLength()));
 
     string cpstr;
     const vector<string>& calpaths = nidas::core::CalFile::getAllPaths();
@@ -418,15 +541,134 @@ void NetcdfRPCChannel::defineData()
         cpstr += cpath;
     }
     if (cpstr.length() > 0)
-        writeGlobalAttr("calibration_file_path", cpstr);
+        attrs.push_back(make_pair("calibration_file_path", cpstr));
+
+    writeGlobalAttrs(attrs, intAttrs);
+}
+
+void NetcdfRPCChannel::writeGlobalAttrs(
+        const vector<pair<string, string> >& attrs,
+        const vector<pair<string, int> >& intAttrs)
+{
+    if (_bulkSetup) {
+        vector<str_attr> sattrs(attrs.size());
+        for (unsigned int i = 0; i < attrs.size(); i++) {
+            sattrs[i].name = const_cast<char*>(attrs[i].first.c_str());
+            sattrs[i].value = const_cast<char*>(attrs[i].second.c_str());
+        }
+        vector<int_attr> iattrs(intAttrs.size());
+        for (unsigned int i = 0; i < intAttrs.size(); i++) {
+            iattrs[i].name = const_cast<char*>(intAttrs[i].first.c_str());
+            iattrs[i].value = intAttrs[i].second;
+        }
+        global_attrs gattrs;
+        gattrs.connectionId = _connectionId;
+        gattrs.attrs.attrs_len = sattrs.size();
+        gattrs.attrs.attrs_val = sattrs.empty() ? 0 : &sattrs.front();
+        gattrs.intAttrs.intAttrs_len = iattrs.size();
+        gattrs.intAttrs.intAttrs_val = iattrs.empty() ? 0 : &iattrs.front();
+
+        int result = 0;
+        enum clnt_stat clnt_stat;
+        int ntry;
+        for (ntry = 0; ntry < 5; ntry++) {
+            clnt_stat = clnt_call(_clnt, WRITE_GLOBAL_ATTRS,
+                (xdrproc_t) xdr_global_attrs, (caddr_t) &gattrs,
+                (xdrproc_t) xdr_int, (caddr_t) &result,
+                _rpcOtherTimeout);
+            if (clnt_stat == RPC_SUCCESS || clnt_stat == RPC_PROCUNAVAIL) break;
+            WLOG(("nc_server WRITE_GLOBAL_ATTRS failed: %s, timeout=%d secs, ntry=%d",
+                  clnt_sperrno(clnt_stat), getRPCTimeout(), ntry+1));
+            if (clnt_stat != RPC_TIMEDOUT && clnt_stat != RPC_CANTRECV) break;
+        }
+        if (clnt_stat == RPC_SUCCESS) {
+            if (result) {
+                checkError();
+                throw n_u::IOException(getName(),"writeGlobalAttrs",
+                    "unknown error");
+            }
+            _lastNonBatchWrite = time((time_t*)0);
+            return;
+        }
+        if (clnt_stat != RPC_PROCUNAVAIL)
+            throw RPCCallFailed(getName(),"writeGlobalAttrs",
+                clnt_sperror(_clnt,""));
+        // An older nc_server, write the attributes one at a time.
+        WLOG(("%s: nc_server does not support WRITE_GLOBAL_ATTRS",
+              getName().c_str()));
+        _bulkSetup = false;
+    }
+    for (unsigned int i = 0; i < attrs.size(); i++)
+        writeGlobalAttr(attrs[i].first, attrs[i].second);
+    for (unsigned int i = 0; i < intAttrs.size(); i++)
+        writeGlobalAttr(intAttrs[i].first, intAttrs[i].second);
+}
+
+void NetcdfRPCChannel::defineGroups()
+{
+    if (_groups.empty()) return;
+
+    if (_bulkSetup) {
+        vector<datadef> defs;
+        list<NcVarGroupFloat*>::const_iterator gi = _groups.begin();
+        for ( ; gi != _groups.end(); ++gi) {
+            (*gi)->_ddef.connectionId = _connectionId;
+            defs.push_back((*gi)->_ddef);
+        }
+        datadefs ddefs;
+        ddefs.connectionId = _connectionId;
+        ddefs.defs.defs_len = defs.size();
+        ddefs.defs.defs_val = &defs.front();
+
+        datarec_ids ids;
+        memset(&ids, 0, sizeof(ids));
+        enum clnt_stat clnt_stat;
+        int ntry;
+        for (ntry = 0; ntry < 5; ntry++) {
+            clnt_stat = clnt_call(_clnt, DEFINE_DATARECS,
+                (xdrproc_t) xdr_datadefs, (caddr_t) &ddefs,
+                (xdrproc_t) xdr_datarec_ids, (caddr_t) &ids,
+                _rpcOtherTimeout);
+            if (clnt_stat == RPC_SUCCESS || clnt_stat == RPC_PROCUNAVAIL) break;
+            WLOG(("nc_server DEFINE_DATARECS failed: %s, timeout=%d secs, ntry=%d",
+                  clnt_sperrno(clnt_stat), getRPCTimeout(), ntry+1));
+            if (clnt_stat != RPC_TIMEDOUT && clnt_stat != RPC_CANTRECV) break;
+        }
+        if (clnt_stat == RPC_SUCCESS) {
+            bool ok = ids.ids.ids_len == defs.size();
+            if (ok) {
+                gi = _groups.begin();
+                for (int i = 0; gi != _groups.end(); ++gi, i++)
+                    (*gi)->connected(this, ids.ids.ids_val[i]);
+            }
+            xdr_free((xdrproc_t) xdr_datarec_ids, (char*) &ids);
+            if (!ok) {
+                checkError();
+                throw n_u::IOException(getName(),"define data recs",
+                    "unknown error");
+            }
+            return;
+        }
+        if (clnt_stat != RPC_PROCUNAVAIL)
+            throw RPCCallFailed(getName(),"define data recs",
+                clnt_sperrno(clnt_stat));
+        WLOG(("%s: nc_server does not support DEFINE_DATARECS",
+              getName().c_str()));
+        _bulkSetup = false;
+    }
+    list<NcVarGroupFloat*>::const_iterator gi = _groups.begin();
+    for ( ; gi != _groups.end(); ++gi) (*gi)->connect(this, _fillValue);
 }
 
 NcVarGroupFloat* NetcdfRPCChannel::getNcVarGroupFloat(
         const vector<ParameterT<int> >&dims,
         const SampleTag* stag)
 {
-    for (auto& grp: _groups)
+    // Only the groups with the same period and variable names can match.
+    auto range = _groupsBySignature.equal_range(groupSignature(stag));
+    for (auto gi = range.first; gi != range.second; ++gi)
     {
+        NcVarGroupFloat* grp = gi->second;
         const auto& dimensions = grp->getDimensions();
         if (dimensions.size() != dims.size()) continue;
 
@@ -470,7 +712,9 @@ void NetcdfRPCChannel::write(const Sample* samp)
     {
         defineData();
         _data_defined = true;
+        if (!_unacked.empty()) resend();
     }
+    if (_outage && time(0) >= _nextReconnect) reconnect();
     dsm_sample_id_t sampid = samp->getId();
 
     map<dsm_sample_id_t,NcVarGroupFloat*>::const_iterator gi =
@@ -485,14 +729,64 @@ void NetcdfRPCChannel::write(const Sample* samp)
 
     NcVarGroupFloat* g = gi->second;
 
+    // start the sender after the synchronous calls of defineData()
+    if (_queueLength > 0 && !_sender.joinable()) {
+        _queue.resize(_queueLength);
+        _quit = false;
+        _sender = std::thread(&NetcdfRPCChannel::sendLoop, this);
+    }
+
     int stationIndex = _stationIndexById[samp->getId()];
 
     VLOG(("NetcdfRPCChannel::write, stationIndex=") << stationIndex);
     g->write(this,samp,stationIndex);
 }
 
+void NetcdfRPCChannel::PendingRec::set(const datarec_float* rec)
+{
+    time = rec->time;
+    datarecId = rec->datarecId;
+    start.assign(rec->start.start_val,
+                 rec->start.start_val + rec->start.start_len);
+    count.assign(rec->count.count_val,
+                 rec->count.count_val + rec->count.count_len);
+    cnts.assign(rec->cnts.cnts_val, rec->cnts.cnts_val + rec->cnts.cnts_len);
+    data.assign(rec->data.data_val, rec->data.data_val + rec->data.data_len);
+}
+
+void NetcdfRPCChannel::PendingRec::get(datarec_float* rec, int connectionId)
+{
+    rec->time = time;
+    rec->connectionId = connectionId;
+    rec->datarecId = datarecId;
+    rec->start.start_len = start.size();
+    rec->start.start_val = start.data();
+    rec->count.count_len = count.size();
+    rec->count.count_val = count.data();
+    rec->cnts.cnts_len = cnts.size();
+    rec->cnts.cnts_val = cnts.data();
+    rec->data.data_len = data.size();
+    rec->data.data_val = data.data();
+}
+
 void NetcdfRPCChannel::write(datarec_float *rec)
 {
+    if (_queueLength > 0) enqueue(rec);
+    else deliver(rec);
+}
+
+void NetcdfRPCChannel::send(datarec_float *rec)
+{
+    if (_rpcBatchMsecs > 0 && _rpcBatchPeriod > 0 && _arrayWrites) {
+        coalesce(rec);
+        return;
+    }
+
+    if (_seqWrites) {
+        sendSeq(rec, 1);
+        return;
+    }
+
     /*
      * Every so often in batch mode check if nc_server actually responds.
      */
@@ -513,7 +807,7 @@ void NetcdfRPCChannel::write(datarec_float *rec)
         (xdrproc_t) NULL, (caddr_t) NULL,
         _rpcBatchTimeout);
     if (clnt_stat != RPC_SUCCESS)
-        throw n_u::IOException(getName(),"write",clnt_sperror(_clnt,""));
+        throw RPCCallFailed(getName(),"write",clnt_sperror(_clnt,""));
 }
 
 void NetcdfRPCChannel::nonBatchWrite(datarec_float *rec)
@@ -530,7 +824,7 @@ void NetcdfRPCChannel::nonBatchWrite(datarec_float *rec)
             bool serious = (clnt_stat != RPC_TIMEDOUT && clnt_stat != RPC_CANTRECV) ||
                 _ntry++ >= NTRY;
             if (serious) 
-                throw n_u::IOException(getName(),"write", clnt_sperror(_clnt,""));
+                throw RPCCallFailed(getName(),"write", clnt_sperror(_clnt,""));
             if (_ntry > NTRY / 2) {
                 WLOG(("%s: %s, timeout=%d secs, ntry=%d",
                       getName().c_str(),
@@ -557,6 +851,569 @@ void NetcdfRPCChannel::nonBatchWrite(datarec_float *rec)
     }
 }
 
+void NetcdfRPCChannel::coalesce(const datarec_float *rec)
+{
+    if (_npending == _pending.size()) _pending.push_back(PendingRec());
+    _pending[_npending++].set(rec);
+
+    // time, ids and the lengths of the arrays, then their values
+    _pendingBytes += 32 + 4 * (rec->start.start_len + rec->count.count_len +
+                               rec->cnts.cnts_len + rec->data.data_len);
+
+    std::chrono::steady_clock::time_point tnow =
+        std::chrono::steady_clock::now();
+    if (_npending == 1) _pendingTime = tnow;
+
+    // The records are held no longer than the batch period, so that
+    // nc_server is checked as often as without coalescing.
+    int msecs = std::min(_rpcBatchMsecs, _rpcBatchPeriod * 1000);
+    if (_pendingBytes >= (size_t) _rpcBatchBytes ||
+        tnow - _pendingTime >= std::chrono::milliseconds(msecs))
+        flush();
+}
+
+void NetcdfRPCChannel::flush()
+{
+    if (_npending == 0) return;
+
+    unsigned int nrecs = _npending;
+    _npending = 0;
+    _pendingBytes = 0;
+
+    _pendingRecs.resize(nrecs);
+    for (unsigned int i = 0; i < nrecs; i++)
+        _pending[i].get(&_pendingRecs[i], _connectionId);
+
+    if (_seqWrites) {
+        sendSeq(&_pendingRecs.front(), nrecs);
+        return;
+    }
+    try {
+        sendArray(&_pendingRecs.front(), nrecs);
+    }
+    catch (const n_u::IOException&) {
+        // keep them to be spooled
+        if (!_spoolFileName.empty()) _npending = nrecs;
+        throw;
+    }
+}
+
+void NetcdfRPCChannel::sendArray(datarec_float *recs, unsigned int nrecs)
+{
+    datarec_float_array array;
+    array.connectionId = _connectionId;
+    array.recs.recs_len = nrecs;
+    array.recs.recs_val = recs;
+
+    int result = 0;
+    enum clnt_stat clnt_stat;
+
+    for ( ; ; ) {
+        clnt_stat = clnt_call(_clnt, WRITE_DATAREC_FLOAT_ARRAY,
+            (xdrproc_t) xdr_datarec_float_array, (caddr_t) &array,
+            (xdrproc_t) xdr_int, (caddr_t) &result,
+            _rpcWriteTimeout);
+        if (clnt_stat == RPC_PROCUNAVAIL) {
+            // An older nc_server, send the records one at a time.
+            WLOG(("%s: nc_server does not support WRITE_DATAREC_FLOAT_ARRAY, "
+                  "records will not be coalesced", getName().c_str()));
+            _arrayWrites = false;
+            for (unsigned int i = 0; i < nrecs; i++)
+                send(recs + i);
+            return;
+        }
+        if (clnt_stat != RPC_SUCCESS) {
+            bool serious = (clnt_stat != RPC_TIMEDOUT && clnt_stat != RPC_CANTRECV) ||
+                _ntry++ >= NTRY;
+            if (serious) 
+                throw RPCCallFailed(getName(),"write", clnt_sperror(_clnt,""));
+            if (_ntry > NTRY / 2) {
+                WLOG(("%s: %s, timeout=%d secs, ntry=%d",
+                      getName().c_str(),
+                      clnt_sperror(_clnt, "nc_server not responding"),
+                      _rpcWriteTimeout.tv_sec, _ntry));
+            }
+        }
+        else {
+            if (!result && _ntry > 0)
+                WLOG(("") << getName() << ": OK");
+            _ntry = 0;
+            /* If result is non-zero, then an error occured on nc_server.
+             * checkError() will retrieve the error string and throw the exception.
+             */
+            if (result) {
+                checkError();
+                throw n_u::IOException(getName(),"write","unknown error");
+            }
+            _lastNonBatchWrite = time((time_t*)0);
+            break;
+        }
+    }
+}
+
+void NetcdfRPCChannel::enqueue(const datarec_float *rec)
+{
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    if (!_senderError.empty())
+        throw n_u::IOException(getName(), "write", _senderError);
+
+    if (!_spilling && _qtail - _qhead == _queue.size()) {
+        switch (_overflow) {
+        case OVERFLOW_BLOCK:
+            while (_qtail - _qhead == _queue.size() && _senderError.empty())
+                _spaceCond.wait(lock);
+            if (!_senderError.empty())
+                throw n_u::IOException(getName(), "write", _senderError);
+            break;
+        case OVERFLOW_DROP:
+            if (!(_ndropped++ % 1000))
+                WLOG(("%s: queue of %u records is full, %lu records dropped",
+                      getName().c_str(), _queueLength, _ndropped));
+            _qhead++;
+            break;
+        case OVERFLOW_SPILL:
+            _spilling = true;
+            break;
+        }
+    }
+    if (_spilling) spill(rec);
+    else _queue[_qtail++ % _queue.size()].set(rec);
+    _queueCond.notify_one();
+}
+
+void NetcdfRPCChannel::spill(const datarec_float *rec)
+{
+    if (_spillFd < 0) {
+        if (_spillFileName.empty())
+            throw n_u::IOException(getName(), "spill", "no spill file");
+        _spillFd = ::open(_spillFileName.c_str(),
+                          O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (_spillFd < 0)
+            throw n_u::IOException(_spillFileName, "open", errno);
+        WLOG(("%s: queue of %u records is full, spilling records to %s",
+              getName().c_str(), _queueLength, _spillFileName.c_str()));
+    }
+
+    // length, then the XDR encoded record
+    u_int len = xdr_sizeof((xdrproc_t) xdr_datarec_float, (void*) rec);
+    vector<char> buf(len + 4);
+    XDR xdrs;
+    xdrmem_create(&xdrs, &buf.front(), buf.size(), XDR_ENCODE);
+    bool ok = xdr_u_int(&xdrs, &len) &&
+        xdr_datarec_float(&xdrs, const_cast<datarec_float*>(rec));
+    xdr_destroy(&xdrs);
+    if (!ok) throw n_u::IOException(_spillFileName, "encode", "failed");
+
+    ssize_t nw = ::pwrite(_spillFd, &buf.front(), buf.size(), _spillWritten);
+    if (nw != (ssize_t) buf.size())
+        throw n_u::IOException(_spillFileName, "write",
+                               nw < 0 ? errno : ENOSPC);
+    _spillWritten += nw;
+    _nspilled++;
+}
+
+off_t NetcdfRPCChannel::readSpill(off_t offset, datarec_float* rec)
+{
+    char lenbuf[4];
+    u_int len = 0;
+    XDR xdrs;
+    if (::pread(_spillFd, lenbuf, 4, offset) != 4)
+        throw n_u::IOException(_spillFileName, "read", errno);
+    xdrmem_create(&xdrs, lenbuf, 4, XDR_DECODE);
+    xdr_u_int(&xdrs, &len);
+    xdr_destroy(&xdrs);
+
+    vector<char> buf(len);
+    if (::pread(_spillFd, &buf.front(), len, offset + 4) != (ssize_t) len)
+        throw n_u::IOException(_spillFileName, "read", errno);
+    xdrmem_create(&xdrs, &buf.front(), len, XDR_DECODE);
+    bool ok = xdr_datarec_float(&xdrs, rec);
+    xdr_destroy(&xdrs);
+    if (!ok) throw n_u::IOException(_spillFileName, "decode", "failed");
+    return offset + 4 + len;
+}
+
+void NetcdfRPCChannel::sendLoop()
+{
+    PendingRec prec;
+    datarec_float rec;
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    try {
+        for (;;) {
+            if (_qhead != _qtail) {
+                // Swap the vectors of the record, which are reused by
+                // the next record put in this slot.
+                std::swap(prec, _queue[_qhead++ % _queue.size()]);
+                _spaceCond.notify_one();
+                lock.unlock();
+                prec.get(&rec, _connectionId);
+                deliver(&rec);
+                lock.lock();
+            }
+            else if (_spilling && _spillRead < _spillWritten) {
+                off_t offset = _spillRead;
+                lock.unlock();
+                memset(&rec, 0, sizeof(rec));
+                off_t next = readSpill(offset, &rec);
+                try {
+                    deliver(&rec);
+                }
+                catch (const n_u::IOException&) {
+                    xdr_free((xdrproc_t) xdr_datarec_float, (char*) &rec);
+                    throw;
+                }
+                xdr_free((xdrproc_t) xdr_datarec_float, (char*) &rec);
+                lock.lock();
+                _spillRead = next;
+            }
+            else if (_spilling) {
+                // caught up, queue the new records again
+                if (::ftruncate(_spillFd, 0) < 0)
+                    throw n_u::IOException(_spillFileName, "truncate", errno);
+                _spillRead = _spillWritten = 0;
+                _spilling = false;
+                ILOG(("%s: %lu spilled records sent", getName().c_str(),
+                      _nspilled));
+            }
+            else if (_quit) break;
+            else if (_npending > 0) {
+                // send the coalesced records when they are old enough
+                int msecs = std::min(_rpcBatchMsecs, _rpcBatchPeriod * 1000);
+                if (_queueCond.wait_until(lock, _pendingTime +
+                        std::chrono::milliseconds(msecs)) ==
+                        std::cv_status::timeout && _qhead == _qtail) {
+                    lock.unlock();
+                    deliver(0);
+                    lock.lock();
+                }
+            }
+            else _queueCond.wait(lock);
+        }
+        lock.unlock();
+        deliver(0);
+    }
+    catch (const n_u::IOException& e) {
+        if (!lock.owns_lock()) lock.lock();
+        _senderError = e.what();
+        _spaceCond.notify_all();
+    }
+}
+
+void NetcdfRPCChannel::stopSender()
+{
+    if (!_sender.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(_queueMutex);
+        _quit = true;
+    }
+    _queueCond.notify_one();
+    _sender.join();
+    if (_spillFd >= 0) {
+        ::close(_spillFd);
+        ::unlink(_spillFileName.c_str());
+        _spillFd = -1;
+    }
+    if (_ndropped > 0 || _nspilled > 0)
+        ILOG(("%s: %lu records dropped, %lu spilled", getName().c_str(),
+              _ndropped, _nspilled));
+    // A sender started later, after a reconnect, starts without error.
+    if (!_senderError.empty()) {
+        PLOG(("%s: %s", getName().c_str(), _senderError.c_str()));
+        _senderError.clear();
+    }
+}
+
+void NetcdfRPCChannel::sendSeq(datarec_float *recs, unsigned int nrecs)
+{
+    datarec_float_seq seqrecs;
+    seqrecs.connectionId = _connectionId;
+    seqrecs.seq = _seq + 1;
+    seqrecs.recs.recs_len = nrecs;
+    seqrecs.recs.recs_val = recs;
+
+    enum clnt_stat clnt_stat;
+    clnt_stat = clnt_call(_clnt, WRITE_DATAREC_FLOAT_SEQ,
+        (xdrproc_t) xdr_datarec_float_seq, (caddr_t) &seqrecs,
+        (xdrproc_t) NULL, (caddr_t) NULL,
+        _rpcBatchTimeout);
+
+    // keep them, even if the call failed, to send them again
+    for (unsigned int i = 0; i < nrecs; i++) {
+        _unacked.push_back(PendingRec());
+        _unacked.back().set(recs + i);
+        _unacked.back().seq = ++_seq;
+    }
+    if (clnt_stat != RPC_SUCCESS)
+        throw RPCCallFailed(getName(),"write",clnt_sperror(_clnt,""));
+
+    if (time(0) - _lastNonBatchWrite > _rpcBatchPeriod ||
+        _unacked.size() >= _ackWindow) {
+        ackThrough();
+        if (_unacked.size() >= _ackWindow) {
+            // nc_server is not syncing the files, make room for more
+            unsigned int n = _unacked.size() - _ackWindow / 2;
+            _unacked.erase(_unacked.begin(), _unacked.begin() + n);
+            _nunconfirmed += n;
+            WLOG(("%s: %u records not acknowledged as durable by nc_server "
+                  "will not be sent again after a reconnect, %lu total",
+                  getName().c_str(), n, _nunconfirmed));
+        }
+    }
+}
+
+bool NetcdfRPCChannel::ackThrough()
+{
+    ack result;
+    enum clnt_stat clnt_stat;
+
+    for ( ; ; ) {
+        memset(&result, 0, sizeof(result));
+        clnt_stat = clnt_call(_clnt, ACK_THROUGH,
+            (xdrproc_t) xdr_int, (caddr_t) &_connectionId,
+            (xdrproc_t) xdr_ack, (caddr_t) &result,
+            _rpcWriteTimeout);
+        if (clnt_stat == RPC_PROCUNAVAIL) return false;
+        if (clnt_stat != RPC_SUCCESS) {
+            bool serious = (clnt_stat != RPC_TIMEDOUT && clnt_stat != RPC_CANTRECV) ||
+                _ntry++ >= NTRY;
+            if (serious)
+                throw RPCCallFailed(getName(),"ackThrough", clnt_sperror(_clnt,""));
+            if (_ntry > NTRY / 2) {
+                WLOG(("%s: %s, timeout=%d secs, ntry=%d",
+                      getName().c_str(),
+                      clnt_sperror(_clnt, "nc_server not responding"),
+                      _rpcWriteTimeout.tv_sec, _ntry));
+            }
+        }
+        else break;
+    }
+    if (!result.error[0] && _ntry > 0)
+        WLOG(("") << getName() << ": OK");
+    _ntry = 0;
+    _lastNonBatchWrite = time((time_t*)0);
+
+    VLOG(("%s: applied=%llu, durable=%llu, unacked=%zu", getName().c_str(),
+          (unsigned long long) result.applied,
+          (unsigned long long) result.durable, _unacked.size()));
+    while (!_unacked.empty() && _unacked.front().seq <= result.durable)
+        _unacked.pop_front();
+
+    /*
+       If error string is non-empty, then an error occured on nc_server.
+       The records after the durable ones are sent again after a reconnect.
+    */
+    string msg = result.error;
+    xdr_free((xdrproc_t) xdr_ack, (char*) &result);
+    if (!msg.empty())
+        throw n_u::IOException(getName(),"write",msg);
+    return true;
+}
+
+void NetcdfRPCChannel::resend()
+{
+    std::deque<PendingRec> recs;
+    recs.swap(_unacked);
+
+    // The groups are defined in the same order on every connection.
+    map<int,int> ids;
+    list<NcVarGroupFloat*>::const_iterator gi = _groups.begin();
+    for (unsigned int i = 0; gi != _groups.end() &&
+            i < _prevGroupIds.size(); ++gi, i++)
+        ids[_prevGroupIds[i]] = (*gi)->_rec.datarecId;
+    for (unsigned int i = 0; i < recs.size(); i++)
+        recs[i].datarecId = ids.count(recs[i].datarecId) ?
+            ids[recs[i].datarecId] : -1;
+
+    ILOG(("%s: sending %zu unacknowledged records again",
+          getName().c_str(), recs.size()));
+    datarec_float rec;
+    unsigned int i = 0;
+    try {
+        for ( ; i < recs.size(); i++) {
+            if (recs[i].datarecId < 0) continue;
+            recs[i].get(&rec, _connectionId);
+            send(&rec);
+        }
+        flush();
+    }
+    catch (const n_u::IOException&) {
+        // keep the rest for the next connection, after those sent
+        for ( ; i < recs.size(); i++) {
+            recs[i].seq = ULLONG_MAX;
+            _unacked.push_back(recs[i]);
+        }
+        throw;
+    }
+}
+
+void NetcdfRPCChannel::deliver(datarec_float *rec)
+{
+    if (_spoolFileName.empty()) {
+        if (rec) send(rec);
+        else flush();
+        return;
+    }
+    if (_outage) {
+        if (rec) spool(rec);
+        return;
+    }
+    // Coalesced and sequence numbered records are kept by send().
+    bool kept = _seqWrites ||
+        (_rpcBatchMsecs > 0 && _rpcBatchPeriod > 0 && _arrayWrites);
+    try {
+        if (rec) send(rec);
+        else flush();
+    }
+    catch (const RPCCallFailed& e) {
+        // Only spool when nc_server did not answer.  The errors it
+        // reports would not go away on the next connection.
+        startOutage(e.what(), kept ? 0 : rec);
+    }
+}
+
+void NetcdfRPCChannel::startOutage(const string& msg, datarec_float *rec)
+{
+    if (!_spool.isOpen()) _spool.open(_spoolFileName, _spoolSize);
+    WLOG(("%s: %s, spooling records to %s, reconnect in %d secs",
+          getName().c_str(), msg.c_str(), _spoolFileName.c_str(),
+          _reconnectSecs));
+
+    // oldest first
+    datarec_float prec;
+    for (unsigned int i = 0; i < _unacked.size(); i++) {
+        _unacked[i].get(&prec, _connectionId);
+        spool(&prec);
+    }
+    _unacked.clear();
+    for (unsigned int i = 0; i < _npending; i++) {
+        _pending[i].get(&prec, _connectionId);
+        spool(&prec);
+    }
+    _npending = 0;
+    _pendingBytes = 0;
+    if (rec) spool(rec);
+
+    _nextReconnect = time(0) + _reconnectSecs;
+    _outage = true;
+}
+
+void NetcdfRPCChannel::spool(const datarec_float *rec)
+{
+    datarec_float srec = *rec;
+    srec.datarecId = -1;
+    int i = 0;
+    list<NcVarGroupFloat*>::const_iterator gi = _groups.begin();
+    for ( ; gi != _groups.end(); ++gi, i++) {
+        if ((*gi)->_rec.datarecId == rec->datarecId) {
+            srec.datarecId = i;
+            break;
+        }
+    }
+    if (srec.datarecId >= 0) _spool.put(&srec);
+}
+
+void NetcdfRPCChannel::reconnect()
+{
+    // The sender spools the records left in the queue.
+    stopSender();
+    if (_clnt) nc_server_client_destroy(_clnt);
+    _clnt = 0;
+
+    unsigned long nspooled = _spool.size();
+    try {
+        probe();
+        connect();
+        defineGroups();
+        writeGlobalAttrs();
+        drain();
+    }
+    catch (const n_u::IOException& e) {
+        disconnect();
+        _nextReconnect = time(0) + _reconnectSecs;
+        WLOG(("%s: %s, %lu records spooled, reconnect in %d secs",
+              getName().c_str(), e.what(), _spool.size(), _reconnectSecs));
+        return;
+    }
+    _outage = false;
+    ILOG(("%s: reconnected, %lu spooled records sent, %lu discarded "
+          "because the spool was full", getName().c_str(), nspooled,
+          _spool.dropped()));
+}
+
+void NetcdfRPCChannel::probe()
+{
+    CLIENT* clnt = nc_server_client_create(getServer());
+    if (clnt == (CLIENT *) NULL)
+        throw RPCCallFailed(getName(),"clnt_create",
+            clnt_spcreateerror(_server.c_str()));
+
+    enum clnt_stat clnt_stat = clnt_call(clnt, NULLPROC,
+        (xdrproc_t)(void(*)(void)) xdr_void, (caddr_t) NULL,
+        (xdrproc_t)(void(*)(void)) xdr_void, (caddr_t) NULL,
+        _rpcWriteTimeout);
+    if (clnt_stat != RPC_SUCCESS) {
+        RPCCallFailed e(getName(),"probe",clnt_sperror(clnt,""));
+        nc_server_client_destroy(clnt);
+        throw e;
+    }
+    nc_server_client_destroy(clnt);
+}
+
+void NetcdfRPCChannel::disconnect() throw()
+{
+    if (!_clnt) return;
+    // Don't leave a connection on nc_server for each failed reconnect.
+    int result = 0;
+    enum clnt_stat clnt_stat = clnt_call(_clnt, CLOSE_CONNECTION,
+        (xdrproc_t) xdr_int, (caddr_t) &_connectionId,
+        (xdrproc_t) xdr_int, (caddr_t) &result,
+        _rpcWriteTimeout);
+    if (clnt_stat != RPC_SUCCESS)
+        WLOG(("%s: %s", getName().c_str(), clnt_sperror(_clnt,"close")));
+    nc_server_client_destroy(_clnt);
+    _clnt = 0;
+}
+
+void NetcdfRPCChannel::drain()
+{
+    // current ids of the groups, by index
+    vector<int> ids;
+    list<NcVarGroupFloat*>::const_iterator gi = _groups.begin();
+    for ( ; gi != _groups.end(); ++gi) ids.push_back((*gi)->_rec.datarecId);
+
+    vector<datarec_float> recs;
+    while (!_spool.empty()) {
+        size_t offset = _spool.head();
+        unsigned long nrecs = 0;
+        size_t nbytes = 0;
+        recs.clear();
+        try {
+            while (nrecs < _spool.size() && nbytes < DRAIN_BYTES) {
+                datarec_float rec;
+                memset(&rec, 0, sizeof(rec));
+                nbytes += _spool.get(offset, &rec);
+                nrecs++;
+                if (rec.datarecId < 0 || rec.datarecId >= (int)ids.size()) {
+                    xdr_free((xdrproc_t) xdr_datarec_float, (char*) &rec);
+                    continue;
+                }
+                rec.connectionId = _connectionId;
+                rec.datarecId = ids[rec.datarecId];
+                recs.push_back(rec);
+            }
+            if (!recs.empty()) sendArray(&recs.front(), recs.size());
+        }
+        catch (const n_u::IOException&) {
+            for (unsigned int i = 0; i < recs.size(); i++)
+                xdr_free((xdrproc_t) xdr_datarec_float, (char*) &recs[i]);
+            throw;
+        }
+        for (unsigned int i = 0; i < recs.size(); i++)
+            xdr_free((xdrproc_t) xdr_datarec_float, (char*) &recs[i]);
+        _spool.pop(offset, nrecs);
+    }
+}
+
 void NetcdfRPCChannel::writeGlobalAttr(const string& name, const string& value)
 {
     int result = 0;
@@ -575,7 +1432,7 @@ void NetcdfRPCChannel::writeGlobalAttr(const string& name, const string& value)
         bool serious = (clnt_stat != RPC_TIMEDOUT && clnt_stat != RPC_CANTRECV) ||
             _ntry++ >= NTRY;
         if (serious) 
-            throw n_u::IOException(getName(),"writeGlobalAttr", clnt_sperror(_clnt,""));
+            throw RPCCallFailed(getName(),"writeGlobalAttr", clnt_sperror(_clnt,""));
         if (_ntry > NTRY / 2) {
             WLOG(("%s: %s, timeout=%d secs, ntry=%d",
                   getName().c_str(),
@@ -618,7 +1475,7 @@ void NetcdfRPCChannel::writeGlobalAttr(const string& name, int value)
         bool serious = (clnt_stat != RPC_TIMEDOUT && clnt_stat != RPC_CANTRECV) ||
             _ntry++ >= NTRY;
         if (serious) 
-            throw n_u::IOException(getName(),"writeGlobalAttr", clnt_sperror(_clnt,""));
+            throw RPCCallFailed(getName(),"writeGlobalAttr", clnt_sperror(_clnt,""));
         if (_ntry > NTRY / 2) {
             WLOG(("%s: %s, timeout=%d secs, ntry=%d",
                   getName().c_str(),
@@ -658,7 +1515,7 @@ void NetcdfRPCChannel::checkError()
         bool serious = (clnt_stat != RPC_TIMEDOUT && clnt_stat != RPC_CANTRECV) ||
                 _ntry++ >= NTRY;
         if (serious)
-            throw n_u::IOException(getName(),"checkError",clnt_sperror(_clnt,""));
+            throw RPCCallFailed(getName(),"checkError",clnt_sperror(_clnt,""));
         WLOG(("%s: %s, timeout=%d secs, ntry=%d",
               getName().c_str(),
               clnt_sperror(_clnt, "nc_server not responding"),
@@ -685,10 +1542,43 @@ void NetcdfRPCChannel::checkError()
 
 void NetcdfRPCChannel::close()
 {
+    // send the queued records
+    stopSender();
+
+    if (_outage) {
+        if (!_spool.empty())
+            WLOG(("%s: nc_server not reachable, %lu spooled records "
+                  "not sent", getName().c_str(), _spool.size()));
+        if (_clnt) nc_server_client_destroy(_clnt);
+        _clnt = 0;
+        _outage = false;
+    }
+    _spool.close();
+
+    // Records are only forgotten if nc_server has written them all.
+    bool acked = !_seqWrites;
+    if (_clnt) {
+        try {
+            flush();
+            if (_seqWrites) acked = ackThrough();
+        }
+        catch (const n_u::IOException& e) {
+            PLOG(("%s", e.what()));
+        }
+    }
+
+    // Save the group ids, to send the unacknowledged records again,
+    // and define the groups again on the next connection.
+    _prevGroupIds.clear();
     list<NcVarGroupFloat*>::const_iterator gi = _groups.begin();
-    for ( ; gi != _groups.end(); ++gi) delete *gi;
+    for ( ; gi != _groups.end(); ++gi) {
+        _prevGroupIds.push_back((*gi)->_rec.datarecId);
+        delete *gi;
+    }
     _groups.clear();
+    _groupsBySignature.clear();
     _groupById.clear();
+    _data_defined = false;
 
     if (_clnt) {
         int result = 0;
@@ -697,13 +1587,15 @@ void NetcdfRPCChannel::close()
             (xdrproc_t) xdr_int, (caddr_t) &_connectionId,
             (xdrproc_t) xdr_int, (caddr_t) &result,
             _rpcOtherTimeout)) != RPC_SUCCESS) {
-          n_u::IOException e(getName(),"close",clnt_sperror(_clnt,""));
+          RPCCallFailed e(getName(),"close",clnt_sperror(_clnt,""));
           nc_server_client_destroy(_clnt);
           _clnt = 0;
           throw e;
         }
         nc_server_client_destroy(_clnt);
         _clnt = 0;
+        // nc_server syncs the files of a connection when it is closed
+        if (acked && result == 0) _unacked.clear();
         ILOG(("closed: ") << getName());
     }
 }
@@ -774,10 +1666,202 @@ void NetcdfRPCChannel::fromDOMElement(const xercesc::DOMElement* node)
                         sval, sval);
                 setRPCBatchPeriod(val);
             }
+            else if (aname == "batchMsecs") {
+                istringstream ist(sval);
+                int val;
+                ist >> val;
+                if (ist.fail() || val < 0)
+                    throw n_u::InvalidParameterException(getName(),
+                        aname, sval);
+                setRPCBatchMsecs(val);
+            }
+            else if (aname == "batchBytes") {
+                istringstream ist(sval);
+                int val;
+                ist >> val;
+                if (ist.fail() || val < 0)
+                    throw n_u::InvalidParameterException(getName(),
+                        aname, sval);
+                setRPCBatchBytes(val);
+            }
+            else if (aname == "queueLength") {
+                istringstream ist(sval);
+                int val;
+                ist >> val;
+                if (ist.fail() || val < 0)
+                    throw n_u::InvalidParameterException(getName(),
+                        aname, sval);
+                setQueueLength(val);
+            }
+            else if (aname == "overflow") {
+                if (sval == "block") setOverflowPolicy(OVERFLOW_BLOCK);
+                else if (sval == "drop") setOverflowPolicy(OVERFLOW_DROP);
+                else if (sval == "spill") setOverflowPolicy(OVERFLOW_SPILL);
+                else throw n_u::InvalidParameterException(getName(),
+                        aname, sval);
+            }
+            else if (aname == "spillFile") setSpillFileName(sval);
+            else if (aname == "ackWrites") {
+                istringstream ist(sval);
+                bool val;
+                ist >> boolalpha >> val;
+                if (ist.fail())
+                    throw n_u::InvalidParameterException(getName(),
+                        aname, sval);
+                setAckWrites(val);
+            }
+            else if (aname == "spoolFile") setSpoolFileName(sval);
+            else if (aname == "spoolSize") {
+                istringstream ist(sval);
+                int val;
+                ist >> val;
+                if (ist.fail() || val <= 0)
+                    throw n_u::InvalidParameterException(getName(),
+                        aname, sval);
+                setSpoolSize(val);
+            }
+            else if (aname == "reconnectSecs") {
+                istringstream ist(sval);
+                int val;
+                ist >> val;
+                if (ist.fail() || val <= 0)
+                    throw n_u::InvalidParameterException(getName(),
+                        aname, sval);
+                setReconnectSecs(val);
+            }
+            else if (aname == "ackWindow") {
+                istringstream ist(sval);
+                int val;
+                ist >> val;
+                if (ist.fail() || val <= 0)
+                    throw n_u::InvalidParameterException(getName(),
+                        aname, sval);
+                setAckWindow(val);
+            }
             else throw n_u::InvalidParameterException(getName(),
                         "unrecognized attribute", aname);
         }
     }
+    if (_overflow == OVERFLOW_SPILL && _spillFileName.empty())
+        throw n_u::InvalidParameterException(getName(), "spillFile",
+            "must be given with overflow=\"spill\"");
+}
+
+RecordSpool::RecordSpool(): _path(), _base(0), _size(0), _head(0),
+    _tail(0), _nrecs(0), _ndropped(0)
+{
+}
+
+RecordSpool::~RecordSpool()
+{
+    close();
+}
+
+void RecordSpool::open(const string& path, size_t size)
+{
+    close();
+    size -= size % 4;
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw n_u::IOException(path, "open", errno);
+    if (::ftruncate(fd, size) < 0) {
+        int ierr = errno;
+        ::close(fd);
+        throw n_u::IOException(path, "truncate", ierr);
+    }
+    void* base = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int ierr = errno;
+    ::close(fd);
+    if (base == MAP_FAILED) throw n_u::IOException(path, "mmap", ierr);
+    _path = path;
+    _base = (char*) base;
+    _size = size;
+    _head = _tail = 0;
+    _nrecs = 0;
+    _ndropped = 0;
+}
+
+void RecordSpool::close()
+{
+    if (!_base) return;
+    ::munmap(_base, _size);
+    ::unlink(_path.c_str());
+    _base = 0;
+    _nrecs = 0;
+}
+
+size_t RecordSpool::wrap(size_t offset) const
+{
+    if (_size - offset < 4) return 0;
+    unsigned int len;
+    memcpy(&len, _base + offset, 4);
+    return len == WRAP ? 0 : offset;
+}
+
+void RecordSpool::drop()
+{
+    size_t offset = wrap(_head);
+    unsigned int len;
+    memcpy(&len, _base + offset, 4);
+    _head = offset + 4 + len;
+    _nrecs--;
+    if (!(_ndropped++ % 1000))
+        WLOG(("%s: spool is full, %lu records discarded", _path.c_str(),
+              _ndropped));
+}
+
+void RecordSpool::put(const datarec_float* rec)
+{
+    unsigned int len = xdr_sizeof((xdrproc_t) xdr_datarec_float,
+                                  const_cast<datarec_float*>(rec));
+    size_t need = 4 + len;
+    if (need > _size / 2)
+        throw n_u::IOException(_path, "put", "record is too large to spool");
+
+    // Records are contiguous, so skip the end of the file if the
+    // record does not fit there.
+    for (;;) {
+        if (_nrecs == 0) _head = _tail = 0;
+        if (_nrecs == 0 || _tail > _head) {
+            if (_size - _tail >= need) break;
+            if (_head >= need) {
+                unsigned int mark = WRAP;
+                if (_size - _tail >= 4) memcpy(_base + _tail, &mark, 4);
+                _tail = 0;
+                break;
+            }
+        }
+        else if (_head - _tail >= need) break;
+        drop();
+    }
+
+    XDR xdrs;
+    xdrmem_create(&xdrs, _base + _tail + 4, len, XDR_ENCODE);
+    bool ok = xdr_datarec_float(&xdrs, const_cast<datarec_float*>(rec));
+    xdr_destroy(&xdrs);
+    if (!ok) throw n_u::IOException(_path, "encode", "failed");
+    memcpy(_base + _tail, &len, 4);
+    _tail += need;
+    _nrecs++;
+}
+
+size_t RecordSpool::get(size_t& offset, datarec_float* rec) const
+{
+    offset = wrap(offset);
+    unsigned int len;
+    memcpy(&len, _base + offset, 4);
+    XDR xdrs;
+    xdrmem_create(&xdrs, _base + offset + 4, len, XDR_DECODE);
+    bool ok = xdr_datarec_float(&xdrs, rec);
+    xdr_destroy(&xdrs);
+    if (!ok) throw n_u::IOException(_path, "decode", "failed");
+    offset += 4 + len;
+    return 4 + len;
+}
+
+void RecordSpool::pop(size_t offset, unsigned long nrecs)
+{
+    _head = offset;
+    _nrecs -= nrecs;
 }
 
 NcVarGroupFloat::NcVarGroupFloat(
@@ -787,7 +1871,8 @@ NcVarGroupFloat::NcVarGroupFloat(
         _sampleTag(*stag),_rec(),
         _weightsIndex(-1),
         _fillValue(fill),
-        _interval(stag->getPeriod())
+        _interval(stag->getPeriod()),
+        _ddef(),_strings(),_ddims(),_dvars(),_dattrs(),_encoded(false)
 {
     _rec.start.start_val = 0;
     _rec.count.count_val = 0;
@@ -803,11 +1888,10 @@ NcVarGroupFloat::~NcVarGroupFloat()
     delete [] _rec.data.data_val;
 }
 
-void NcVarGroupFloat::connect(NetcdfRPCChannel* conn, float _fillValue)
+void NcVarGroupFloat::encode(NetcdfRPCChannel* conn, float _fillValue)
 {
-    CStringCache strings;
-    datadef ddef; 
-    ddef.connectionId = conn->getConnectionId(); 
+    datadef& ddef = _ddef;
+    CStringCache& strings = _strings;
     ddef.rectype = NS_TIMESERIES;
     ddef.datatype = NS_FLOAT;
     ddef.fillmissingrecords = 1;
@@ -816,17 +1900,13 @@ void NcVarGroupFloat::connect(NetcdfRPCChannel* conn, float _fillValue)
     ddef.interval = _sampleTag.getPeriod();
 
     int ndims = _dimensions.size();
-    ddef.dimensions.dimensions_val = 0;
+    _ddims.resize(ndims);
+    ddef.dimensions.dimensions_val = ndims > 0 ? &_ddims.front() : 0;
     ddef.dimensions.dimensions_len = ndims;
 
-    if (ndims > 0) {
-        ddef.dimensions.dimensions_val = new dimension[ndims];
-        for(int i = 0; i < ndims; i++) {
-            ddef.dimensions.dimensions_val[i].name =
-                strings.cache(_dimensions[i].getName());
-            ddef.dimensions.dimensions_val[i].size =
-                _dimensions[i].getValue(0);
-        }
+    for(int i = 0; i < ndims; i++) {
+        _ddims[i].name = strings.cache(_dimensions[i].getName());
+        _ddims[i].size = _dimensions[i].getValue(0);
     }
     _weightsIndex = -1;
     string weightsName;
@@ -850,15 +1930,18 @@ void NcVarGroupFloat::connect(NetcdfRPCChannel* conn, float _fillValue)
         nvars--;
     }
 
-    ddef.variables.variables_val = new variable[nvars];
+    _dvars.resize(nvars);
+    _dattrs.resize(nvars);
+    ddef.variables.variables_val = nvars > 0 ? &_dvars.front() : 0;
     ddef.variables.variables_len = nvars;
 
     vi = _sampleTag.getVariableIterator();
     for (int i = 0; vi.hasNext(); ) {
         const Variable* var = vi.next();
-        struct variable& dvar = ddef.variables.variables_val[i];
-
+        // The weights variable is last and has no entry in _dvars.
         if (var->getType() == Variable::WEIGHT) continue;
+        struct variable& dvar = _dvars[i];
+
         if (ndims > 0) 
             dvar.name = strings.cache(var->getNameWithoutSite());
         else
@@ -875,14 +1958,7 @@ void NcVarGroupFloat::connect(NetcdfRPCChannel* conn, float _fillValue)
 
         // Find this original Variable in the Project to get to any attributes
         // which were added to it during processing.
-        VariableIterator vit(Project::getInstance());
-        const Variable* origin_var{ nullptr };
-        while (!origin_var && vit.hasNext())
-        {
-            const Variable* vp = vit.next();
-            if (vp->getName() == var->getName())
-                origin_var = vp;
-        }
+        const Variable* origin_var = conn->getProjectVariable(var->getName());
 
         std::vector<Parameter> attributes;
         if (origin_var)
@@ -890,12 +1966,12 @@ void NcVarGroupFloat::connect(NetcdfRPCChannel* conn, float _fillValue)
             attributes = origin_var->getAttributes();
             nattrs += attributes.size();
         }
+        vector<str_attr>& dattrs = _dattrs[i];
+        dattrs.resize(nattrs);
         dvar.attrs.attrs_len = nattrs;
-        dvar.attrs.attrs_val = 0;
+        dvar.attrs.attrs_val = nattrs > 0 ? &dattrs.front() : 0;
 
         if (nattrs > 0) {
-            dvar.attrs.attrs_val = new str_attr[nattrs];
-
             int iattr = 0;
             if (_weightsIndex >= 0) {
                 str_attr *s = dvar.attrs.attrs_val + iattr++;
@@ -929,6 +2005,16 @@ void NcVarGroupFloat::connect(NetcdfRPCChannel* conn, float _fillValue)
         }
         i++;
     }
+    _encoded = true;
+}
+
+void NcVarGroupFloat::connect(NetcdfRPCChannel* conn, float _fillValue)
+{
+    // The definition does not change between connections, only the
+    // connection id.
+    if (!_encoded) encode(conn, _fillValue);
+    datadef& ddef = _ddef;
+    ddef.connectionId = conn->getConnectionId(); 
 
     CLIENT *clnt = conn->getRPCClient();
     enum clnt_stat clnt_stat;
@@ -947,16 +2033,8 @@ void NcVarGroupFloat::connect(NetcdfRPCChannel* conn, float _fillValue)
     if (ntry > 0 && clnt_stat == RPC_SUCCESS)
         WLOG(("nc_server OK"));
 
-    for (int i=0; i < nvars; i++) {
-        struct variable& dvar = ddef.variables.variables_val[i];
-        delete [] dvar.attrs.attrs_val;
-    }
-
-    delete [] ddef.variables.variables_val;
-    delete [] ddef.dimensions.dimensions_val;
-
     if (clnt_stat != RPC_SUCCESS)
-        throw n_u::IOException(conn->getName(),"define data rec",
+        throw RPCCallFailed(conn->getName(),"define data rec",
             clnt_sperrno(clnt_stat));
 
     // If return is < 0, fetch the error string, and throw exception
@@ -967,8 +2045,22 @@ void NcVarGroupFloat::connect(NetcdfRPCChannel* conn, float _fillValue)
         throw n_u::IOException(conn->getName(),"define data rec","unknown error");
     }
 
-    // initialize data record
-    _rec.datarecId = result;
+    connected(conn, result);
+}
+
+void NcVarGroupFloat::connected(NetcdfRPCChannel* conn, int datarecId)
+{
+    int ndims = _dimensions.size();
+    int nvars = _dvars.size();
+
+    // initialize data record, which may have been defined on an
+    // earlier connection
+    delete [] _rec.start.start_val;
+    delete [] _rec.count.count_val;
+    delete [] _rec.cnts.cnts_val;
+    delete [] _rec.data.data_val;
+
+    _rec.datarecId = datarecId;
     _rec.connectionId = conn->getConnectionId();
    
     _rec.start.start_len = ndims;
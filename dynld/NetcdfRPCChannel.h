@@ -32,15 +32,139 @@
 #include <nidas/core/Parameter.h>
 
 #include <nc_server_rpc.h>
+#include "CStringCache.h"
 
 #include <string>
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <sys/types.h>
 
 namespace nidas { namespace dynld { namespace isff {
 
 class NcVarGroupFloat;
 
+/**
+ * Ring of XDR encoded data records in a memory mapped file, which
+ * keeps the records written while nc_server cannot be reached.  When
+ * it is full, the oldest records are discarded.  It is not locked,
+ * the channel uses it from one thread at a time.
+ */
+class RecordSpool {
+public:
+    RecordSpool();
+
+    ~RecordSpool();
+
+    /**
+     * Create the file, of size bytes, and map it.
+     * @throws nidas::util::IOException
+     */
+    void open(const std::string& path, size_t size);
+
+    /**
+     * Unmap and remove the file.
+     */
+    void close();
+
+    bool isOpen() const { return _base != 0; }
+
+    bool empty() const { return _nrecs == 0; }
+
+    /**
+     * Number of records in the spool.
+     */
+    unsigned long size() const { return _nrecs; }
+
+    /**
+     * Number of records discarded because the spool was full.
+     */
+    unsigned long dropped() const { return _ndropped; }
+
+    /**
+     * Append a record, discarding the oldest ones to make room.
+     * @throws nidas::util::IOException if the record is larger than
+     *  half of the spool, or cannot be encoded.
+     */
+    void put(const datarec_float* rec);
+
+    /**
+     * Offset of the oldest record.
+     */
+    size_t head() const { return _head; }
+
+    /**
+     * Decode the record at offset, which must be head() or an offset
+     * returned by a previous get(), and advance offset to the next
+     * record.  The record must be freed with xdr_free().
+     * @return Encoded length of the record.
+     * @throws nidas::util::IOException
+     */
+    size_t get(size_t& offset, datarec_float* rec) const;
+
+    /**
+     * Discard the nrecs oldest records, which end at offset.
+     */
+    void pop(size_t offset, unsigned long nrecs);
+
+private:
+
+    /**
+     * Offset of the record at offset, or 0 if the records continue
+     * at the beginning of the file.
+     */
+    size_t wrap(size_t offset) const;
+
+    /**
+     * Discard the oldest record.
+     */
+    void drop();
+
+    /**
+     * Length of a record which marks the end of the records
+     * before the end of the file.
+     */
+    static const unsigned int WRAP = 0xffffffff;
+
+    std::string _path;
+
+    char* _base;
+
+    size_t _size;
+
+    size_t _head;
+
+    size_t _tail;
+
+    unsigned long _nrecs;
+
+    unsigned long _ndropped;
+
+    /** No copying. */
+    RecordSpool(const RecordSpool&);
+
+    /** No assignment. */
+    RecordSpool& operator=(const RecordSpool&);
+};
+
+/**
+ * IOException of an RPC call which did not get a reply from nc_server,
+ * as opposed to an error which nc_server reported.
+ */
+class RPCCallFailed: public nidas::util::IOException {
+public:
+    RPCCallFailed(const std::string& device, const std::string& task,
+                  const std::string& msg):
+        nidas::util::IOException(device, task, msg) {}
+};
+
 /**
  * A perversion of a simple IOChannel.  This sends data
  * to a nc_server via RPC calls.
@@ -187,6 +311,118 @@ public:
 
     int getRPCBatchPeriod() const;
 
+    /**
+     * In batch mode, coalesce the data records for up to this many
+     * milliseconds, bounded by the batch period, and send them in one
+     * WRITE_DATAREC_FLOAT_ARRAY call.  The records are sent in the order
+     * they were written, by the first write after this time, or by
+     * flush() or close().  If nc_server does not support arrays of
+     * records, they are sent one at a time.  The default of 0 sends
+     * each record when it is written.
+     */
+    void setRPCBatchMsecs(int val);
+
+    int getRPCBatchMsecs() const;
+
+    /**
+     * Send the coalesced records when their size reaches this many
+     * bytes, default 65536.
+     */
+    void setRPCBatchBytes(int val);
+
+    int getRPCBatchBytes() const;
+
+    /**
+     * Send the coalesced data records, and wait for the reply.
+     */
+    void flush();
+
+    /**
+     * If non-zero, data records are put in a queue of this length and
+     * sent to nc_server by a separate thread, so the thread writing the
+     * samples does not wait for nc_server.  An error in the sender
+     * thread is thrown by the next write.  The default of 0 sends the
+     * records from the thread which writes them.
+     */
+    void setQueueLength(unsigned int val) { _queueLength = val; }
+
+    unsigned int getQueueLength() const { return _queueLength; }
+
+    /**
+     * What to do with a record when the queue is full.
+     */
+    enum overflow_policy {
+        /** wait for room in the queue */
+        OVERFLOW_BLOCK,
+        /** discard the oldest record in the queue */
+        OVERFLOW_DROP,
+        /** append the record to the spill file, which is sent
+         * after the queue */
+        OVERFLOW_SPILL
+    };
+
+    void setOverflowPolicy(overflow_policy val) { _overflow = val; }
+
+    overflow_policy getOverflowPolicy() const { return _overflow; }
+
+    /**
+     * Spill file, for OVERFLOW_SPILL.  It is created when the queue
+     * first overflows, and removed when the channel is closed.
+     */
+    void setSpillFileName(const std::string& val) { _spillFileName = val; }
+
+    const std::string& getSpillFileName() const { return _spillFileName; }
+
+    /**
+     * In batch mode, number the data records and send them with
+     * WRITE_DATAREC_FLOAT_SEQ, and instead of a synchronous write
+     * every batch period, call ACK_THROUGH to find out which records
+     * nc_server has written and synced, and any error.  A copy of the
+     * records which are not yet durable is kept, and they are sent
+     * again after a reconnect.  Ignored if nc_server does not support
+     * ACK_THROUGH.  Default is false.
+     */
+    void setAckWrites(bool val) { _ackWrites = val; }
+
+    bool getAckWrites() const { return _ackWrites; }
+
+    /**
+     * Maximum number of records kept until nc_server acknowledges
+     * them as durable, default 10000.  ACK_THROUGH is called early
+     * when this many are kept.
+     */
+    void setAckWindow(unsigned int val) { _ackWindow = val; }
+
+    unsigned int getAckWindow() const { return _ackWindow; }
+
+    /**
+     * If set, data records which cannot be sent because nc_server is
+     * down are written to a memory mapped ring file, instead of the
+     * write throwing an IOException.  A reconnect is tried every
+     * reconnect interval, and after the variables are defined again,
+     * the spooled records are sent in large arrays before any new
+     * records.  The file is created when it is first needed, and
+     * removed when the channel is closed.
+     */
+    void setSpoolFileName(const std::string& val) { _spoolFileName = val; }
+
+    const std::string& getSpoolFileName() const { return _spoolFileName; }
+
+    /**
+     * Size of the spool file in bytes, default 64 MiB.  When it is full
+     * the oldest records are discarded.
+     */
+    void setSpoolSize(size_t val) { _spoolSize = val; }
+
+    size_t getSpoolSize() const { return _spoolSize; }
+
+    /**
+     * Seconds between reconnect attempts while spooling, default 30.
+     */
+    void setReconnectSecs(int val) { _reconnectSecs = val; }
+
+    int getReconnectSecs() const { return _reconnectSecs; }
+
     void fromDOMElement(const xercesc::DOMElement* node);
 
     /**
@@ -236,11 +472,152 @@ protected:
     void
     defineData();
 
+    /**
+     * Index the variables of the Project by name, so the attributes
+     * of the variables of each group can be found without scanning
+     * the project for every one.
+     */
+    void indexProjectVariables();
+
+    /**
+     * Project variable with a name, or NULL.  If there are more than
+     * one, the first one found by a VariableIterator.
+     */
+    const nidas::core::Variable*
+    getProjectVariable(const std::string& name) const;
+
+    /**
+     * Write the global attributes of the project to nc_server.
+     */
+    void writeGlobalAttrs();
+
+    /**
+     * Write global attributes with one WRITE_GLOBAL_ATTRS, or
+     * one at a time if nc_server does not support it.
+     */
+    void writeGlobalAttrs(
+        const std::vector<std::pair<std::string, std::string> >& attrs,
+        const std::vector<std::pair<std::string, int> >& intAttrs);
+
+    /**
+     * Define the variable groups with one DEFINE_DATARECS, or
+     * one at a time if nc_server does not support it.
+     */
+    void defineGroups();
+
     /**
      * Send a data record to the RPC server.
     */
     void write(datarec_float*);
 
+    /**
+     * Send a data record to the RPC server from this thread.
+     */
+    void send(datarec_float*);
+
+    /**
+     * Copy a data record to the coalesced records, and send them
+     * if they are old or large enough.
+     */
+    void coalesce(const datarec_float*);
+
+    /**
+     * Put a data record in the queue of the sender thread.
+     */
+    void enqueue(const datarec_float*);
+
+    /**
+     * Sender thread.  Sends the queued records, then the spilled ones.
+     */
+    void sendLoop();
+
+    /**
+     * Append a record to the spill file.  Called with _queueMutex locked.
+     */
+    void spill(const datarec_float*);
+
+    /**
+     * Read the spilled record at offset _spillRead into rec.
+     * @return offset of the next record.
+     */
+    off_t readSpill(off_t offset, datarec_float* rec);
+
+    /**
+     * Stop the sender thread, after it has sent the queued records.
+     */
+    void stopSender();
+
+    /**
+     * Send records with WRITE_DATAREC_FLOAT_SEQ, and keep a copy of
+     * them until they are acknowledged.
+     */
+    void sendSeq(datarec_float* recs, unsigned int nrecs);
+
+    /**
+     * Call ACK_THROUGH, and forget the records which are durable.
+     * @return false if nc_server does not support ACK_THROUGH.
+     * @throws IOException if nc_server reports an error.
+     */
+    bool ackThrough();
+
+    /**
+     * Send the records which were not acknowledged on the previous
+     * connection.
+     */
+    void resend();
+
+    /**
+     * Send a data record, or if rec is NULL the coalesced records.
+     * If there is a spool file, the records are spooled instead when
+     * nc_server cannot be reached.  Errors reported by nc_server are
+     * thrown as without a spool file.
+     */
+    void deliver(datarec_float* rec);
+
+    /**
+     * Spool the records which may not have reached nc_server,
+     * after an error sending them.
+     * @param rec The record which was being sent, or NULL.
+     */
+    void startOutage(const std::string& msg, datarec_float* rec);
+
+    /**
+     * Append a record to the spool, with its variable group id
+     * replaced by the index of the group in _groups, which does
+     * not change from one connection to the next.
+     */
+    void spool(const datarec_float* rec);
+
+    /**
+     * Try to connect to nc_server again and define the variables.
+     * If that succeeds, send the spooled records.
+     */
+    void reconnect();
+
+    /**
+     * Check with a NULLPROC call that nc_server answers within the
+     * write timeout, before the calls with the longer timeouts.
+     * @throws RPCCallFailed
+     */
+    void probe();
+
+    /**
+     * Close the connection on nc_server, ignoring errors, and destroy
+     * the client.
+     */
+    void disconnect() throw();
+
+    /**
+     * Send the spooled records in arrays of up to DRAIN_BYTES.
+     */
+    void drain();
+
+    /**
+     * Send records with a synchronous WRITE_DATAREC_FLOAT_ARRAY, or one
+     * at a time if nc_server does not support it.
+     */
+    void sendArray(datarec_float* recs, unsigned int nrecs);
+
 private:
 
     std::string _name;
@@ -281,11 +658,175 @@ private:
 
     time_t _lastNonBatchWrite;
 
+    int _rpcBatchMsecs;
+
+    int _rpcBatchBytes;
+
+    /**
+     * False if nc_server does not have WRITE_DATAREC_FLOAT_ARRAY.
+     */
+    bool _arrayWrites;
+
+    /**
+     * False if nc_server does not have DEFINE_DATARECS and
+     * WRITE_GLOBAL_ATTRS.
+     */
+    bool _bulkSetup;
+
+    /**
+     * Copy of a coalesced data record.  The elements are reused,
+     * so their vectors are not reallocated for every record.
+     */
+    struct PendingRec
+    {
+        PendingRec(): time(0.0), datarecId(0), seq(0), start(), count(),
+            cnts(), data()
+        {}
+
+        void set(const datarec_float* rec);
+
+        /**
+         * Point rec to the values of this record.
+         */
+        void get(datarec_float* rec, int connectionId);
+
+        double time;
+        int datarecId;
+        unsigned long long seq;
+        std::vector<int> start;
+        std::vector<int> count;
+        std::vector<int> cnts;
+        std::vector<float> data;
+    };
+
+    std::vector<PendingRec> _pending;
+
+    unsigned int _npending;
+
+    /**
+     * Approximate XDR size of the coalesced records.
+     */
+    size_t _pendingBytes;
+
+    std::chrono::steady_clock::time_point _pendingTime;
+
+    /**
+     * The coalesced records, pointing to the vectors in _pending.
+     */
+    std::vector<datarec_float> _pendingRecs;
+
+    unsigned int _queueLength;
+
+    overflow_policy _overflow;
+
+    std::string _spillFileName;
+
+    /**
+     * Circular queue of records for the sender thread.
+     */
+    std::vector<PendingRec> _queue;
+
+    unsigned long _qhead;
+
+    unsigned long _qtail;
+
+    std::mutex _queueMutex;
+
+    /**
+     * Signaled when a record is queued, or the sender should quit.
+     */
+    std::condition_variable _queueCond;
+
+    /**
+     * Signaled when there is room in the queue, or the sender failed.
+     */
+    std::condition_variable _spaceCond;
+
+    bool _quit;
+
+    /**
+     * Error of the sender thread, thrown by the next write.
+     */
+    std::string _senderError;
+
+    std::thread _sender;
+
+    int _spillFd;
+
+    /**
+     * Bytes written to and read from the spill file.
+     */
+    off_t _spillWritten;
+
+    off_t _spillRead;
+
+    /**
+     * While true, new records are spilled to keep them in order.
+     */
+    bool _spilling;
+
+    unsigned long _ndropped;
+
+    unsigned long _nspilled;
+
+    bool _ackWrites;
+
+    /**
+     * True if the records of this connection are sequence numbered.
+     */
+    bool _seqWrites;
+
+    unsigned int _ackWindow;
+
+    /**
+     * Sequence number of the last record sent on this connection.
+     */
+    unsigned long long _seq;
+
+    /**
+     * Records sent which nc_server has not acknowledged as durable.
+     */
+    std::deque<PendingRec> _unacked;
+
+    /**
+     * Variable group ids of the previous connection, in the order
+     * of _groups, to send the unacknowledged records again.
+     */
+    std::vector<int> _prevGroupIds;
+
+    unsigned long _nunconfirmed;
+
+    std::string _spoolFileName;
+
+    size_t _spoolSize;
+
+    int _reconnectSecs;
+
+    RecordSpool _spool;
+
+    /**
+     * True while nc_server cannot be reached and records are spooled.
+     */
+    std::atomic<bool> _outage;
+
+    std::atomic<time_t> _nextReconnect;
+
+    static const size_t DRAIN_BYTES = 1048576;
+
     std::map<dsm_sample_id_t, NcVarGroupFloat*> _groupById;
 
     std::map<dsm_sample_id_t, int> _stationIndexById;
 
     std::list<NcVarGroupFloat*> _groups;
+
+    /**
+     * The groups by the period and variable names of their first
+     * SampleTag, to find the group of a SampleTag without comparing
+     * it to every group.
+     */
+    std::multimap<std::string, NcVarGroupFloat*> _groupsBySignature;
+
+    std::map<std::string, const nidas::core::Variable*> _projectVars;
     
     std::list<SampleTag*> _sampleTags;
 
@@ -331,6 +872,17 @@ protected:
 
     void connect(NetcdfRPCChannel* conn,float fillValue);
 
+    /**
+     * Build the data record definition of this group, which is then
+     * sent on every connection.
+     */
+    void encode(NetcdfRPCChannel* conn,float fillValue);
+
+    /**
+     * Initialize the data record after the group has been defined.
+     */
+    void connected(NetcdfRPCChannel* conn,int datarecId);
+
     void write(NetcdfRPCChannel* conn,const nidas::core::Sample* samp,
                int stationNumber);
 
@@ -353,6 +905,21 @@ private:
      */
     double _interval;
 
+    /**
+     * Encoded data record definition, and the storage it points to.
+     */
+    datadef _ddef;
+
+    CStringCache _strings;
+
+    std::vector<dimension> _ddims;
+
+    std::vector<variable> _dvars;
+
+    std::vector<std::vector<str_attr> > _dattrs;
+
+    bool _encoded;
+
 private:
 
     NcVarGroupFloat(const NcVarGroupFloat&);	// prevent copying
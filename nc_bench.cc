@@ -0,0 +1,648 @@
+//              Copyright (C) by UCAR
+//
+// Description:
+//   Synthetic load generator for nc_server.  Opens connections, defines
+//   variable groups of a configurable shape, streams records to them at a
+//   target rate or as fast as possible, and reports the throughput and the
+//   latency of the RPC calls.
+
+#include "nc_server_client.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+/**
+ * The shape of the benchmark, from the command line.
+ */
+struct BenchConfig
+{
+    BenchConfig():
+        host("localhost"), serverPath(), serverArgs(), outputDir("/tmp"),
+        resultsFile(), nconnections(1), ngroups(4), nvars(10), nstations(0),
+        nsamples(1), counts(false), interval(1.0), fileLength(86400.0),
+        nrecs(3600), rate(0.0), batch(false), syncEvery(100), arrayLen(0),
+        sharedFiles(false)
+    {
+    }
+
+    string host;
+
+    /** Path of an nc_server to start in standalone mode. */
+    string serverPath;
+
+    /** Additional options for the started nc_server. */
+    string serverArgs;
+
+    string outputDir;
+
+    string resultsFile;
+
+    int nconnections;
+
+    int ngroups;
+
+    int nvars;
+
+    /** Size of the station dimension, 0 for none. */
+    int nstations;
+
+    /** Samples per record interval, the size of the sample dimension. */
+    int nsamples;
+
+    /** Whether each group has a counts variable. */
+    bool counts;
+
+    double interval;
+
+    double fileLength;
+
+    /** Time steps sent to each group of each connection. */
+    int nrecs;
+
+    /** Target records per second of each connection, 0 for flat out. */
+    double rate;
+
+    bool batch;
+
+    /** In batch mode, a synchronous write is made every syncEvery records. */
+    int syncEvery;
+
+    /** Send arrays of arrayLen records, 0 to send them one at a time. */
+    int arrayLen;
+
+    /** Whether the connections write to the same files. */
+    bool sharedFiles;
+};
+
+/**
+ * Counts and latencies of the calls of one connection.
+ */
+struct ConnResult
+{
+    ConnResult(): nrecs(0), nbytes(0), nerrors(0), latencies(), error()
+    {
+    }
+
+    unsigned long long nrecs;
+
+    unsigned long long nbytes;
+
+    unsigned int nerrors;
+
+    /** Microseconds of each call which waits for a reply. */
+    vector<float> latencies;
+
+    string error;
+};
+
+struct timeval rpc_timeout = { 60, 0 };
+
+struct timeval batch_timeout = { 0, 0 };
+
+/**
+ * One client connection, with its variable groups, run in its own thread
+ * since a CLIENT cannot be shared between threads.
+ */
+class BenchConnection
+{
+public:
+    BenchConnection(const BenchConfig& config, int index);
+
+    ~BenchConnection();
+
+    void run(bench_clock::time_point t0);
+
+    const ConnResult& result() const { return _result; }
+
+private:
+    bool open();
+
+    bool define_groups();
+
+    /**
+     * Make a call of WRITE_DATAREC_FLOAT, or of the batch or array
+     * procedures, for the records in _pending.
+     */
+    bool send();
+
+    bool call(rpcproc_t proc, xdrproc_t xargs, caddr_t args);
+
+    void close();
+
+    const BenchConfig& _config;
+
+    int _index;
+
+    CLIENT* _clnt;
+
+    int _id;
+
+    vector<int> _groupIds;
+
+    vector<datarec_float> _pending;
+
+    vector<float> _data;
+
+    vector<int> _cnts;
+
+    vector<int> _start;
+
+    vector<int> _count;
+
+    unsigned long long _nsent;
+
+    ConnResult _result;
+
+    BenchConnection(const BenchConnection&);
+    BenchConnection& operator=(const BenchConnection&);
+};
+
+BenchConnection::BenchConnection(const BenchConfig& config, int index):
+    _config(config), _index(index), _clnt(0), _id(-1), _groupIds(),
+    _pending(), _data(), _cnts(), _start(), _count(), _nsent(0), _result()
+{
+}
+
+BenchConnection::~BenchConnection()
+{
+    if (_clnt) nc_server_client_destroy(_clnt);
+}
+
+bool BenchConnection::open()
+{
+    _clnt = nc_server_client_create(_config.host);
+    if (!_clnt) {
+        _result.error = clnt_spcreateerror(_config.host.c_str());
+        return false;
+    }
+
+    std::ostringstream fmt;
+    fmt << "nc_bench";
+    if (!_config.sharedFiles) fmt << '_' << _index;
+    fmt << "_%Y%m%d_%H%M%S.nc";
+    string filenamefmt = fmt.str();
+    string cdlfile;
+
+    connection conn;
+    conn.filelength = _config.fileLength;
+    conn.interval = _config.interval;
+    conn.filenamefmt = (char*) filenamefmt.c_str();
+    conn.outputdir = (char*) _config.outputDir.c_str();
+    conn.cdlfile = (char*) cdlfile.c_str();
+
+    int* res = open_connection_2(&conn, _clnt);
+    if (!res) {
+        _result.error = clnt_sperror(_clnt, "open_connection");
+        return false;
+    }
+    if (*res < 0) {
+        _result.error = "open_connection failed, see the nc_server log";
+        return false;
+    }
+    _id = *res;
+    return true;
+}
+
+bool BenchConnection::define_groups()
+{
+    int ndims = _config.nstations > 0 ? 1 : 0;
+    string stationName = "station";
+    dimension stationDim;
+    stationDim.name = (char*) stationName.c_str();
+    stationDim.size = _config.nstations;
+
+    for (int ig = 0; ig < _config.ngroups; ig++) {
+        vector<string> names(_config.nvars);
+        std::ostringstream cntsName;
+        cntsName << "counts_g" << ig;
+        string cntsStr = cntsName.str();
+        string countsAttr = "counts";
+        string units = "V";
+
+        vector<variable> vars(_config.nvars);
+        vector<str_attr> attrs(_config.nvars);
+        for (int iv = 0; iv < _config.nvars; iv++) {
+            std::ostringstream ost;
+            ost << 'g' << ig << "_v" << iv;
+            names[iv] = ost.str();
+            vars[iv].name = (char*) names[iv].c_str();
+            vars[iv].units = (char*) units.c_str();
+            vars[iv].attrs.attrs_len = 0;
+            vars[iv].attrs.attrs_val = 0;
+            if (_config.counts) {
+                attrs[iv].name = (char*) countsAttr.c_str();
+                attrs[iv].value = (char*) cntsStr.c_str();
+                vars[iv].attrs.attrs_len = 1;
+                vars[iv].attrs.attrs_val = &attrs[iv];
+            }
+        }
+
+        datadef dd;
+        memset(&dd, 0, sizeof(dd));
+        dd.interval = _config.interval / _config.nsamples;
+        dd.connectionId = _id;
+        dd.rectype = NS_TIMESERIES;
+        dd.datatype = NS_FLOAT;
+        dd.variables.variables_len = _config.nvars;
+        dd.variables.variables_val = &vars.front();
+        dd.dimensions.dimensions_len = ndims;
+        dd.dimensions.dimensions_val = ndims ? &stationDim : 0;
+        dd.floatFill = 1.e37;
+        dd.intFill = 0;
+        dd.fillmissingrecords = 1;
+
+        int* res = define_datarec_2(&dd, _clnt);
+        if (!res) {
+            _result.error = clnt_sperror(_clnt, "define_datarec");
+            return false;
+        }
+        if (*res < 0) {
+            _result.error = "define_datarec failed, see the nc_server log";
+            return false;
+        }
+        _groupIds.push_back(*res);
+    }
+    return true;
+}
+
+bool BenchConnection::call(rpcproc_t proc, xdrproc_t xargs, caddr_t args)
+{
+    int result = 0;
+    bench_clock::time_point t0 = bench_clock::now();
+    enum clnt_stat stat = clnt_call(_clnt, proc, xargs, args,
+                                    (xdrproc_t) xdr_int, (caddr_t) &result,
+                                    rpc_timeout);
+    _result.latencies.push_back(std::chrono::duration<float, std::micro>(
+        bench_clock::now() - t0).count());
+    if (stat != RPC_SUCCESS) {
+        _result.error = clnt_sperror(_clnt, "write");
+        return false;
+    }
+    if (result < 0) _result.nerrors++;
+    return true;
+}
+
+bool BenchConnection::send()
+{
+    if (_config.arrayLen > 0) {
+        datarec_float_array arr;
+        arr.connectionId = _id;
+        arr.recs.recs_len = _pending.size();
+        arr.recs.recs_val = &_pending.front();
+        if (!call(WRITE_DATAREC_FLOAT_ARRAY, (xdrproc_t) xdr_datarec_float_array,
+                  (caddr_t) &arr))
+            return false;
+        _nsent += _pending.size();
+        return true;
+    }
+    for (unsigned int i = 0; i < _pending.size(); i++) {
+        datarec_float* rec = &_pending[i];
+        _nsent++;
+        if (_config.batch && _nsent % _config.syncEvery != 0) {
+            enum clnt_stat stat = clnt_call(_clnt, WRITE_DATAREC_BATCH_FLOAT,
+                (xdrproc_t) xdr_datarec_float, (caddr_t) rec,
+                (xdrproc_t) NULL, (caddr_t) NULL, batch_timeout);
+            if (stat != RPC_SUCCESS) {
+                _result.error = clnt_sperror(_clnt, "batch write");
+                return false;
+            }
+        }
+        else if (!call(WRITE_DATAREC_FLOAT, (xdrproc_t) xdr_datarec_float,
+                       (caddr_t) rec))
+            return false;
+    }
+    return true;
+}
+
+void BenchConnection::close()
+{
+    if (_clnt && _id >= 0) {
+        // flushes any batched records, and waits for them to be written
+        close_connection_2(&_id, _clnt);
+        _id = -1;
+    }
+}
+
+void BenchConnection::run(bench_clock::time_point t0)
+{
+    if (!open() || !define_groups()) {
+        close();
+        return;
+    }
+
+    int nstations = std::max(_config.nstations, 1);
+    int nper = _config.nvars;
+    // The records of an array are all sent at once, so each needs
+    // its own slot for the data.
+    unsigned int batchLen = _config.arrayLen > 0 ? _config.arrayLen : 1;
+    _data.resize(batchLen * nper);
+    _cnts.resize(batchLen);
+    _start.resize(batchLen);
+    _count.resize(batchLen, 1);
+
+    // Data times start at a round time, so the files have the same
+    // names on each run.
+    double tbase = 1704067200.0;        // 2024 Jan 1 00:00 UTC
+    double dt = _config.interval / _config.nsamples;
+    int nsteps = _config.nrecs * _config.nsamples;
+    int nrecsPerStep = _config.ngroups * nstations;
+
+    for (int it = 0; it < nsteps; it++) {
+        double tdata = tbase + it * dt;
+        for (int ir = 0; ir < nrecsPerStep; ir++) {
+            int ig = ir / nstations;
+            int istn = ir % nstations;
+            unsigned int slot = _pending.size();
+            datarec_float rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.time = tdata;
+            rec.connectionId = _id;
+            rec.datarecId = _groupIds[ig];
+            float* d = &_data[slot * nper];
+            for (int iv = 0; iv < nper; iv++)
+                d[iv] = sin(tdata * 0.001 + iv) * 10.0 + istn;
+            rec.data.data_len = nper;
+            rec.data.data_val = d;
+            if (_config.counts) {
+                _cnts[slot] = 10 + it % 5;
+                rec.cnts.cnts_len = 1;
+                rec.cnts.cnts_val = &_cnts[slot];
+            }
+            if (_config.nstations > 0) {
+                _start[slot] = istn;
+                rec.start.start_len = 1;
+                rec.start.start_val = &_start[slot];
+                rec.count.count_len = 1;
+                rec.count.count_val = &_count[slot];
+            }
+            _pending.push_back(rec);
+
+            bool last = it == nsteps - 1 && ir == nrecsPerStep - 1;
+            if (_pending.size() < batchLen && !last) continue;
+
+            if (_config.rate > 0.0) {
+                std::this_thread::sleep_until(t0 +
+                    std::chrono::duration_cast<bench_clock::duration>(
+                        std::chrono::duration<double>(
+                            _result.nrecs / _config.rate)));
+            }
+            if (!send()) {
+                close();
+                return;
+            }
+            for (unsigned int i = 0; i < _pending.size(); i++)
+                _result.nbytes += _pending[i].data.data_len * sizeof(float) +
+                    _pending[i].cnts.cnts_len * sizeof(int);
+            _result.nrecs += _pending.size();
+            _pending.clear();
+        }
+    }
+    close();
+}
+
+/**
+ * Start nc_server in standalone mode on a free port, and set
+ * NC_SERVER_PORT so that the clients connect to it.
+ */
+pid_t start_server(const BenchConfig& config)
+{
+    int pfd[2];
+    if (pipe(pfd) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        ::close(pfd[0]);
+        dup2(pfd[1], 1);
+        ::close(pfd[1]);
+        vector<string> args = { config.serverPath, "-s", "-p", "0",
+            "-d", "-l", "warning" };
+        std::istringstream ist(config.serverArgs);
+        string arg;
+        while (ist >> arg) args.push_back(arg);
+        vector<char*> argv;
+        for (unsigned int i = 0; i < args.size(); i++)
+            argv.push_back((char*) args[i].c_str());
+        argv.push_back(0);
+        execv(argv[0], &argv.front());
+        perror(argv[0]);
+        _exit(1);
+    }
+    ::close(pfd[1]);
+    FILE* fp = fdopen(pfd[0], "r");
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, "NC_SERVER_PORT=", 15)) {
+            line[strcspn(line, "\n")] = 0;
+            setenv("NC_SERVER_PORT", line + 15, 1);
+            fclose(fp);
+            return pid;
+        }
+    }
+    fclose(fp);
+    std::cerr << config.serverPath << " did not report its port" << std::endl;
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+    return -1;
+}
+
+void stop_server(const BenchConfig& config, pid_t pid)
+{
+    CLIENT* clnt = nc_server_client_create(config.host);
+    if (clnt) {
+        shutdown_2((void *)0, clnt);
+        nc_server_client_destroy(clnt);
+    }
+    else kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+}
+
+float percentile(const vector<float>& sorted, double p)
+{
+    if (sorted.empty()) return 0.0;
+    unsigned int i = (unsigned int)(p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+void usage(const char* argv0)
+{
+    std::cerr << "\
+nc_bench is a load generator for nc_server.  It opens connections, defines\n\
+variable groups, streams records to them, and reports the records/s, MB/s\n\
+and the latency of the calls which wait for a reply.\n\
+\n\
+Usage: " << argv0 << " [options] [server_host]\n\
+    -S path: start path as a standalone nc_server (-s -p 0) and use it\n\
+    -x args: more options for the started nc_server, e.g. \"-t 4 -w 1000\"\n\
+    -d dir: output directory on the server, default /tmp\n\
+    -c n: number of connections, each with its own thread, default 1\n\
+    -F: the connections write to the same files, default a file set each\n\
+    -g n: variable groups per connection, default 4\n\
+    -v n: variables per group, default 10\n\
+    -n n: size of a station dimension, default 0 for none\n\
+    -s n: samples per record interval, the sample dimension, default 1\n\
+    -C: each group has a counts variable\n\
+    -i secs: record interval of the connections, default 1\n\
+    -l secs: file length, default 86400\n\
+    -N n: record intervals to send, default 3600\n\
+    -r rate: records/s sent by each connection, default 0: flat out\n\
+    -b: batch mode, WRITE_DATAREC_BATCH_FLOAT, without waiting for replies\n\
+    -B n: in batch mode, make a synchronous write every n records, default 100\n\
+    -a n: send arrays of n records with WRITE_DATAREC_FLOAT_ARRAY\n\
+    -o file: append the results to file, as one line of JSON\n\
+The results are printed to stdout as one line of JSON, and a summary\n\
+to stderr." << std::endl;
+}
+
+int parse_args(int argc, char** argv, BenchConfig& config)
+{
+    int c;
+    while ((c = getopt(argc, argv, "a:bB:c:Cd:Fg:i:l:n:N:o:r:s:S:v:x:")) != -1) {
+        switch (c) {
+        case 'a': config.arrayLen = atoi(optarg); break;
+        case 'b': config.batch = true; break;
+        case 'B': config.syncEvery = atoi(optarg); break;
+        case 'c': config.nconnections = atoi(optarg); break;
+        case 'C': config.counts = true; break;
+        case 'd': config.outputDir = optarg; break;
+        case 'F': config.sharedFiles = true; break;
+        case 'g': config.ngroups = atoi(optarg); break;
+        case 'i': config.interval = atof(optarg); break;
+        case 'l': config.fileLength = atof(optarg); break;
+        case 'n': config.nstations = atoi(optarg); break;
+        case 'N': config.nrecs = atoi(optarg); break;
+        case 'o': config.resultsFile = optarg; break;
+        case 'r': config.rate = atof(optarg); break;
+        case 's': config.nsamples = atoi(optarg); break;
+        case 'S': config.serverPath = optarg; break;
+        case 'v': config.nvars = atoi(optarg); break;
+        case 'x': config.serverArgs = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) config.host = argv[optind];
+    if (config.nconnections < 1 || config.ngroups < 1 || config.nvars < 1 ||
+        config.nstations < 0 || config.nsamples < 1 || config.nrecs < 1 ||
+        config.syncEvery < 1 || config.arrayLen < 0 ||
+        config.interval <= 0.0 || config.fileLength <= 0.0 ||
+        (config.batch && config.arrayLen > 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    return 0;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig config;
+    if (parse_args(argc, argv, config)) return 1;
+
+    pid_t server = 0;
+    if (!config.serverPath.empty()) {
+        config.host = "localhost";
+        if ((server = start_server(config)) < 0) return 1;
+    }
+
+    vector<BenchConnection*> conns;
+    for (int i = 0; i < config.nconnections; i++)
+        conns.push_back(new BenchConnection(config, i));
+
+    bench_clock::time_point t0 = bench_clock::now();
+    vector<std::thread> threads;
+    for (unsigned int i = 0; i < conns.size(); i++)
+        threads.push_back(std::thread(&BenchConnection::run, conns[i], t0));
+    for (unsigned int i = 0; i < threads.size(); i++)
+        threads[i].join();
+    double secs = std::chrono::duration<double>(bench_clock::now() - t0).count();
+
+    if (server > 0) stop_server(config, server);
+
+    unsigned long long nrecs = 0;
+    unsigned long long nbytes = 0;
+    unsigned int nerrors = 0;
+    vector<float> latencies;
+    int status = 0;
+    for (unsigned int i = 0; i < conns.size(); i++) {
+        const ConnResult& res = conns[i]->result();
+        nrecs += res.nrecs;
+        nbytes += res.nbytes;
+        nerrors += res.nerrors;
+        latencies.insert(latencies.end(), res.latencies.begin(),
+                         res.latencies.end());
+        if (!res.error.empty()) {
+            std::cerr << "connection " << i << ": " << res.error << std::endl;
+            status = 1;
+        }
+        delete conns[i];
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    const char* mode = config.arrayLen > 0 ? "array" :
+        (config.batch ? "batch" : "sync");
+    std::ostringstream json;
+    json << "{\"connections\":" << config.nconnections <<
+        ",\"groups\":" << config.ngroups <<
+        ",\"variables\":" << config.nvars <<
+        ",\"stations\":" << config.nstations <<
+        ",\"samples\":" << config.nsamples <<
+        ",\"counts\":" << (config.counts ? "true" : "false") <<
+        ",\"mode\":\"" << mode << "\"" <<
+        ",\"array_length\":" << config.arrayLen <<
+        ",\"rate\":" << config.rate <<
+        ",\"server_args\":\"" << config.serverArgs << "\"" <<
+        ",\"records\":" << nrecs <<
+        ",\"bytes\":" << nbytes <<
+        ",\"seconds\":" << secs <<
+        ",\"records_per_sec\":" << nrecs / secs <<
+        ",\"mb_per_sec\":" << nbytes / secs * 1.e-6 <<
+        ",\"calls\":" << latencies.size() <<
+        ",\"latency_usecs\":{\"p50\":" << percentile(latencies, 0.5) <<
+        ",\"p99\":" << percentile(latencies, 0.99) <<
+        ",\"p999\":" << percentile(latencies, 0.999) <<
+        ",\"max\":" << (latencies.empty() ? 0.0 : latencies.back()) << "}" <<
+        ",\"write_errors\":" << nerrors <<
+        ",\"failed\":" << (status ? "true" : "false") << "}";
+
+    std::cout << json.str() << std::endl;
+    if (!config.resultsFile.empty()) {
+        std::ofstream ofs(config.resultsFile.c_str(), std::ios::app);
+        ofs << json.str() << std::endl;
+    }
+    std::cerr << nrecs << " records in " << secs << " secs: " <<
+        nrecs / secs << " records/s, " << nbytes / secs * 1.e-6 <<
+        " MB/s, latency p50/p99/p999 " << percentile(latencies, 0.5) << '/' <<
+        percentile(latencies, 0.99) << '/' << percentile(latencies, 0.999) <<
+        " usecs" << std::endl;
+    return status;
+}
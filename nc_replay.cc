@@ -0,0 +1,397 @@
+//              Copyright (C) by UCAR
+//
+// Description:
+//   Replay the requests captured by nc_server -R to an nc_server,
+//   at the recorded pace or as fast as possible.  The connection and
+//   variable group ids of the capture are mapped to the ones returned
+//   by the server.
+
+#include "nc_server_client.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+
+using std::string;
+
+namespace {
+
+const unsigned int CAPTURE_MAGIC = 0x4e435231;
+
+struct timeval rpc_timeout = { 300, 0 };
+
+struct timeval batch_timeout = { 0, 0 };
+
+/**
+ * Maps the ids of the capture to those of the server.
+ */
+class IdMap
+{
+public:
+    IdMap(): _connIds(), _groupIds()
+    {
+    }
+
+    void add_connection(int oldId, int newId)
+    {
+        _connIds[oldId] = newId;
+    }
+
+    void add_group(int oldConnId, int oldGroupId, int newGroupId)
+    {
+        _groupIds[std::make_pair(oldConnId, oldGroupId)] = newGroupId;
+    }
+
+    /**
+     * @return -1 if the connection was not opened in the capture.
+     */
+    int connection(int oldId) const
+    {
+        std::map<int,int>::const_iterator ci = _connIds.find(oldId);
+        return ci == _connIds.end() ? -1 : ci->second;
+    }
+
+    int group(int oldConnId, int oldGroupId) const
+    {
+        std::map<std::pair<int,int>,int>::const_iterator gi =
+            _groupIds.find(std::make_pair(oldConnId, oldGroupId));
+        return gi == _groupIds.end() ? -1 : gi->second;
+    }
+
+    template<class REC_T>
+    void map_rec(REC_T* rec) const
+    {
+        rec->datarecId = group(rec->connectionId, rec->datarecId);
+        rec->connectionId = connection(rec->connectionId);
+    }
+
+private:
+    std::map<int,int> _connIds;
+
+    std::map<std::pair<int,int>,int> _groupIds;
+};
+
+/**
+ * Counts of the replayed requests.
+ */
+struct ReplayStats
+{
+    ReplayStats(): nrequests(0), nrecs(0), nerrors(0)
+    {
+    }
+
+    unsigned long nrequests;
+
+    unsigned long nrecs;
+
+    unsigned long nerrors;
+};
+
+class Replayer
+{
+public:
+    Replayer(CLIENT* clnt);
+
+    /**
+     * Decode the argument of a request from the capture, map its ids,
+     * and send it to the server.
+     * @return false if the argument could not be decoded, or the
+     *  server could not be called.
+     */
+    bool replay(XDR* xdrs, unsigned int proc, int capturedResult);
+
+    const ReplayStats& stats() const { return _stats; }
+
+private:
+    /**
+     * Decode an argument of type T, call the server, and free it.
+     * The argument is passed to map before the call, which returns
+     * false if the request should be skipped.
+     */
+    template<class T, class MAP_T>
+    bool call(XDR* xdrs, unsigned int proc, xdrproc_t xargs, bool batch,
+              int* result, MAP_T map);
+
+    CLIENT* _clnt;
+
+    IdMap _ids;
+
+    ReplayStats _stats;
+
+    Replayer(const Replayer&);
+    Replayer& operator=(const Replayer&);
+};
+
+Replayer::Replayer(CLIENT* clnt): _clnt(clnt), _ids(), _stats()
+{
+}
+
+template<class T, class MAP_T>
+bool Replayer::call(XDR* xdrs, unsigned int proc, xdrproc_t xargs,
+                    bool batch, int* result, MAP_T map)
+{
+    T args;
+    memset(&args, 0, sizeof(args));
+    if (!xargs(xdrs, &args)) return false;
+
+    bool ok = true;
+    if (map(args)) {
+        enum clnt_stat stat;
+        if (batch)
+            stat = clnt_call(_clnt, proc, xargs, (caddr_t) &args,
+                             (xdrproc_t) NULL, (caddr_t) NULL, batch_timeout);
+        else
+            stat = clnt_call(_clnt, proc, xargs, (caddr_t) &args,
+                             (xdrproc_t) xdr_int, (caddr_t) result,
+                             rpc_timeout);
+        if (stat != RPC_SUCCESS) {
+            clnt_perror(_clnt, "replay");
+            ok = false;
+        }
+        else if (!batch && *result < 0) _stats.nerrors++;
+        _stats.nrequests++;
+    }
+    xdr_free(xargs, (char*) &args);
+    return ok;
+}
+
+bool Replayer::replay(XDR* xdrs, unsigned int proc, int capturedResult)
+{
+    int result = 0;
+    const IdMap& ids = _ids;
+    ReplayStats& stats = _stats;
+
+    switch (proc) {
+    case OPEN_CONNECTION:
+        if (!call<connection>(xdrs, proc, (xdrproc_t) xdr_connection, false,
+                              &result, [](connection&) { return true; }))
+            return false;
+        if (result >= 0) _ids.add_connection(capturedResult, result);
+        return true;
+    case DEFINE_DATAREC:
+        {
+            int oldConnId = -1;
+            if (!call<datadef>(xdrs, proc, (xdrproc_t) xdr_datadef, false,
+                               &result, [&](datadef& dd) {
+                        oldConnId = dd.connectionId;
+                        dd.connectionId = ids.connection(dd.connectionId);
+                        return dd.connectionId >= 0;
+                    }))
+                return false;
+            if (result >= 0)
+                _ids.add_group(oldConnId, capturedResult, result);
+        }
+        return true;
+    case WRITE_DATAREC_FLOAT:
+    case WRITE_DATAREC_BATCH_FLOAT:
+        return call<datarec_float>(xdrs, proc, (xdrproc_t) xdr_datarec_float,
+                                   proc == WRITE_DATAREC_BATCH_FLOAT, &result,
+                                   [&](datarec_float& rec) {
+                ids.map_rec(&rec);
+                stats.nrecs++;
+                return rec.connectionId >= 0;
+            });
+    case WRITE_DATAREC_INT:
+    case WRITE_DATAREC_BATCH_INT:
+        return call<datarec_int>(xdrs, proc, (xdrproc_t) xdr_datarec_int,
+                                 proc == WRITE_DATAREC_BATCH_INT, &result,
+                                 [&](datarec_int& rec) {
+                ids.map_rec(&rec);
+                stats.nrecs++;
+                return rec.connectionId >= 0;
+            });
+    case WRITE_DATAREC_FLOAT_ARRAY:
+        return call<datarec_float_array>(xdrs, proc,
+                                         (xdrproc_t) xdr_datarec_float_array,
+                                         false, &result,
+                                         [&](datarec_float_array& arr) {
+                for (unsigned int i = 0; i < arr.recs.recs_len; i++)
+                    ids.map_rec(arr.recs.recs_val + i);
+                stats.nrecs += arr.recs.recs_len;
+                arr.connectionId = ids.connection(arr.connectionId);
+                return arr.connectionId >= 0;
+            });
+    case WRITE_DATAREC_INT_ARRAY:
+        return call<datarec_int_array>(xdrs, proc,
+                                       (xdrproc_t) xdr_datarec_int_array,
+                                       false, &result,
+                                       [&](datarec_int_array& arr) {
+                for (unsigned int i = 0; i < arr.recs.recs_len; i++)
+                    ids.map_rec(arr.recs.recs_val + i);
+                stats.nrecs += arr.recs.recs_len;
+                arr.connectionId = ids.connection(arr.connectionId);
+                return arr.connectionId >= 0;
+            });
+    case WRITE_DATAREC_FLOAT_SEQ:
+        return call<datarec_float_seq>(xdrs, proc,
+                                       (xdrproc_t) xdr_datarec_float_seq,
+                                       true, &result,
+                                       [&](datarec_float_seq& arr) {
+                for (unsigned int i = 0; i < arr.recs.recs_len; i++)
+                    ids.map_rec(arr.recs.recs_val + i);
+                stats.nrecs += arr.recs.recs_len;
+                arr.connectionId = ids.connection(arr.connectionId);
+                return arr.connectionId >= 0;
+            });
+    case WRITE_HISTORY:
+    case WRITE_HISTORY_BATCH:
+        return call<history_attr>(xdrs, proc, (xdrproc_t) xdr_history_attr,
+                                  proc == WRITE_HISTORY_BATCH, &result,
+                                  [&](history_attr& attr) {
+                attr.connectionId = ids.connection(attr.connectionId);
+                return attr.connectionId >= 0;
+            });
+    case WRITE_GLOBAL_ATTR:
+        return call<global_attr>(xdrs, proc, (xdrproc_t) xdr_global_attr,
+                                 false, &result, [&](global_attr& attr) {
+                attr.connectionId = ids.connection(attr.connectionId);
+                return attr.connectionId >= 0;
+            });
+    case WRITE_GLOBAL_INT_ATTR:
+        return call<global_int_attr>(xdrs, proc,
+                                     (xdrproc_t) xdr_global_int_attr,
+                                     false, &result,
+                                     [&](global_int_attr& attr) {
+                attr.connectionId = ids.connection(attr.connectionId);
+                return attr.connectionId >= 0;
+            });
+    case WRITE_GLOBAL_ATTRS:
+        return call<global_attrs>(xdrs, proc, (xdrproc_t) xdr_global_attrs,
+                                  false, &result, [&](global_attrs& attrs) {
+                attrs.connectionId = ids.connection(attrs.connectionId);
+                return attrs.connectionId >= 0;
+            });
+    case CLOSE_CONNECTION:
+        return call<int>(xdrs, proc, (xdrproc_t) xdr_int, false, &result,
+                         [&](int& id) {
+                id = ids.connection(id);
+                return id >= 0;
+            });
+    case CLOSE_FILES:
+    case SYNC_FILES:
+        {
+            enum clnt_stat stat = clnt_call(_clnt, proc,
+                (xdrproc_t)(void(*)(void)) xdr_void, (caddr_t) NULL,
+                (xdrproc_t) xdr_int, (caddr_t) &result, rpc_timeout);
+            if (stat != RPC_SUCCESS) {
+                clnt_perror(_clnt, "replay");
+                return false;
+            }
+            _stats.nrequests++;
+        }
+        return true;
+    default:
+        std::cerr << "unknown procedure in capture: " << proc << std::endl;
+        return false;
+    }
+}
+
+void usage(const char* argv0)
+{
+    std::cerr << "\
+nc_replay sends the requests captured by nc_server -R to an nc_server.\n\
+Use a fresh standalone server, such as nc_server -s -p 0, with its port in\n\
+NC_SERVER_PORT, so the files of the capture are not overwritten.\n\
+\n\
+Usage: " << argv0 << " [-f] [-x speed] capture_file [server_host]\n\
+    -f: send the requests as fast as possible, not at the recorded pace\n\
+    -x speed: send the requests speed times faster than recorded, default 1\n\
+    server_host: default localhost" << std::endl;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    bool fast = false;
+    double speed = 1.0;
+    int c;
+    while ((c = getopt(argc, argv, "fx:")) != -1) {
+        switch (c) {
+        case 'f':
+            fast = true;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            if (speed <= 0.0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* capfile = argv[optind++];
+    string host = optind < argc ? argv[optind] : "localhost";
+
+    FILE* fp = fopen(capfile, "r");
+    if (!fp) {
+        perror(capfile);
+        return 1;
+    }
+    XDR xdrs;
+    xdrstdio_create(&xdrs, fp, XDR_DECODE);
+    unsigned int magic = 0;
+    if (!xdr_u_int(&xdrs, &magic) || magic != CAPTURE_MAGIC) {
+        std::cerr << capfile << ": not an nc_server capture file" << std::endl;
+        return 1;
+    }
+
+    CLIENT* clnt = nc_server_client_create(host);
+    if (!clnt) {
+        clnt_pcreateerror(host.c_str());
+        return 1;
+    }
+
+    typedef std::chrono::steady_clock clock;
+    Replayer replayer(clnt);
+    clock::time_point start = clock::now();
+    double t0 = 0.0;
+    double t;
+    unsigned int proc;
+    int result;
+    int status = 0;
+    while (xdr_double(&xdrs, &t)) {
+        if (!xdr_u_int(&xdrs, &proc) || !xdr_int(&xdrs, &result)) {
+            std::cerr << capfile << ": truncated" << std::endl;
+            break;
+        }
+        if (t0 == 0.0) t0 = t;
+        if (!fast) {
+            std::this_thread::sleep_until(start +
+                std::chrono::duration_cast<clock::duration>(
+                    std::chrono::duration<double>((t - t0) / speed)));
+        }
+        if (!replayer.replay(&xdrs, proc, result)) {
+            status = 1;
+            break;
+        }
+    }
+
+    // wait for any batched requests to be written
+    sync_files_2((void *)0, clnt);
+    double secs = std::chrono::duration<double>(clock::now() - start).count();
+    const ReplayStats& stats = replayer.stats();
+    std::cout << stats.nrequests << " requests, " << stats.nrecs <<
+        " records in " << secs << " secs, " << stats.nrecs / secs <<
+        " records/s, " << stats.nerrors << " errors" << std::endl;
+
+    nc_server_client_destroy(clnt);
+    xdr_destroy(&xdrs);
+    fclose(fp);
+    return status;
+}
@@ -10,25 +10,37 @@
 #include "version.h"
 
 #include <unistd.h>
+#include <strings.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <rpc/pmap_clnt.h>
 #include <pwd.h>
 #include <grp.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
 
 #include <netcdf.h>
 
 #include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include <set>
 #include <iostream>
+#include <iomanip>
+#include <deque>
+#include <thread>
+#include <condition_variable>
 
 #include <nidas/util/Process.h>
 #include <nidas/util/Socket.h>
 #include <nidas/util/Logger.h>
 #include <nidas/util/ParseException.h>
+#include <nidas/util/IOException.h>
 
 using nidas::util::LogContext;
 using nidas::util::UTime;
@@ -45,7 +57,7 @@ using nidas::util::LogMessage;
 
 const int Connections::CONNECTIONTIMEOUT = 43200;
 const int FileGroup::FILEACCESSTIMEOUT = 900;
-const int FileGroup::MAX_FILES_OPEN = 16;
+const unsigned int FileGroup::HOT_FILES = 4;
 
 namespace {
     const char* defaultLogConfig{ "notice" };
@@ -57,6 +69,14 @@ namespace {
     using std::auto_ptr;
 #endif
 
+    /**
+     * libnetcdf, and the global NcError status of its C++ interface,
+     * are not thread safe, so every call into the library is made with
+     * this locked.  It is locked after the mutex of a FileGroup, and
+     * a FileGroup mutex is only try-locked while it is held.
+     */
+    std::recursive_mutex netcdf_mutex;
+
 };
 
 
@@ -163,297 +183,1816 @@ inline int NS_NcFile::EndTimeGT(double time) const
 }
 
 
-Connections::Connections(void): _connections(),_connectionCntr(0)
+LatencyHistogram::LatencyHistogram(): _bins(), _count(0), _nanos(0)
 {
-    srandom((unsigned int)time(0));
+    for (int i = 0; i < NBINS; i++) _bins[i] = 0;
 }
 
-Connections *Connections::_instance = 0;
+void LatencyHistogram::add(clock::duration d)
+{
+    unsigned long long nanos =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    unsigned long long usecs = (nanos + 999) / 1000;
+    // smallest i such that usecs <= 2^i
+    int i = usecs <= 1 ? 0 : 64 - __builtin_clzll(usecs - 1);
+    if (i >= NBINS) i = NBINS - 1;
+    _bins[i]++;
+    _count++;
+    _nanos += nanos;
+}
 
-Connections *Connections::Instance()
+MetricsReport::MetricsReport(): _names(), _text()
 {
-    if (_instance == 0)
-        _instance = new Connections;
-    return _instance;
 }
 
-Connections::~Connections(void)
+string& MetricsReport::metric(const string& name, const string& type,
+                              const string& help)
 {
-    map <int, Connection * >::iterator ci = _connections.begin();
-    for ( ; ci != _connections.end(); ++ci) delete ci->second;
+    map<string, string>::iterator mi = _text.find(name);
+    if (mi != _text.end()) return mi->second;
+    _names.push_back(name);
+    string& text = _text[name];
+    text = "# HELP " + name + ' ' + help + "\n# TYPE " + name + ' ' +
+        type + '\n';
+    return text;
 }
 
-int Connections::openConnection(const struct connection *conn) throw()
+namespace {
+    string sample(const string& name, const string& labels, double value)
+    {
+        ostringstream ost;
+        ost << name;
+        if (!labels.empty()) ost << '{' << labels << '}';
+        ost << ' ' << std::setprecision(12) << value << '\n';
+        return ost.str();
+    }
+}
+
+void MetricsReport::counter(const string& name, const string& help,
+                            const string& labels, double value)
 {
-    Connection *cp = 0;
+    metric(name, "counter", help) += sample(name, labels, value);
+}
 
-    VLOG(("_connections.size()=%d", _connections.size()));
+void MetricsReport::gauge(const string& name, const string& help,
+                          const string& labels, double value)
+{
+    metric(name, "gauge", help) += sample(name, labels, value);
+}
 
-    closeOldConnections();
+void MetricsReport::histogram(const string& name, const string& help,
+                              const string& labels,
+                              const LatencyHistogram& hist)
+{
+    string& text = metric(name, "histogram", help);
+    string sep = labels.empty() ? "" : ",";
+    unsigned long long cum = 0;
+    for (int i = 0; i < LatencyHistogram::NBINS - 1; i++) {
+        cum += hist.bin(i);
+        ostringstream le;
+        le << LatencyHistogram::bound(i);
+        text += sample(name + "_bucket", labels + sep + label("le", le.str()),
+                       cum);
+    }
+    text += sample(name + "_bucket", labels + sep + label("le", "+Inf"),
+                   hist.count());
+    text += sample(name + "_sum", labels, hist.sum());
+    text += sample(name + "_count", labels, hist.count());
+}
 
-    // just in case this process ever handles over 2^31 connections :-)
-    if (_connectionCntr < 0) _connectionCntr = 0;
+string MetricsReport::str() const
+{
+    string res;
+    for (unsigned int i = 0; i < _names.size(); i++)
+        res += _text.find(_names[i])->second;
+    return res;
+}
 
-    // The low order 2 bytes of the connection id are an integer
-    // that increments for every new connection. The high order
-    // 2 bytes are a random value, so that if this process is
-    // restarted, it is unlikely that any pre-existing client will
-    // have the same id as a new client.
-    int id = (_connectionCntr++ & 0xffff) + (random() & 0xffff0000UL);
-    try {
-        cp = new Connection(conn,id);
-    }
-    catch(const nidas::util::Exception& e) {
-        PLOG(("%s",e.what()));
-        return -1;
+string MetricsReport::label(const string& name, const string& value)
+{
+    string res = name + "=\"";
+    for (unsigned int i = 0; i < value.length(); i++) {
+        char c = value[i];
+        if (c == '\\' || c == '"') res += '\\';
+        if (c == '\n') res += "\\n";
+        else res += c;
+    }
+    return res + '"';
+}
+
+/**
+ * Ring of the trace events of one thread.  Only the thread writes to it,
+ * the fields are atomic so that a dump can read it at the same time,
+ * although an event being overwritten may be garbled.
+ */
+class Trace::Ring
+{
+public:
+    Ring(unsigned int nevents);
+
+    ~Ring();
+
+    void add(Point p, long arg, long long nanos);
+
+    /**
+     * Log the stages of the request which ended at sequence number
+     * seq, if it took longer than slowNanos.
+     */
+    void check_slow(unsigned int seq, long long nanos, long long slowNanos);
+
+    void dump(std::ostream& ost, long long offset) const;
+
+    struct Event
+    {
+        std::atomic<long long> nanos;
+        std::atomic<int> point;
+        std::atomic<long> arg;
+    };
+
+    unsigned int _nevents;
+
+    std::unique_ptr<Event[]> _events;
+
+    /** Number of events added, the next is at _seq % _nevents. */
+    std::atomic<unsigned int> _seq;
+
+    /** Start of the current request. */
+    unsigned int _beginSeq;
+
+    long long _beginNanos;
+
+    pid_t _tid;
+
+private:
+    Ring(const Ring&);
+    Ring& operator=(const Ring&);
+};
+
+std::atomic<bool> Trace::_enabled{false};
+
+unsigned int Trace::_nevents = 1024;
+
+long long Trace::_slowNanos = 0;
+
+std::mutex Trace::_ringsMutex;
+
+std::set<Trace::Ring*> Trace::_rings;
+
+namespace {
+    long long trace_nanos()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
     }
-    _connections[id] = cp;
-#ifdef LOG_HEAP
-    ILOG(("Opened connection, id=%d, #connections=%zd, heap=%zd",
-            (id & 0xffff),_connections.size(), heap()));
-#else
-    ILOG(("Opened connection, id=%d, #connections=%zd",
-            (id & 0xffff),_connections.size()));
-#endif
-    return id;
 }
 
-int Connections::closeConnection(int id)
+Trace::Ring::Ring(unsigned int nevents):
+    _nevents(nevents), _events(new Event[nevents]), _seq(0),
+    _beginSeq(0), _beginNanos(trace_nanos()), _tid(::syscall(SYS_gettid))
 {
-    map <int, Connection * >::iterator ci = _connections.find(id);
-    if (ci != _connections.end()) {
-        int id = ci->first;
-        delete ci->second;
-        _connections.erase(ci);
-        ILOG(("Closed connection, id=%d, #connections=%zd",
-            (id & 0xffff),_connections.size()));
-        return 0;
+    for (unsigned int i = 0; i < _nevents; i++) {
+        _events[i].nanos = 0;
+        _events[i].point = BEGIN;
+        _events[i].arg = 0;
     }
-    return -1;
+    std::lock_guard<std::mutex> lock(Trace::_ringsMutex);
+    Trace::_rings.insert(this);
 }
 
-void Connections::closeOldConnections()
+Trace::Ring::~Ring()
 {
-    time_t utime;
-    /*
-     * Release timed-out connections.
-     */
-    utime = time(0);
+    std::lock_guard<std::mutex> lock(Trace::_ringsMutex);
+    Trace::_rings.erase(this);
+}
+
+void Trace::Ring::add(Point p, long arg, long long nanos)
+{
+    unsigned int seq = _seq.load(std::memory_order_relaxed);
+    Event& ev = _events[seq % _nevents];
+    ev.nanos.store(nanos, std::memory_order_relaxed);
+    ev.point.store(p, std::memory_order_relaxed);
+    ev.arg.store(arg, std::memory_order_relaxed);
+    _seq.store(seq + 1, std::memory_order_release);
+}
 
-    map<int, Connection*>::iterator ci = _connections.begin();
-    for ( ; ci != _connections.end(); ) {
-        int id = ci->first;
-        Connection* co = ci->second;
-        if (utime - co->LastRequest() > CONNECTIONTIMEOUT) {
-            delete co;
-            // map::erase doesn't return an iterator, unless
-            // __GXX_EXPERIMENTAL_CXX0X__ is defined
-            _connections.erase(ci++);
-            ILOG(("Timeout, closed connection, id=%d, #connections=%zd",
-                (id & 0xffff),_connections.size()));
+void Trace::Ring::check_slow(unsigned int seq, long long nanos,
+                             long long slowNanos)
+{
+    long long total = nanos - _beginNanos;
+    if (slowNanos > 0 && total > slowNanos) {
+        Probes probes;
+        long connId = -1;
+        unsigned int first = _beginSeq;
+        bool truncated = seq - first >= _nevents;
+        if (truncated) first = seq - _nevents + 1;
+        for (unsigned int i = first; i <= seq; i++) {
+            const Event& ev = _events[i % _nevents];
+            Point p = (Point)(int)ev.point;
+            probes.push_back(std::make_pair(p, (long long)ev.nanos));
+            if (i > first && p == LOOKUP && connId < 0) connId = ev.arg;
         }
-        else ++ci;
+        ostringstream ost;
+        ost << std::fixed << std::setprecision(6) << "slow request, " <<
+            total * 1.e-9 << " secs";
+        if (connId >= 0) ost << ", " << Connection::getIdStr(connId);
+        if (truncated) ost << ", earliest stages lost";
+        ost << ":" << Trace::stages(probes);
+        WLOG(("%s", ost.str().c_str()));
+    }
+    _beginSeq = seq;
+    _beginNanos = nanos;
+}
+
+void Trace::Ring::dump(std::ostream& ost, long long offset) const
+{
+    unsigned int seq = _seq.load(std::memory_order_acquire);
+    unsigned int first = seq > _nevents ? seq - _nevents : 0;
+    ost << "thread " << _tid << ", " << seq - first << " events\n";
+    for (unsigned int i = first; i < seq; i++) {
+        const Event& ev = _events[i % _nevents];
+        long long nanos = ev.nanos + offset;
+        UTime ut(nanos * 1.e-9);
+        ost << ut.format(true, "%Y %m %d %H:%M:%S.%6f") << ' ' <<
+            Trace::name((Point)(int)ev.point) << ' ' << ev.arg << '\n';
     }
 }
 
-unsigned int Connections::num() const
+void Trace::enable(unsigned int nevents, double slowSecs)
 {
-    return _connections.size();
+    if (nevents > 0) _nevents = nevents;
+    _slowNanos = (long long)(slowSecs * 1.e9);
+    _enabled = true;
 }
 
-/* static */
-std::string Connection::getIdStr(int id) 
+const char* Trace::name(Point p)
+{
+    static const char* names[NPOINTS] = {
+        "begin", "decode", "lookup", "sync", "open_file", "get_file",
+        "get_vars", "put_time", "put_vars", "flush", "end"
+    };
+    return (p >= 0 && p < NPOINTS) ? names[p] : "unknown";
+}
+
+string Trace::stages(const Probes& probes)
 {
+    // The time of each stage, summed over the records of the request.
+    long long stage[NPOINTS] = {0};
+    int nprobes[NPOINTS] = {0};
+    for (unsigned int i = 1; i < probes.size(); i++) {
+        int p = probes[i].first;
+        if (p < 0 || p >= NPOINTS) continue;
+        stage[p] += probes[i].second - probes[i - 1].second;
+        nprobes[p]++;
+    }
     ostringstream ost;
-    ost << "connection#" << (id & 0xffff);
+    ost << std::fixed << std::setprecision(6);
+    for (int p = DECODE; p < NPOINTS; p++) {
+        if (nprobes[p] == 0) continue;
+        ost << ' ' << Trace::name((Point)p) << '=' << stage[p] * 1.e-9;
+        if (nprobes[p] > 1) ost << '(' << nprobes[p] << ')';
+    }
     return ost.str();
 }
 
-Connection::Connection(const connection * conn, int id)
-:  _filegroup(0),_history(),_histlen(),
-    _lastf(0),_lastRequest(time(0)),
-    _id(id),_errorMsg(),_state(CONN_OK)
+Trace::Ring* Trace::ring()
 {
+    static thread_local std::unique_ptr<Ring> tring;
+    if (!tring) tring.reset(new Ring(_nevents));
+    return tring.get();
+}
 
-    AllFiles *allfiles = AllFiles::Instance();
-    _lastRequest = time(0);
+void Trace::record(Point p, long arg)
+{
+    Ring* r = ring();
+    long long nanos = trace_nanos();
+    if (p == BEGIN) {
+        r->_beginSeq = r->_seq.load(std::memory_order_relaxed);
+        r->_beginNanos = nanos;
+    }
+    r->add(p, arg, nanos);
+    if (p == END)
+        r->check_slow(r->_seq.load(std::memory_order_relaxed) - 1, nanos,
+                      _slowNanos);
+}
+
+string Trace::dump()
+{
+    if (!enabled()) return "tracing is not enabled, see nc_server -T\n";
+
+    // offset from CLOCK_MONOTONIC to the time of day
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long offset = ts.tv_sec * 1000000000LL + ts.tv_nsec - trace_nanos();
 
-    _filegroup = allfiles->get_file_group(conn);
-    _filegroup->add_connection(this);
+    ostringstream ost;
+    std::lock_guard<std::mutex> lock(_ringsMutex);
+    for (std::set<Ring*>::const_iterator ri = _rings.begin();
+         ri != _rings.end(); ++ri)
+        (*ri)->dump(ost, offset);
+    return ost.str();
 }
 
-Connection::~Connection(void)
+
+ServerStats *ServerStats::_instance = 0;
+
+ServerStats *ServerStats::Instance()
 {
-    if (_lastf)
-        _lastf->sync();
-    _filegroup->remove_connection(this);
+    if (_instance == 0)
+        _instance = new ServerStats;
+    return _instance;
+}
 
-    AllFiles *allfiles = AllFiles::Instance();
-    allfiles->close_old_files();
+ServerStats::ServerStats(): _nrequests(0), _handlerNanos(0),
+    _dispatchNanos(0), _dispatchLatency()
+{
 }
 
-int Connection::add_var_group(const struct datadef *dd) throw()
+void ServerStats::rpc_dispatched(clock::duration d)
 {
-    _lastRequest = time(0);
-    try {
-        return _filegroup->add_var_group(dd);
-    }
-    catch (const nidas::util::Exception& e) {
-        PLOG(("%s",e.what()));
-        _state = CONN_ERROR;
-        _errorMsg = e.what();
-        return -1;
-    }
+    _dispatchNanos +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    _dispatchLatency.add(d);
 }
 
-Connection *Connections::operator[] (int i) const
+void ServerStats::rpc_handled(clock::duration d)
 {
-    VLOG(("i=%d,_connections.size()=%d", i, _connections.size()));
-    map <int, Connection*>::const_iterator ci = _connections.find(i);
-    if (ci != _connections.end()) return ci->second;
-    return 0;
+    _nrequests++;
+    _handlerNanos +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
 }
 
-NS_NcFile *Connection::last_file() const
+string ServerStats::report()
 {
-    return _lastf;
+    MetricsReport report;
+    report.gauge("nc_server_vsize_bytes", "Virtual memory size", "",
+                 heap());
+    report.gauge("nc_server_connections", "Open connections", "",
+                 Connections::Instance()->num());
+    report.gauge("nc_server_open_files", "Open netCDF files", "",
+                 AllFiles::Instance()->num_files());
+    report.gauge("nc_server_max_open_files", "Maximum open netCDF files", "",
+                 AllFiles::Instance()->getMaxOpenFiles());
+    report.counter("nc_server_rpc_requests_total", "RPC requests executed",
+                   "", _nrequests);
+    report.counter("nc_server_rpc_handler_seconds_total",
+                   "Time executing RPC procedures", "", _handlerNanos * 1.e-9);
+    // The handlers run within the dispatch, the rest is mostly XDR.
+    unsigned long long dispatch = _dispatchNanos;
+    unsigned long long handler = _handlerNanos;
+    report.counter("nc_server_rpc_decode_seconds_total",
+                   "Time in RPC dispatch outside the procedures, "
+                   "decoding and encoding", "",
+                   (dispatch > handler ? dispatch - handler : 0) * 1.e-9);
+    report.histogram("nc_server_rpc_dispatch_seconds",
+                     "Time servicing the requests of a readable transport",
+                     "", _dispatchLatency);
+
+    Connections::Instance()->report(report);
+    AllFiles::Instance()->report(report);
+    Journal::Instance()->report(report);
+    return report.str();
 }
 
+RequestCapture *RequestCapture::_instance = 0;
 
-void Connection::unset_last_file()
+std::atomic<bool> RequestCapture::_active{false};
+
+RequestCapture *RequestCapture::Instance()
 {
-    _lastf = 0;
+    if (_instance == 0)
+        _instance = new RequestCapture;
+    return _instance;
 }
 
+RequestCapture::RequestCapture(): _mutex(), _path(), _fp(0), _xdrs(),
+    _lastFlush(0)
+{
+}
 
-template <typename T>
-void log_rec(const T* writerec)
+void RequestCapture::open(const string& path)
 {
-    DLOG(("first record: connid=") << writerec->connectionId
-         << ", datarecid=" << writerec->datarecId
-         << ", time="
-         << UTime(writerec->time).format(true,"%Y-%m-%d_%H:%M:%S.%3f"));
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_fp) return;
+    if (!(_fp = fopen(path.c_str(), "w")))
+        throw nidas::util::IOException(path, "open", errno);
+    _path = path;
+    xdrstdio_create(&_xdrs, _fp, XDR_ENCODE);
+    unsigned int magic = MAGIC;
+    xdr_u_int(&_xdrs, &magic);
+    _lastFlush = time(0);
+    _active = true;
+    ILOG(("capturing requests to %s", path.c_str()));
 }
 
+void RequestCapture::close()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_fp) return;
+    _active = false;
+    xdr_destroy(&_xdrs);
+    if (fclose(_fp) != 0)
+        PLOG(("%s: %m", _path.c_str()));
+    _fp = 0;
+}
 
-int Connection::put_rec(const datarec_float * writerec) throw()
+void RequestCapture::write(unsigned int proc, xdrproc_t xargs, void* args,
+                           int result)
 {
-    if (_state != CONN_OK) return -1;
-    _lastRequest = time(0);
-    if (!_first_rec_received && (_first_rec_received = true))
-        log_rec(writerec);
-    try {
-        _lastf = _filegroup->put_rec<datarec_float,float>(writerec, _lastf);
-        _state = CONN_OK;
-    }
-    catch (const nidas::util::Exception& e) {
-        PLOG(("%s",e.what()));
-        _state = CONN_ERROR;
-        _errorMsg = e.what();
-        return -1;
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    double t = tv.tv_sec + tv.tv_usec * 1.e-6;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_fp) return;
+    if (!xdr_double(&_xdrs, &t) || !xdr_u_int(&_xdrs, &proc) ||
+        !xdr_int(&_xdrs, &result) || !xargs(&_xdrs, args)) {
+        PLOG(("%s: write failed, capture stopped: %m", _path.c_str()));
+        _active = false;
+        xdr_destroy(&_xdrs);
+        fclose(_fp);
+        _fp = 0;
+        return;
+    }
+    // The requests of the last second may be lost in a crash.
+    if (tv.tv_sec != _lastFlush) {
+        fflush(_fp);
+        _lastFlush = tv.tv_sec;
     }
-    return 0;
 }
 
-int Connection::put_rec(const datarec_int * writerec) throw()
+namespace {
+
+/**
+ * Replays the requests of a journal into the files.  The connection
+ * and variable group ids of the journal are mapped to the new ones.
+ * The definitions which were written again at the start of a journal
+ * are skipped if they have already been replayed from path.prev.
+ */
+class JournalReplayer
 {
-    if (_state != CONN_OK) return -1;
-    _lastRequest = time(0);
-    if (!_first_rec_received && (_first_rec_received = true))
-        log_rec(writerec);
-    try {
-        _lastf = _filegroup->put_rec<datarec_int,int>(writerec, _lastf);
-        _state = CONN_OK;
-    }
-    catch (const nidas::util::Exception& e) {
-        PLOG(("%s",e.what()));
-        _state = CONN_ERROR;
-        _errorMsg = e.what();
-        return -1;
+public:
+    JournalReplayer(): _connIds(), _groupIds(), _nrecs(0), _nerrors(0)
+    {
     }
-    return 0;
+
+    /**
+     * @return false if the argument of the request could not be decoded.
+     */
+    bool replay(XDR* xdrs, unsigned int proc, int result);
+
+    /**
+     * Close the connections which were opened, which writes their
+     * history to the files.
+     */
+    void close_connections();
+
+    unsigned long nrecs() const { return _nrecs; }
+
+    unsigned long nerrors() const { return _nerrors; }
+
+private:
+    /**
+     * Decode an argument of type T, pass it to func and free it.
+     */
+    template<class T, class FUNC_T>
+    static bool decode(XDR* xdrs, xdrproc_t xargs, FUNC_T func);
+
+    /**
+     * Map the ids of a record, and return its connection, or NULL.
+     */
+    template<class REC_T>
+    std::shared_ptr<Connection> map_rec(REC_T* rec) const;
+
+    std::shared_ptr<Connection> find_connection(int oldId) const;
+
+    std::map<int,int> _connIds;
+
+    std::map<std::pair<int,int>,int> _groupIds;
+
+    unsigned long _nrecs;
+
+    unsigned long _nerrors;
+};
+
+template<class T, class FUNC_T>
+bool JournalReplayer::decode(XDR* xdrs, xdrproc_t xargs, FUNC_T func)
+{
+    T args;
+    memset(&args, 0, sizeof(args));
+    bool ok = xargs(xdrs, &args);
+    if (ok) func(args);
+    xdr_free(xargs, (char*) &args);
+    return ok;
 }
 
-//
-// Cache the history records, to be written when we close files.
-//
-int Connection::put_history(const string & h) throw()
+std::shared_ptr<Connection> JournalReplayer::find_connection(int oldId) const
 {
-    _history += h;
-    if (_history.length() > 0 && _history[_history.length() - 1] != '\n')
-        _history += '\n';
-    _lastRequest = time(0);
-    return 0;
+    std::map<int,int>::const_iterator ci = _connIds.find(oldId);
+    if (ci == _connIds.end()) return std::shared_ptr<Connection>();
+    return (*Connections::Instance())[ci->second];
 }
 
-//
-//
-int Connection::write_global_attr(const string& name, const string& value) throw()
+template<class REC_T>
+std::shared_ptr<Connection> JournalReplayer::map_rec(REC_T* rec) const
 {
-    try {
-        _filegroup->write_global_attr(name,value);
-        _state = CONN_OK;
-    }
-    catch (const nidas::util::Exception& e) {
-        PLOG(("%s",e.what()));
-        _state = CONN_ERROR;
-        _errorMsg = e.what();
-        return -1;
-    }
-    _lastRequest = time(0);
-    return 0;
+    std::shared_ptr<Connection> conn = find_connection(rec->connectionId);
+    std::map<std::pair<int,int>,int>::const_iterator gi =
+        _groupIds.find(std::make_pair(rec->connectionId, rec->datarecId));
+    if (!conn || gi == _groupIds.end()) return std::shared_ptr<Connection>();
+    rec->connectionId = conn->getId();
+    rec->datarecId = gi->second;
+    return conn;
 }
 
-int Connection::write_global_attr(const string& name, int value) throw()
+bool JournalReplayer::replay(XDR* xdrs, unsigned int proc, int result)
 {
-    try {
-        _filegroup->write_global_attr(name,value);
-        _state = CONN_OK;
-    }
-    catch (const nidas::util::Exception& e) {
-        PLOG(("%s",e.what()));
-        _state = CONN_ERROR;
-        _errorMsg = e.what();
-        return -1;
+    switch (proc) {
+    case OPEN_CONNECTION:
+        return decode<connection>(xdrs, (xdrproc_t) xdr_connection,
+                                  [&](connection& c) {
+                if (_connIds.count(result)) return;
+                int id = Connections::Instance()->openConnection(&c);
+                if (id >= 0) _connIds[result] = id;
+                else _nerrors++;
+            });
+    case DEFINE_DATAREC:
+        return decode<datadef>(xdrs, (xdrproc_t) xdr_datadef,
+                               [&](datadef& dd) {
+                std::pair<int,int> key(dd.connectionId, result);
+                std::shared_ptr<Connection> conn = find_connection(dd.connectionId);
+                if (_groupIds.count(key) || !conn) return;
+                dd.connectionId = conn->getId();
+                int id = conn->add_var_group(&dd);
+                if (id >= 0) _groupIds[key] = id;
+                else _nerrors++;
+            });
+    case WRITE_DATAREC_FLOAT:
+    case WRITE_DATAREC_BATCH_FLOAT:
+        return decode<datarec_float>(xdrs, (xdrproc_t) xdr_datarec_float,
+                                     [&](datarec_float& rec) {
+                std::shared_ptr<Connection> conn = map_rec(&rec);
+                if (!conn || conn->put_rec(&rec) < 0) _nerrors++;
+                _nrecs++;
+            });
+    case WRITE_DATAREC_INT:
+    case WRITE_DATAREC_BATCH_INT:
+        return decode<datarec_int>(xdrs, (xdrproc_t) xdr_datarec_int,
+                                   [&](datarec_int& rec) {
+                std::shared_ptr<Connection> conn = map_rec(&rec);
+                if (!conn || conn->put_rec(&rec) < 0) _nerrors++;
+                _nrecs++;
+            });
+    case WRITE_DATAREC_FLOAT_ARRAY:
+        return decode<datarec_float_array>(xdrs,
+                                           (xdrproc_t) xdr_datarec_float_array,
+                                           [&](datarec_float_array& arr) {
+                std::shared_ptr<Connection> conn = find_connection(arr.connectionId);
+                for (unsigned int i = 0; conn && i < arr.recs.recs_len; i++)
+                    if (!map_rec(arr.recs.recs_val + i)) conn.reset();
+                if (conn) arr.connectionId = conn->getId();
+                if (!conn || conn->put_recs(&arr) < 0) _nerrors++;
+                _nrecs += arr.recs.recs_len;
+            });
+    case WRITE_DATAREC_INT_ARRAY:
+        return decode<datarec_int_array>(xdrs,
+                                         (xdrproc_t) xdr_datarec_int_array,
+                                         [&](datarec_int_array& arr) {
+                std::shared_ptr<Connection> conn = find_connection(arr.connectionId);
+                for (unsigned int i = 0; conn && i < arr.recs.recs_len; i++)
+                    if (!map_rec(arr.recs.recs_val + i)) conn.reset();
+                if (conn) arr.connectionId = conn->getId();
+                if (!conn || conn->put_recs(&arr) < 0) _nerrors++;
+                _nrecs += arr.recs.recs_len;
+            });
+    case WRITE_DATAREC_FLOAT_SEQ:
+        return decode<datarec_float_seq>(xdrs,
+                                         (xdrproc_t) xdr_datarec_float_seq,
+                                         [&](datarec_float_seq& arr) {
+                std::shared_ptr<Connection> conn = find_connection(arr.connectionId);
+                for (unsigned int i = 0; conn && i < arr.recs.recs_len; i++)
+                    if (!map_rec(arr.recs.recs_val + i)) conn.reset();
+                if (conn) arr.connectionId = conn->getId();
+                if (!conn || conn->put_recs(&arr) < 0) _nerrors++;
+                _nrecs += arr.recs.recs_len;
+            });
+    case WRITE_HISTORY:
+    case WRITE_HISTORY_BATCH:
+        return decode<history_attr>(xdrs, (xdrproc_t) xdr_history_attr,
+                                    [&](history_attr& attr) {
+                std::shared_ptr<Connection> conn = find_connection(attr.connectionId);
+                if (!conn || conn->put_history(attr.history) < 0) _nerrors++;
+            });
+    case WRITE_GLOBAL_ATTR:
+        return decode<global_attr>(xdrs, (xdrproc_t) xdr_global_attr,
+                                   [&](global_attr& attr) {
+                std::shared_ptr<Connection> conn = find_connection(attr.connectionId);
+                if (!conn || conn->write_global_attr(attr.attr.name,
+                                                     attr.attr.value) < 0)
+                    _nerrors++;
+            });
+    case WRITE_GLOBAL_INT_ATTR:
+        return decode<global_int_attr>(xdrs, (xdrproc_t) xdr_global_int_attr,
+                                       [&](global_int_attr& attr) {
+                std::shared_ptr<Connection> conn = find_connection(attr.connectionId);
+                if (!conn || conn->write_global_attr(attr.name,
+                                                     attr.value) < 0)
+                    _nerrors++;
+            });
+    case CLOSE_CONNECTION:
+        return decode<int>(xdrs, (xdrproc_t) xdr_int, [&](int& id) {
+                std::map<int,int>::iterator ci = _connIds.find(id);
+                if (ci == _connIds.end()) return;
+                Connections::Instance()->closeConnection(ci->second);
+                _connIds.erase(ci);
+            });
+    default:
+        PLOG(("unknown procedure in journal: %u", proc));
+        return false;
     }
-    _lastRequest = time(0);
-    return 0;
 }
 
-AllFiles::AllFiles(void): _filegroups()
+void JournalReplayer::close_connections()
 {
+    std::map<int,int>::const_iterator ci = _connIds.begin();
+    for ( ; ci != _connIds.end(); ++ci)
+        Connections::Instance()->closeConnection(ci->second);
+    _connIds.clear();
+    _groupIds.clear();
 }
 
-AllFiles::~AllFiles()
-{
-    unsigned int i;
-    for (i = 0; i < _filegroups.size(); i++)
-        delete _filegroups[i];
 }
 
-AllFiles *AllFiles::_instance = 0;
+Journal *Journal::_instance = 0;
 
-AllFiles *AllFiles::Instance()
+std::atomic<bool> Journal::_active{false};
+
+Journal *Journal::Instance()
 {
     if (_instance == 0)
-        _instance = new AllFiles;
+        _instance = new Journal;
     return _instance;
 }
 
-//
-// Look through existing file groups to find one with
-// same output directory and file name format
-// If not found, allocate a new group
-//
-FileGroup *AllFiles::get_file_group(const struct connection *conn)
+Journal::Journal(): _mutex(), _commitMutex(), _cond(), _path(), _fd(-1),
+    _dirty(false), _quit(false), _checkpointSecs(0), _defs(),
+    _nentries(0), _committed(0), _nbytes(0), _ncommits(0), _ncheckpoints(0),
+    _commitLatency(), _checkpointLatency(), _commitThread(),
+    _checkpointThread()
 {
-    FileGroup *p;
-    vector < FileGroup * >::iterator ip;
-
-    VLOG(("filegroups.size=%d", _filegroups.size()));
+}
 
-    for (ip = _filegroups.begin(); ip < _filegroups.end(); ++ip) {
-        p = *ip;
+unsigned long Journal::recover(const string& path)
+{
+    JournalReplayer replayer;
+    string paths[2] = { path + ".prev", path };
+    for (int i = 0; i < 2; i++) {
+        FILE* fp = fopen(paths[i].c_str(), "r");
+        if (!fp) {
+            if (errno != ENOENT) PLOG(("%s: %m", paths[i].c_str()));
+            continue;
+        }
+        XDR xdrs;
+        xdrstdio_create(&xdrs, fp, XDR_DECODE);
+        unsigned int magic = 0;
+        if (!xdr_u_int(&xdrs, &magic) || magic != RequestCapture::MAGIC)
+            WLOG(("%s: not a journal", paths[i].c_str()));
+        else {
+            double t;
+            unsigned int proc;
+            int result;
+            while (xdr_double(&xdrs, &t)) {
+                // The last request may have been partially written.
+                if (!xdr_u_int(&xdrs, &proc) || !xdr_int(&xdrs, &result) ||
+                    !replayer.replay(&xdrs, proc, result)) {
+                    WLOG(("%s: truncated request at %s", paths[i].c_str(),
+                          UTime(t).format(true, "%Y %m %d %H:%M:%S").c_str()));
+                    break;
+                }
+            }
+        }
+        xdr_destroy(&xdrs);
+        fclose(fp);
+    }
+    replayer.close_connections();
+    Connections::Instance()->flush_queues();
+    AllFiles::Instance()->sync();
+    if (replayer.nrecs() > 0 || replayer.nerrors() > 0)
+        ILOG(("%s: recovered %lu records, %lu errors", path.c_str(),
+              replayer.nrecs(), replayer.nerrors()));
+    return replayer.nrecs();
+}
+
+void Journal::open(const string& path, int checkpointSecs)
+{
+    if (_commitThread.joinable()) return;
+    recover(path);
+    ::unlink((path + ".prev").c_str());
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _path = path;
+        _checkpointSecs = checkpointSecs;
+        _quit = false;
+        create();
+    }
+    NS_NcFile::setSyncInterval(checkpointSecs);
+    _active = true;
+    _commitThread = std::thread(&Journal::commitLoop, this);
+    _checkpointThread = std::thread(&Journal::checkpointLoop, this);
+    ILOG(("journaling requests to %s, checkpoint every %d secs",
+          path.c_str(), checkpointSecs));
+}
+
+void Journal::close(bool remove)
+{
+    if (!_commitThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _active = false;
+        _quit = true;
+    }
+    _cond.notify_all();
+    _commitThread.join();
+    _checkpointThread.join();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_fd >= 0) {
+        if (::fdatasync(_fd) < 0 || ::close(_fd) < 0)
+            PLOG(("%s: %m", _path.c_str()));
+        else _committed = _nentries;
+        _fd = -1;
+    }
+    if (remove) {
+        ::unlink(_path.c_str());
+        ::unlink((_path + ".prev").c_str());
+    }
+    _defs.clear();
+    NS_NcFile::setSyncInterval(NS_NcFile::SYNC_CHECK_INTERVAL_SECS);
+}
+
+void Journal::create()
+{
+    _fd = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                 0664);
+    if (_fd < 0) throw nidas::util::IOException(_path, "open", errno);
+
+    // The kept requests are written with the header, so that a crash
+    // while they are written leaves a truncated journal.
+    string buf(4, '\0');
+    XDR xdrs;
+    xdrmem_create(&xdrs, &buf[0], buf.length(), XDR_ENCODE);
+    unsigned int magic = RequestCapture::MAGIC;
+    xdr_u_int(&xdrs, &magic);
+    xdr_destroy(&xdrs);
+
+    std::map<int, Definitions>::const_iterator di = _defs.begin();
+    for ( ; di != _defs.end(); ++di) {
+        const Definitions& defs = di->second;
+        buf += defs.open;
+        for (unsigned int i = 0; i < defs.groups.size(); i++)
+            buf += defs.groups[i];
+        std::map<string, string>::const_iterator ai = defs.attrs.begin();
+        for ( ; ai != defs.attrs.end(); ++ai) buf += ai->second;
+        buf += defs.history;
+    }
+    ssize_t nw = ::write(_fd, buf.c_str(), buf.length());
+    if (nw != (ssize_t) buf.length() || ::fdatasync(_fd) < 0) {
+        int ierr = nw < 0 ? errno : EIO;
+        ::close(_fd);
+        _fd = -1;
+        throw nidas::util::IOException(_path, "write", ierr);
+    }
+    _nbytes += buf.length();
+    _dirty = false;
+}
+
+void Journal::fail(const char* what)
+{
+    PLOG(("%s: %s failed, journal stopped, files will be synced every %d "
+          "secs: %m", _path.c_str(), what,
+          NS_NcFile::SYNC_CHECK_INTERVAL_SECS));
+    _active = false;
+    if (_fd >= 0) ::close(_fd);
+    _fd = -1;
+    NS_NcFile::setSyncInterval(NS_NcFile::SYNC_CHECK_INTERVAL_SECS);
+}
+
+unsigned long Journal::write(unsigned int proc, xdrproc_t xargs,
+                             void* args, int result)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    double t = tv.tv_sec + tv.tv_usec * 1.e-6;
+
+    // time, procedure and result, then the argument
+    static thread_local string entry;
+    entry.resize(16 + xdr_sizeof(xargs, args));
+    XDR xdrs;
+    xdrmem_create(&xdrs, &entry[0], entry.length(), XDR_ENCODE);
+    bool ok = xdr_double(&xdrs, &t) && xdr_u_int(&xdrs, &proc) &&
+        xdr_int(&xdrs, &result) && xargs(&xdrs, args);
+    xdr_destroy(&xdrs);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_fd < 0) return 0;
+    if (!ok) {
+        PLOG(("%s: cannot encode request %u", _path.c_str(), proc));
+        return 0;
+    }
+    // One write of each request, so it is not lost if the process
+    // crashes, and the journal is never interleaved.
+    ssize_t nw = ::write(_fd, entry.c_str(), entry.length());
+    if (nw != (ssize_t) entry.length()) {
+        if (nw >= 0) errno = ENOSPC;
+        fail("write");
+        return 0;
+    }
+    _dirty = true;
+    _nentries++;
+    _nbytes += entry.length();
+    keep(proc, args, result, entry);
+    return _nentries;
+}
+
+void Journal::keep(unsigned int proc, void* args, int result,
+                   const string& entry)
+{
+    switch (proc) {
+    case OPEN_CONNECTION:
+        _defs[result].open = entry;
+        break;
+    case DEFINE_DATAREC:
+        {
+            std::map<int, Definitions>::iterator di =
+                _defs.find(((datadef*) args)->connectionId);
+            if (di != _defs.end()) di->second.groups.push_back(entry);
+        }
+        break;
+    case WRITE_HISTORY:
+    case WRITE_HISTORY_BATCH:
+        {
+            std::map<int, Definitions>::iterator di =
+                _defs.find(((history_attr*) args)->connectionId);
+            if (di != _defs.end()) di->second.history += entry;
+        }
+        break;
+    case WRITE_GLOBAL_ATTR:
+        {
+            global_attr* attr = (global_attr*) args;
+            std::map<int, Definitions>::iterator di =
+                _defs.find(attr->connectionId);
+            if (di != _defs.end()) di->second.attrs[attr->attr.name] = entry;
+        }
+        break;
+    case WRITE_GLOBAL_INT_ATTR:
+        {
+            global_int_attr* attr = (global_int_attr*) args;
+            std::map<int, Definitions>::iterator di =
+                _defs.find(attr->connectionId);
+            if (di != _defs.end()) di->second.attrs[attr->name] = entry;
+        }
+        break;
+    case CLOSE_CONNECTION:
+        _defs.erase(*(int*) args);
+        break;
+    default:
+        break;
+    }
+}
+
+void Journal::commit()
+{
+    std::lock_guard<std::mutex> clock(_commitMutex);
+    int fd;
+    unsigned long nentries;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_fd < 0 || !_dirty) return;
+        _dirty = false;
+        fd = _fd;
+        nentries = _nentries;
+    }
+    LatencyHistogram::clock::time_point t0 = LatencyHistogram::clock::now();
+    if (::fdatasync(fd) < 0) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        fail("fdatasync");
+        return;
+    }
+    _committed = nentries;
+    _commitLatency.add(LatencyHistogram::clock::now() - t0);
+    _ncommits++;
+}
+
+void Journal::commitLoop()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_quit) {
+        _cond.wait_for(lock, std::chrono::milliseconds(COMMIT_MSECS));
+        if (_quit) break;
+        lock.unlock();
+        commit();
+        lock.lock();
+    }
+}
+
+void Journal::checkpoint()
+{
+    LatencyHistogram::clock::time_point t0 = LatencyHistogram::clock::now();
+    string prev = _path + ".prev";
+    {
+        std::lock_guard<std::mutex> clock(_commitMutex);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_fd < 0) return;
+
+        // connections which timed out are not kept
+        Connections* connections = Connections::Instance();
+        std::map<int, Definitions>::iterator di = _defs.begin();
+        for ( ; di != _defs.end(); ) {
+            if (!(*connections)[di->first]) _defs.erase(di++);
+            else ++di;
+        }
+
+        // The requests in the renamed journal are applied, and
+        // are written to the files by the sync below.
+        if (::fdatasync(_fd) < 0 || ::close(_fd) < 0) {
+            _fd = -1;
+            fail("fdatasync");
+            return;
+        }
+        _committed = _nentries;
+        _fd = -1;
+        if (::rename(_path.c_str(), prev.c_str()) < 0) {
+            fail("rename");
+            return;
+        }
+        try {
+            create();
+        }
+        catch (const nidas::util::IOException& e) {
+            errno = e.getErrno();
+            fail("create");
+            return;
+        }
+    }
+    Connections::Instance()->flush_queues();
+    AllFiles::Instance()->sync();
+    ::unlink(prev.c_str());
+    _checkpointLatency.add(LatencyHistogram::clock::now() - t0);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _ncheckpoints++;
+}
+
+void Journal::checkpointLoop()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_quit) {
+        std::chrono::steady_clock::time_point next =
+            std::chrono::steady_clock::now() +
+            std::chrono::seconds(_checkpointSecs);
+        if (_cond.wait_until(lock, next, [this]() { return _quit; }))
+            break;
+        lock.unlock();
+        checkpoint();
+        lock.lock();
+    }
+}
+
+void Journal::report(MetricsReport& report)
+{
+    std::lock_guard<std::mutex> clock(_commitMutex);
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_path.empty()) return;
+    string labels = MetricsReport::label("journal", _path);
+    report.gauge("nc_server_journal_active",
+                 "Requests are being journaled", labels, _fd >= 0);
+    report.counter("nc_server_journal_requests_total",
+                   "Requests written to the journal", labels, _nentries);
+    report.counter("nc_server_journal_bytes_total",
+                   "Bytes written to the journal", labels, _nbytes);
+    report.counter("nc_server_journal_commits_total",
+                   "Syncs of the journal", labels, _ncommits);
+    report.histogram("nc_server_journal_commit_seconds",
+                     "Time syncing the journal", labels, _commitLatency);
+    report.counter("nc_server_journal_checkpoints_total",
+                   "Checkpoints, after which the files were synced", labels,
+                   _ncheckpoints);
+    report.histogram("nc_server_journal_checkpoint_seconds",
+                     "Time rotating the journal and syncing the files",
+                     labels, _checkpointLatency);
+}
+
+
+Connections::Connections(void): _connections(),_connectionCntr(0),
+    _writeBehindLength(0),_mutex()
+{
+    srandom((unsigned int)time(0));
+}
+
+Connections *Connections::_instance = 0;
+
+Connections *Connections::Instance()
+{
+    if (_instance == 0)
+        _instance = new Connections;
+    return _instance;
+}
+
+Connections::~Connections(void)
+{
+}
+
+int Connections::openConnection(const struct connection *conn) throw()
+{
+    std::shared_ptr<Connection> cp;
+
+    VLOG(("_connections.size()=%d", _connections.size()));
+
+    closeOldConnections();
+
+    int id;
+    {
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        // just in case this process ever handles over 2^31 connections :-)
+        if (_connectionCntr < 0) _connectionCntr = 0;
+
+        // The low order 2 bytes of the connection id are an integer
+        // that increments for every new connection. The high order
+        // 2 bytes are a random value, so that if this process is
+        // restarted, it is unlikely that any pre-existing client will
+        // have the same id as a new client.
+        id = (_connectionCntr++ & 0xffff) + (random() & 0xffff0000UL);
+    }
+    try {
+        cp.reset(new Connection(conn,id,_writeBehindLength));
+    }
+    catch(const nidas::util::Exception& e) {
+        PLOG(("%s",e.what()));
+        return -1;
+    }
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    _connections[id] = cp;
+#ifdef LOG_HEAP
+    ILOG(("Opened connection, id=%d, #connections=%zd, heap=%zd",
+            (id & 0xffff),_connections.size(), heap()));
+#else
+    ILOG(("Opened connection, id=%d, #connections=%zd",
+            (id & 0xffff),_connections.size()));
+#endif
+    return id;
+}
+
+int Connections::closeConnection(int id)
+{
+    std::shared_ptr<Connection> co;
+    size_t nconn;
+    {
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        map <int, std::shared_ptr<Connection> >::iterator ci =
+            _connections.find(id);
+        if (ci == _connections.end()) return -1;
+        co = ci->second;
+        _connections.erase(ci);
+        nconn = _connections.size();
+    }
+    // The Connection destructor waits for its FileGroup, so release it
+    // without holding up lookups of other connections.  If a handler
+    // in another thread is using it, it is deleted when that is done.
+    co.reset();
+    ILOG(("Closed connection, id=%d, #connections=%zd",
+        (id & 0xffff),nconn));
+    return 0;
+}
+
+void Connections::flush_queues()
+{
+    // Connections are not deleted while their queues are flushed.
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    map <int, std::shared_ptr<Connection> >::iterator ci =
+        _connections.begin();
+    for ( ; ci != _connections.end(); ++ci) ci->second->flush_queue();
+}
+
+void Connections::closeOldConnections()
+{
+    time_t utime;
+    /*
+     * Release timed-out connections.
+     */
+    utime = time(0);
+
+    vector<std::shared_ptr<Connection> > oldconns;
+    {
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        map<int, std::shared_ptr<Connection> >::iterator ci =
+            _connections.begin();
+        for ( ; ci != _connections.end(); ) {
+            int id = ci->first;
+            const std::shared_ptr<Connection>& co = ci->second;
+            if (utime - co->LastRequest() > CONNECTIONTIMEOUT) {
+                oldconns.push_back(co);
+                // map::erase doesn't return an iterator, unless
+                // __GXX_EXPERIMENTAL_CXX0X__ is defined
+                _connections.erase(ci++);
+                ILOG(("Timeout, closed connection, id=%d, #connections=%zd",
+                    (id & 0xffff),_connections.size()));
+            }
+            else ++ci;
+        }
+    }
+    // released without the lock, as in closeConnection()
+    oldconns.clear();
+}
+
+unsigned int Connections::num() const
+{
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    return _connections.size();
+}
+
+/* static */
+std::string Connection::getIdStr(int id) 
+{
+    ostringstream ost;
+    ost << "connection#" << (id & 0xffff);
+    return ost.str();
+}
+
+Connection::Connection(const connection * conn, int id,
+                       unsigned int queueLength)
+:  _filegroup(0),_history(),_histlen(),
+    _hotFiles(),_lastRequest(time(0)),
+    _id(id),_errorMsg(),_state(CONN_OK),
+    _startLengths(),_producerMutex(),_queue(queueLength),
+    _qhead(0),_qtail(0),_queueMutex(),_queueCond(),_drainCond(),
+    _recsReceived(0),_bytesReceived(0),_recsWritten(0),_recsDropped(0),
+    _putLatency(),
+    _writerWaiting(false),_drainWaiters(0),_quit(false),_writer(),
+    _seqReceived(0),_seqApplied(0),_unsynced(),_ackMutex(),_journaled(),
+    _seqJournalDurable(0)
+{
+
+    AllFiles *allfiles = AllFiles::Instance();
+    _lastRequest = time(0);
+
+    _filegroup = allfiles->get_file_group(conn, this);
+
+    if (queueLength > 0)
+        _writer = std::thread(&Connection::write_behind, this);
+}
+
+Connection::~Connection(void)
+{
+    if (_writer.joinable()) {
+        // the writer thread exits after writing what is left in the queue
+        {
+            std::lock_guard<std::mutex> lock(_queueMutex);
+            _quit = true;
+        }
+        _queueCond.notify_one();
+        _writer.join();
+    }
+    {
+        std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+        for (unsigned int i = 0; i < _hotFiles.size(); i++)
+            _hotFiles[i]->sync();
+        _filegroup->remove_connection(this);
+    }
+
+    AllFiles *allfiles = AllFiles::Instance();
+    allfiles->close_old_files();
+}
+
+std::string Connection::getErrorMsg() const
+{
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    if (_recsDropped == 0) return _errorMsg;
+    ostringstream ost;
+    ost << _errorMsg << ", " << _recsDropped <<
+        " queued records after it were not written";
+    return ost.str();
+}
+
+void Connection::setErrorMsg(const std::string& val)
+{
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    _errorMsg = val;
+}
+
+int Connection::add_var_group(const struct datadef *dd) throw()
+{
+    int id;
+    int nstart;
+    {
+        std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+        _lastRequest = time(0);
+        try {
+            id = _filegroup->add_var_group(dd);
+        }
+        catch (const nidas::util::Exception& e) {
+            PLOG(("%s",e.what()));
+            _state = CONN_ERROR;
+            _errorMsg = e.what();
+            return -1;
+        }
+        nstart = _filegroup->get_var_group(id)->num_dims() - 2;
+    }
+    // Save what queue_recs() needs to validate records, without
+    // locking the FileGroup, which the writer thread may be holding.
+    std::lock_guard<std::mutex> lock(_producerMutex);
+    if ((int)_startLengths.size() <= id) _startLengths.resize(id + 1, -1);
+    _startLengths[id] = nstart;
+    return id;
+}
+
+int Connection::add_var_groups(const struct datadefs *dds,
+                               vector<int>& ids) throw()
+{
+    vector<int> nstarts;
+    ids.clear();
+    {
+        std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+        _lastRequest = time(0);
+        try {
+            for (unsigned int i = 0; i < dds->defs.defs_len; i++) {
+                int id = _filegroup->add_var_group(dds->defs.defs_val + i);
+                ids.push_back(id);
+                nstarts.push_back(_filegroup->get_var_group(id)->num_dims() - 2);
+            }
+        }
+        catch (const nidas::util::Exception& e) {
+            PLOG(("%s",e.what()));
+            _state = CONN_ERROR;
+            _errorMsg = e.what();
+            ids.clear();
+            return -1;
+        }
+    }
+    std::lock_guard<std::mutex> lock(_producerMutex);
+    for (unsigned int i = 0; i < ids.size(); i++) {
+        int id = ids[i];
+        if ((int)_startLengths.size() <= id) _startLengths.resize(id + 1, -1);
+        _startLengths[id] = nstarts[i];
+    }
+    return 0;
+}
+
+std::shared_ptr<Connection> Connections::operator[] (int i) const
+{
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    VLOG(("i=%d,_connections.size()=%d", i, _connections.size()));
+    map <int, std::shared_ptr<Connection> >::const_iterator ci =
+        _connections.find(i);
+    if (ci != _connections.end()) return ci->second;
+    return std::shared_ptr<Connection>();
+}
+
+void Connection::unset_file(NS_NcFile* f)
+{
+    _hotFiles.erase(std::remove(_hotFiles.begin(), _hotFiles.end(), f),
+                    _hotFiles.end());
+    // the records in a closed file are written out
+    file_synced(f);
+}
+
+
+void Connection::unset_files()
+{
+    _hotFiles.clear();
+    // keep the records which were lost
+    _unsynced.erase(std::remove_if(_unsynced.begin(), _unsynced.end(),
+                [](const std::pair<NS_NcFile*, unsigned long long>& u)
+                { return u.first != 0; }), _unsynced.end());
+}
+
+void Connection::write_failed(NS_NcFile* f, const string& msg)
+{
+    bool wrote = std::find(_hotFiles.begin(), _hotFiles.end(), f) !=
+        _hotFiles.end();
+    // The sequence numbers from the first unsynced record in the file
+    // are never durable.
+    for (unsigned int i = 0; i < _unsynced.size(); i++) {
+        if (_unsynced[i].first == f) {
+            _unsynced[i].first = 0;
+            wrote = true;
+        }
+    }
+    if (!wrote) return;
+    _state = CONN_ERROR;
+    _errorMsg = msg;
+}
+
+void Connection::file_synced(NS_NcFile* f)
+{
+    for (unsigned int i = 0; i < _unsynced.size(); i++) {
+        if (_unsynced[i].first == f) {
+            _unsynced.erase(_unsynced.begin() + i);
+            break;
+        }
+    }
+}
+
+unsigned int Connection::skip_received(unsigned long long seq,
+                                       unsigned int nrecs)
+{
+    unsigned int nskip = 0;
+    if (seq <= _seqReceived)
+        nskip = std::min<unsigned long long>(_seqReceived - seq + 1, nrecs);
+    if (seq + nrecs - 1 > _seqReceived) _seqReceived = seq + nrecs - 1;
+    return nskip;
+}
+
+void Connection::set_applied(unsigned long long seq)
+{
+    _seqApplied = seq;
+    NS_NcFile* f = _hotFiles.front();
+    for (unsigned int i = 0; i < _unsynced.size(); i++)
+        if (_unsynced[i].first == f) return;
+    _unsynced.push_back(std::make_pair(f, seq));
+}
+
+void Connection::journaled(unsigned long entry, unsigned long long seq)
+{
+    std::lock_guard<std::mutex> lock(_ackMutex);
+    // forget the committed entries, if the client is not asking
+    unsigned long committed = Journal::Instance()->committed();
+    while (!_journaled.empty() && _journaled.front().first <= committed) {
+        _seqJournalDurable = _journaled.front().second;
+        _journaled.pop_front();
+    }
+    _journaled.push_back(std::make_pair(entry, seq));
+}
+
+void Connection::get_ack(unsigned long long& applied,
+                         unsigned long long& durable, string& error)
+{
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    applied = _seqApplied;
+    unsigned long long synced = applied;
+    for (unsigned int i = 0; i < _unsynced.size(); i++)
+        synced = std::min(synced, _unsynced[i].second - 1);
+    {
+        std::lock_guard<std::mutex> alock(_ackMutex);
+        if (!_journaled.empty()) {
+            unsigned long committed = Journal::Instance()->committed();
+            while (!_journaled.empty() &&
+                   _journaled.front().first <= committed) {
+                _seqJournalDurable = _journaled.front().second;
+                _journaled.pop_front();
+            }
+        }
+        // Journaled records may still be in the write-behind queue.
+        durable = std::min(applied, std::max(synced, _seqJournalDurable));
+    }
+    if (_state != CONN_OK) error = _errorMsg;
+    else error.clear();
+}
+
+
+template <typename T>
+void log_rec(const T* writerec)
+{
+    DLOG(("first record: connid=") << writerec->connectionId
+         << ", datarecid=" << writerec->datarecId
+         << ", time="
+         << UTime(writerec->time).format(true,"%Y-%m-%d_%H:%M:%S.%3f"));
+}
+
+
+template<class REC_T>
+void Connection::count_received(const REC_T * writerecs, unsigned int nrecs)
+{
+    unsigned long long nbytes = 0;
+    for (unsigned int i = 0; i < nrecs; i++)
+        nbytes += writerecs[i].data.data_len *
+            sizeof(writerecs[i].data.data_val[0]);
+    _recsReceived += nrecs;
+    _bytesReceived += nbytes;
+}
+
+template<class REC_T, class DATA_T>
+void Connection::write_rec(const REC_T * writerec)
+{
+    LatencyHistogram::clock::time_point t0 = LatencyHistogram::clock::now();
+    _filegroup->put_rec<REC_T,DATA_T>(writerec, _hotFiles);
+    _putLatency.add(LatencyHistogram::clock::now() - t0);
+    _recsWritten++;
+}
+
+int Connection::put_rec(const datarec_float * writerec) throw()
+{
+    count_received(writerec, 1);
+    if (_writer.joinable()) return queue_recs(writerec, 1, 0);
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    if (_state != CONN_OK) return -1;
+    _lastRequest = time(0);
+    if (!_first_rec_received && (_first_rec_received = true))
+        log_rec(writerec);
+    try {
+        write_rec<datarec_float,float>(writerec);
+    }
+    catch (const nidas::util::Exception& e) {
+        PLOG(("%s",e.what()));
+        _state = CONN_ERROR;
+        _errorMsg = e.what();
+        return -1;
+    }
+    return 0;
+}
+
+int Connection::put_rec(const datarec_int * writerec) throw()
+{
+    count_received(writerec, 1);
+    if (_writer.joinable()) return queue_recs(writerec, 1, 0);
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    if (_state != CONN_OK) return -1;
+    _lastRequest = time(0);
+    if (!_first_rec_received && (_first_rec_received = true))
+        log_rec(writerec);
+    try {
+        write_rec<datarec_int,int>(writerec);
+    }
+    catch (const nidas::util::Exception& e) {
+        PLOG(("%s",e.what()));
+        _state = CONN_ERROR;
+        _errorMsg = e.what();
+        return -1;
+    }
+    return 0;
+}
+
+template<class REC_T, class DATA_T>
+int Connection::put_recs(const REC_T * writerecs, unsigned int nrecs,
+                         unsigned long long seq) throw()
+{
+    count_received(writerecs, nrecs);
+    if (_writer.joinable()) return queue_recs(writerecs, nrecs, seq);
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    if (_state != CONN_OK) return -1;
+    _lastRequest = time(0);
+    if (nrecs > 0 && !_first_rec_received && (_first_rec_received = true))
+        log_rec(writerecs);
+    unsigned int i = seq ? skip_received(seq, nrecs) : 0;
+    try {
+        for ( ; i < nrecs; i++) {
+            write_rec<REC_T,DATA_T>(writerecs + i);
+            if (seq) set_applied(seq + i);
+        }
+    }
+    catch (const nidas::util::Exception& e) {
+        ostringstream ost;
+        ost << e.what() << " (record " << i << " of " << nrecs << ")";
+        PLOG(("%s",ost.str().c_str()));
+        _state = CONN_ERROR;
+        _errorMsg = ost.str();
+        return -1;
+    }
+    return 0;
+}
+
+int Connection::put_recs(const datarec_float_array * writerecs) throw()
+{
+    return put_recs<datarec_float,float>(writerecs->recs.recs_val,
+                                         writerecs->recs.recs_len);
+}
+
+int Connection::put_recs(const datarec_int_array * writerecs) throw()
+{
+    return put_recs<datarec_int,int>(writerecs->recs.recs_val,
+                                     writerecs->recs.recs_len);
+}
+
+int Connection::put_recs(const datarec_float_seq * writerecs) throw()
+{
+    if (writerecs->seq == 0) {
+        PLOG(("%s: sequence numbers start at 1", getIdStr(_id).c_str()));
+        setErrorMsg("sequence numbers start at 1");
+        _state = CONN_ERROR;
+        return -1;
+    }
+    return put_recs<datarec_float,float>(writerecs->recs.recs_val,
+                                         writerecs->recs.recs_len,
+                                         writerecs->seq);
+}
+
+void Connection::QueuedRec::set(const datarec_float* writerec)
+{
+    isInt = false;
+    time = writerec->time;
+    connectionId = writerec->connectionId;
+    datarecId = writerec->datarecId;
+    // assign() reuses the storage of the earlier records in this slot
+    fdata.assign(writerec->data.data_val,
+                 writerec->data.data_val + writerec->data.data_len);
+    cnts.assign(writerec->cnts.cnts_val,
+                writerec->cnts.cnts_val + writerec->cnts.cnts_len);
+    start.assign(writerec->start.start_val,
+                 writerec->start.start_val + writerec->start.start_len);
+    count.assign(writerec->count.count_val,
+                 writerec->count.count_val + writerec->count.count_len);
+}
+
+void Connection::QueuedRec::set(const datarec_int* writerec)
+{
+    isInt = true;
+    time = writerec->time;
+    connectionId = writerec->connectionId;
+    datarecId = writerec->datarecId;
+    idata.assign(writerec->data.data_val,
+                 writerec->data.data_val + writerec->data.data_len);
+    cnts.assign(writerec->cnts.cnts_val,
+                writerec->cnts.cnts_val + writerec->cnts.cnts_len);
+    start.assign(writerec->start.start_val,
+                 writerec->start.start_val + writerec->start.start_len);
+    count.assign(writerec->count.count_val,
+                 writerec->count.count_val + writerec->count.count_len);
+}
+
+template<class REC_T>
+void Connection::check_rec(const REC_T * writerec)
+{
+    int groupid = writerec->datarecId;
+    if (groupid < 0 || groupid >= (int)_startLengths.size() ||
+            _startLengths[groupid] < 0) {
+        ostringstream ost;
+        ost << "Invalid variable group number: " <<  groupid;
+        throw NcServerAccessFailed(getIdStr(_id),"put_rec",ost.str());
+    }
+    int nstart = writerec->start.start_len;
+    if (nstart != _startLengths[groupid] ||
+            nstart != (int)writerec->count.count_len) {
+        ostringstream ost;
+        ost << "variable group " << groupid <<
+            ": has incorrect start or count length";
+        throw NcServerAccessFailed(getIdStr(_id),"put_rec",ost.str());
+    }
+}
+
+template<class REC_T>
+int Connection::queue_recs(const REC_T * writerecs, unsigned int nrecs,
+                           unsigned long long seq) throw()
+{
+    {
+        std::lock_guard<std::mutex> plock(_producerMutex);
+        if (_state != CONN_OK) return -1;
+        _lastRequest = time(0);
+        if (nrecs > 0 && !_first_rec_received && (_first_rec_received = true))
+            log_rec(writerecs);
+
+        unsigned int i = 0;
+        try {
+            // Check them all first, so a bad array is not partially queued
+            for ( ; i < nrecs; i++) check_rec(writerecs + i);
+        }
+        catch (const nidas::util::Exception& e) {
+            ostringstream ost;
+            ost << e.what();
+            if (nrecs > 1) ost << " (record " << i << " of " << nrecs << ")";
+            PLOG(("%s",ost.str().c_str()));
+            setErrorMsg(ost.str());
+            _state = CONN_ERROR;
+            return -1;
+        }
+
+        unsigned int size = _queue.size();
+        for (i = seq ? skip_received(seq, nrecs) : 0; i < nrecs; i++) {
+            unsigned int tail = _qtail;
+            if (tail - _qhead >= size) {
+                // Full. This is what keeps a slow disk from using up
+                // the memory of the server.
+                std::unique_lock<std::mutex> lock(_queueMutex);
+                ++_drainWaiters;
+                while (tail - _qhead >= size) _drainCond.wait(lock);
+                --_drainWaiters;
+            }
+            _queue[tail % size].set(writerecs + i);
+            _queue[tail % size].seq = seq ? seq + i : 0;
+            _qtail = tail + 1;
+            if (_writerWaiting) {
+                std::lock_guard<std::mutex> lock(_queueMutex);
+                _queueCond.notify_one();
+            }
+        }
+    }
+    return 0;
+}
+
+void Connection::write_behind()
+{
+    unsigned int size = _queue.size();
+    for (;;) {
+        unsigned int head = _qhead;
+        if (head == _qtail) {
+            std::unique_lock<std::mutex> lock(_queueMutex);
+            _writerWaiting = true;
+            while (_qhead == _qtail && !_quit) _queueCond.wait(lock);
+            _writerWaiting = false;
+            if (_qhead == _qtail) break;
+            continue;
+        }
+        Trace::begin();
+        write_queued(_queue[head % size]);
+        Trace::end();
+        _qhead = head + 1;
+        if (_drainWaiters > 0) {
+            std::lock_guard<std::mutex> lock(_queueMutex);
+            _drainCond.notify_all();
+        }
+    }
+}
+
+void Connection::write_queued(QueuedRec& rec) throw()
+{
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    // After an error the rest of the queue is discarded, and the
+    // client finds out from the return of its next write, and how
+    // many were discarded from CHECK_ERROR.
+    if (_state != CONN_OK) {
+        _recsDropped++;
+        return;
+    }
+    try {
+        if (rec.isInt) {
+            datarec_int writerec;
+            writerec.time = rec.time;
+            writerec.connectionId = rec.connectionId;
+            writerec.datarecId = rec.datarecId;
+            writerec.data.data_len = rec.idata.size();
+            writerec.data.data_val = rec.idata.data();
+            writerec.cnts.cnts_len = rec.cnts.size();
+            writerec.cnts.cnts_val = rec.cnts.data();
+            writerec.start.start_len = rec.start.size();
+            writerec.start.start_val = rec.start.data();
+            writerec.count.count_len = rec.count.size();
+            writerec.count.count_val = rec.count.data();
+            write_rec<datarec_int,int>(&writerec);
+        }
+        else {
+            datarec_float writerec;
+            writerec.time = rec.time;
+            writerec.connectionId = rec.connectionId;
+            writerec.datarecId = rec.datarecId;
+            writerec.data.data_len = rec.fdata.size();
+            writerec.data.data_val = rec.fdata.data();
+            writerec.cnts.cnts_len = rec.cnts.size();
+            writerec.cnts.cnts_val = rec.cnts.data();
+            writerec.start.start_len = rec.start.size();
+            writerec.start.start_val = rec.start.data();
+            writerec.count.count_len = rec.count.size();
+            writerec.count.count_val = rec.count.data();
+            write_rec<datarec_float,float>(&writerec);
+        }
+        if (rec.seq) set_applied(rec.seq);
+    }
+    catch (const nidas::util::Exception& e) {
+        PLOG(("%s",e.what()));
+        _state = CONN_ERROR;
+        _errorMsg = e.what();
+    }
+}
+
+void Connection::report(MetricsReport& report) const
+{
+    string labels = MetricsReport::label("connection", getIdStr(_id)) + ',' +
+        MetricsReport::label("group", _filegroup->toString());
+    report.counter("nc_server_records_received_total",
+                   "Data records received", labels, _recsReceived);
+    report.counter("nc_server_bytes_received_total",
+                   "Bytes of data values received", labels, _bytesReceived);
+    report.counter("nc_server_records_written_total",
+                   "Data records written to files", labels, _recsWritten);
+    report.counter("nc_server_records_dropped_total",
+                   "Queued data records discarded after a write error",
+                   labels, _recsDropped);
+    report.gauge("nc_server_queue_depth",
+                 "Records in the write-behind queue", labels,
+                 _qtail - _qhead);
+    report.histogram("nc_server_put_seconds",
+                     "Time writing a data record to its file", labels,
+                     _putLatency);
+}
+
+void Connections::report(MetricsReport& report) const
+{
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    map <int, std::shared_ptr<Connection> >::const_iterator ci =
+        _connections.begin();
+    for ( ; ci != _connections.end(); ++ci) ci->second->report(report);
+}
+
+void Connection::flush_queue()
+{
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    ++_drainWaiters;
+    while (_qhead != _qtail) _drainCond.wait(lock);
+    --_drainWaiters;
+}
+
+//
+// Cache the history records, to be written when we close files.
+//
+int Connection::put_history(const string & h) throw()
+{
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    _history += h;
+    if (_history.length() > 0 && _history[_history.length() - 1] != '\n')
+        _history += '\n';
+    _lastRequest = time(0);
+    return 0;
+}
+
+//
+//
+int Connection::write_global_attr(const string& name, const string& value) throw()
+{
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    try {
+        _filegroup->write_global_attr(name,value);
+        _state = CONN_OK;
+    }
+    catch (const nidas::util::Exception& e) {
+        PLOG(("%s",e.what()));
+        _state = CONN_ERROR;
+        _errorMsg = e.what();
+        return -1;
+    }
+    _lastRequest = time(0);
+    return 0;
+}
+
+int Connection::write_global_attr(const string& name, int value) throw()
+{
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    try {
+        _filegroup->write_global_attr(name,value);
+        _state = CONN_OK;
+    }
+    catch (const nidas::util::Exception& e) {
+        PLOG(("%s",e.what()));
+        _state = CONN_ERROR;
+        _errorMsg = e.what();
+        return -1;
+    }
+    _lastRequest = time(0);
+    return 0;
+}
+
+int Connection::write_global_attrs(const struct global_attrs* attrs) throw()
+{
+    std::lock_guard<std::recursive_mutex> lock(_filegroup->mutex());
+    try {
+        _filegroup->write_global_attrs(attrs);
+        _state = CONN_OK;
+    }
+    catch (const nidas::util::Exception& e) {
+        PLOG(("%s",e.what()));
+        _state = CONN_ERROR;
+        _errorMsg = e.what();
+        return -1;
+    }
+    _lastRequest = time(0);
+    return 0;
+}
+
+AllFiles::AllFiles(void): _filegroups(),_mutex(),_precreating(0),_nfiles(0),
+    _maxOpenFiles(DEFAULT_MAX_OPEN_FILES),_lruMutex(),_lruHead(0),_lruTail(0)
+{
+}
+
+AllFiles::~AllFiles()
+{
+    unsigned int i;
+    for (i = 0; i < _filegroups.size(); i++)
+        delete _filegroups[i];
+}
+
+AllFiles *AllFiles::_instance = 0;
+
+AllFiles *AllFiles::Instance()
+{
+    if (_instance == 0)
+        _instance = new AllFiles;
+    return _instance;
+}
+
+//
+// Look through existing file groups to find one with
+// same output directory and file name format
+// If not found, allocate a new group
+//
+FileGroup *AllFiles::get_file_group(const struct connection *conn,
+                                    Connection *cp)
+{
+    FileGroup *p;
+    vector < FileGroup * >::iterator ip;
+
+    // Hold the lock until the connection is added, so that the group
+    // is not deleted as inactive in the meantime.
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+    VLOG(("filegroups.size=%d", _filegroups.size()));
+
+    for (ip = _filegroups.begin(); ip < _filegroups.end(); ++ip) {
+        p = *ip;
         if (p) {
             if (!p->match(conn->outputdir, conn->filenamefmt))
                 continue;
@@ -471,12 +2010,15 @@ FileGroup *AllFiles::get_file_group(const struct connection *conn)
                     " for this file group " << p->toString();
                 throw InvalidFileLength(ost.str());
             }
+            std::lock_guard<std::recursive_mutex> glock(p->mutex());
+            p->add_connection(cp);
             return p;
         }
     }
 
     // Create new file group
     p = new FileGroup(conn);
+    p->add_connection(cp);
 
     if (ip < _filegroups.end())
         *ip = p;
@@ -488,22 +2030,32 @@ FileGroup *AllFiles::get_file_group(const struct connection *conn)
 
 int AllFiles::num_files() const
 {
-    int unsigned i, n;
-    for (i = n = 0; i < _filegroups.size(); i++)
-        if (_filegroups[i])
-            n += _filegroups[i]->num_files();
-    return n;
+    return _nfiles;
+}
+
+void AllFiles::report(MetricsReport& report)
+{
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    for (unsigned int i = 0; i < _filegroups.size(); i++)
+        if (_filegroups[i]) _filegroups[i]->report(report);
 }
 
 void AllFiles::close() throw()
 {
     unsigned int i, n = 0;
 
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+
     // close all filegroups.  If a filegroup is not active, delete it
     for (i = 0; i < _filegroups.size(); i++) {
         if (_filegroups[i]) {
-            _filegroups[i]->close();
-            if (!_filegroups[i]->active()) {
+            bool active;
+            {
+                std::lock_guard<std::recursive_mutex> glock(_filegroups[i]->mutex());
+                _filegroups[i]->close();
+                active = _filegroups[i]->active();
+            }
+            if (!active && _filegroups[i] != _precreating) {
                 delete _filegroups[i];
                 _filegroups[i] = 0;
             } else {
@@ -519,10 +2071,30 @@ void AllFiles::close() throw()
 
 void AllFiles::sync() throw()
 {
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+
     // sync all filegroups.
     for (unsigned int i = 0; i < _filegroups.size(); i++) {
-        if (_filegroups[i])
+        if (_filegroups[i]) {
+            std::lock_guard<std::recursive_mutex> glock(_filegroups[i]->mutex());
             _filegroups[i]->sync();
+        }
+    }
+}
+
+void AllFiles::flush_old_records() throw()
+{
+    // This is called from the dispatch loop, so it does not wait for
+    // the groups in use by the RPC threads. Those are receiving data,
+    // and their old records are written by put_rec().
+    std::unique_lock<std::recursive_mutex> lock(_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) return;
+
+    for (unsigned int i = 0; i < _filegroups.size(); i++) {
+        if (!_filegroups[i]) continue;
+        std::unique_lock<std::recursive_mutex> glock(
+                _filegroups[i]->mutex(), std::try_to_lock);
+        if (glock.owns_lock()) _filegroups[i]->flush_old_records();
     }
 }
 
@@ -530,10 +2102,17 @@ void AllFiles::close_old_files(void) throw()
 {
     unsigned int i, n = 0;
 
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+
     for (i = 0; i < _filegroups.size(); i++) {
         if (_filegroups[i]) {
-            _filegroups[i]->close_old_files();
-            if (!_filegroups[i]->active()) {
+            bool active;
+            {
+                std::lock_guard<std::recursive_mutex> glock(_filegroups[i]->mutex());
+                _filegroups[i]->close_old_files();
+                active = _filegroups[i]->active();
+            }
+            if (!active && _filegroups[i] != _precreating) {
                 delete _filegroups[i];
                 _filegroups[i] = 0;
             } else {
@@ -547,31 +2126,148 @@ void AllFiles::close_old_files(void) throw()
     VLOG(("%d current file groups, heap=%d", n, heap()));
 }
 
-void AllFiles::close_oldest_file(void) throw()
+void AllFiles::precreate_files(int lead) throw()
 {
-    unsigned int i;
-    time_t lastaccess = time(0) - 10;
-    time_t accesst;
-    FileGroup *fg;
-    int oldgroup = -1;
+    vector<FileGroup*> groups;
+    {
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        for (unsigned int i = 0; i < _filegroups.size(); i++)
+            if (_filegroups[i]) groups.push_back(_filegroups[i]);
+    }
 
-    for (i = 0; i < _filegroups.size(); i++)
-        if ((fg = _filegroups[i])
-                && (accesst = fg->oldest_file()) < lastaccess) {
-            lastaccess = accesst;
-            oldgroup = i;
+    // Only the group is locked while its file is created, so this does
+    // not hold up connections and the other groups.  The group is not
+    // deleted while it is _precreating.
+    for (unsigned int i = 0; i < groups.size(); i++) {
+        {
+            std::lock_guard<std::recursive_mutex> lock(_mutex);
+            if (std::find(_filegroups.begin(), _filegroups.end(),
+                          groups[i]) == _filegroups.end())
+                continue;
+            _precreating = groups[i];
+        }
+        groups[i]->precreate_file(lead);
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        _precreating = 0;
+    }
+}
+
+namespace {
+    /**
+     * File descriptors kept for RPC connections, logging, etc,
+     * when setting the maximum number of open files.
+     */
+    const int RESERVED_FDS = 64;
+}
+
+void AllFiles::setMaxOpenFiles(int n)
+{
+    if (n <= 0) n = DEFAULT_MAX_OPEN_FILES;
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        PLOG(("getrlimit(RLIMIT_NOFILE): %m"));
+        _maxOpenFiles = n;
+        return;
+    }
+
+    rlim_t need = n + RESERVED_FDS;
+    if (rl.rlim_cur != RLIM_INFINITY && need > rl.rlim_cur) {
+        struct rlimit nrl = rl;
+        nrl.rlim_cur = (rl.rlim_max == RLIM_INFINITY) ? need :
+            std::min(need, rl.rlim_max);
+        if (setrlimit(RLIMIT_NOFILE, &nrl) < 0)
+            PLOG(("setrlimit(RLIMIT_NOFILE, %lu): %m",
+                  (unsigned long) nrl.rlim_cur));
+        else rl = nrl;
+        if (need > rl.rlim_cur) {
+            int nmax = std::max((int)rl.rlim_cur - RESERVED_FDS, 1);
+            WLOG(("RLIMIT_NOFILE=%lu, reducing maximum open files from %d to %d",
+                  (unsigned long) rl.rlim_cur, n, nmax));
+            n = nmax;
+        }
+    }
+    ILOG(("maximum open files=%d, RLIMIT_NOFILE=%lu", n,
+          (unsigned long) rl.rlim_cur));
+    _maxOpenFiles = n;
+}
+
+void AllFiles::file_opened(FileGroup* group, NS_NcFile* f)
+{
+    std::lock_guard<std::mutex> lock(_lruMutex);
+    f->_group = group;
+    f->_lruPrev = 0;
+    f->_lruNext = _lruHead;
+    if (_lruHead) _lruHead->_lruPrev = f;
+    else _lruTail = f;
+    _lruHead = f;
+    _nfiles++;
+}
+
+void AllFiles::file_closed(NS_NcFile* f)
+{
+    std::lock_guard<std::mutex> lock(_lruMutex);
+    if (f->_lruPrev) f->_lruPrev->_lruNext = f->_lruNext;
+    else _lruHead = f->_lruNext;
+    if (f->_lruNext) f->_lruNext->_lruPrev = f->_lruPrev;
+    else _lruTail = f->_lruPrev;
+    f->_lruPrev = f->_lruNext = 0;
+    _nfiles--;
+}
+
+void AllFiles::touch(NS_NcFile* f)
+{
+    std::lock_guard<std::mutex> lock(_lruMutex);
+    if (f == _lruHead) return;
+    // unlink, f is not the head so it has a previous file
+    f->_lruPrev->_lruNext = f->_lruNext;
+    if (f->_lruNext) f->_lruNext->_lruPrev = f->_lruPrev;
+    else _lruTail = f->_lruPrev;
+    // and push on the front
+    f->_lruPrev = 0;
+    f->_lruNext = _lruHead;
+    _lruHead->_lruPrev = f;
+    _lruHead = f;
+}
+
+bool AllFiles::close_oldest_file(FileGroup* caller) throw()
+{
+    NS_NcFile* f;
+    std::unique_lock<std::recursive_mutex> glock;
+    {
+        // The calling FileGroup is locked, so waiting here for another
+        // group could deadlock. Groups in use by other threads are not
+        // the least recently used anyway, so skip them. A group is not
+        // deleted while it has files in the list, and once it is locked
+        // here its files are not closed by anyone else.  try_lock of the
+        // recursive mutex of the caller would always succeed, so its
+        // files are skipped explicitly.
+        std::lock_guard<std::mutex> lock(_lruMutex);
+        for (f = _lruTail; f; f = f->_lruPrev) {
+            if (f->_group == caller) continue;
+            glock = std::unique_lock<std::recursive_mutex>(
+                    f->_group->mutex(), std::try_to_lock);
+            if (glock.owns_lock()) break;
         }
-    if (oldgroup >= 0)
-        _filegroups[oldgroup]->close_oldest_file();
+    }
+    if (!f) return false;
+    f->_group->close_file(f);
+    return true;
+}
 
+void AllFiles::close_oldest_files(FileGroup* caller) throw()
+{
+    while (_nfiles > _maxOpenFiles && close_oldest_file(caller));
 }
 
 FileGroup::FileGroup(const struct connection *conn):
     _connections(),_files(),
     _outputDir(),_fileNameFormat(),
-    _CDLFileName(),_vargroups(),
+    _CDLFileName(),_cdlSchema(),_cdlMtime(),_vargroups(),
     _vargroupId(0),_interval(conn->interval),
-    _fileLength(conn->filelength),_globalAttrs(),_globalIntAttrs()
+    _fileLength(conn->filelength),_globalAttrs(),_globalIntAttrs(),
+    _mutex(),_lastDataTime(0.0),_nopens(0),_ncloses(0),_nchecks(0),
+    _ncdlCreates(0),_nncgens(0),_syncLatency()
 {
     VLOG(("creating FileGroup, dir=%s,file=%s",
           conn->outputdir, conn->filenamefmt));
@@ -585,6 +2281,9 @@ FileGroup::FileGroup(const struct connection *conn):
 
     _fileNameFormat = conn->filenamefmt;
 
+    // files which an earlier nc_server did not finish pre-creating
+    remove_precreated(_outputDir);
+
     _CDLFileName = conn->cdlfile;
 
     VLOG(("created FileGroup, dir=") << _outputDir
@@ -677,35 +2376,44 @@ void FileGroup::close() throw()
 {
     unsigned int i;
 
-    for (i = 0; i < _connections.size(); i++) {
-        _connections[i]->unset_last_file();
-
-        // write history and global attributes
-        list < NS_NcFile * >::const_iterator ni;
-        for (ni = _files.begin(); ni != _files.end(); ni++) {
-
-            try {
-                (*ni)->put_history(_connections[i]->get_history());
-                update_global_attrs();
-            }
-            catch(const nidas::util::Exception& e) {
-                PLOG(("%s",e.what()));
-            }
+    // write history and global attributes
+    map<double, NS_NcFile*>::const_iterator ni;
+    for (ni = _files.begin(); ni != _files.end(); ni++) {
+        try {
+            for (i = 0; i < _connections.size(); i++)
+                ni->second->put_history(_connections[i]->get_history());
+            update_global_attrs(ni->second);
+        }
+        catch(const nidas::util::Exception& e) {
+            PLOG(("%s",e.what()));
         }
     }
 
+    AllFiles *allfiles = AllFiles::Instance();
     while (_files.size() > 0) {
-        delete _files.back();
-        _files.pop_back();
+        NS_NcFile* f = _files.begin()->second;
+        _files.erase(_files.begin());
+        allfiles->file_closed(f);
+        delete f;
+        _ncloses++;
     }
+    // after the files, which tell the connections of write errors
+    for (i = 0; i < _connections.size(); i++)
+        _connections[i]->unset_files();
+}
+
+void FileGroup::flush_old_records() throw()
+{
+    map<double, NS_NcFile*>::const_iterator ni = _files.begin();
+    for ( ; ni != _files.end(); ++ni) ni->second->flush_old_records();
 }
 
 // sync all NS_NcFile objects
 void FileGroup::sync() throw()
 {
-    list < NS_NcFile * >::const_iterator ni;
+    map<double, NS_NcFile*>::const_iterator ni;
     for (ni = _files.begin(); ni != _files.end(); ni++)
-        (*ni)->sync();
+        ni->second->sync();
 }
 
 void FileGroup::add_connection(Connection * cp)
@@ -718,12 +2426,12 @@ void FileGroup::remove_connection(Connection * cp)
     vector < Connection * >::iterator ic;
     Connection *p;
 
-    list < NS_NcFile * >::const_iterator ni;
+    map<double, NS_NcFile*>::const_iterator ni;
     // write history
     for (ni = _files.begin(); ni != _files.end(); ni++) {
         try {
-            (*ni)->put_history(cp->get_history());
-            update_global_attrs();
+            ni->second->put_history(cp->get_history());
+            update_global_attrs(ni->second);
         }
         catch(const nidas::util::Exception& e) {
             PLOG(("%s",e.what()));
@@ -740,56 +2448,42 @@ void FileGroup::remove_connection(Connection * cp)
 }
 
 
-NS_NcFile *FileGroup::get_file(double dtime)
+NS_NcFile *FileGroup::find_file(double dtime) const
 {
-    NS_NcFile *f = 0;
-    list < NS_NcFile * >::iterator ni;
-    list < NS_NcFile * >::const_iterator nie;
+    // The file with the latest start time at or before dtime
+    // is the only one which could contain it.
+    map<double, NS_NcFile*>::const_iterator ni = _files.upper_bound(dtime);
+    if (ni == _files.begin()) return 0;
+    NS_NcFile *f = (--ni)->second;
+    return f->EndTimeGT(dtime) ? f : 0;
+}
 
-    nie = _files.end();
+NS_NcFile *FileGroup::get_file(double dtime)
+{
+    NS_NcFile *f = find_file(dtime);
+    if (f) return f;
 
-    for (ni = _files.begin(); ni != nie; ni++)
-        if ((*ni)->EndTimeGT(dtime))
-            break;
+    VLOG(("new NS_NcFile: %s %s", _outputDir.c_str(),
+          _fileNameFormat.c_str()));
 
-    /*
-     * At this point:
-     *    ni == nie, no files open
-     *               no file with an endTime > dtime, ie all earlier
-     *    or *ni->endTime > dtime
-     */
+    // If the file length is less than 0, then the file has "infinite"
+    // length.  We will have problems here, because you can't
+    // insert records, only overwrite or append.
+    // if (length() < 0) return(0);
 
     AllFiles *allfiles = AllFiles::Instance();
-    if (ni == nie) {
-        VLOG(("new NS_NcFile: %s %s", _outputDir.c_str(),
-              _fileNameFormat.c_str()));
-        if ((f = open_file(dtime)))
-            _files.push_back(f);
-        close_old_files();
-        if (allfiles->num_files() > MAX_FILES_OPEN)
-            allfiles->close_oldest_file();
-    } else if (!(f = *ni)->StartTimeLE(dtime)) {
-        VLOG(("new NS_NcFile: %s %s", _outputDir.c_str(),
-              _fileNameFormat.c_str()));
-
-        // If the file length is less than 0, then the file has "infinite"
-        // length.  We will have problems here, because you can't
-        // insert records, only overwrite or append.
-        // if (length() < 0) return(0);
-
-        if ((f = open_file(dtime)))
-            _files.insert(ni, f);
-        close_old_files();
-        if (allfiles->num_files() > MAX_FILES_OPEN)
-            allfiles->close_oldest_file();
+    if ((f = open_file(dtime))) {
+        _files[f->StartTime()] = f;
+        allfiles->file_opened(this, f);
+        _nopens++;
     }
+    close_old_files();
+    allfiles->close_oldest_files(this);
     return f;
 }
 
 NS_NcFile *FileGroup::open_file(double dtime)
 {
-    int fileExists = 0;
-
     // given a data time, find the name of the file which would contain it and
     // the times which bound it.
     UTime basetime{UTime::ZERO};
@@ -799,6 +2493,18 @@ NS_NcFile *FileGroup::open_file(double dtime)
     string fileName =
         build_name(_outputDir, _fileNameFormat, _fileLength, basetime);
 
+    NS_NcFile *f = open_file(fileName, basetime, endtime,
+                             _globalAttrs, _globalIntAttrs);
+    Trace::probe(Trace::OPEN_FILE);
+    return f;
+}
+
+NS_NcFile *FileGroup::open_file(const string& fileName,
+        const UTime& basetime, const UTime& endtime,
+        const map<string,string>& attrs, const map<string,int>& intAttrs)
+{
+    int fileExists = 0;
+
     struct stat statBuf;
     if (!access(fileName.c_str(), F_OK)) {
         if (stat(fileName.c_str(), &statBuf) < 0) {
@@ -846,21 +2552,124 @@ NS_NcFile *FileGroup::open_file(double dtime)
                 && !ncgen_file(_CDLFileName, fileName)))
         openmode = NcFile::Replace;
 
-    NS_NcFile *ncfile = new NS_NcFile(fileName, openmode, _interval,
-                                      _fileLength, basetime, endtime);
+    NS_NcFile *ncfile;
+    {
+        std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+        ncfile = new NS_NcFile(fileName, openmode, _interval,
+                               _fileLength, basetime, endtime);
+    }
 
     // write global attributes to file
-    map<string,string>::const_iterator ai =  _globalAttrs.begin();
-    for ( ; ai != _globalAttrs.end(); ++ai)
+    map<string,string>::const_iterator ai =  attrs.begin();
+    for ( ; ai != attrs.end(); ++ai)
         ncfile->write_global_attr(ai->first,ai->second);
 
-    map<string,int>::const_iterator iai =  _globalIntAttrs.begin();
-    for ( ; iai != _globalIntAttrs.end(); ++iai)
+    map<string,int>::const_iterator iai =  intAttrs.begin();
+    for ( ; iai != intAttrs.end(); ++iai)
         ncfile->write_global_attr(iai->first,iai->second);
 
     return ncfile;
 }
 
+void FileGroup::precreate_file(int lead) throw()
+{
+    // Writers to this group wait for the create, as they would in
+    // get_file(), but the groups of other connections do not.
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    if (!active() || _lastDataTime <= 0.0 || _fileLength <= 0) return;
+
+    UTime basetime{UTime::ZERO};
+    UTime endtime{UTime::ZERO};
+    get_time_bounds(_lastDataTime, basetime, endtime);
+    double next = endtime.toDoubleSecs();
+    if (_lastDataTime + lead < next) return;
+
+    if (find_file(next)) return;
+
+    get_time_bounds(next, basetime, endtime);
+    string fileName =
+        build_name(_outputDir, _fileNameFormat, _fileLength, basetime);
+    // If it exists, it will be opened by get_file as usual
+    if (!access(fileName.c_str(), F_OK)) return;
+
+    // Create it under another name, so that a crash while it is
+    // being defined does not leave a partial file under the real name.
+    string tmpName = precreate_name(fileName);
+    ::unlink(tmpName.c_str());
+
+    NS_NcFile *f = 0;
+    try {
+        f = open_file(tmpName, basetime, endtime,
+                      _globalAttrs, _globalIntAttrs);
+        map<int,VariableGroup*>::const_iterator vi = _vargroups.begin();
+        for ( ; vi != _vargroups.end(); ++vi)
+            f->define_var_group(vi->second);
+        f->sync();
+    }
+    catch (const nidas::util::Exception& e) {
+        PLOG(("%s: %s", tmpName.c_str(), e.what()));
+        delete f;
+        ::unlink(tmpName.c_str());
+        return;
+    }
+
+    // link() does not replace a file which was created by someone else
+    if (::link(tmpName.c_str(), fileName.c_str()) < 0) {
+        if (errno != EEXIST)
+            PLOG(("link %s %s: %m", tmpName.c_str(), fileName.c_str()));
+        delete f;
+        ::unlink(tmpName.c_str());
+        return;
+    }
+    ::unlink(tmpName.c_str());
+    f->setName(fileName);
+
+    _files[f->StartTime()] = f;
+    AllFiles::Instance()->file_opened(this, f);
+    _nopens++;
+    AllFiles::Instance()->close_oldest_files(this);
+    ILOG(("Pre-created %s", fileName.c_str()));
+}
+
+namespace {
+    const char PRECREATE_PREFIX[] = ".precreate.";
+}
+
+string FileGroup::precreate_name(const string& fileName)
+{
+    // The pid tells the files of this process from those left by
+    // an earlier one.
+    string::size_type slash = fileName.rfind('/');
+    ostringstream ost;
+    ost << fileName.substr(0, slash + 1) << PRECREATE_PREFIX << getpid()
+        << '.' << fileName.substr(slash + 1);
+    return ost.str();
+}
+
+void FileGroup::remove_precreated(const string& dir)
+{
+    DIR* dp = ::opendir(dir.c_str());
+    if (!dp) {
+        PLOG(("%s: %m", dir.c_str()));
+        return;
+    }
+    ostringstream ours;
+    ours << PRECREATE_PREFIX << getpid() << '.';
+
+    struct dirent* dep;
+    while ((dep = ::readdir(dp))) {
+        string name(dep->d_name);
+        if (name.compare(0, sizeof(PRECREATE_PREFIX) - 1, PRECREATE_PREFIX) ||
+                !name.compare(0, ours.str().length(), ours.str()))
+            continue;
+        string path = dir + '/' + name;
+        if (::unlink(path.c_str()) < 0)
+            PLOG(("unlink %s: %m", path.c_str()));
+        else
+            ILOG(("removed leftover %s", path.c_str()));
+    }
+    ::closedir(dp);
+}
 
 namespace {
 
@@ -976,16 +2785,375 @@ string FileGroup::build_name(const string & outputDir,
 }
 
 
+namespace {
+
+    /**
+     * Files which passed validation, or which were cleanly closed by
+     * this process, keyed by device and inode, with the size and
+     * modification time they had then.  A file is not re-validated
+     * unless one of those has changed.
+     */
+    class CheckedFiles
+    {
+    public:
+        bool contains(const struct stat& st) const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            map<file_key, file_state>::const_iterator fi =
+                _files.find(file_key(st.st_dev, st.st_ino));
+            return fi != _files.end() && fi->second == value(st);
+        }
+
+        void insert(const struct stat& st)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _files[file_key(st.st_dev, st.st_ino)] = value(st);
+        }
+
+        void insert(const string& fileName)
+        {
+            struct stat st;
+            if (::stat(fileName.c_str(), &st) == 0) insert(st);
+        }
+
+        void erase(const struct stat& st)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _files.erase(file_key(st.st_dev, st.st_ino));
+        }
+
+    private:
+        typedef pair<dev_t, ino_t> file_key;
+        typedef pair<off_t, pair<time_t, long> > file_state;
+
+        static file_state value(const struct stat& st)
+        {
+            return file_state(st.st_size,
+                    make_pair(st.st_mtim.tv_sec, st.st_mtim.tv_nsec));
+        }
+
+        mutable std::mutex _mutex{};
+        map<file_key, file_state> _files{};
+    };
+
+    CheckedFiles checked_files;
+
+    /**
+     * Sequential reader of the big-endian header of a netCDF-3 file.
+     * Throws std::out_of_range when reading past the end of the buffer.
+     */
+    class NC3HeaderReader
+    {
+    public:
+        explicit NC3HeaderReader(const vector<unsigned char>& buf):
+            _buf(buf), _pos(0)
+        {
+        }
+
+        unsigned long long get(int nbytes)
+        {
+            if (_pos + nbytes > _buf.size())
+                throw std::out_of_range("header");
+            unsigned long long val = 0;
+            for (int i = 0; i < nbytes; i++)
+                val = (val << 8) | _buf[_pos++];
+            return val;
+        }
+
+        void skip(unsigned long long nbytes)
+        {
+            // values are padded to 4 byte boundaries
+            nbytes = (nbytes + 3) & ~3ULL;
+            if (nbytes > _buf.size() - _pos)
+                throw std::out_of_range("header");
+            _pos += nbytes;
+        }
+
+        void skip_name()
+        {
+            skip(get(4));
+        }
+
+        void skip_attrs()
+        {
+            get(4);     // NC_ATTRIBUTE tag, or ABSENT
+            unsigned long long natts = get(4);
+            for (unsigned long long i = 0; i < natts; i++) {
+                skip_name();
+                int type = get(4);
+                unsigned long long nelems = get(4);
+                skip(nelems * type_size(type));
+            }
+        }
+
+        static int type_size(int type)
+        {
+            switch (type) {
+            case NC_SHORT: return 2;
+            case NC_INT: case NC_FLOAT: return 4;
+            case NC_DOUBLE: return 8;
+            default: return 1;
+            }
+        }
+
+    private:
+        const vector<unsigned char>& _buf;
+        size_t _pos;
+    };
+
+    /**
+     * Check that a netCDF-3 file is long enough to hold the fixed
+     * variables and the number of records claimed in its header.
+     * The last record may be partially written, which netcdf reads
+     * back as zeroes, so only the preceding records must be complete.
+     * Returns false and sets errmsg on failure.
+     */
+    bool check_nc3_size(int fd, const struct stat& st, string& errmsg)
+    {
+        vector<unsigned char> buf;
+        size_t len = std::min<off_t>(st.st_size, 65536);
+
+        for (;;) {
+            buf.resize(len);
+            ssize_t l = pread(fd, &buf.front(), len, 0);
+            if (l < 0) {
+                errmsg = string("read: ") + strerror(errno);
+                return false;
+            }
+            buf.resize(l);
+            try {
+                NC3HeaderReader hdr(buf);
+                if (hdr.get(3) != ('C' << 16 | 'D' << 8 | 'F')) {
+                    errmsg = "not a netCDF-3 file";
+                    return false;
+                }
+                int version = hdr.get(1);
+                if (version != 1 && version != 2) return true;
+
+                unsigned long long numrecs = hdr.get(4);
+                if (numrecs == 0xffffffffULL) return true; // streaming
+
+                vector<unsigned long long> dimlens;
+                hdr.get(4);
+                unsigned long long ndims = hdr.get(4);
+                for (unsigned long long i = 0; i < ndims; i++) {
+                    hdr.skip_name();
+                    dimlens.push_back(hdr.get(4));
+                }
+                hdr.skip_attrs();
+
+                unsigned long long recbegin = 0;
+                unsigned long long recsize = 0;
+                unsigned long long fixedend = 0;
+
+                hdr.get(4);
+                unsigned long long nvars = hdr.get(4);
+                for (unsigned long long i = 0; i < nvars; i++) {
+                    hdr.skip_name();
+                    unsigned long long nvdims = hdr.get(4);
+                    bool isrec = false;
+                    for (unsigned long long j = 0; j < nvdims; j++) {
+                        unsigned long long dimid = hdr.get(4);
+                        if (j == 0 && dimid < dimlens.size() &&
+                                dimlens[dimid] == 0) isrec = true;
+                    }
+                    hdr.skip_attrs();
+                    hdr.get(4);     // nc_type
+                    unsigned long long vsize = hdr.get(4);
+                    unsigned long long begin = hdr.get(version == 1 ? 4 : 8);
+                    if (isrec) {
+                        if (recsize == 0 || begin < recbegin)
+                            recbegin = begin;
+                        recsize += vsize;
+                    }
+                    else fixedend = std::max(fixedend, begin + vsize);
+                }
+
+                unsigned long long need = fixedend;
+                if (numrecs > 0 && recsize > 0)
+                    need = std::max(need, recbegin + (numrecs - 1) * recsize);
+                // allow for padding of the last variable
+                if (need > (unsigned long long) st.st_size + 3) {
+                    std::ostringstream ost;
+                    ost << "file size=" << st.st_size <<
+                        " is too short for " << numrecs <<
+                        " records, expected at least " << need;
+                    errmsg = ost.str();
+                    return false;
+                }
+                return true;
+            }
+            catch (const std::out_of_range&) {
+                if ((off_t)buf.size() >= st.st_size) {
+                    errmsg = "truncated header";
+                    return false;
+                }
+                len = std::min<off_t>(st.st_size, buf.size() * 4);
+            }
+        }
+    }
+
+    /**
+     * Read the last record of every record variable.
+     */
+    bool check_last_record(int ncid, string& errmsg)
+    {
+        int ndims, nvars, ngatts, recdim;
+        int status = nc_inq(ncid, &ndims, &nvars, &ngatts, &recdim);
+        size_t nrecs = 0;
+        if (status == NC_NOERR && recdim >= 0)
+            status = nc_inq_dimlen(ncid, recdim, &nrecs);
+        if (status != NC_NOERR) {
+            errmsg = nc_strerror(status);
+            return false;
+        }
+        if (nrecs == 0) return true;
+
+        vector<char> buf;
+        for (int varid = 0; varid < nvars; varid++) {
+            char name[NC_MAX_NAME + 1] = "";
+            nc_type type;
+            int nvdims = 0;
+            int dimids[NC_MAX_VAR_DIMS];
+            status = nc_inq_var(ncid, varid, name, &type, &nvdims,
+                    dimids, 0);
+            if (status == NC_NOERR && (nvdims == 0 || dimids[0] != recdim))
+                continue;
+
+            size_t start[NC_MAX_VAR_DIMS];
+            size_t count[NC_MAX_VAR_DIMS];
+            size_t nvals = 1;
+            for (int i = 0; status == NC_NOERR && i < nvdims; i++) {
+                start[i] = 0;
+                count[i] = 1;
+                if (i == 0) start[i] = nrecs - 1;
+                else status = nc_inq_dimlen(ncid, dimids[i], &count[i]);
+                nvals *= count[i];
+            }
+            size_t tsize = 0;
+            if (status == NC_NOERR)
+                status = nc_inq_type(ncid, type, 0, &tsize);
+            if (status == NC_NOERR) {
+                buf.resize(std::max<size_t>(nvals * tsize, 1));
+                status = nc_get_vara(ncid, varid, start, count, &buf.front());
+            }
+            if (status != NC_NOERR) {
+                errmsg = string("variable ") + name + ": " +
+                    nc_strerror(status);
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
 int FileGroup::check_file(const string & fileName) const
 {
-    bool fileok = false;
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        WLOG(("%s: %m", fileName.c_str()));
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        WLOG(("%s: %m", fileName.c_str()));
+        ::close(fd);
+        return false;
+    }
+    if (checked_files.contains(st)) {
+        VLOG(("%s: unchanged since last check", fileName.c_str()));
+        ::close(fd);
+        return true;
+    }
+
+    _nchecks++;
+    string errmsg;
+    bool fileok = check_nc3_size(fd, st, errmsg);
+    ::close(fd);
+
+    if (fileok) {
+        std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+        int ncid;
+        int status = nc_open(fileName.c_str(), NC_NOWRITE, &ncid);
+        if (status != NC_NOERR) {
+            errmsg = nc_strerror(status);
+            fileok = false;
+        }
+        else {
+            fileok = check_last_record(ncid, errmsg);
+            nc_close(ncid);
+        }
+    }
+
+    if (fileok) {
+        VLOG(("%s: ok", fileName.c_str()));
+        checked_files.insert(st);
+    }
+    else {
+        WLOG(("%s: ", fileName.c_str()) << errmsg);
+        checked_files.erase(st);
+    }
+    return fileok;
+}
+
+int FileGroup::ncgen_file(const string & CDLFileName,
+        const string & fileName)
+{
+    std::shared_ptr<const CDLSchema> schema;
+    {
+        // Already locked by the callers of open_file().  The schema is
+        // only replaced, never modified, so the copy is used as is.
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        struct stat st;
+        if (::stat(CDLFileName.c_str(), &st) < 0) {
+            WLOG(("%s: %m", CDLFileName.c_str()));
+            return 1;
+        }
+        if (st.st_mtim.tv_sec != _cdlMtime.tv_sec ||
+                st.st_mtim.tv_nsec != _cdlMtime.tv_nsec) {
+            _cdlMtime = st.st_mtim;
+            _cdlSchema.reset();
+            try {
+                _cdlSchema.reset(new CDLSchema(CDLFileName));
+                ILOG(("parsed %s", CDLFileName.c_str()));
+            }
+            catch (const nidas::util::Exception& e) {
+                WLOG(("%s, will use ncgen", e.what()));
+            }
+        }
+        schema = _cdlSchema;
+    }
+
+    if (!schema) {
+        _nncgens++;
+        return run_ncgen(CDLFileName, fileName);
+    }
+
+    int status = schema->create(fileName);
+    if (status != NC_NOERR) {
+        // ncgen may still manage, or give a better error message
+        WLOG(("creating %s from %s: %s, will use ncgen", fileName.c_str(),
+                    CDLFileName.c_str(), nc_strerror(status)));
+        _nncgens++;
+        return run_ncgen(CDLFileName, fileName);
+    }
+    _ncdlCreates++;
+    ILOG(("created %s from %s", fileName.c_str(), CDLFileName.c_str()));
+    return 0;
+}
 
+int FileGroup::run_ncgen(const string & CDLFileName,
+        const string & fileName) const
+{
+    int res = 1;
     try {
         vector < string > args;
-        args.push_back("nc_check");
+        args.push_back("ncgen");
+        args.push_back("-o");
         args.push_back(fileName);
+        args.push_back(CDLFileName);
         nidas::util::Process proc =
-            nidas::util::Process::spawn("nc_check", args);
+            nidas::util::Process::spawn("ncgen", args);
         int status;
         char buf[512];
         string errmsg;
@@ -993,178 +3161,533 @@ int FileGroup::check_file(const string & fileName) const
             ssize_t l = read(proc.getErrFd(),buf,sizeof(buf));
             if (l == 0) break;
             if (l < 0) {
-                WLOG(("error reading nc_check error output: %m"));
+                WLOG(("error reading ncgen error output: %m"));
                 break;
             }
-            if (errmsg.length() < 1024) errmsg += string(buf, l);
+            if (errmsg.length() < 1024) errmsg += string(buf, l);
+        }
+        proc.wait(true, &status);
+        if (WIFEXITED(status)) {
+            if (WEXITSTATUS(status))
+                WLOG(("ncgen exited with status=%d, err output=",
+                            WEXITSTATUS(status)) << errmsg);
+            else {
+                ILOG(("ncgen -o %s %s", fileName.c_str(),CDLFileName.c_str()));
+                res = 0;
+            }
+        } else if (WIFSIGNALED(status))
+            WLOG(("ncgen received signal=%d, err output=",
+                        WTERMSIG(status)) << errmsg);
+    }
+    catch(const nidas::util::IOException & e)
+    {
+        WLOG(("%s", e.what()));
+    }
+    return res;
+}
+
+/**
+ * Splits CDL text into names, numbers, strings and punctuation,
+ * skipping white space and // comments.
+ */
+class CDLSchema::Scanner
+{
+public:
+    enum Kind { END, NAME, NUMBER, STRING, PUNCT };
+
+    Scanner(const string& fileName, const string& text):
+        _fileName(fileName), _text(text), _pos(0), _line(1),
+        _kind(END), _token(), _peeked(false)
+    {
+    }
+
+    Kind next()
+    {
+        if (_peeked) _peeked = false;
+        else scan();
+        return _kind;
+    }
+
+    Kind peek()
+    {
+        if (!_peeked) {
+            scan();
+            _peeked = true;
+        }
+        return _kind;
+    }
+
+    const string& token() const
+    {
+        return _token;
+    }
+
+    bool is(const string& punct)
+    {
+        return peek() == PUNCT && _token == punct;
+    }
+
+    void expect(const string& punct)
+    {
+        if (next() != PUNCT || _token != punct)
+            throw error("expected \"" + punct + "\"");
+    }
+
+    const string& expect_name()
+    {
+        if (next() != NAME) throw error("expected a name");
+        return _token;
+    }
+
+    nidas::util::ParseException error(const string& msg) const
+    {
+        std::ostringstream ost;
+        ost << _fileName << ": line " << _line << ": " << msg;
+        if (_kind != END) ost << " at \"" << _token << '"';
+        return nidas::util::ParseException(ost.str());
+    }
+
+private:
+
+    void scan()
+    {
+        for (;;) {
+            while (_pos < _text.size() && isspace(_text[_pos]))
+                if (_text[_pos++] == '\n') _line++;
+            if (_text.compare(_pos, 2, "//") != 0) break;
+            _pos = _text.find('\n', _pos);
+            if (_pos == string::npos) _pos = _text.size();
+        }
+        _token.clear();
+        if (_pos >= _text.size()) {
+            _kind = END;
+            return;
+        }
+        char c = _text[_pos];
+        char c1 = _pos + 1 < _text.size() ? _text[_pos + 1] : '\0';
+
+        if (c == '"') {
+            _kind = STRING;
+            for (_pos++; _pos < _text.size() && _text[_pos] != '"'; _pos++) {
+                c = _text[_pos];
+                if (c == '\n') _line++;
+                if (c == '\\' && _pos + 1 < _text.size()) {
+                    c = _text[++_pos];
+                    switch (c) {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case '0': c = '\0'; break;
+                    default: break;
+                    }
+                }
+                _token += c;
+            }
+            if (_pos++ >= _text.size()) throw error("unterminated string");
+        }
+        else if (isdigit(c) || ((c == '-' || c == '+' || c == '.') &&
+                    (isdigit(c1) || c1 == '.'))) {
+            _kind = NUMBER;
+            _token += _text[_pos++];
+            for ( ; _pos < _text.size(); _pos++) {
+                c = _text[_pos];
+                if ((c == '-' || c == '+') &&
+                        (_token.back() == 'e' || _token.back() == 'E'))
+                    _token += c;
+                else if (isalnum(c) || c == '.') _token += c;
+                else break;
+            }
+        }
+        else if (isalpha(c) || c == '_' || c == '\\') {
+            _kind = NAME;
+            for ( ; _pos < _text.size(); _pos++) {
+                c = _text[_pos];
+                if (c == '\\' && _pos + 1 < _text.size()) c = _text[++_pos];
+                else if (!isalnum(c) && !strchr("_.@+-", c)) break;
+                _token += c;
+            }
+        }
+        else {
+            _kind = PUNCT;
+            _token += _text[_pos++];
+        }
+    }
+
+    const string _fileName;
+    const string& _text;
+    string::size_type _pos;
+    int _line;
+    Kind _kind;
+    string _token;
+    bool _peeked;
+};
+
+namespace {
+
+    /**
+     * Return the netCDF-3 type of a CDL type name, or NC_NAT.
+     */
+    nc_type cdl_type(const string& name)
+    {
+        if (name == "byte") return NC_BYTE;
+        if (name == "char") return NC_CHAR;
+        if (name == "short") return NC_SHORT;
+        if (name == "int" || name == "long") return NC_INT;
+        if (name == "float" || name == "real") return NC_FLOAT;
+        if (name == "double") return NC_DOUBLE;
+        return NC_NAT;
+    }
+
+    /**
+     * Type of a CDL numeric constant, from its suffix or form.
+     */
+    nc_type number_type(const string& num)
+    {
+        char suffix = tolower(num[num.size() - 1]);
+        if (suffix == 'b') return NC_BYTE;
+        if (suffix == 's') return NC_SHORT;
+        if (suffix == 'f') return NC_FLOAT;
+        if (suffix == 'd') return NC_DOUBLE;
+        if (num.find_first_of(".eE") != string::npos) return NC_DOUBLE;
+        return NC_INT;
+    }
+}
+
+CDLSchema::CDLSchema(const string& cdlFileName):
+    _fileName(cdlFileName), _mtime(), _dims(), _vars(), _globalAtts()
+{
+    int fd = ::open(cdlFileName.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) < 0) {
+        int ierr = errno;
+        if (fd >= 0) ::close(fd);
+        throw nidas::util::IOException(cdlFileName, "open", ierr);
+    }
+    _mtime = st.st_mtim;
+
+    string text;
+    char buf[8192];
+    ssize_t l;
+    while ((l = ::read(fd, buf, sizeof(buf))) > 0) text.append(buf, l);
+    int ierr = errno;
+    ::close(fd);
+    if (l < 0) throw nidas::util::IOException(cdlFileName, "read", ierr);
+
+    Scanner scan(cdlFileName, text);
+    if (scan.expect_name() != "netcdf")
+        throw scan.error("expected \"netcdf\"");
+    scan.expect_name();
+    scan.expect("{");
+
+    map<string, int> dimIds;
+    map<string, int> varIds;
+    string section;
+
+    while (!scan.is("}")) {
+        if (scan.next() == Scanner::END) throw scan.error("unexpected end");
+        string name = scan.token();
+
+        if (scan.is(":") && (name == "dimensions" || name == "variables" ||
+                    name == "data")) {
+            scan.next();
+            section = name;
+            continue;
+        }
+
+        if (section == "dimensions") {
+            for (;;) {
+                Dim dim;
+                dim.name = name;
+                scan.expect("=");
+                if (scan.next() == Scanner::NUMBER)
+                    dim.len = strtoul(scan.token().c_str(), 0, 0);
+                else if (strcasecmp(scan.token().c_str(), "unlimited") == 0)
+                    dim.len = NC_UNLIMITED;
+                else throw scan.error("expected a dimension length");
+                dimIds[dim.name] = _dims.size();
+                _dims.push_back(dim);
+                if (scan.is(";")) break;
+                scan.expect(",");
+                name = scan.expect_name();
+            }
+            scan.expect(";");
+        }
+        else if (section == "variables") {
+            if (name == ":") {
+                parse_attr(scan, _globalAtts, NC_NAT);
+                continue;
+            }
+            nc_type type = cdl_type(name);
+            if (type != NC_NAT) {
+                // a typed attribute, or variable declarations
+                if (scan.is(":")) {
+                    scan.next();
+                    parse_attr(scan, _globalAtts, type);
+                    continue;
+                }
+                name = scan.expect_name();
+                if (!scan.is(":")) {
+                    for (;;) {
+                        Var var;
+                        var.name = name;
+                        var.type = type;
+                        if (scan.is("(")) {
+                            scan.next();
+                            for (;;) {
+                                map<string, int>::const_iterator di =
+                                    dimIds.find(scan.expect_name());
+                                if (di == dimIds.end())
+                                    throw scan.error("unknown dimension");
+                                var.dimids.push_back(di->second);
+                                if (scan.is(")")) break;
+                                scan.expect(",");
+                            }
+                            scan.next();
+                        }
+                        varIds[var.name] = _vars.size();
+                        _vars.push_back(var);
+                        if (scan.is(";")) break;
+                        scan.expect(",");
+                        name = scan.expect_name();
+                    }
+                    scan.expect(";");
+                    continue;
+                }
+            }
+            else if (name == "ubyte" || name == "ushort" || name == "uint" ||
+                    name == "int64" || name == "uint64" || name == "string")
+                throw scan.error("netCDF-4 types are not supported");
+            map<string, int>::const_iterator vi = varIds.find(name);
+            if (vi == varIds.end()) throw scan.error("unknown variable");
+            scan.expect(":");
+            parse_attr(scan, _vars[vi->second].atts, type);
         }
-        proc.wait(true, &status);
-        if (WIFEXITED(status)) {
-            if (WEXITSTATUS(status))
-                WLOG(("nc_check exited with status=%d, err output=",
-                      WEXITSTATUS(status)) << errmsg);
-            else {
-                VLOG(("nc_check exited with status=%d, err output=",
-                      WEXITSTATUS(status)) << errmsg);
-                fileok = true;
-            }
-        } else if (WIFSIGNALED(status))
-            WLOG(("nc_check received signal=%d, err output=",
-                        WTERMSIG(status)) << errmsg);
-    }
-    catch(const nidas::util::IOException & e)
-    {
-        WLOG(("%s", e.what()));
+        else if (section == "data") {
+            map<string, int>::const_iterator vi = varIds.find(name);
+            if (vi == varIds.end()) throw scan.error("unknown variable");
+            scan.expect("=");
+            parse_data(scan, _vars[vi->second]);
+        }
+        else throw scan.error("expected \"dimensions:\"");
     }
+    scan.next();
+}
 
-    return fileok;
+void CDLSchema::parse_attr(Scanner& scan, vector<Att>& atts, nc_type type)
+{
+    Att att;
+    att.name = scan.expect_name();
+    att.type = type;
+    scan.expect("=");
+    for (;;) {
+        Scanner::Kind kind = scan.next();
+        if (kind == Scanner::STRING && att.vals.empty()) {
+            if (att.type == NC_NAT) att.type = NC_CHAR;
+            att.text += scan.token();
+        }
+        else if (kind == Scanner::NUMBER && att.text.empty()) {
+            if (att.type == NC_NAT) att.type = number_type(scan.token());
+            att.vals.push_back(strtod(scan.token().c_str(), 0));
+        }
+        else throw scan.error("expected an attribute value");
+        if (scan.is(";")) break;
+        scan.expect(",");
+    }
+    scan.next();
+    if ((att.type == NC_CHAR) != att.vals.empty())
+        throw scan.error("attribute " + att.name + " value does not match type");
+
+    // a later value replaces an earlier one
+    vector<Att>::iterator ai = atts.begin();
+    for ( ; ai != atts.end(); ++ai)
+        if (ai->name == att.name) break;
+    if (ai == atts.end()) atts.push_back(att);
+    else *ai = att;
 }
 
-int FileGroup::ncgen_file(const string & CDLFileName,
-        const string & fileName) const
+void CDLSchema::parse_data(Scanner& scan, Var& var)
 {
-    int res = 1;
-    try {
-        vector < string > args;
-        args.push_back("ncgen");
-        args.push_back("-o");
-        args.push_back(fileName);
-        args.push_back(CDLFileName);
-        nidas::util::Process proc =
-            nidas::util::Process::spawn("ncgen", args);
-        int status;
-        char buf[512];
-        string errmsg;
-        for (;;) {
-            ssize_t l = read(proc.getErrFd(),buf,sizeof(buf));
-            if (l == 0) break;
-            if (l < 0) {
-                WLOG(("error reading nc_check error output: %m"));
-                break;
-            }
-            if (errmsg.length() < 1024) errmsg += string(buf, l);
+    // strings of char variables are padded to the last dimension
+    size_t slen = 1;
+    if (var.type == NC_CHAR && !var.dimids.empty())
+        slen = _dims[var.dimids.back()].len;
+    for (;;) {
+        Scanner::Kind kind = scan.next();
+        if (kind == Scanner::NAME && scan.token() == "_") {
+            if (var.type == NC_CHAR) var.text.append(slen, '\0');
+            else var.data.push_back(fill_value(var));
         }
-        proc.wait(true, &status);
-        if (WIFEXITED(status)) {
-            if (WEXITSTATUS(status))
-                WLOG(("ncgen exited with status=%d, err output=",
-                            WEXITSTATUS(status)) << errmsg);
-            else {
-                ILOG(("ncgen -o %s %s", fileName.c_str(),CDLFileName.c_str()));
-                res = 0;
-            }
-        } else if (WIFSIGNALED(status))
-            WLOG(("ncgen received signal=%d, err output=",
-                        WTERMSIG(status)) << errmsg);
+        else if (kind == Scanner::STRING && var.type == NC_CHAR) {
+            string str = scan.token();
+            if (slen > 0) str.resize(((str.size() + slen - 1) / slen) * slen);
+            var.text += str;
+        }
+        else if (kind == Scanner::NUMBER && var.type != NC_CHAR)
+            var.data.push_back(strtod(scan.token().c_str(), 0));
+        else throw scan.error("expected a value of " + var.name);
+        if (scan.is(";")) break;
+        scan.expect(",");
     }
-    catch(const nidas::util::IOException & e)
-    {
-        WLOG(("%s", e.what()));
+    scan.next();
+}
+
+double CDLSchema::fill_value(const Var& var) const
+{
+    for (unsigned int i = 0; i < var.atts.size(); i++)
+        if (var.atts[i].name == "_FillValue" && !var.atts[i].vals.empty())
+            return var.atts[i].vals[0];
+    switch (var.type) {
+    case NC_BYTE: return NC_FILL_BYTE;
+    case NC_SHORT: return NC_FILL_SHORT;
+    case NC_INT: return NC_FILL_INT;
+    case NC_FLOAT: return NC_FILL_FLOAT;
+    default: return NC_FILL_DOUBLE;
     }
-    return res;
 }
 
-void FileGroup::close_old_files(void) throw()
+int CDLSchema::create(const string& fileName) const
 {
-    NS_NcFile *f;
-    time_t now = time(0);
-    vector < Connection * >::iterator ic;
-    Connection *cp;
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+
+    int ncid;
+    int status = nc_create(fileName.c_str(), NC_CLOBBER, &ncid);
+    if (status != NC_NOERR) return status;
+
+    vector<int> dimids;
+    for (unsigned int i = 0; status == NC_NOERR && i < _dims.size(); i++) {
+        int dimid = -1;
+        status = nc_def_dim(ncid, _dims[i].name.c_str(), _dims[i].len, &dimid);
+        dimids.push_back(dimid);
+    }
+
+    vector<pair<int, const vector<Att>*> > atts;
+    atts.push_back(make_pair(NC_GLOBAL, &_globalAtts));
+
+    for (unsigned int i = 0; status == NC_NOERR && i < _vars.size(); i++) {
+        const Var& var = _vars[i];
+        vector<int> vdims;
+        for (unsigned int j = 0; j < var.dimids.size(); j++)
+            vdims.push_back(dimids[var.dimids[j]]);
+        int varid;
+        status = nc_def_var(ncid, var.name.c_str(), var.type, vdims.size(),
+                vdims.empty() ? 0 : &vdims.front(), &varid);
+        atts.push_back(make_pair(varid, &var.atts));
+    }
+
+    for (unsigned int i = 0; status == NC_NOERR && i < atts.size(); i++) {
+        int varid = atts[i].first;
+        const vector<Att>& vatts = *atts[i].second;
+        for (unsigned int j = 0; status == NC_NOERR && j < vatts.size(); j++) {
+            const Att& att = vatts[j];
+            if (att.type == NC_CHAR)
+                status = nc_put_att_text(ncid, varid, att.name.c_str(),
+                        att.text.size(), att.text.c_str());
+            else
+                status = nc_put_att_double(ncid, varid, att.name.c_str(),
+                        att.type, att.vals.size(), &att.vals.front());
+        }
+    }
 
-    list < NS_NcFile * >::iterator ni;
+    if (status == NC_NOERR) status = nc_enddef(ncid);
 
-    for (ni = _files.begin(); ni != _files.end();) {
-        f = *ni;
-        if (now - f->LastAccess() > FILEACCESSTIMEOUT) {
-            for (ic = _connections.begin(); ic < _connections.end(); ic++) {
-                cp = *ic;
-                if (cp->last_file() == f)
-                    cp->unset_last_file();
-                try {
-                    // write history
-                    f->put_history(cp->get_history());
-
-                    map<string,string>::const_iterator ai =  _globalAttrs.begin();
-                    for ( ; ai != _globalAttrs.end(); ++ai)
-                        f->write_global_attr(ai->first,ai->second);
-
-                    map<string,int>::const_iterator iai =  _globalIntAttrs.begin();
-                    for ( ; iai != _globalIntAttrs.end(); ++iai)
-                        f->write_global_attr(iai->first,iai->second);
-                }
-                catch(const nidas::util::Exception& e) {
-                    PLOG(("%s",e.what()));
-                }
+    for (unsigned int i = 0; status == NC_NOERR && i < _vars.size(); i++)
+        status = put_data(ncid, i, _vars[i]);
 
-            }
-            ni = _files.erase(ni);
-            delete f;
-        } else
-            ++ni;
-    }
+    int cstatus = nc_close(ncid);
+    if (status == NC_NOERR) status = cstatus;
+    if (status != NC_NOERR) ::unlink(fileName.c_str());
+    return status;
+}
+
+int CDLSchema::put_data(int ncid, int varid, const Var& var) const
+{
+    size_t nvals = var.type == NC_CHAR ? var.text.size() : var.data.size();
+    if (nvals == 0) return NC_NOERR;
+
+    vector<size_t> start(var.dimids.size(), 0);
+    vector<size_t> count;
+    size_t reclen = 1;
+    for (unsigned int i = 0; i < var.dimids.size(); i++) {
+        count.push_back(_dims[var.dimids[i]].len);
+        if (i > 0) reclen *= count[i];
+    }
+    if (!count.empty() && count[0] == NC_UNLIMITED)
+        count[0] = reclen > 0 ? (nvals + reclen - 1) / reclen : 0;
+    if (!count.empty()) reclen *= count[0];
+    if (reclen == 0) return NC_NOERR;
+
+    // ncgen pads short data with fill values, and ignores the excess
+    if (var.type == NC_CHAR) {
+        string text = var.text;
+        text.resize(reclen, '\0');
+        return nc_put_vara_text(ncid, varid, start.empty() ? 0 : &start.front(),
+                count.empty() ? 0 : &count.front(), text.c_str());
+    }
+    vector<double> data = var.data;
+    data.resize(reclen, fill_value(var));
+    return nc_put_vara_double(ncid, varid, start.empty() ? 0 : &start.front(),
+            count.empty() ? 0 : &count.front(), &data.front());
 }
 
-time_t FileGroup::oldest_file(void)
+void FileGroup::close_old_files(void) throw()
 {
-    NS_NcFile *f;
-    time_t lastaccess = time(0);
+    time_t now = time(0);
 
-    list < NS_NcFile * >::const_iterator ni;
+    map<double, NS_NcFile*>::iterator ni;
 
     for (ni = _files.begin(); ni != _files.end();) {
-        f = *ni;
-        if (f->LastAccess() < lastaccess)
-            lastaccess = f->LastAccess();
-        ++ni;
+        NS_NcFile *f = (ni++)->second;
+        if (now - f->LastAccess() > FILEACCESSTIMEOUT) close_file(f);
     }
-    return lastaccess;
 }
 
-void FileGroup::close_oldest_file(void) throw()
+void FileGroup::close_file(NS_NcFile* f) throw()
 {
-    NS_NcFile *f;
-    time_t lastaccess = time(0);
     vector < Connection * >::iterator ic;
     Connection *cp;
 
-    list < NS_NcFile * >::iterator ni, oldest;
-
-    oldest = _files.end();
-
-    for (ni = _files.begin(); ni != _files.end();) {
-        f = *ni;
-        if (f->LastAccess() < lastaccess) {
-            lastaccess = f->LastAccess();
-            oldest = ni;
-        }
-        ++ni;
-    }
-    if (oldest != _files.end()) {
-        f = *oldest;
+    try {
         for (ic = _connections.begin(); ic < _connections.end(); ic++) {
             cp = *ic;
-            if (cp->last_file() == f)
-                cp->unset_last_file();
-
-            try {
-                // write history
-                f->put_history(cp->get_history());
-
-                map<string,string>::const_iterator ai =  _globalAttrs.begin();
-                for ( ; ai != _globalAttrs.end(); ++ai)
-                    f->write_global_attr(ai->first,ai->second);
-
-                map<string,int>::const_iterator iai =  _globalIntAttrs.begin();
-                for ( ; iai != _globalIntAttrs.end(); ++iai)
-                    f->write_global_attr(iai->first,iai->second);
-            }
-            catch(const nidas::util::Exception& e) {
-                PLOG(("%s",e.what()));
-            }
+            // write history
+            f->put_history(cp->get_history());
         }
-        _files.erase(oldest);
-        delete f;
+        update_global_attrs(f);
+    }
+    catch(const nidas::util::Exception& e) {
+        PLOG(("%s",e.what()));
     }
+    map<double, NS_NcFile*>::iterator ni = _files.find(f->StartTime());
+    if (ni != _files.end() && ni->second == f) _files.erase(ni);
+    AllFiles::Instance()->file_closed(f);
+    // The connections still refer to it, in case the last of its
+    // records cannot be written.
+    delete f;
+    _ncloses++;
+    for (ic = _connections.begin(); ic < _connections.end(); ic++)
+        (*ic)->unset_file(f);
+}
+
+void FileGroup::report(MetricsReport& report) const
+{
+    string labels = MetricsReport::label("group", toString());
+    report.gauge("nc_server_group_open_files",
+                 "Open files of the file group", labels, _nopens - _ncloses);
+    report.counter("nc_server_file_opens_total", "Files opened", labels,
+                   _nopens);
+    report.counter("nc_server_file_closes_total", "Files closed", labels,
+                   _ncloses);
+    report.counter("nc_server_file_checks_total",
+                   "Existing files validated when opened", labels, _nchecks);
+    report.counter("nc_server_file_creates_total",
+                   "Files created from a CDL file",
+                   labels + ',' + MetricsReport::label("by", "schema"),
+                   _ncdlCreates);
+    report.counter("nc_server_file_creates_total",
+                   "Files created from a CDL file",
+                   labels + ',' + MetricsReport::label("by", "ncgen"),
+                   _nncgens);
+    report.histogram("nc_server_sync_seconds", "Time syncing a file",
+                     labels, _syncLatency);
 }
 
 int FileGroup::add_var_group(const struct datadef *dd)
@@ -1191,14 +3714,28 @@ int FileGroup::add_var_group(const struct datadef *dd)
     return _vargroupId++;
 }
 
+const VariableGroup* FileGroup::get_var_group(int id) const
+{
+    map<int,VariableGroup*>::const_iterator vi = _vargroups.find(id);
+    if (vi == _vargroups.end()) return 0;
+    return vi->second;
+}
+
+void FileGroup::get_var_groups(vector<VariableGroup*>& vgroups) const
+{
+    map<int,VariableGroup*>::const_iterator vi = _vargroups.begin();
+    for ( ; vi != _vargroups.end(); ++vi)
+        vgroups.push_back(vi->second);
+}
+
 void FileGroup::write_global_attr(const string& name, const string& value)
 {
     _globalAttrs[name] = value;
 
     // write global attribute to existing files
-    list < NS_NcFile * >::const_iterator ni;
+    map<double, NS_NcFile*>::const_iterator ni;
     for (ni = _files.begin(); ni != _files.end(); ni++) {
-        (*ni)->write_global_attr(name,value);
+        ni->second->write_global_attr(name,value);
     }
 }
 
@@ -1207,27 +3744,49 @@ void FileGroup::write_global_attr(const string& name, int value)
     _globalIntAttrs[name] = value;
 
     // write global attribute to existing files
-    list < NS_NcFile * >::const_iterator ni;
+    map<double, NS_NcFile*>::const_iterator ni;
     for (ni = _files.begin(); ni != _files.end(); ni++) {
-        (*ni)->write_global_attr(name,value);
+        ni->second->write_global_attr(name,value);
     }
 }
 
-void FileGroup::update_global_attrs()
+void FileGroup::write_global_attrs(const struct global_attrs* attrs)
 {
+    for (unsigned int i = 0; i < attrs->attrs.attrs_len; i++) {
+        const str_attr& attr = attrs->attrs.attrs_val[i];
+        _globalAttrs[attr.name] = attr.value;
+    }
+    for (unsigned int i = 0; i < attrs->intAttrs.intAttrs_len; i++) {
+        const int_attr& attr = attrs->intAttrs.intAttrs_val[i];
+        _globalIntAttrs[attr.name] = attr.value;
+    }
+
     // write global attributes to existing files
-    list < NS_NcFile * >::const_iterator ni;
+    map<double, NS_NcFile*>::const_iterator ni;
     for (ni = _files.begin(); ni != _files.end(); ni++) {
-        map<string,string>::const_iterator ai =  _globalAttrs.begin();
-        for ( ; ai != _globalAttrs.end(); ++ai)
-            (*ni)->write_global_attr(ai->first,ai->second);
-    
-        map<string,int>::const_iterator iai =  _globalIntAttrs.begin();
-        for ( ; iai != _globalIntAttrs.end(); ++iai)
-            (*ni)->write_global_attr(iai->first,iai->second);
+        ni->second->write_global_attrs(attrs);
     }
 }
 
+void FileGroup::update_global_attrs()
+{
+    // write global attributes to existing files
+    map<double, NS_NcFile*>::const_iterator ni;
+    for (ni = _files.begin(); ni != _files.end(); ni++)
+        update_global_attrs(ni->second);
+}
+
+void FileGroup::update_global_attrs(NS_NcFile* f)
+{
+    map<string,string>::const_iterator ai =  _globalAttrs.begin();
+    for ( ; ai != _globalAttrs.end(); ++ai)
+        f->write_global_attr(ai->first,ai->second);
+
+    map<string,int>::const_iterator iai =  _globalIntAttrs.begin();
+    for ( ; iai != _globalIntAttrs.end(); ++iai)
+        f->write_global_attr(iai->first,iai->second);
+}
+
 VariableGroup::VariableGroup(const struct datadef *dd, int id, double finterval):
     _name(),_interval(dd->interval),_vars(),_outvars(),
     _ndims(0),_dimsizes(), _dimnames(),
@@ -1507,6 +4066,20 @@ OutVariable::OutVariable(const Variable& v, NS_datatype dtype,
 
 const double NS_NcFile::minInterval = 1.e-5;
 
+unsigned int NS_NcFile::_recordBufferSize = 1;
+
+int NS_NcFile::_recordBufferAge = 10;
+
+bool NS_NcFile::_noFillMode = false;
+
+size_t NS_NcFile::_headerFree = 0;
+
+size_t NS_NcFile::_varAlign = 4;
+
+bool NS_NcFile::_stageGroups = false;
+
+std::atomic<int> NS_NcFile::_syncInterval{NS_NcFile::SYNC_CHECK_INTERVAL_SECS};
+
 NS_NcFile::NS_NcFile(const string & fileName, enum FileMode openmode,
         double interval, double fileLength,
         const UTime& basetime, const UTime& endtime):
@@ -1518,12 +4091,19 @@ NS_NcFile::NS_NcFile(const string & fileName, enum FileMode openmode,
     _baseTimeVar(0),_timeOffsetVar(0),_vars(),_recdim(0),
     _baseTime(0),_nrecs(0),_dimNames(0),_dimSizes(),_dimIndices(),
     _ndims(0),_dims(),_ndims_req(0),_lastAccess(0),_lastSync(0),
-    _historyHeader(),_countsNamesByVGId()
+    _historyHeader(),_textAttrs(),_intAttrs(),_dirtyAttrs(),_historyLines(),
+    _countsNamesByVGId(),
+    _recordBlocks(),_timeBlock(),_timeBlockStart(0),_bufferTime(0),
+    _noFill(false),_fillFrom(0),_nvarsAtOpen(0),_writtenRecs(),
+    _recordFills(),_fillVarIds(),_nvarsChecked(0),
+    _group(0),_lruPrev(0),_lruNext(0)
 {
 
     if (!is_valid())
         throw NetCDFAccessFailed(getName(),"open",get_error_string());
 
+    load_attrs();
+
     if (_interval < minInterval)
         _ttType = VARIABLE_DELTAT;
 
@@ -1642,6 +4222,8 @@ NS_NcFile::NS_NcFile(const string & fileName, enum FileMode openmode,
         }
     }
 
+    commit_schema();
+
     /* Write base time */
     if (!_baseTimeVar->put(&_baseTime, &_nrecs))
         throw NetCDFAccessFailed(getName(),
@@ -1654,11 +4236,7 @@ NS_NcFile::NS_NcFile(const string & fileName, enum FileMode openmode,
     // Write Creation/Update time in global history attribute
     //
 
-    // Remember: this history attribute is not deleted on file close!
-    // If you throw an exception between here and the end of the
-    // constructor, remember to delete historyAtt first.
-
-    auto historyAtt = get_att_unique(this, "history");
+    bool hasHistory = _textAttrs.find("history") != _textAttrs.end();
     //
     // If history doesn't exist, add a Created message.
     // Otherwise don't add an Updated message unless the user
@@ -1667,7 +4245,7 @@ NS_NcFile::NS_NcFile(const string & fileName, enum FileMode openmode,
     // frequently to add data, and we don't want a history record
     // every time.
     //
-    if (!historyAtt) {
+    if (!hasHistory) {
         string tmphist =
             nidas::util::UTime(_lastAccess).format(true, "Created: %F %T %z\n");
         put_history(tmphist);
@@ -1681,17 +4259,44 @@ NS_NcFile::NS_NcFile(const string & fileName, enum FileMode openmode,
 
     _startTime = _baseTime;
     _endTime = endtime.toDoubleSecs();
+
+    // The header and base_time are written in fill mode, NC_NOFILL only
+    // applies to the records and the variables added from now on.
+    if (_noFillMode) {
+        if (!set_fill(NoFill))
+            throw NetCDFAccessFailed(getName(),"set_fill",get_error_string());
+        _noFill = true;
+        _fillFrom = _recdim->size();
+        _nvarsAtOpen = num_vars();
+    }
 }
 
 NS_NcFile::~NS_NcFile(void)
 {
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
     ILOG(("Closing: %s", _fileName.c_str()));
+    bool complete = true;
+    try {
+        flush_attrs();
+        flush_records();
+        fill_gaps();
+    }
+    catch (const NetCDFAccessFailed& e) {
+        PLOG(("%s",e.what()));
+        if (_group) _group->write_failed(this, e.what());
+        complete = false;
+    }
     map<int,vector<NS_NcVar*> >::iterator vi = _vars.begin();
     for ( ; vi != _vars.end(); ++vi) {
         vector<NS_NcVar*>& vars = vi->second;
         for (unsigned int j = 0; j < vars.size(); j++)
             delete vars[j];
     }
+    // Close it here rather than in ~NcFile(), with the library
+    // locked.  ~NcFile() does nothing if closed.
+    // A file cleanly closed here doesn't need checking when reopened,
+    // unless its records or fill values may not all have been written.
+    if (NcFile::close() && complete) checked_files.insert(_fileName);
 }
 
 const string & NS_NcFile::getName() const
@@ -1701,8 +4306,26 @@ const string & NS_NcFile::getName() const
 
 NcBool NS_NcFile::sync() throw()
 {
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+    bool complete = true;
+    try {
+        flush_attrs();
+        commit_schema();
+        flush_records();
+        fill_gaps();
+    }
+    catch (const NetCDFAccessFailed& e) {
+        PLOG(("%s",e.what()));
+        if (_group) _group->write_failed(this, e.what());
+        complete = false;
+    }
     _lastSync = time(0);
+    LatencyHistogram::clock::time_point t0 = LatencyHistogram::clock::now();
     NcBool res = NcFile::sync();
+    if (_group)
+        _group->file_synced(this, res && complete,
+                            LatencyHistogram::clock::now() - t0);
+    Trace::probe(Trace::SYNC);
     if (!res)
         PLOG(("%s: sync: %s",
                     getName().c_str(),
@@ -1711,6 +4334,11 @@ NcBool NS_NcFile::sync() throw()
     return res;
 }
 
+void NS_NcFile::flush_old_records() throw()
+{
+    if (_bufferTime && time(0) - _bufferTime >= _recordBufferAge) sync();
+}
+
 std::string NS_NcFile::getCountsName(VariableGroup * vgroup)
 {
     return _countsNamesByVGId[vgroup->getId()];
@@ -1754,7 +4382,8 @@ bool NS_NcFile::checkCountsVariableName(const string& name,VariableGroup * vgrou
         // Check the dimensions. We're not being picky about the type.
         if (!check_var_dims(ncv)) return false;
     }
-    const vector<NS_NcVar*>& gvars = get_vars(vgroup);
+    // called by define_vars(), after the group has been added
+    const vector<NS_NcVar*>& gvars = _vars[vgroup->getId()];
 
     // loop over all variables in the file
     for (int i = 0; i < num_vars(); i++) {
@@ -1794,7 +4423,48 @@ const vector<NS_NcVar*>& NS_NcFile::get_vars(VariableGroup * vgroup)
 
     // variables have been initialzed for this VariableGroup and file.
     map<int,vector<NS_NcVar*> >::iterator vi = _vars.find(groupid);
-    if (vi != _vars.end()) return vi->second;
+    if (vi != _vars.end()) {
+        // global attributes may have been added since
+        commit_schema();
+        return vi->second;
+    }
+
+    bool doSync = define_vars(vgroup);
+
+    // Stage the variables of the other groups known so far, so they
+    // are added to the file in the same define mode session, rather
+    // than one session, and possibly a move of the data, per group.
+    if (_stageGroups && _group) {
+        vector<VariableGroup*> vgroups;
+        _group->get_var_groups(vgroups);
+        for (unsigned int i = 0; i < vgroups.size(); i++) {
+            VariableGroup* vg = vgroups[i];
+            if (_vars.find(vg->getId()) != _vars.end()) continue;
+            try {
+                if (define_vars(vg)) doSync = true;
+            }
+            catch (const NetCDFAccessFailed& e) {
+                // leave it to be defined when it has data
+                WLOG(("%s", e.what()));
+                vector<NS_NcVar*>& vars = _vars[vg->getId()];
+                for (unsigned int j = 0; j < vars.size(); j++)
+                    delete vars[j];
+                _vars.erase(vg->getId());
+            }
+        }
+    }
+    commit_schema();
+
+    if (doSync && time(0) - _lastSync > _syncInterval) sync();
+
+    VLOG(("get_vars done"));
+    return _vars[groupid];
+}
+
+bool NS_NcFile::define_vars(VariableGroup * vgroup)
+{
+    int groupid = vgroup->getId();
+    if (_vars.find(groupid) != _vars.end()) return false;
 
     _ndims_req = vgroup->num_dims();
 
@@ -1907,11 +4577,23 @@ const vector<NS_NcVar*>& NS_NcFile::get_vars(VariableGroup * vgroup)
         if (!vars[iv]) vars[iv] = add_var(ov,doSync);
         if (add_attrs(ov,vars[iv],cntsName)) doSync = true;
     }
+    return doSync;
+}
+
+void NS_NcFile::define_var_group(VariableGroup* vgroup)
+{
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+    define_vars(vgroup);
+}
 
-    if (doSync && time(0) - _lastSync > SYNC_CHECK_INTERVAL_SECS) sync();
+void NS_NcFile::commit_schema()
+{
+    if (!in_define_mode) return;
 
-    VLOG(("get_vars done"));
-    return vars;
+    int status = nc__enddef(the_id, _headerFree, _varAlign, 0, 4);
+    if (status != NC_NOERR)
+        throw NetCDFAccessFailed(getName(),"nc__enddef",nc_strerror(status));
+    in_define_mode = 0;
 }
 
 NS_NcVar *NS_NcFile::add_var(OutVariable* ov, bool& modified)
@@ -2116,7 +4798,6 @@ NcVar *NS_NcFile::find_var(OutVariable* ov)
 
 long NS_NcFile::put_time(double timeoffset)
 {
-    float floatOffset;
     long nrec;
 
     /*
@@ -2164,27 +4845,24 @@ long NS_NcFile::put_time(double timeoffset)
     }
 #endif
 
-    // Write time to previous records and the current record
+    // Compute the times of the previous records and the current record.
+    // After a gap they are all written with one put by flush_times(),
+    // and the data variables of the skipped records are left to the
+    // fill mode of the file.
+    if (_nrecs <= nrec) {
+        if (_timeBlock.empty()) _timeBlockStart = _nrecs;
+        _timeBlock.reserve(_timeBlock.size() + nrec - _nrecs + 1);
+    }
     for (; _nrecs <= nrec; _nrecs++) {
         if (_ttType == VARIABLE_DELTAT)
             _timeOffset = timeoffset;
         else
             _timeOffset += _interval;
-        int i = 0;
-        switch (_timeOffsetType) {
-        case ncFloat:
-            floatOffset = _timeOffset;
-            i = _timeOffsetVar->put_rec(&floatOffset, _nrecs);
-            break;
-        case ncDouble:
-            i = _timeOffsetVar->put_rec(&_timeOffset, _nrecs);
-            break;
-        default:
-            break;
-        }
-        if (!i)
-            throw NetCDFAccessFailed(getName(),string("put_rec ") + _timeOffsetVar->name(),get_error_string());
+        _timeBlock.push_back(_timeOffset);
     }
+    // If records are buffered, flush_records() writes the times.
+    if (_recordBufferSize <= 1) flush_times();
+
     VLOG(("after fill timeoffset = %f, timeOffset=%f,nrec=%d, "
           "_nrecs=%d,interval=%f",
           (double)timeoffset, (double)_timeOffset, nrec,
@@ -2201,21 +4879,257 @@ long NS_NcFile::put_time(double timeoffset)
     return nrec;
 }
 
+void NS_NcFile::flush_times()
+{
+    if (_timeBlock.empty()) return;
+
+    int i = 0;
+    long n = _timeBlock.size();
+    _timeOffsetVar->set_cur(_timeBlockStart);
+    switch (_timeOffsetType) {
+    case ncFloat:
+        {
+            vector<float> floatOffsets(_timeBlock.begin(), _timeBlock.end());
+            i = _timeOffsetVar->put(&floatOffsets.front(), n);
+        }
+        break;
+    case ncDouble:
+        i = _timeOffsetVar->put(&_timeBlock.front(), n);
+        break;
+    default:
+        break;
+    }
+    _timeBlock.clear();
+    if (!i)
+        throw NetCDFAccessFailed(getName(),string("put ") + _timeOffsetVar->name(),get_error_string());
+}
+
+bool NS_NcFile::RecordBlock::follows(long nrec1, int nstart,
+        const long* start1, const long* count1, bool hasCnts1) const
+{
+    if (nrec1 != nrec + nrecs || hasCnts1 != hasCnts ||
+            nstart != (int)start.size())
+        return false;
+    for (int i = 0; i < nstart; i++)
+        if (start1[i] != start[i] || count1[i] != count[i]) return false;
+    return true;
+}
+
+void NS_NcFile::flush_records()
+{
+    commit_schema();
+    flush_times();
+
+    map<int,RecordBlock>::iterator bi = _recordBlocks.begin();
+    for ( ; bi != _recordBlocks.end(); ++bi) {
+        RecordBlock& block = bi->second;
+        if (block.nrecs == 0) continue;
+        const vector<NS_NcVar*>& vars = _vars[bi->first];
+        VLOG(("%s: writing %ld records of variable group %d, starting at %ld",
+              getName().c_str(), block.nrecs, bi->first, block.nrec));
+        for (unsigned int iv = 0; iv < vars.size(); iv++) {
+            NS_NcVar* var = vars[iv];
+            int i = 1;
+            var->set_cur(block.nrec, 0, block.start.data());
+            if (_noFill && (!block.fvals[iv].empty() || !block.ivals[iv].empty()))
+                track_put(var, block.nrec, block.nrecs, block.count.data());
+            if (!block.fvals[iv].empty())
+                i = var->put_recs(block.fvals[iv].data(), block.nrecs,
+                                  block.count.data());
+            else if (!block.ivals[iv].empty())
+                i = var->put_recs(block.ivals[iv].data(), block.nrecs,
+                                  block.count.data());
+            if (!i) {
+                NetCDFAccessFailed e(getName(),string("put_var ") + var->name(),get_error_string());
+                // don't try to write them again, but tell the writers
+                clear_records();
+                if (_group) _group->write_failed(this, e.what());
+                throw e;
+            }
+        }
+        block.nrecs = 0;
+    }
+    _bufferTime = 0;
+}
+
+namespace {
+/**
+ * Add [first, end) to a map of ranges, merging it with the ranges it
+ * overlaps or touches.  Usually it extends the last one.
+ */
+void add_range(map<long,long>& ranges, long first, long end)
+{
+    map<long,long>::iterator ri = ranges.upper_bound(first);
+    if (ri != ranges.begin()) {
+        map<long,long>::iterator prev = ri;
+        --prev;
+        if (prev->second >= first) {
+            first = prev->first;
+            end = std::max(end, prev->second);
+            ri = prev;
+        }
+    }
+    while (ri != ranges.end() && ri->first <= end) {
+        end = std::max(end, ri->second);
+        ranges.erase(ri++);
+    }
+    ranges[first] = end;
+}
+}
+
+void NS_NcFile::track_put(NS_NcVar* var, long nrec, long nrecs,
+        const long* count)
+{
+    int varid = var->var()->id();
+    var->put_len(count);
+    if (!var->whole_records()) {
+        // Records which are partly written, such as one sample of
+        // several, are filled first, as libnetcdf would have done.
+        fill_unwritten(varid, nrec, nrec + nrecs);
+        return;
+    }
+    add_range(_writtenRecs[varid], nrec, nrec + nrecs);
+}
+
+void NS_NcFile::fill_unwritten(int varid, long first, long end)
+{
+    // records in the file when it was opened are already filled
+    if (varid < _nvarsAtOpen) first = std::max(first, _fillFrom);
+    if (first >= end) return;
+
+    map<long,long>& written = _writtenRecs[varid];
+    long rec = first;
+    map<long,long>::const_iterator wi = written.begin();
+    for ( ; rec < end; ++wi) {
+        long gapEnd = end;
+        if (wi != written.end()) gapEnd = std::min(wi->first, end);
+        if (gapEnd > rec) {
+            const RecordFill& rf = record_fill(varid);
+            size_t esize = rf.esize;
+            size_t nvals = rf.nvals;
+            size_t start[NC_MAX_VAR_DIMS];
+            size_t count[NC_MAX_VAR_DIMS];
+            for (int k = 1; k < rf.ndims; k++) {
+                start[k] = 0;
+                count[k] = rf.count[k];
+            }
+
+            // write fill values in chunks of about a megabyte
+            long nrecChunk = std::max(1L, (long)((1 << 20) / (nvals * esize)));
+            nrecChunk = std::min(nrecChunk, gapEnd - rec);
+            vector<char> buf(nrecChunk * nvals * esize);
+            for (size_t i = 0; i < buf.size(); i += esize)
+                ::memcpy(&buf[i], &rf.fill.front(), esize);
+            VLOG(("%s: filling records %ld to %ld of variable %d",
+                  getName().c_str(), rec, gapEnd - 1, varid));
+            for ( ; rec < gapEnd; rec += count[0]) {
+                start[0] = rec;
+                count[0] = std::min(nrecChunk, gapEnd - rec);
+                int status = nc_put_vara(id(), varid, start, count, &buf.front());
+                if (status != NC_NOERR)
+                    throw NetCDFAccessFailed(getName(),"fill_unwritten",nc_strerror(status));
+            }
+        }
+        if (wi == written.end()) break;
+        rec = std::max(rec, wi->second);
+    }
+
+    add_range(written, first, end);
+}
+
+const NS_NcFile::RecordFill& NS_NcFile::record_fill(int varid)
+{
+    map<int, RecordFill>::const_iterator ri = _recordFills.find(varid);
+    if (ri != _recordFills.end()) return ri->second;
+
+    int ncid = id();
+    RecordFill rf;
+    nc_type xtype;
+    int dimids[NC_MAX_VAR_DIMS];
+    int status = nc_inq_var(ncid, varid, 0, &xtype, &rf.ndims, dimids, 0);
+    if (status == NC_NOERR)
+        status = nc_inq_type(ncid, xtype, 0, &rf.esize);
+    if (status == NC_NOERR) rf.count.resize(rf.ndims);
+    for (int k = 1; status == NC_NOERR && k < rf.ndims; k++) {
+        status = nc_inq_dimlen(ncid, dimids[k], &rf.count[k]);
+        rf.nvals *= rf.count[k];
+    }
+    if (status == NC_NOERR) {
+        rf.fill.resize(rf.esize);
+        int nofill;
+        status = nc_inq_var_fill(ncid, varid, &nofill, &rf.fill.front());
+    }
+    if (status != NC_NOERR)
+        throw NetCDFAccessFailed(getName(),"record_fill",nc_strerror(status));
+    return _recordFills[varid] = rf;
+}
+
+void NS_NcFile::fill_gaps()
+{
+    if (!_noFill) return;
+
+    int ncid = id();
+    int nvars = 0;
+    int status = nc_inq_nvars(ncid, &nvars);
+    if (status != NC_NOERR)
+        throw NetCDFAccessFailed(getName(),"fill_gaps",nc_strerror(status));
+
+    // Only the variables added since the last call are inquired.
+    // This covers all record variables, including those in the file
+    // which are not in any VariableGroup, since libnetcdf no longer
+    // fills them when records are added.
+    if (nvars > _nvarsChecked) {
+        int unlimid = -1;
+        status = nc_inq_unlimdim(ncid, &unlimid);
+        if (status != NC_NOERR)
+            throw NetCDFAccessFailed(getName(),"fill_gaps",nc_strerror(status));
+        int timeid = _timeOffsetVar->id();
+        for (int varid = _nvarsChecked; varid < nvars; varid++) {
+            // all times up to the last record are written by put_time()
+            if (varid == timeid) continue;
+            int ndims;
+            int dimids[NC_MAX_VAR_DIMS];
+            status = nc_inq_var(ncid, varid, 0, 0, &ndims, dimids, 0);
+            if (status != NC_NOERR)
+                throw NetCDFAccessFailed(getName(),"fill_gaps",nc_strerror(status));
+            if (ndims > 0 && dimids[0] == unlimid) _fillVarIds.push_back(varid);
+        }
+        _nvarsChecked = nvars;
+    }
+
+    long nrecs = _recdim->size();
+    for (unsigned int i = 0; i < _fillVarIds.size(); i++)
+        fill_unwritten(_fillVarIds[i], 0, nrecs);
+}
+
+void NS_NcFile::clear_records()
+{
+    map<int,RecordBlock>::iterator bi = _recordBlocks.begin();
+    for ( ; bi != _recordBlocks.end(); ++bi)
+        bi->second.nrecs = 0;
+    _timeBlock.clear();
+    _bufferTime = 0;
+}
+
 void NS_NcFile::put_history(string val)
 {
     if (val.length() == 0) return;
 
-    string history;
+    string& history = _textAttrs["history"];
+    VLOG(("history=%.40s", history.c_str()));
 
-    auto historyAtt{get_att_unique(this, "history")};
-    if (historyAtt) {
-        history = att_as_string(historyAtt);
-        VLOG(("history=%.40s", history.c_str()));
+    string::size_type i1, i2;
+    if (_historyLines.empty()) {
+        for (i1 = 0; i1 < history.length(); i1 = i2) {
+            i2 = history.find('\n', i1);
+            if (i2 == string::npos) i2 = history.length();
+            else i2++;
+            _historyLines.insert(history.substr(i1, i2 - i1));
+        }
     }
 
-    string::size_type i1, i2 = 0;
-
-    // check \n repeated records in h and history
+    // skip the lines of val which are already in history
+    string newval;
     for (i1 = 0; i1 < val.length(); i1 = i2) {
 
         i2 = val.find('\n', i1);
@@ -2224,59 +5138,117 @@ void NS_NcFile::put_history(string val)
         else
             i2++;
 
-        if (history.find(val.substr(i1, i2 - i1)) != string::npos) {
-            // match of a line in val with the existing history
-            val = val.substr(0, i1) + val.substr(i2);
-            i2 = i1;
-        }
+        string line = val.substr(i1, i2 - i1);
+        if (_historyLines.find(line) == _historyLines.end())
+            newval += line;
     }
 
-    if (val.length() > 0) {
-        history += _historyHeader + val;
-        write_global_attr("history",history);
+    if (newval.length() > 0) {
+        val = _historyHeader + newval;
+        for (i1 = 0; i1 < val.length(); i1 = i2) {
+            i2 = val.find('\n', i1);
+            if (i2 == string::npos) i2 = val.length();
+            else i2++;
+            _historyLines.insert(val.substr(i1, i2 - i1));
+        }
+        write_global_attr("history", history + val);
     }
 
     VLOG(("NS_NcFile::put_history"));
 }
 
-void NS_NcFile::write_global_attr(const string& name, const string& value)
+void NS_NcFile::load_attrs()
 {
-    bool needsUpdate = true;
-    auto att{get_att_unique(this, name)};
-    if (att) {
-        needsUpdate = att_as_string(att) != value;
+    for (int i = 0; i < num_atts(); i++) {
+        std::unique_ptr<NcAtt> att(NcFile::get_att(i));
+        if (!att) continue;
+        if (att->type() == ncChar)
+            _textAttrs[att->name()] = att_as_string(att);
+        else if (att->type() == ncInt && att->num_vals() == 1)
+            _intAttrs[att->name()] = att->as_int(0);
     }
-    if (needsUpdate) {
-        if (!add_att(name, value))
+}
+
+bool NS_NcFile::set_global_attr(const string& name, const string& value)
+{
+    map<string, string>::iterator ai = _textAttrs.find(name);
+    if (ai != _textAttrs.end() && ai->second == value) return false;
+    _textAttrs[name] = value;
+    _intAttrs.erase(name);
+    _dirtyAttrs.insert(name);
+    return true;
+}
+
+bool NS_NcFile::set_global_attr(const string& name, int value)
+{
+    map<string, int>::iterator ai = _intAttrs.find(name);
+    if (ai != _intAttrs.end() && ai->second == value) return false;
+    _intAttrs[name] = value;
+    _textAttrs.erase(name);
+    _dirtyAttrs.insert(name);
+    return true;
+}
+
+void NS_NcFile::flush_attrs()
+{
+    set<string>::iterator di = _dirtyAttrs.begin();
+    for ( ; di != _dirtyAttrs.end(); ) {
+        const string& name = *di;
+        map<string, string>::const_iterator ai = _textAttrs.find(name);
+        NcBool ok;
+        if (ai != _textAttrs.end()) ok = add_att(name, ai->second);
+        else ok = add_att(name, _intAttrs[name]);
+        if (!ok)
             throw NetCDFAccessFailed(getName(),string("add_att ") + name,get_error_string());
+        _dirtyAttrs.erase(di++);
+    }
+}
+
+void NS_NcFile::write_global_attr(const string& name, const string& value)
+{
+    if (set_global_attr(name, value)) {
         _lastAccess = time(0);
         VLOG(("%s: NS_NcFile::write_global_attr %s, syncing",
               getName().c_str(),name.c_str()));
-        if (time(0) - _lastSync > SYNC_CHECK_INTERVAL_SECS) sync();
+        if (time(0) - _lastSync > _syncInterval) sync();
     }
 
     VLOG(("NS_NcFile::write_global_attr"));
-
 }
 
 void NS_NcFile::write_global_attr(const string& name, int value)
 {
-    bool needsUpdate = true;
-    auto att = get_att_unique(this, name);
-    if (att) {
-        if (att->type() == ncInt && att->num_vals() == 1)
-            needsUpdate = value != att->as_int(0);
-    }
-    if (needsUpdate) {
-        if (!add_att(name, value))
-            throw NetCDFAccessFailed(getName(),string("add_att ") + name,get_error_string());
+    if (set_global_attr(name, value)) {
         _lastAccess = time(0);
         VLOG(("%s: NS_NcFile::write_global_attr %s, syncing",
               getName().c_str(),name.c_str()));
-        if (time(0) - _lastSync > SYNC_CHECK_INTERVAL_SECS) sync();
+        if (time(0) - _lastSync > _syncInterval) sync();
+    }
+
+    VLOG(("NS_NcFile::write_global_attr"));
+}
+
+void NS_NcFile::write_global_attrs(const struct global_attrs* attrs)
+{
+    // The changed attributes are added to the file together by
+    // flush_attrs() on the next sync, so the header is rewritten
+    // once for all of them.
+    bool modified = false;
+    for (unsigned int i = 0; i < attrs->attrs.attrs_len; i++) {
+        const str_attr& attr = attrs->attrs.attrs_val[i];
+        if (set_global_attr(attr.name, attr.value)) modified = true;
+    }
+    for (unsigned int i = 0; i < attrs->intAttrs.intAttrs_len; i++) {
+        const int_attr& attr = attrs->intAttrs.intAttrs_val[i];
+        if (set_global_attr(attr.name, attr.value)) modified = true;
+    }
+    if (modified) {
+        _lastAccess = time(0);
+        VLOG(("%s: NS_NcFile::write_global_attrs, %u attributes",
+              getName().c_str(),
+              attrs->attrs.attrs_len + attrs->intAttrs.intAttrs_len));
+        if (time(0) - _lastSync > _syncInterval) sync();
     }
-
-    VLOG(("NS_NcFile::write_global_attr"));
 }
 
 bool NS_NcFile::check_var_dims(NcVar * var)
@@ -2473,8 +5445,8 @@ NS_NcVar::NS_NcVar(NcVar * var, int *dimIndices, int ndimIndices, float ffill, i
 {
     int i;
     _dimIndices = new int[_ndimIndices];
-    _start = new long[_ndimIndices];
-    _count = new long[_ndimIndices];
+    _start = new long[_ndimIndices]();
+    _count = new long[_ndimIndices]();
     for (i = 0; i < _ndimIndices; i++)
         _dimIndices[i] = dimIndices[i];
 }
@@ -2568,6 +5540,43 @@ int NS_NcVar::put(const int * d, const long *counts)
     return (_var->put(d, _count) ? nout : 0);
 }
 
+int NS_NcVar::put_recs(const float *d, long nrecs, const long *counts)
+{
+    int nout = put_len(counts);
+    _count[0] = nrecs;
+    // type conversion of one data value per record
+    if (nout == 1 && _var->type() == ncLong) {
+        vector<int> dl(nrecs);
+        for (long i = 0; i < nrecs; i++) {
+            if (d[i] == _floatFill) dl[i] = _intFill;
+            else dl[i] = (int) d[i];
+        }
+        return (_var->put(&dl.front(), _count) ? nout * nrecs : 0);
+    }
+    return (_var->put(d, _count) ? nout * nrecs : 0);
+}
+
+int NS_NcVar::put_recs(const int * d, long nrecs, const long *counts)
+{
+    int nout = put_len(counts);
+    _count[0] = nrecs;
+    if (nout == 1 && _var->type() == ncFloat) {
+        vector<float> df(d, d + nrecs);
+        return (_var->put(&df.front(), _count) ? nout * nrecs : 0);
+    }
+    return (_var->put(d, _count) ? nout * nrecs : 0);
+}
+
+bool NS_NcVar::whole_records() const
+{
+    int ndims = _var->num_dims();
+    for (int k = 1; k < ndims; k++) {
+        if (_start[k] != 0 || _count[k] != _var->get_dim(k)->size())
+            return false;
+    }
+    return true;
+}
+
 int NS_NcVar::put_len(const long *counts)
 {
     int i, j, k;
@@ -2593,6 +5602,23 @@ NcServerApp::NcServerApp():
     _daemon(true),_logConfig(defaultLogConfig),
     _rpcport(DEFAULT_RPC_PORT),
     _standalone(false),
+    _nthreads(0),
+    _writeBehindLength(0),
+    _recordBufferSize(1),
+    _recordBufferAge(10),
+    _noFill(false),
+    _headerFree(0),
+    _varAlign(4),
+    _stageGroups(false),
+    _precreateLead(0),
+    _maxOpenFiles(0),
+    _metricsFile(),
+    _metricsInterval(60),
+    _traceEvents(0),
+    _slowMsecs(0),
+    _captureFile(),
+    _journalFile(),
+    _checkpointSecs(300),
     _transp(0)
 {
 }
@@ -2612,19 +5638,65 @@ void NcServerApp::usage(const char *argv0)
         nc_server is part of the nc_server package.\n" << 
         "******************************************************************\n" << endl;
 
-    cerr << "Usage: " << argv0 << " [-d] [-l loglevel] [-u username] [ -g groupname -g ... ] [-z]\n\
+    cerr << "Usage: " << argv0 << " [-d] [-l loglevel] [-b nrecs] [-a secs] [-c secs] [-f maxfiles] [-G] [-H bytes] [-j file] [-J secs] [-m file] [-M secs] [-n] [-R file] [-S msecs] [-T nevents] [-t nthreads] [-u username] [-V bytes] [-w queuelen] [ -g groupname -g ... ] [-z]\n\
+        -a secs: maximum age of the records in the record buffer, default 10\n\
+        -b nrecs: buffer up to nrecs consecutive time records of each variable group\n\
+        in memory, and write each variable over the whole time range at once. Buffered\n\
+        records are written when nrecs are buffered, the oldest is -a secs old, or the\n\
+        file is synced or closed. Default 1: records are written as they are received\n\
+        -c secs: create the next file of each file group in a background thread\n\
+        when the data is within secs of the end of the current file, so the files\n\
+        are ready at rollover. Should be less than 900, when idle files are closed.\n\
+        Default 0: files are created when the first record for them is received\n\
         -d: debug, run in foreground and send messages to stderr with log level of debug\n\
         Otherwise run in the background, cd to /, and log messages to syslog\n\
         Specify a -l option after -d to change the log level from debug\n\
+        -f maxfiles: maximum number of netCDF files open at once. The least recently\n\
+        used file is closed when more are opened. The RLIMIT_NOFILE soft limit is\n\
+        raised if needed. Default: 16\n\
+        -G: when a variable group is first written to a file, add the variables of\n\
+        all the groups of the file group in the same define mode session. Groups\n\
+        without data for the file are then filled. Default: add each group when it\n\
+        is first written to the file\n\
+        -H bytes: leave bytes of free space after the header of the netCDF files,\n\
+        so that variables and attributes can be added later without moving the data\n\
+        in the file. Default 0\n\
+        -j file: journal the requests which write to the files to file, and sync\n\
+        the files every -J secs instead of every " << NS_NcFile::SYNC_CHECK_INTERVAL_SECS << " secs. The requests in the journal\n\
+        of a server which did not shut down cleanly are written to the files on startup\n\
+        -J secs: interval for syncing the files when journaling, default 300\n\
         -l config: 7=debug,6=info,5=notice,4=warning,3=err,...\n\
         The default config if no -d option is " << defaultLogConfig << "\n\
+        -m file: write statistics of the connections and file groups to file\n\
+        every -M secs, in the Prometheus text format. They can also be queried\n\
+        with nc_stats\n\
+        -M secs: interval for writing the -m statistics file, default 60\n\
+        -n: open files in NC_NOFILL mode. Records which are not written are filled\n\
+        when files are synced and closed, instead of filling all records as they are added.\n\
+        If nc_server crashes, the records skipped since the last sync hold whatever was on\n\
+        the disk, not fill values\n\
         -p port: port number, default " << DEFAULT_RPC_PORT << "\n\
+        -R file: capture the requests which write to the files to file, for\n\
+        replay with nc_replay\n\
         -s: standalone instance, do not register, print port number to stdout\n\
+        -S msecs: log the time spent in each stage of requests which take longer\n\
+        than msecs. Enables tracing, with rings of 1024 events if -T is not given\n\
+        -T nevents: trace the stages of each request in a ring of nevents for each\n\
+        thread. The rings are logged on SIGUSR1, and printed by nc_stats -t\n\
+        -t nthreads: decode and execute RPC requests in a pool of nthreads threads.\n\
+        Writes are serialized per file group, so clients writing to different\n\
+        file groups do not wait for each other, except for the netCDF library\n\
+        calls, which are made one at a time. Default 0: single-threaded\n\
         -u name: change user id of the process to given user name and their default group\n\
         after opening RPC portmap socket\n\
         -g name: add name to the list of supplementary group ids of the process.\n\
         More than one -g option can be specified so that the process can belong to more\n\
         than one group, if necessary, for write permissions on multiple directories\n\
+        -V bytes: align the start of the data in the netCDF files on bytes, default 4\n\
+        -w queuelen: write behind. Data records are checked and put in a queue\n\
+        of length queuelen for each connection, and the RPC call returns before the\n\
+        records are written. Write errors are returned by later calls. Default 0:\n\
+        records are written before the call returns\n\
         -z: run in background as a daemon. Either the -d or -z options must be specified" << endl;
 }
 
@@ -2632,13 +5704,44 @@ int NcServerApp::parseRunstring(int argc, char **argv)
 {
     int c;
     int daemonOrforeground = -1;
-    while ((c = getopt(argc, argv, "dl:g:sp:u:vz")) != -1) {
+    while ((c = getopt(argc, argv, "a:b:c:df:GH:j:J:l:g:m:M:np:R:sS:t:T:u:vV:w:z")) != -1) {
         switch (c) {
+        case 'a':
+            _recordBufferAge = atoi(optarg);
+            if (_recordBufferAge < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            {
+                int n = atoi(optarg);
+                if (n < 1) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                _recordBufferSize = n;
+            }
+            break;
+        case 'c':
+            _precreateLead = atoi(optarg);
+            if (_precreateLead < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
         case 'd':
             daemonOrforeground = 0;
             _daemon = false;
             _logConfig = "debug";
             break;
+        case 'f':
+            _maxOpenFiles = atoi(optarg);
+            if (_maxOpenFiles < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
         case 'g':
             {
                 struct group groupinfo;
@@ -2659,15 +5762,72 @@ int NcServerApp::parseRunstring(int argc, char **argv)
                 _suppGroupNames.push_back(optarg);
             }
             break;
+        case 'G':
+            _stageGroups = true;
+            break;
+        case 'H':
+            _headerFree = atoi(optarg);
+            if (_headerFree < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'j':
+            _journalFile = optarg;
+            break;
+        case 'J':
+            _checkpointSecs = atoi(optarg);
+            if (_checkpointSecs < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
         case 'l':
             _logConfig = optarg;
             break;
+        case 'm':
+            _metricsFile = optarg;
+            break;
+        case 'M':
+            _metricsInterval = atoi(optarg);
+            if (_metricsInterval < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            _noFill = true;
+            break;
         case 'p':
             _rpcport = atoi(optarg);
             break;
+        case 'R':
+            _captureFile = optarg;
+            break;
         case 's':
             _standalone = true;
             break;
+        case 'S':
+            _slowMsecs = atoi(optarg);
+            if (_slowMsecs < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            _nthreads = atoi(optarg);
+            if (_nthreads < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'T':
+            _traceEvents = atoi(optarg);
+            if (_traceEvents < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
         case 'u':
             {
                 _username = optarg;
@@ -2706,6 +5866,23 @@ int NcServerApp::parseRunstring(int argc, char **argv)
         case 'v':
             cout << "nc_server " << REPO_REVISION << '\n' << "Copyright (C) UCAR" << endl;
             exit(0);
+        case 'V':
+            _varAlign = atoi(optarg);
+            if (_varAlign < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            {
+                int n = atoi(optarg);
+                if (n < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                _writeBehindLength = n;
+            }
+            break;
         case 'z':
             daemonOrforeground = 1;
             _daemon = true;
@@ -2749,6 +5926,7 @@ void NcServerApp::setup()
 
 void shutdown()
 {
+    Connections::Instance()->flush_queues();
     AllFiles *allfiles = AllFiles::Instance();
     int nfiles = allfiles->num_files();
     allfiles->close();
@@ -2760,7 +5938,7 @@ void shutdown()
 }
 
 
-bool interrupted = false;
+std::atomic<bool> interrupted{false};
 
 
 void request_shutdown()
@@ -2773,15 +5951,53 @@ void request_shutdown()
 // This is the asynchronous signal handler for SIGINT and SIGTERM. Do not call
 // non-reentrant functions from here, just set a flag to indicate that
 // shutdown has been requested.
-void shutdown_handler(int sig)
+void shutdown_handler(int)
 {
     interrupted = true;
 }
 
 
+std::atomic<bool> trace_requested{false};
+
+
+// Handler for SIGUSR1, which requests a dump of the trace rings.
+void trace_handler(int)
+{
+    trace_requested = true;
+}
+
+
+/**
+ * Log the trace rings, if a dump was requested with SIGUSR1.
+ */
+void log_trace()
+{
+    if (!trace_requested.exchange(false)) return;
+    std::istringstream ist(Trace::dump());
+    string line;
+    while (std::getline(ist, line))
+        ILOG(("trace: %s", line.c_str()));
+}
+
+
+/**
+ * Once a second, write the records which have been buffered for longer
+ * than -a secs by groups which are not receiving any more data.  The
+ * dispatch loops wake up at least once a second to call this.
+ */
+void flush_old_records()
+{
+    static time_t lastFlush = 0;
+    time_t now = time(0);
+    if (now == lastFlush) return;
+    lastFlush = now;
+    AllFiles::Instance()->flush_old_records();
+}
+
+
 /**
- * Block SIGINT and SIGTERM signals, then set up handlers for them, so they
- * can be unblocked and handled in the main loop inside pselect().
+ * Block SIGINT, SIGTERM and SIGUSR1 signals, then set up handlers for them,
+ * so they can be unblocked and handled in the main loop inside pselect().
  */
 void setup_signals()
 {
@@ -2790,6 +6006,7 @@ void setup_signals()
     sigemptyset(&blockset);
     sigaddset(&blockset, SIGINT);
     sigaddset(&blockset, SIGTERM);
+    sigaddset(&blockset, SIGUSR1);
     sigprocmask(SIG_BLOCK, &blockset, NULL);
 
     struct sigaction sa;
@@ -2799,6 +6016,289 @@ void setup_signals()
     sigemptyset(&sa.sa_mask);
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = trace_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+
+namespace {
+
+/**
+ * Pool of threads which service RPC requests.  The main loop selects on
+ * the client transports and queues each readable one to the pool, where
+ * a worker thread decodes and executes its requests with
+ * svc_getreq_common().  A transport is not selected again until its
+ * worker is done, so the requests from one client are still handled in
+ * order, and a transport is never used by two threads at once.
+ */
+class RPCThreadPool
+{
+public:
+    RPCThreadPool(int nthreads);
+
+    /**
+     * Wait for the workers to finish their current requests and exit.
+     */
+    ~RPCThreadPool();
+
+    /**
+     * Queue a readable transport to be serviced by a worker.
+     */
+    void dispatch(int fd);
+
+    /**
+     * Clear the transports which are being serviced from @p fds.
+     */
+    void mask_busy(fd_set* fds);
+
+    /**
+     * A descriptor which becomes readable when a worker is done with
+     * a transport, so the main loop can select on it again.
+     */
+    int wakeup_fd() const
+    {
+        return _pipe[0];
+    }
+
+    void clear_wakeup();
+
+private:
+    void run();
+
+    std::mutex _mutex;
+
+    std::condition_variable _cond;
+
+    std::deque<int> _queue;
+
+    fd_set _busy;
+
+    bool _quit;
+
+    int _pipe[2];
+
+    std::vector<std::thread> _threads;
+
+    RPCThreadPool(const RPCThreadPool&);
+    RPCThreadPool& operator=(const RPCThreadPool&);
+};
+
+
+RPCThreadPool::RPCThreadPool(int nthreads):
+    _mutex(), _cond(), _queue(), _busy(), _quit(false), _pipe(), _threads()
+{
+    FD_ZERO(&_busy);
+    if (::pipe(_pipe) < 0)
+        throw nidas::util::IOException("RPCThreadPool", "pipe", errno);
+    ::fcntl(_pipe[0], F_SETFL, O_NONBLOCK);
+    ::fcntl(_pipe[1], F_SETFL, O_NONBLOCK);
+    for (int i = 0; i < nthreads; i++)
+        _threads.push_back(std::thread(&RPCThreadPool::run, this));
+}
+
+RPCThreadPool::~RPCThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _cond.notify_all();
+    for (unsigned int i = 0; i < _threads.size(); i++)
+        _threads[i].join();
+    ::close(_pipe[0]);
+    ::close(_pipe[1]);
+}
+
+void RPCThreadPool::dispatch(int fd)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        FD_SET(fd, &_busy);
+        _queue.push_back(fd);
+    }
+    _cond.notify_one();
+}
+
+void RPCThreadPool::mask_busy(fd_set* fds)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (int fd = 0; fd < FD_SETSIZE; ++fd)
+        if (FD_ISSET(fd, &_busy)) FD_CLR(fd, fds);
+}
+
+void RPCThreadPool::clear_wakeup()
+{
+    char buf[64];
+    while (::read(_pipe[0], buf, sizeof(buf)) > 0);
+}
+
+void RPCThreadPool::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        while (!_quit && _queue.empty())
+            _cond.wait(lock);
+        if (_quit) break;
+        int fd = _queue.front();
+        _queue.pop_front();
+
+        lock.unlock();
+        ServerStats::clock::time_point t0 = ServerStats::clock::now();
+        Trace::begin();
+        svc_getreq_common(fd);
+        ServerStats::Instance()->rpc_dispatched(ServerStats::clock::now() - t0);
+        lock.lock();
+
+        FD_CLR(fd, &_busy);
+        char c = 0;
+        // if the pipe is full, the main loop will wake up anyway
+        if (::write(_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+            WLOG(("RPCThreadPool wakeup: %m"));
+    }
+}
+
+
+/**
+ * Thread which checks every second whether the next files of the
+ * FileGroups should be created, so that the first record of a new
+ * file period does not wait for the file to be created.
+ */
+class FilePrecreator
+{
+public:
+    FilePrecreator(int lead);
+
+    /**
+     * Stop the thread, after it finishes the file it is creating.
+     */
+    ~FilePrecreator();
+
+private:
+    void run();
+
+    int _lead;
+
+    std::mutex _mutex;
+
+    std::condition_variable _cond;
+
+    bool _quit;
+
+    std::thread _thread;
+
+    FilePrecreator(const FilePrecreator&);
+    FilePrecreator& operator=(const FilePrecreator&);
+};
+
+FilePrecreator::FilePrecreator(int lead):
+    _lead(lead), _mutex(), _cond(), _quit(false), _thread()
+{
+    _thread = std::thread(&FilePrecreator::run, this);
+}
+
+FilePrecreator::~FilePrecreator()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _cond.notify_one();
+    _thread.join();
+}
+
+void FilePrecreator::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_quit) {
+        _cond.wait_for(lock, std::chrono::seconds(1));
+        if (_quit) break;
+        lock.unlock();
+        AllFiles::Instance()->precreate_files(_lead);
+        lock.lock();
+    }
+}
+
+/**
+ * Thread which periodically writes ServerStats::report() to a file,
+ * for a Prometheus node exporter textfile collector or similar.
+ * The report is written to a temporary file which is renamed, so
+ * readers never see a partial file.
+ */
+class StatsWriter
+{
+public:
+    StatsWriter(const std::string& path, int interval);
+
+    ~StatsWriter();
+
+private:
+    void run();
+
+    void write();
+
+    std::string _path;
+
+    int _interval;
+
+    std::mutex _mutex;
+
+    std::condition_variable _cond;
+
+    bool _quit;
+
+    std::thread _thread;
+
+    StatsWriter(const StatsWriter&);
+    StatsWriter& operator=(const StatsWriter&);
+};
+
+StatsWriter::StatsWriter(const std::string& path, int interval):
+    _path(path), _interval(interval), _mutex(), _cond(), _quit(false),
+    _thread()
+{
+    _thread = std::thread(&StatsWriter::run, this);
+}
+
+StatsWriter::~StatsWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _cond.notify_one();
+    _thread.join();
+}
+
+void StatsWriter::write()
+{
+    string report = ServerStats::Instance()->report();
+    string tmpname = _path + ".tmp";
+    FILE* fp = fopen(tmpname.c_str(), "w");
+    if (!fp) {
+        PLOG(("%s: %m", tmpname.c_str()));
+        return;
+    }
+    size_t nw = fwrite(report.c_str(), 1, report.length(), fp);
+    if (fclose(fp) != 0 || nw != report.length()) {
+        PLOG(("%s: write failed: %m", tmpname.c_str()));
+        ::unlink(tmpname.c_str());
+        return;
+    }
+    if (::rename(tmpname.c_str(), _path.c_str()) < 0)
+        PLOG(("rename %s %s: %m", tmpname.c_str(), _path.c_str()));
+}
+
+void StatsWriter::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_quit) {
+        lock.unlock();
+        write();
+        lock.lock();
+        _cond.wait_for(lock, std::chrono::seconds(_interval));
+    }
+}
+
 }
 
 
@@ -2932,9 +6432,77 @@ int NcServerApp::run(void)
     // files have been opened yet.
     setup_signals();
 
+#ifndef _TIRPC_SVC_H
+    // svc_fdset is thread-specific in the legacy glibc RPC, so transports
+    // closed in a worker thread would not be cleared in the main thread.
+    if (_nthreads > 0) {
+        WLOG(("multithreaded dispatch requires libtirpc, "
+              "servicing requests in one thread"));
+        _nthreads = 0;
+    }
+#endif
+
+    Connections::Instance()->setWriteBehindLength(_writeBehindLength);
+    NS_NcFile::setRecordBuffer(_recordBufferSize, _recordBufferAge);
+    NS_NcFile::setNoFill(_noFill);
+    NS_NcFile::setHeaderReserve(_headerFree, _varAlign);
+    NS_NcFile::setStageGroups(_stageGroups);
+    if (_maxOpenFiles > 0)
+        AllFiles::Instance()->setMaxOpenFiles(_maxOpenFiles);
+    if (_traceEvents > 0 || _slowMsecs > 0)
+        Trace::enable(_traceEvents, _slowMsecs * 1.e-3);
+    if (!_captureFile.empty()) {
+        try {
+            RequestCapture::Instance()->open(_captureFile);
+        }
+        catch (const nidas::util::IOException& e) {
+            PLOG(("%s", e.what()));
+            return 1;
+        }
+    }
+
+    // Replay the journal of an unclean shutdown before serving clients.
+    if (!_journalFile.empty()) {
+        try {
+            Journal::Instance()->open(_journalFile, _checkpointSecs);
+        }
+        catch (const nidas::util::IOException& e) {
+            PLOG(("%s", e.what()));
+            return 1;
+        }
+    }
+
+    // Like the RPC threads, this is started after the signals are
+    // blocked, so they are only handled in pselect().
+    std::unique_ptr<FilePrecreator> precreator;
+    if (_precreateLead > 0)
+        precreator.reset(new FilePrecreator(_precreateLead));
+
+    ServerStats::Instance();
+    std::unique_ptr<StatsWriter> statsWriter;
+    if (!_metricsFile.empty())
+        statsWriter.reset(new StatsWriter(_metricsFile, _metricsInterval));
+
     // Replace svc_run() with a pselect() loop so shutdowns can be handled
     // synchronously and called from only one place.
     DLOG(("entering main loop..."));
+    int status;
+    if (_nthreads > 0)
+        status = dispatchThreadsLoop();
+    else
+        status = dispatchLoop();
+    precreator.reset();
+    statsWriter.reset();
+    shutdown();
+    // the files are closed, the journal is not needed
+    Journal::Instance()->close(true);
+    RequestCapture::Instance()->close();
+    return status;
+}
+
+
+int NcServerApp::dispatchLoop()
+{
     int status = 0;
     while (true) {
         fd_set rfds = svc_fdset;
@@ -2945,17 +6513,21 @@ int NcServerApp::run(void)
 
         sigset_t emptyset;
         sigemptyset(&emptyset);
-        int nsel = pselect(maxfd + 1, &rfds, nullptr, nullptr, nullptr,
+        struct timespec tick = { 1, 0 };
+        int nsel = pselect(maxfd + 1, &rfds, nullptr, nullptr, &tick,
                            &emptyset);
         if (nsel < 0 && errno != EINTR) {
             PLOG(("pselect failed: %m"));
             status = 1;
             break;
         }
+        log_trace();
         if (interrupted) {
             ILOG(("nc_server interrupted, shutting down."));
             break;
         }
+        flush_old_records();
+        if (nsel <= 0) continue;
         // It could happen that a very busy server has lots of fds open, all
         // of which are sending lots of data to be written, and any one of
         // those writes could delay a shutdown request by a noticeable amount
@@ -2963,7 +6535,10 @@ int NcServerApp::run(void)
         // time, in successive calls to svc_getreqset(), checking for
         // interruptions in between service handlers.  However, it is really
         // unlikely to be a problem worth fixing.
+        ServerStats::clock::time_point t0 = ServerStats::clock::now();
+        Trace::begin();
         svc_getreqset(&rfds);
+        ServerStats::Instance()->rpc_dispatched(ServerStats::clock::now() - t0);
         // If an RPC handler set the interrupted flag, then this is a
         // requested shutdown.  Since the interrupt signals are blocked
         // outside the pselect(), this cannot be caused by a signal interrupt.
@@ -2971,46 +6546,118 @@ int NcServerApp::run(void)
             break;
         }
     }
-    shutdown();
+    return status;
+}
+
+
+int NcServerApp::dispatchThreadsLoop()
+{
+    ILOG(("servicing RPC requests with %d threads", _nthreads));
+
+    // The workers inherit the signal mask of this thread, with SIGINT and
+    // SIGTERM blocked, so those are only handled here in pselect().
+    RPCThreadPool pool(_nthreads);
+
+    int status = 0;
+    while (true) {
+        fd_set rfds = svc_fdset;
+        pool.mask_busy(&rfds);
+        FD_SET(pool.wakeup_fd(), &rfds);
+        int maxfd = 0;
+        for (int fd = 0; fd < FD_SETSIZE; ++fd) {
+            maxfd = FD_ISSET(fd, &rfds) ? fd : maxfd;
+        }
+
+        sigset_t emptyset;
+        sigemptyset(&emptyset);
+        struct timespec tick = { 1, 0 };
+        int nsel = pselect(maxfd + 1, &rfds, nullptr, nullptr, &tick,
+                           &emptyset);
+        log_trace();
+        if (interrupted) {
+            ILOG(("nc_server interrupted, shutting down."));
+            break;
+        }
+        flush_old_records();
+        if (nsel < 0) {
+            // A worker can destroy a transport after svc_fdset was copied
+            // above, in which case just select again.
+            if (errno == EINTR || errno == EBADF) continue;
+            PLOG(("pselect failed: %m"));
+            status = 1;
+            break;
+        }
+        for (int fd = 0; fd <= maxfd; ++fd) {
+            if (!FD_ISSET(fd, &rfds)) continue;
+            if (fd == pool.wakeup_fd())
+                pool.clear_wakeup();
+            // New connections are accepted here, where svc_fdset is read.
+            else if (fd == _transp->xp_fd)
+                svc_getreq_common(fd);
+            else
+                pool.dispatch(fd);
+        }
+    }
+    // The pool destructor waits for requests in progress, and then
+    // run() closes the files.
     return status;
 }
 
 
 template<class REC_T,class DATA_T>
-NS_NcFile *FileGroup::put_rec(const REC_T * writerec,
-        NS_NcFile * f)
+void FileGroup::put_rec(const REC_T * writerec,
+        vector<NS_NcFile*>& hotFiles)
 {
     int groupid = writerec->datarecId;
     double dtime = writerec->time;
 
+    if (dtime > _lastDataTime) _lastDataTime = dtime;
+
     if (_vargroups.find(groupid) == _vargroups.end()) {
         std::string idstr = Connection::getIdStr(writerec->connectionId);
         std::ostringstream ost;
         ost << "Invalid variable group number: " <<  groupid;
         throw NcServerAccessFailed(idstr,"put_rec",ost.str());
     }
+    Trace::probe(Trace::LOOKUP, writerec->connectionId);
+
+    /* Check the files recently written by this connection */
+    NS_NcFile *f = 0;
+    vector<NS_NcFile*>::iterator hi = hotFiles.begin();
+    for ( ; hi != hotFiles.end(); ++hi)
+        if ((*hi)->StartTimeLE(dtime) && (*hi)->EndTimeGT(dtime)) break;
 
-    /* Check if last file is still current */
-    if (!(f && (f->StartTimeLE(dtime) && f->EndTimeGT(dtime)))) {
-        VLOG(("time not contained in current file: %s",(f ? f->getName().c_str():"none")));
-        if (f)
-            f->sync();
+    if (hi != hotFiles.end()) {
+        f = *hi;
+        std::rotate(hotFiles.begin(), hi, hi + 1);
+    }
+    else {
+        VLOG(("time not contained in recent files, last: %s",
+              (hotFiles.empty() ? "none" : hotFiles.front()->getName().c_str())));
+        // usually the data has moved on to the next file
+        if (!hotFiles.empty())
+            hotFiles.front()->sync();
         try {
             f = get_file(dtime);
         }
         catch(const NetCDFAccessFailed& e) {
             // Too many files open
-            if (ncerror.get_err() == NC_ENFILE) {
-                AllFiles::Instance()->close_oldest_file();
+            if (e.getNcStatus() == NC_ENFILE) {
+                AllFiles::Instance()->close_oldest_file(this);
                 f = get_file(dtime);
             }
             else throw e;
         }
+        hotFiles.insert(hotFiles.begin(), f);
+        if (hotFiles.size() > HOT_FILES) hotFiles.pop_back();
     }
+    Trace::probe(Trace::GET_FILE);
     VLOG(("Writing Record, groupid=") << groupid << ",f=" << f->getName()
           << ",time=" << UTime(dtime).format(true,"%Y-%m-%d_%H:%M:%S.%3f"));
+    // Like LastAccess(), the order of the open files only needs
+    // to be kept to the second.
+    if (f->LastAccess() != time(0)) AllFiles::Instance()->touch(f);
     f->put_rec<REC_T,DATA_T>(writerec, _vargroups[groupid], dtime);
-    return f;
 }
 
 
@@ -3027,10 +6674,15 @@ void NS_NcFile::put_rec(const REC_T * writerec,
     time_t tnow;
     int ndims_req = vgroup->num_dims();
 
+    // Records are buffered with the library locked too, since a block
+    // may be flushed by any record.
+    std::lock_guard<std::recursive_mutex> lock(netcdf_mutex);
+
     // this will add variables if necessary
     VLOG(("calling get_vars"));
 
     const std::vector<NS_NcVar*>& vars = get_vars(vgroup);
+    Trace::probe(Trace::GET_VARS, vgroup->getId());
 
     nidas::util::UTime debugUT(dtime);
     static LogContext vlog(LOG_VERBOSE);
@@ -3101,6 +6753,7 @@ void NS_NcFile::put_rec(const REC_T * writerec,
     }
 
     nrec = put_time(dtime);
+    Trace::probe(Trace::PUT_TIME, nrec);
 
     nv = vars.size();
 
@@ -3125,14 +6778,53 @@ void NS_NcFile::put_rec(const REC_T * writerec,
             lp.log() << "count[" << i << "]=" << count[i];
     }
 
+    // Buffer records which are one hyperslab per variable, and
+    // can be appended to the earlier records.
+    RecordBlock* block = 0;
+    if (_recordBufferSize > 1 && vgroup->num_samples() == 1) {
+        bool hasCnts = writerec->cnts.cnts_len > 0;
+        block = &_recordBlocks[vgroup->getId()];
+        if (block->nrecs > 0 &&
+                !block->follows(nrec, nstart, start, count, hasCnts))
+            flush_records();
+        if (block->nrecs == 0) {
+            block->nrec = nrec;
+            block->hasCnts = hasCnts;
+            block->start.assign(start, start + nstart);
+            block->count.assign(count, count + ncount);
+            block->fvals.resize(nv);
+            block->ivals.resize(nv);
+            for (iv = 0; iv < nv; iv++) {
+                block->fvals[iv].clear();
+                block->ivals[iv].clear();
+            }
+        }
+        // Check the data length before anything is added to the block
+        long nvals = 0;
+        for (iv = 0; iv < nv; iv++)
+            if (!vars[iv]->isCnts()) nvals += vars[iv]->put_len(count);
+        if (nvals > nd) {
+            std::ostringstream ost;
+            ost << vars[0]->name() << ": data array has " << nd << " values, num_variables=" << nv;
+            throw NetCDFAccessFailed(getName(),"put_rec",ost.str());
+        }
+    }
+
     for (iv = 0; iv < nv; iv++) {
         var = vars[iv];
-        var->set_cur(nrec, nsample, start);
+        if (!block)
+            var->set_cur(nrec, nsample, start);
         if (var->isCnts()) {
             if (writerec->cnts.cnts_len > 0) {
                 VLOG(("put counts"));
-                if (!var->put((const int *) writerec->cnts.cnts_val, count))
-                    throw NetCDFAccessFailed(getName(),std::string("put_var ") + var->name(),get_error_string());
+                if (block)
+                    block->append(iv, (const int *) writerec->cnts.cnts_val,
+                                  var->put_len(count));
+                else {
+                    if (_noFill) track_put(var, nrec, 1, count);
+                    if (!var->put((const int *) writerec->cnts.cnts_val, count))
+                        throw NetCDFAccessFailed(getName(),std::string("put_var ") + var->name(),get_error_string());
+                }
             }
         } else {
             if (d >= dend) {
@@ -3141,13 +6833,26 @@ void NS_NcFile::put_rec(const REC_T * writerec,
                 throw NetCDFAccessFailed(getName(),"put_rec",ost.str());
             }
             else {
-                if (!(i = var->put(d, count)))
-                    throw NetCDFAccessFailed(getName(),std::string("put_var ") + var->name(),get_error_string());
+                if (block) {
+                    i = var->put_len(count);
+                    block->append(iv, d, i);
+                }
+                else {
+                    if (_noFill) track_put(var, nrec, 1, count);
+                    if (!(i = var->put(d, count)))
+                        throw NetCDFAccessFailed(getName(),std::string("put_var ") + var->name(),get_error_string());
+                }
                 VLOG(("var->put of %s, i=%d", var->name(), i));
                 d += i;
             }
         }
     }
+    Trace::probe(Trace::PUT_VARS);
+    tnow = time(0);
+    if (block) {
+        block->nrecs++;
+        if (_bufferTime == 0) _bufferTime = tnow;
+    }
     if (d != dend) {
         std::ostringstream ost;
         ost << vars[0]->name() << ": data array has " << nd << " values, but only " <<
@@ -3155,9 +6860,26 @@ void NS_NcFile::put_rec(const REC_T * writerec,
         throw NetCDFAccessFailed(getName(),"put_rec",ost.str());
     }
 
-    if ((tnow = time(0)) - _lastSync > SYNC_CHECK_INTERVAL_SECS) {
+    if (block && (block->nrecs >= (long)_recordBufferSize ||
+                tnow - _bufferTime >= _recordBufferAge)) {
+        flush_records();
+        Trace::probe(Trace::FLUSH);
+    }
+    // sync() also writes the buffered records
+    if (tnow - _lastSync > _syncInterval) {
         // DLOG(("put_rec syncing %s",getName().c_str()));
         sync();
     }
     _lastAccess = tnow;
 }
+
+// Instantiate the record writers, so they can be called from other
+// modules, such as the tests and benchmarks.
+template void FileGroup::put_rec<datarec_float,float>(
+        const datarec_float*, vector<NS_NcFile*>&);
+template void FileGroup::put_rec<datarec_int,int>(
+        const datarec_int*, vector<NS_NcFile*>&);
+template void NS_NcFile::put_rec<datarec_float,float>(
+        const datarec_float*, VariableGroup*, double);
+template void NS_NcFile::put_rec<datarec_int,int>(
+        const datarec_int*, VariableGroup*, double);
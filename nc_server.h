@@ -39,10 +39,17 @@
 #include <string>
 #include <sstream>
 #include <list>
+#include <deque>
 #include <map>
 #include <set>
+#include <unordered_set>
 #include <memory>
 #include <utility>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 #include <netcdf.hh>
 #include <netcdf.h>
 
@@ -116,6 +123,15 @@ public:
     /** main loop */
     int run();
 
+    /**
+     * Number of threads servicing RPC requests. If zero, requests
+     * are handled one at a time in the main loop.
+     */
+    int getNumThreads() const
+    {
+        return _nthreads;
+    }
+
     static void setupSignals();
 
     uid_t getUserID()
@@ -133,6 +149,19 @@ private:
     /** Signal handler */
     static void sigAction(int sig, siginfo_t * siginfo, void *vptr);
 
+    /**
+     * Select on the RPC transports and service the requests in
+     * this thread with svc_getreqset().
+     */
+    int dispatchLoop();
+
+    /**
+     * Select on the RPC transports in this thread, and pass
+     * readable transports to a pool of threads which decode
+     * and execute the requests.
+     */
+    int dispatchThreadsLoop();
+
     std::string _username;
 
     uid_t _userid;
@@ -153,6 +182,40 @@ private:
 
     bool _standalone;
 
+    int _nthreads;
+
+    unsigned int _writeBehindLength;
+
+    unsigned int _recordBufferSize;
+
+    int _recordBufferAge;
+
+    bool _noFill;
+
+    int _headerFree;
+
+    int _varAlign;
+
+    bool _stageGroups;
+
+    int _precreateLead;
+
+    int _maxOpenFiles;
+
+    std::string _metricsFile;
+
+    int _metricsInterval;
+
+    int _traceEvents;
+
+    int _slowMsecs;
+
+    std::string _captureFile;
+
+    std::string _journalFile;
+
+    int _checkpointSecs;
+
     SVCXPRT* _transp;
 
     /** No copying */
@@ -172,17 +235,32 @@ public:
     }
 };
 
+/**
+ * The status of the last netCDF call is saved when the exception is
+ * created, while the library is locked, since the global ncerror is
+ * changed by the calls of other threads once it is unlocked.
+ */
 class NetCDFAccessFailed: public nidas::util::Exception
 {
 public:
     NetCDFAccessFailed(const std::string& file,const std::string& operation,const std::string& msg):
-        nidas::util::Exception("NetCDFAccessFailed",file + ": " + operation + ": " + msg)
+        nidas::util::Exception("NetCDFAccessFailed",file + ": " + operation + ": " + msg),
+        _ncStatus(ncerror.get_err())
     {
     }
     NetCDFAccessFailed(const std::string& msg):
-        nidas::util::Exception("NetCDFAccessFailed",msg)
+        nidas::util::Exception("NetCDFAccessFailed",msg),
+        _ncStatus(ncerror.get_err())
     {
     }
+
+    int getNcStatus() const
+    {
+        return _ncStatus;
+    }
+
+private:
+    int _ncStatus;
 };
 
 class NcServerAccessFailed: public nidas::util::Exception
@@ -194,6 +272,501 @@ public:
     }
 };
 
+/**
+ * Histogram of durations, in power of 2 bins of microseconds, which
+ * is updated by several threads without locking.
+ */
+class LatencyHistogram
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    /**
+     * Bin i counts the durations of up to 2^i microseconds which are
+     * not in a lower bin, and the last bin counts the rest.
+     */
+    static const int NBINS = 24;
+
+    LatencyHistogram();
+
+    void add(clock::duration d);
+
+    /**
+     * Number of durations added.
+     */
+    unsigned long long count() const
+    {
+        return _count;
+    }
+
+    /**
+     * Sum of the durations, in seconds.
+     */
+    double sum() const
+    {
+        return _nanos * 1.e-9;
+    }
+
+    unsigned long long bin(int i) const
+    {
+        return _bins[i];
+    }
+
+    /**
+     * Upper bound of bin i, in seconds.
+     */
+    static double bound(int i)
+    {
+        return (1ULL << i) * 1.e-6;
+    }
+
+private:
+    std::atomic<unsigned long long> _bins[NBINS];
+    std::atomic<unsigned long long> _count;
+    std::atomic<unsigned long long> _nanos;
+
+    LatencyHistogram(const LatencyHistogram&);
+    LatencyHistogram& operator=(const LatencyHistogram&);
+};
+
+/**
+ * Samples of metrics in the Prometheus text format.  The samples of
+ * each metric are kept together after its HELP and TYPE lines, in the
+ * order the metrics were first added.
+ */
+class MetricsReport
+{
+public:
+    MetricsReport();
+
+    void counter(const std::string& name, const std::string& help,
+                 const std::string& labels, double value);
+
+    void gauge(const std::string& name, const std::string& help,
+               const std::string& labels, double value);
+
+    void histogram(const std::string& name, const std::string& help,
+                   const std::string& labels, const LatencyHistogram& hist);
+
+    std::string str() const;
+
+    /**
+     * Format name="value", escaping the value.  Labels are joined
+     * with commas.
+     */
+    static std::string label(const std::string& name,
+                             const std::string& value);
+
+private:
+    /**
+     * Return the text of a metric, to which samples are appended.
+     */
+    std::string& metric(const std::string& name, const std::string& type,
+                        const std::string& help);
+
+    std::vector<std::string> _names;
+
+    std::map<std::string, std::string> _text;
+};
+
+/**
+ * Timestamped probes at the stages of handling a request, which are
+ * recorded in a ring buffer for each thread.  The rings are dumped on
+ * SIGUSR1 and by GET_TRACE, and requests which take longer than a
+ * threshold are logged with the time spent in each stage.
+ * A probe costs a relaxed atomic load when tracing is not enabled,
+ * and a clock read and a few stores to the ring of the thread when it is.
+ */
+class Trace
+{
+public:
+    /**
+     * Probe points.  A probe is made at the end of the stage it names,
+     * so the time of a stage is the time since the previous probe.
+     */
+    enum Point {
+        BEGIN, DECODE, LOOKUP, SYNC, OPEN_FILE, GET_FILE, GET_VARS,
+        PUT_TIME, PUT_VARS, FLUSH, END, NPOINTS
+    };
+
+    /**
+     * Enable tracing, with rings of nevents for each thread. Requests
+     * which take longer than slowSecs are logged, if it is positive.
+     * Called before the threads which make probes are started.
+     */
+    static void enable(unsigned int nevents, double slowSecs);
+
+    static bool enabled()
+    {
+        return _enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * The start of a request, before it is decoded.
+     */
+    static void begin()
+    {
+        if (enabled()) record(BEGIN, 0);
+    }
+
+    static void probe(Point p, long arg = 0)
+    {
+        if (enabled()) record(p, arg);
+    }
+
+    /**
+     * The end of a request. It is logged if it took longer than
+     * the slow threshold.  Another request on the thread without a
+     * begin() is timed from here.
+     */
+    static void end()
+    {
+        if (enabled()) record(END, 0);
+    }
+
+    /**
+     * The events in the rings of all threads, oldest first.
+     */
+    static std::string dump();
+
+    static const char* name(Point p);
+
+    typedef std::vector<std::pair<Point, long long> > Probes;
+
+    /**
+     * The time of each stage of a request, as logged for a slow one,
+     * from its probes and their times in nanoseconds.  The first probe
+     * is the start of the request.  The time of a stage with several
+     * probes is summed over them, followed by the number of probes.
+     */
+    static std::string stages(const Probes& probes);
+
+    class Ring;
+
+private:
+    static void record(Point p, long arg);
+
+    static Ring* ring();
+
+    static std::atomic<bool> _enabled;
+
+    static unsigned int _nevents;
+
+    static long long _slowNanos;
+
+    static std::mutex _ringsMutex;
+
+    static std::set<Ring*> _rings;
+};
+
+/**
+ * Server wide statistics, and the report of the statistics of all
+ * connections and file groups returned by GET_STATS.
+ */
+class ServerStats
+{
+public:
+    typedef LatencyHistogram::clock clock;
+
+    static ServerStats *Instance();
+
+    /**
+     * Called by the dispatch loops with the time taken to service the
+     * requests of a transport, including XDR decoding and encoding.
+     */
+    void rpc_dispatched(clock::duration d);
+
+    /**
+     * Times the execution of an RPC procedure, so the decoding and
+     * encoding time is the difference from the dispatch time.
+     */
+    class HandlerTimer
+    {
+    public:
+        HandlerTimer(): _t0(clock::now())
+        {
+            Trace::probe(Trace::DECODE);
+        }
+        ~HandlerTimer()
+        {
+            ServerStats::Instance()->rpc_handled(clock::now() - _t0);
+            Trace::end();
+        }
+    private:
+        clock::time_point _t0;
+    };
+
+    void rpc_handled(clock::duration d);
+
+    /**
+     * Statistics of the server, connections and file groups,
+     * in the Prometheus text format.
+     */
+    std::string report();
+
+private:
+    ServerStats();
+
+    static ServerStats* _instance;
+
+    std::atomic<unsigned long long> _nrequests;
+
+    std::atomic<unsigned long long> _handlerNanos;
+
+    std::atomic<unsigned long long> _dispatchNanos;
+
+    LatencyHistogram _dispatchLatency;
+
+    ServerStats(const ServerStats&);
+    ServerStats& operator=(const ServerStats&);
+};
+
+/**
+ * Capture of the decoded requests which change the files, for
+ * replay by nc_replay.  Each request is written to the capture file
+ * as its time, procedure number and result, followed by the XDR
+ * encoding of its argument, as it was received.
+ */
+class RequestCapture
+{
+public:
+    static RequestCapture *Instance();
+
+    /**
+     * Create the capture file and start capturing.
+     * @throws nidas::util::IOException
+     */
+    void open(const std::string& path);
+
+    void close();
+
+    static bool active()
+    {
+        return _active.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Write a request to the capture file, if capturing.
+     * @param result The value returned to the client, which nc_replay
+     *  needs for the connection and variable group ids.
+     */
+    static void capture(unsigned int proc, xdrproc_t xargs, void* args,
+                        int result = 0)
+    {
+        if (active()) Instance()->write(proc, xargs, args, result);
+    }
+
+    /**
+     * Magic number at the start of a capture file.
+     */
+    static const unsigned int MAGIC = 0x4e435231;
+
+private:
+    RequestCapture();
+
+    void write(unsigned int proc, xdrproc_t xargs, void* args, int result);
+
+    static RequestCapture* _instance;
+
+    static std::atomic<bool> _active;
+
+    std::mutex _mutex;
+
+    std::string _path;
+
+    FILE* _fp;
+
+    XDR _xdrs;
+
+    time_t _lastFlush;
+
+    RequestCapture(const RequestCapture&);
+    RequestCapture& operator=(const RequestCapture&);
+};
+
+/**
+ * Write-ahead journal of the requests which change the files, so
+ * that the netCDF files can be synced less often.  Each request is
+ * appended to the journal with one write() after it is applied, and
+ * the journal is synced to disk with fdatasync() every COMMIT_MSECS
+ * by a commit thread, so that many requests share one sync.
+ *
+ * Every checkpoint interval the journal is renamed to path.prev, a
+ * new journal is started with the connections, variable groups,
+ * global attributes and history which are still in use, the files
+ * are synced, and path.prev is removed.  On startup the requests in
+ * path.prev and path are replayed into the files before any clients
+ * are served.  Replay is idempotent, since records are written at
+ * the index of their time, and repeated history lines are skipped.
+ *
+ * The records use the format of RequestCapture, so a journal can
+ * also be replayed with nc_replay.
+ */
+class Journal
+{
+public:
+    static Journal *Instance();
+
+    /**
+     * Recover the requests in an existing journal at path, start a
+     * new journal, and sync the netCDF files every checkpointSecs
+     * instead of every NS_NcFile::SYNC_CHECK_INTERVAL_SECS.
+     * @throws nidas::util::IOException
+     */
+    void open(const std::string& path, int checkpointSecs);
+
+    /**
+     * Stop journaling, after a final commit.
+     * @param remove Remove the journal, because the files have
+     *  been closed.
+     */
+    void close(bool remove);
+
+    /**
+     * Replay the requests of the journal at path, and path.prev,
+     * into the files, sync them, and close the connections which
+     * were opened.  The journal is not removed.
+     * @return Number of data records replayed.
+     */
+    unsigned long recover(const std::string& path);
+
+    /**
+     * Rotate the journal and sync the files.
+     */
+    void checkpoint();
+
+    static bool active()
+    {
+        return _active.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Append a request which has been applied to the journal,
+     * if journaling.
+     * @param result The value returned to the client: the id of
+     *  a new connection or variable group.
+     * @return Number of the entry, counting from 1, or 0 if the
+     *  request was not journaled.
+     */
+    static unsigned long append(unsigned int proc, xdrproc_t xargs,
+                                void* args, int result = 0)
+    {
+        return active() ? Instance()->write(proc, xargs, args, result) : 0;
+    }
+
+    /**
+     * Number of the last entry which has been synced to disk.
+     */
+    unsigned long committed() const
+    {
+        return _committed.load(std::memory_order_acquire);
+    }
+
+    void report(MetricsReport& report);
+
+    /**
+     * Interval of the fdatasync() of the journal.
+     */
+    static const int COMMIT_MSECS = 200;
+
+private:
+    Journal();
+
+    unsigned long write(unsigned int proc, xdrproc_t xargs, void* args,
+                        int result);
+
+    /**
+     * Keep a copy of the requests which define the state of a
+     * connection, to start the next journal with them.
+     */
+    void keep(unsigned int proc, void* args, int result,
+              const std::string& entry);
+
+    /**
+     * Create the journal and write the kept requests.
+     * Called with _mutex locked.
+     * @throws nidas::util::IOException
+     */
+    void create();
+
+    /**
+     * Stop journaling after an error.  Called with _mutex locked.
+     */
+    void fail(const char* what);
+
+    void commit();
+
+    void commitLoop();
+
+    void checkpointLoop();
+
+    /**
+     * Requests which define the state of a connection.
+     */
+    struct Definitions
+    {
+        Definitions(): open(), groups(), attrs(), history() {}
+
+        std::string open;
+
+        std::vector<std::string> groups;
+
+        std::map<std::string, std::string> attrs;
+
+        std::string history;
+    };
+
+    static Journal* _instance;
+
+    static std::atomic<bool> _active;
+
+    /**
+     * Protects the journal file and the definitions.
+     */
+    std::mutex _mutex;
+
+    /**
+     * Held during a commit, so the file is not closed by a
+     * checkpoint while it is synced.  Locked before _mutex.
+     */
+    std::mutex _commitMutex;
+
+    std::condition_variable _cond;
+
+    std::string _path;
+
+    int _fd;
+
+    bool _dirty;
+
+    bool _quit;
+
+    int _checkpointSecs;
+
+    std::map<int, Definitions> _defs;
+
+    unsigned long _nentries;
+
+    std::atomic<unsigned long> _committed;
+
+    unsigned long long _nbytes;
+
+    unsigned long _ncommits;
+
+    unsigned long _ncheckpoints;
+
+    LatencyHistogram _commitLatency;
+
+    LatencyHistogram _checkpointLatency;
+
+    std::thread _commitThread;
+
+    std::thread _checkpointThread;
+
+    Journal(const Journal&);
+    Journal& operator=(const Journal&);
+};
+
 class Connections
 {
 public:
@@ -209,18 +782,52 @@ public:
 
     /**
      * Close a connection, given the id. Return 0 on success, -1 if
-     * the connection is not found.
+     * the connection is not found.  The Connection is deleted when
+     * the last RPC handler which is using it is done.
      */
     int closeConnection(int);
 
     void closeOldConnections();
 
-    Connection * operator[] (int) const;
+    /**
+     * Return the connection with an id, or an empty pointer if it
+     * is not open.  The Connection is not deleted while the caller
+     * holds the pointer, even if it is closed by another thread.
+     */
+    std::shared_ptr<Connection> operator[] (int) const;
 
     unsigned int num() const;
+
+    /**
+     * Length of the write-behind queue of new connections.
+     * If zero, the default, records are written before the RPC
+     * call returns.
+     */
+    void setWriteBehindLength(unsigned int val)
+    {
+        _writeBehindLength = val;
+    }
+
+    /**
+     * Wait until the records queued by all connections are written.
+     */
+    void flush_queues();
+
+    /**
+     * Add the statistics of each connection to a report.
+     */
+    void report(MetricsReport& report) const;
+
 private:
-    std::map <int, Connection*> _connections;
+    std::map <int, std::shared_ptr<Connection> > _connections;
     int _connectionCntr;
+
+    unsigned int _writeBehindLength;
+
+    /**
+     * Protects _connections from the RPC dispatch threads.
+     */
+    mutable std::recursive_mutex _mutex;
     static Connections *_instance;
 protected:
     Connections(void);
@@ -232,9 +839,14 @@ class Connection
 public:
     /**
      * @brief Construct a new Connection object
+     * @param queueLength: if non-zero, data records are validated
+     *      and queued, and a writer thread of this connection writes
+     *      them to the files.  An error in the writer thread is
+     *      reported back by the next put_rec() and CHECK_ERROR.
      * @throws InvalidFileLength, InvalidInterval, InvalidOutputDir
      */
-    Connection(const struct connection *, int id);
+    Connection(const struct connection *, int id,
+               unsigned int queueLength = 0);
 
     ~Connection(void);
 
@@ -246,18 +858,84 @@ public:
 
     int put_rec(const datarec_int * writerec) throw();
 
+    /**
+     * Write an array of records in one pass.  Return 0 if all the
+     * records were written, otherwise -1, in which case the error
+     * message identifies the record which failed.  Records after the
+     * failed record are not written.
+     */
+    int put_recs(const datarec_float_array * writerecs) throw();
+
+    int put_recs(const datarec_int_array * writerecs) throw();
+
+    /**
+     * Write an array of sequence numbered records.  Records with a
+     * sequence number which has already been received on this
+     * connection are skipped, so a client can send records again
+     * when it does not know whether they arrived.
+     */
+    int put_recs(const datarec_float_seq * writerecs) throw();
+
+    /**
+     * The records through sequence number seq have been written to
+     * journal entry number entry, so they are durable once the
+     * journal has been committed through that entry.
+     */
+    void journaled(unsigned long entry, unsigned long long seq);
+
+    /**
+     * Progress of the sequence numbered records, for ACK_THROUGH.
+     * @param applied Highest sequence number written to a file.
+     * @param durable Highest sequence number of the records which are
+     *  in files which have been synced or closed since, or which have
+     *  been committed to the journal.
+     * @param error Empty, or the error of the connection.
+     */
+    void get_ack(unsigned long long& applied, unsigned long long& durable,
+                 std::string& error);
+
+    /**
+     * Called by the FileGroup after a file has been synced.
+     */
+    void file_synced(NS_NcFile* f);
+
+    /**
+     * Called by the FileGroup when records which were accepted could
+     * not be written to a file.  If this connection wrote to the file,
+     * it is put in the error state, so that its next request fails,
+     * and the records are never acknowledged as durable.
+     */
+    void write_failed(NS_NcFile* f, const std::string& msg);
+
+    /**
+     * Wait until the writer thread has written all the queued records.
+     */
+    void flush_queue();
+
     int put_history(const std::string &) throw();
 
     int write_global_attr(const std::string & name, const std::string& value) throw();
 
     int write_global_attr(const std::string & name, int value) throw();
 
+    /**
+     * Write the attributes to the files together.
+     * @return: 0, or -1 on error.
+     */
+    int write_global_attrs(const struct global_attrs *) throw();
+
     /**
      * @return: non-negative group id or -1 on error.
      */
     int add_var_group(const struct datadef *) throw();
 
-    time_t LastRequest()
+    /**
+     * Add the variable groups, and return their ids.
+     * @return: 0, or -1 on error, when ids is empty.
+     */
+    int add_var_groups(const struct datadefs *, std::vector<int>& ids) throw();
+
+    time_t LastRequest() const
     {
         return _lastRequest;
     }
@@ -267,9 +945,14 @@ public:
         return _history;
     }
 
-    NS_NcFile *last_file() const;
+    void unset_file(NS_NcFile* f);      // the file has been closed
 
-    void unset_last_file();     // the file has been closed
+    void unset_files();     // all files of the group have been closed
+
+    FileGroup* getFileGroup() const
+    {
+        return _filegroup;
+    }
 
     enum state {CONN_OK, CONN_ERROR };
 
@@ -278,36 +961,212 @@ public:
         return _state;
     }
 
-    const std::string& getErrorMsg() const
-    {
-        return _errorMsg;
-    }
+    /**
+     * Return a copy of the error message, since it may be changed
+     * by another RPC dispatch thread.  After a write-behind error, it
+     * includes the number of queued records which were discarded.
+     */
+    std::string getErrorMsg() const;
 
-    void setErrorMsg(const std::string& val)
-    {
-        _errorMsg = val;
-    }
+    void setErrorMsg(const std::string& val);
+
+    void report(MetricsReport& report) const;
 
 private:
+    /**
+     * @param seq Sequence number of the first record, or 0 if the
+     *  records are not numbered.
+     */
+    template<class REC_T, class DATA_T>
+        int put_recs(const REC_T * writerecs, unsigned int nrecs,
+                     unsigned long long seq = 0) throw();
+
+    /**
+     * Advance the highest sequence number received past nrecs records
+     * starting at seq.
+     * @return Number of leading records which were already received.
+     */
+    unsigned int skip_received(unsigned long long seq, unsigned int nrecs);
+
+    /**
+     * Record numbered seq has been written to the first hot file.
+     * Called with the FileGroup mutex locked.
+     */
+    void set_applied(unsigned long long seq);
+
+    /**
+     * Count records and their data bytes received from the client.
+     */
+    template<class REC_T>
+        void count_received(const REC_T * writerecs, unsigned int nrecs);
+
+    /**
+     * Write a record to the file group, and time it.
+     * @throws nidas::util::Exception
+     */
+    template<class REC_T, class DATA_T>
+        void write_rec(const REC_T * writerec);
+
+    /**
+     * Copy of a data record in the write-behind queue.  The RPC
+     * arguments are freed when the call returns, so the arrays
+     * are copied.
+     */
+    struct QueuedRec
+    {
+        QueuedRec(): isInt(false), time(0.0), connectionId(0),
+            datarecId(0), seq(0), fdata(), idata(), cnts(), start(),
+            count()
+        {}
+
+        void set(const datarec_float*);
+
+        void set(const datarec_int*);
+
+        bool isInt;
+        double time;
+        int connectionId;
+        int datarecId;
+        unsigned long long seq;
+        std::vector<float> fdata;
+        std::vector<int> idata;
+        std::vector<int> cnts;
+        std::vector<int> start;
+        std::vector<int> count;
+    };
+
+    /**
+     * Check the variable group id and the lengths of the start and
+     * count arrays of a record, since the writer thread cannot report
+     * a bad record back to the client right away.
+     * @throws NcServerAccessFailed
+     */
+    template<class REC_T>
+        void check_rec(const REC_T * writerec);
+
+    /**
+     * Validate records and add them to the write-behind queue,
+     * waiting for room if the queue is full.
+     */
+    template<class REC_T>
+        int queue_recs(const REC_T * writerecs, unsigned int nrecs,
+                       unsigned long long seq) throw();
+
+    /**
+     * Writer thread: write the queued records until the
+     * connection is closed.
+     */
+    void write_behind();
+
+    void write_queued(QueuedRec& rec) throw();
+
     FileGroup *_filegroup;
 
     std::string _history;
 
     int _histlen;
 
-    NS_NcFile *_lastf;          // last file written to, saved for efficiency
-    time_t _lastRequest;
+    /**
+     * Files recently written to, most recent first, saved for efficiency.
+     */
+    std::vector<NS_NcFile*> _hotFiles;
+    std::atomic<time_t> _lastRequest;
     int _id;
 
     std::string _errorMsg;
 
-    enum state _state;
+    std::atomic<enum state> _state;
 
     Connection(const Connection&);
     Connection& operator=(const Connection&);
 
     bool _first_rec_received{false};
 
+    /**
+     * Expected length of the start and count arrays of the records
+     * of each variable group defined on this connection, or -1.
+     * Used to validate records before they are queued.
+     */
+    std::vector<int> _startLengths;
+
+    /**
+     * Serializes the RPC threads adding to the write-behind queue, so
+     * adding is not lock-free, although this is only contended if a
+     * client has several requests in progress.  The writer thread does
+     * not take it, and only shares the atomic indices of the queue
+     * with the producer.
+     */
+    std::mutex _producerMutex;
+
+    /**
+     * Ring of queued records.  The RPC thread fills _queue[_qtail % size]
+     * and then increments _qtail, the writer thread writes
+     * _queue[_qhead % size] and then increments _qhead.
+     */
+    std::vector<QueuedRec> _queue;
+
+    std::atomic<unsigned int> _qhead;
+
+    std::atomic<unsigned int> _qtail;
+
+    /**
+     * Only used to sleep when the queue is empty or full.
+     */
+    std::mutex _queueMutex;
+
+    std::condition_variable _queueCond;
+
+    std::condition_variable _drainCond;
+
+    std::atomic<unsigned long long> _recsReceived;
+
+    std::atomic<unsigned long long> _bytesReceived;
+
+    std::atomic<unsigned long long> _recsWritten;
+
+    /**
+     * Queued records which the writer thread discarded, because an
+     * earlier record failed.
+     */
+    std::atomic<unsigned long long> _recsDropped;
+
+    LatencyHistogram _putLatency;
+
+    std::atomic<bool> _writerWaiting;
+
+    std::atomic<int> _drainWaiters;
+
+    std::atomic<bool> _quit;
+
+    std::thread _writer;
+
+    /**
+     * Highest sequence number received.  Protected by the FileGroup
+     * mutex, or by _producerMutex if there is a writer thread.
+     */
+    unsigned long long _seqReceived;
+
+    std::atomic<unsigned long long> _seqApplied;
+
+    /**
+     * Files written to since they were synced, with the sequence
+     * number of the first record written to them since then.
+     * Protected by the FileGroup mutex.
+     */
+    std::vector<std::pair<NS_NcFile*, unsigned long long> > _unsynced;
+
+    /**
+     * Protects _journaled and _seqJournalDurable.
+     */
+    std::mutex _ackMutex;
+
+    /**
+     * Journal entry numbers not known to be committed, with the
+     * highest sequence number of their records.
+     */
+    std::deque<std::pair<unsigned long, unsigned long long> > _journaled;
+
+    unsigned long long _seqJournalDurable;
 };
 
 class AllFiles
@@ -316,17 +1175,118 @@ public:
     static AllFiles *Instance();
 
     /**
+     * Find or create the FileGroup for a connection, and add the
+     * Connection to it.
      * @throws InvalidFileLength, InvalidInterval, InvalidOutputDir
      */
-    FileGroup *get_file_group(const struct connection *);
+    FileGroup *get_file_group(const struct connection *, Connection *);
     void close() throw();
     void sync() throw();
     void close_old_files(void) throw();
-    void close_oldest_file(void) throw();
+
+    /**
+     * Write the old buffered records of the FileGroups which are
+     * not in use by other threads.  This is called periodically
+     * from the dispatch loop, and does not wait for any lock.
+     */
+    void flush_old_records() throw();
+
+    /**
+     * Close the least recently used file of the FileGroups other
+     * than caller.  This is called by a FileGroup which has its mutex
+     * locked, so files of other groups which are busy in another
+     * thread are skipped.  The files of the caller are skipped too,
+     * since its recursive mutex cannot tell whether they are in use
+     * further up the stack, such as the file it has just opened.
+     * @return false if no file could be closed.
+     */
+    bool close_oldest_file(FileGroup* caller) throw();
+
+    /**
+     * Close least recently used files of the FileGroups other than
+     * caller, until no more than the maximum number are open.
+     */
+    void close_oldest_files(FileGroup* caller) throw();
+
     int num_files(void) const;
 
+    /**
+     * Set the maximum number of files open at once.  If n is not
+     * positive, use DEFAULT_MAX_OPEN_FILES.  The RLIMIT_NOFILE soft
+     * limit is raised if needed, up to the hard limit, keeping some
+     * descriptors for the RPC connections, and n is reduced if that
+     * is not enough.
+     */
+    void setMaxOpenFiles(int n);
+
+    /**
+     * Maximum number of open files, unless set with -f.
+     */
+    static const int DEFAULT_MAX_OPEN_FILES = 16;
+
+    int getMaxOpenFiles() const
+    {
+        return _maxOpenFiles;
+    }
+
+    /**
+     * Add the statistics of each FileGroup to a report.
+     */
+    void report(MetricsReport& report);
+
+    /**
+     * Create the next file of each active FileGroup whose data is
+     * within lead seconds of the end of its current file.
+     * Called periodically from a background thread.
+     */
+    void precreate_files(int lead) throw();
+
+    /**
+     * FileGroups call these with their mutex locked when they open and
+     * close files.  The open files of all groups are kept in a list,
+     * most recently used first, so the least recently used one is found
+     * without locking or searching every group.
+     */
+    void file_opened(FileGroup* group, NS_NcFile* f);
+
+    void file_closed(NS_NcFile* f);
+
+    /**
+     * Move a file to the front of the list of open files.
+     */
+    void touch(NS_NcFile* f);
+
 private:
     std::vector < FileGroup*> _filegroups;
+
+    /**
+     * Protects _filegroups, and serializes the operations on all
+     * groups.  When both are locked, this mutex is locked before
+     * the mutex of a FileGroup.
+     */
+    std::recursive_mutex _mutex;
+
+    /**
+     * The group whose next file is being created by precreate_files(),
+     * without _mutex locked.  It is not deleted in the meantime.
+     */
+    FileGroup* _precreating;
+
+    std::atomic<int> _nfiles;
+
+    std::atomic<int> _maxOpenFiles;
+
+    /**
+     * Protects the list of open files.  It is locked after the mutex
+     * of a FileGroup, and only try_lock is used on a FileGroup mutex
+     * while it is held.
+     */
+    std::mutex _lruMutex;
+
+    NS_NcFile* _lruHead;
+
+    NS_NcFile* _lruTail;
+
     AllFiles(const AllFiles &); // prevent copying
     AllFiles & operator=(const AllFiles &);     // prevent assignment
     static AllFiles *_instance;
@@ -417,36 +1377,149 @@ public:
         return std::unique_ptr<NcAtt>{NcFile::get_att(attname.c_str())};
     }
 
-    NcBool add_att(const std::string& attname, const std::string& v)
+    NcBool add_att(const std::string& attname, const std::string& v)
+    {
+        return NcFile::add_att(attname.c_str(), v.c_str());
+    }
+
+    NcBool add_att(const std::string& attname, int v)
+    {
+        return NcFile::add_att(attname.c_str(), v);
+    }
+
+    /**
+     * Append the lines of history which are not in the history
+     * attribute already.
+     */
+    void put_history(std::string history);
+
+    /**
+     * Set a global attribute, and sync if it is time.  The attributes
+     * which have changed are written together when the file is synced
+     * or closed.
+     */
+    void write_global_attr(const std::string& name, const std::string& val);
+
+    void write_global_attr(const std::string& name, int val);
+
+    void write_global_attrs(const struct global_attrs* attrs);
+
+    time_t LastAccess() const
+    {
+        return _lastAccess;
+    }
+
+    double StartTime() const
+    {
+        return _startTime;
+    }
+
+    /**
+     * Write any buffered records, then sync the file.
+     */
+    NcBool sync(void) throw();
+
+    /**
+     * Sync the file if its oldest buffered record is older than the
+     * maximum age of the record buffer.  This writes the records of a
+     * group which has stopped receiving data, and so does not reach
+     * the check in put_rec().
+     */
+    void flush_old_records() throw();
+
+    /**
+     * Set the size of the record buffer of each file.  If nrecs is
+     * greater than one, consecutive time records of a VariableGroup
+     * with one sample per record are kept in memory, and written with
+     * one put of each variable over the time range once nrecs records
+     * are buffered, or the first buffered record is maxAge seconds
+     * old, or when the file is synced or closed.
+     */
+    static void setRecordBuffer(unsigned int nrecs, int maxAge)
+    {
+        _recordBufferSize = nrecs;
+        _recordBufferAge = maxAge;
+    }
+
+    /**
+     * Write the buffered records and their times.
+     * @throws NetCDFAccessFailed
+     */
+    void flush_records();
+
+    /**
+     * Add the variables of a VariableGroup to the file, if they
+     * are not there already.  The file is left in define mode,
+     * until commit_schema().
+     * @throws NetCDFAccessFailed
+     */
+    void define_var_group(VariableGroup* vgroup);
+
+    /**
+     * Leave define mode, if the file is in it, with the header free
+     * space and variable alignment of setHeaderReserve().  If the
+     * header no longer fits, or record variables have been added to
+     * a file with records, libnetcdf moves the data in the file,
+     * which is counted by the FileGroup.
+     * @throws NetCDFAccessFailed
+     */
+    void commit_schema();
+
+    /**
+     * Create the files with h_minfree bytes of free space after the
+     * header, and the data of the variables aligned on v_align bytes,
+     * (see nc__enddef), so that variables and attributes can be
+     * added without moving the data.  Defaults are 0 and 4, as
+     * with nc_enddef.
+     */
+    static void setHeaderReserve(size_t h_minfree, size_t v_align)
     {
-        return NcFile::add_att(attname.c_str(), v.c_str());
+        _headerFree = h_minfree;
+        _varAlign = v_align;
     }
 
-    NcBool add_att(const std::string& attname, int v)
+    /**
+     * If val is true, the variables of all the variable groups of the
+     * file group are added to a file when the first of them is
+     * written, in one define mode session.  The groups which then have
+     * no data for the file are left with fill values.  Default false:
+     * a group is added when it is first written to the file.
+     */
+    static void setStageGroups(bool val)
     {
-        return NcFile::add_att(attname.c_str(), v);
+        _stageGroups = val;
     }
 
     /**
-     * @throws NetCDFAccessFailed
+     * Change the name of the file, after it has been renamed.
      */
-    void put_history(std::string history);
+    void setName(const std::string& val)
+    {
+        _fileName = val;
+    }
 
     /**
-     * @throws NetCDFAccessFailed
+     * Open files in NC_NOFILL mode, so that libnetcdf does not write
+     * fill values to every record variable when the number of
+     * records grows, which are then overwritten with the data.
+     * Instead the records written to each variable are tracked,
+     * and fill_gaps() writes fill values to the records which were
+     * not, so the content of the files is the same as with fill mode.
+     * If the process dies before a sync or close, the skipped records
+     * are left with whatever was on the disk.
      */
-    void write_global_attr(const std::string& name, const std::string& val);
+    static void setNoFill(bool val)
+    {
+        _noFillMode = val;
+    }
 
     /**
+     * In NC_NOFILL mode, write fill values to the records of each
+     * record variable which have not been written.  Called when
+     * the file is synced and closed.
      * @throws NetCDFAccessFailed
      */
-    void write_global_attr(const std::string& name, int val);
-
-    time_t LastAccess() const
-    {
-        return _lastAccess;
-    }
-    NcBool sync(void) throw();
+    void fill_gaps();
 
     std::string getCountsName(VariableGroup* vg);
 
@@ -476,10 +1549,24 @@ public:
 
     /**
      * When writing time-series records, how frequently to check
-     * to sync the NetCDF file.
+     * to sync the NetCDF file, by default.
      */
     static const int SYNC_CHECK_INTERVAL_SECS = 5;
 
+    /**
+     * Sync a file when it is written and has not been synced for
+     * secs seconds.  Increased when the requests are journaled.
+     */
+    static void setSyncInterval(int secs)
+    {
+        _syncInterval = secs;
+    }
+
+    static int getSyncInterval()
+    {
+        return _syncInterval;
+    }
+
 private:
     std::string _fileName;
     double _startTime, _endTime;
@@ -524,6 +1611,25 @@ private:
 
     std::string _historyHeader;
 
+    /**
+     * Mirror of the global attributes of the file, with the
+     * values which have not been written to it yet.
+     */
+    std::map<std::string, std::string> _textAttrs;
+
+    std::map<std::string, int> _intAttrs;
+
+    /**
+     * Names of the attributes which differ from the file.
+     */
+    std::set<std::string> _dirtyAttrs;
+
+    /**
+     * Lines of the history attribute, to skip those which are
+     * put again.  Filled on the first put_history().
+     */
+    std::unordered_set<std::string> _historyLines;
+
     /**
      * @brief Get variables.
      * 
@@ -533,6 +1639,14 @@ private:
      */
     const std::vector<NS_NcVar*>& get_vars(VariableGroup *);
 
+    /**
+     * Add the variables of a VariableGroup to the file, without
+     * leaving define mode.
+     * @return true if the file was modified.
+     * @throws NetCDFAccessFailed
+     */
+    bool define_vars(VariableGroup *);
+
     /**
      * Add a variable to the NS_NcFile. Set modified to true if
      * the NcFile was modified.
@@ -554,16 +1668,283 @@ private:
      */
     bool add_attrs(OutVariable * v, NS_NcVar * var,const std::string& countsAttr);
 
+    /**
+     * Set a global attribute in the mirror, if it does not have the
+     * value, to be written by flush_attrs().
+     * @return true if it was changed.
+     */
+    bool set_global_attr(const std::string& name, const std::string& value);
+
+    bool set_global_attr(const std::string& name, int value);
+
+    /**
+     * Read the global attributes of the file into the mirror.
+     */
+    void load_attrs();
+
+    /**
+     * Add the changed global attributes to the file, which is then
+     * in define mode until commit_schema().
+     * @throws NetCDFAccessFailed
+     */
+    void flush_attrs();
+
     bool check_var_dims(NcVar *);
     const NcDim *get_dim(NcToken name, long size);
 
     std::map <int,std::string> _countsNamesByVGId;
 
+    /**
+     * Consecutive records of one VariableGroup, which have the
+     * same start and count, buffered by put_rec().
+     */
+    struct RecordBlock
+    {
+        RecordBlock(): nrec(0), nrecs(0), hasCnts(false),
+            start(), count(), fvals(), ivals()
+        {}
+
+        /** Can record nrec with these start and count be added? */
+        bool follows(long nrec, int nstart, const long* start,
+                     const long* count, bool hasCnts) const;
+
+        void append(int iv, const float* d, int n)
+        {
+            fvals[iv].insert(fvals[iv].end(), d, d + n);
+        }
+
+        void append(int iv, const int* d, int n)
+        {
+            ivals[iv].insert(ivals[iv].end(), d, d + n);
+        }
+
+        /** first record number */
+        long nrec;
+
+        /** number of records */
+        long nrecs;
+
+        bool hasCnts;
+
+        std::vector<long> start;
+
+        std::vector<long> count;
+
+        /** values of each variable, float or int */
+        std::vector<std::vector<float> > fvals;
+
+        std::vector<std::vector<int> > ivals;
+    };
+
+    /**
+     * Record buffers, by VariableGroup id.
+     */
+    std::map <int,RecordBlock> _recordBlocks;
+
+    /**
+     * Time offsets of the buffered records, starting at
+     * record _timeBlockStart.
+     */
+    std::vector<double> _timeBlock;
+
+    long _timeBlockStart;
+
+    /**
+     * When the first record in the buffer was added, or 0 if empty.
+     */
+    time_t _bufferTime;
+
+    static unsigned int _recordBufferSize;
+
+    static int _recordBufferAge;
+
+    /**
+     * @throws NetCDFAccessFailed
+     */
+    void flush_times();
+
+    /**
+     * Discard the buffered records.
+     */
+    void clear_records();
+
+    static bool _noFillMode;
+
+    static size_t _headerFree;
+
+    static size_t _varAlign;
+
+    static bool _stageGroups;
+
+    static std::atomic<int> _syncInterval;
+
+    /**
+     * This file is in NC_NOFILL mode.
+     */
+    bool _noFill;
+
+    /**
+     * Number of records in the file when opened.  These were
+     * already filled or written.
+     */
+    long _fillFrom;
+
+    /**
+     * Number of variables when opened.  Variables with larger ids are
+     * new, and are filled from the first record.
+     */
+    int _nvarsAtOpen;
+
+    /**
+     * For each record variable id, the ranges of records which have
+     * been written or filled, as a map of first record to one past
+     * the last.
+     */
+    std::map<int, std::map<long,long> > _writtenRecs;
+
+    /**
+     * What fill_unwritten() needs to know about a record variable,
+     * which does not change once the variable is defined.
+     */
+    struct RecordFill
+    {
+        RecordFill(): ndims(0), esize(0), nvals(1), count(), fill() {}
+        int ndims;
+        /** size of one value */
+        size_t esize;
+        /** number of values in one record */
+        size_t nvals;
+        /** the lengths of the dimensions of one record */
+        std::vector<size_t> count;
+        /** the fill value */
+        std::vector<char> fill;
+    };
+
+    /**
+     * RecordFill of each variable id, added when first filled.
+     */
+    std::map<int, RecordFill> _recordFills;
+
+    /**
+     * Ids of the record variables which fill_gaps() fills, among the
+     * first _nvarsChecked variables of the file.
+     */
+    std::vector<int> _fillVarIds;
+
+    int _nvarsChecked;
+
+    /**
+     * Return the RecordFill of a record variable, inquiring it the
+     * first time.
+     * @throws NetCDFAccessFailed
+     */
+    const RecordFill& record_fill(int varid);
+
+    /**
+     * Track a put of nrecs records of a variable, after NS_NcVar::set_cur().
+     * If the put does not cover whole records, fill the records first.
+     * @throws NetCDFAccessFailed
+     */
+    void track_put(NS_NcVar* var, long nrec, long nrecs, const long* count);
+
+    /**
+     * Write fill values to the records of a variable from first to
+     * end - 1 which have not been written, and mark them written.
+     * @throws NetCDFAccessFailed
+     */
+    void fill_unwritten(int varid, long first, long end);
+
+    /**
+     * The FileGroup of this file, and the neighbours of this
+     * file in the AllFiles list of open files.
+     */
+    friend class AllFiles;
+    FileGroup* _group;
+    NS_NcFile* _lruPrev;
+    NS_NcFile* _lruNext;
+
     NS_NcFile(const NS_NcFile &);       // prevent copying
     NS_NcFile & operator=(const NS_NcFile &);   // prevent assignment
 
 };
 
+/**
+ * The dimensions, variables, attributes and data of a CDL file, parsed
+ * once, from which any number of netCDF files can be created without
+ * running ncgen.  Only the netCDF-3 subset of CDL is supported.
+ */
+class CDLSchema
+{
+public:
+    /**
+     * Parse a CDL file.
+     * @throws nidas::util::IOException
+     * @throws nidas::util::ParseException
+     */
+    CDLSchema(const std::string& cdlFileName);
+
+    /**
+     * Create a netCDF file from the schema, replacing any existing file.
+     * @return 0 on success, otherwise a netCDF error status.
+     */
+    int create(const std::string& fileName) const;
+
+    /**
+     * Modification time of the CDL file when it was parsed.
+     */
+    const struct timespec& mtime() const
+    {
+        return _mtime;
+    }
+
+private:
+
+    struct Att
+    {
+        std::string name;
+        nc_type type;
+        std::string text;
+        std::vector<double> vals;
+    };
+
+    struct Dim
+    {
+        std::string name;
+        size_t len;
+    };
+
+    struct Var
+    {
+        std::string name;
+        nc_type type;
+        std::vector<int> dimids;
+        std::vector<Att> atts;
+        std::vector<double> data;
+        std::string text;
+    };
+
+    class Scanner;
+
+    void parse_attr(Scanner& scan, std::vector<Att>& atts, nc_type type);
+
+    void parse_data(Scanner& scan, Var& var);
+
+    double fill_value(const Var& var) const;
+
+    int put_data(int ncid, int varid, const Var& var) const;
+
+    std::string _fileName;
+
+    struct timespec _mtime;
+
+    std::vector<Dim> _dims;
+
+    std::vector<Var> _vars;
+
+    std::vector<Att> _globalAtts;
+
+};
+
 // A file group is a list of similarly named files with the same
 // time series data interval and length
 class FileGroup
@@ -580,11 +1961,14 @@ public:
     ~FileGroup(void);
 
     /**
+     * Write a record to the file containing its time.  hotFiles are the
+     * files most recently written by the connection, most recent first,
+     * which are checked before the files of the group, and updated.
      * @throws nidas::util::Exception
-     * @return NS_NcFile* 
      */
     template<class REC_T, class DATA_T>
-        NS_NcFile* put_rec(const REC_T * writerec, NS_NcFile * f);
+        void put_rec(const REC_T * writerec,
+                     std::vector<NS_NcFile*>& hotFiles);
 
     int match(const std::string & dir, const std::string & file);
     /**
@@ -602,11 +1986,60 @@ public:
      */
     NS_NcFile *open_file(double time);
 
+    /**
+     * Open or create a file and write global attributes to it.
+     * The mutex must be locked, since a changed CDL file is parsed
+     * again into the schema of the group.
+     * @throws NetCDFAccessFailed
+     */
+    NS_NcFile *open_file(const std::string& fileName,
+            const UTime& basetime, const UTime& endtime,
+            const std::map<std::string,std::string>& attrs,
+            const std::map<std::string,int>& intAttrs);
+
+    /**
+     * If the data of this group is within lead seconds of the end
+     * of its file, create and define the next file, so it is ready
+     * when the data gets there.  The mutex is locked while the file
+     * is created under a temporary name, and then linked to its real
+     * name and added to the group.  The caller must make sure that
+     * this group is not deleted in the meantime.
+     */
+    void precreate_file(int lead) throw();
+
+    /**
+     * The temporary name of a file while it is pre-created,
+     * which includes the process id.
+     */
+    static std::string precreate_name(const std::string& fileName);
+
+    /**
+     * Remove the temporary files in a directory which were left
+     * by another nc_server process while pre-creating them.
+     */
+    static void remove_precreated(const std::string& dir);
+
     void close() throw();
     void sync() throw();
     void close_old_files(void) throw();
-    void close_oldest_file(void) throw();
+    void flush_old_records() throw();
+    /**
+     * Write history and global attributes to a file of this group,
+     * then close it.
+     */
+    void close_file(NS_NcFile* f) throw();
     void add_connection(Connection *);
+
+    /**
+     * Writes to the files of this group, and changes to its
+     * connections and variable groups, are serialized with this mutex.
+     * FileGroup methods do not lock it themselves, the Connection
+     * and AllFiles callers do.
+     */
+    std::recursive_mutex& mutex()
+    {
+        return _mutex;
+    }
     void remove_connection(Connection *);
 
     /**
@@ -615,6 +2048,16 @@ public:
      */
     int add_var_group(const struct datadef *);
 
+    /**
+     * @return: the VariableGroup with an id, or 0 if not found.
+     */
+    const VariableGroup* get_var_group(int id) const;
+
+    /**
+     * Append the variable groups to vgroups.
+     */
+    void get_var_groups(std::vector<VariableGroup*>& vgroups) const;
+
     double interval() const
     {
         return _interval;
@@ -635,13 +2078,27 @@ public:
     {
         return _vargroups.size();
     }
-    time_t oldest_file();
 
     std::string build_name(const std::string & outputDir,
             const std::string & nameFormat,
             double fileLength, const UTime& basetime) const;
     int check_file(const std::string &) const;
-    int ncgen_file(const std::string &, const std::string &) const;
+
+    /**
+     * Create a netCDF file from a CDL file.  The CDL is parsed once,
+     * and again only if its modification time changes.  If the CDL
+     * cannot be parsed, or the file cannot be created from it, fall
+     * back to running ncgen.  The mutex must be locked, since the
+     * parsed schema is replaced here.
+     * @return 0 on success.
+     */
+    int ncgen_file(const std::string &, const std::string &);
+
+    /**
+     * Run ncgen to create a netCDF file from a CDL file.
+     * @return 0 on success.
+     */
+    int run_ncgen(const std::string &, const std::string &) const;
 
     /**
      * @throws NetCDFAccessFailed
@@ -653,15 +2110,51 @@ public:
      */
     void write_global_attr(const std::string & name, int value);
 
+    /**
+     * @throws NetCDFAccessFailed
+     */
+    void write_global_attrs(const struct global_attrs* attrs);
+
     /**
      * @throws NetCDFAccessFailed
      */
     void update_global_attrs();
 
+    /**
+     * Set the global attributes of the group in a file.
+     * @throws NetCDFAccessFailed
+     */
+    void update_global_attrs(NS_NcFile* f);
+
     std::string toString() const {
         return _outputDir + '/' + _fileNameFormat;
     }
 
+    /**
+     * Called by a file of this group after a sync.
+     * @param ok The sync succeeded.
+     */
+    void file_synced(NS_NcFile* f, bool ok,
+                     LatencyHistogram::clock::duration d)
+    {
+        _syncLatency.add(d);
+        if (!ok) return;
+        for (unsigned int i = 0; i < _connections.size(); i++)
+            _connections[i]->file_synced(f);
+    }
+
+    /**
+     * Called by a file of this group when buffered records, or the
+     * fill values and attributes, could not be written to it.
+     */
+    void write_failed(NS_NcFile* f, const std::string& msg)
+    {
+        for (unsigned int i = 0; i < _connections.size(); i++)
+            _connections[i]->write_failed(f, msg);
+    }
+
+    void report(MetricsReport& report) const;
+
     /**
      * Given a data time, find the file times which bound it.  The file times
      * depend on file length and config bounds.  A monthly interval is
@@ -681,10 +2174,22 @@ private:
 
     std::vector < Connection * >_connections;
 
-    std::list < NS_NcFile * >_files;    // List of files in this group
+    /**
+     * Files in this group, by start time.
+     */
+    std::map<double, NS_NcFile*> _files;
+
+    /**
+     * Return the open file containing dtime, or null.
+     */
+    NS_NcFile *find_file(double dtime) const;
 
     static const int FILEACCESSTIMEOUT;
-    static const int MAX_FILES_OPEN;
+
+    /**
+     * How many recently written files are kept for each connection.
+     */
+    static const unsigned int HOT_FILES;
 
     FileGroup(const FileGroup &);       // prevent copying
     FileGroup & operator=(const FileGroup &);   // prevent assignment
@@ -692,6 +2197,19 @@ private:
     std::string _outputDir;
     std::string _fileNameFormat;
     std::string _CDLFileName;
+
+    /**
+     * Schema parsed from _CDLFileName, null if it could not be parsed.
+     * Shared, so that files can be created from it without holding
+     * the group lock.
+     */
+    std::shared_ptr<const CDLSchema> _cdlSchema;
+
+    /**
+     * Modification time of _CDLFileName when last parsed.
+     */
+    struct timespec _cdlMtime;
+
     std::map <int, VariableGroup*> _vargroups;
     int _vargroupId;
     double _interval;
@@ -701,6 +2219,28 @@ private:
 
     std::map<std::string,int> _globalIntAttrs;
 
+    std::recursive_mutex _mutex;
+
+    /**
+     * Latest data time written to this group.
+     */
+    double _lastDataTime;
+
+    /**
+     * Statistics, which are read without the mutex locked.
+     */
+    std::atomic<unsigned long> _nopens;
+
+    std::atomic<unsigned long> _ncloses;
+
+    mutable std::atomic<unsigned long> _nchecks;
+
+    std::atomic<unsigned long> _ncdlCreates;
+
+    std::atomic<unsigned long> _nncgens;
+
+    LatencyHistogram _syncLatency;
+
 };
 
 class VariableGroup
@@ -842,7 +2382,21 @@ public:
     NcBool set_cur(long, int, const long *);
     int put(const float *d, const long *);
     int put(const int * d, const long *);
+
+    /**
+     * Write nrecs consecutive records, each with the given counts,
+     * starting at the record set by set_cur().
+     */
+    int put_recs(const float *d, long nrecs, const long *);
+    int put_recs(const int * d, long nrecs, const long *);
     int put_len(const long *);
+
+    /**
+     * After set_cur() and put_len(), whether the put
+     * covers all the values of its records.
+     */
+    bool whole_records() const;
+
     const char *name() const
     {
         return _var->name();
@@ -115,6 +115,8 @@ exit 0
 %{prefix}/bin/nc_ping
 %{prefix}/bin/nc_close
 %{prefix}/bin/nc_sync
+%{prefix}/bin/nc_stats
+%{prefix}/bin/nc_replay
 
 %changelog
 * Mon Feb 03 2025 Gary Granger <granger@ucar.edu> - 2.2-1
@@ -77,6 +77,50 @@ struct datarec_int {
     int count<>;
 };
 
+/**
+  * A sequence of float data records, possibly of different datarecIds,
+  * all from the same connection.  The records are written in order and
+  * a single status is returned for the whole array.
+  */
+struct datarec_float_array {
+    int connectionId;
+    datarec_float recs<>;
+};
+
+/**
+  * A sequence of int data records, possibly of different datarecIds,
+  * all from the same connection.
+  */
+struct datarec_int_array {
+    int connectionId;
+    datarec_int recs<>;
+};
+
+/**
+  * A sequence of float data records from a connection, numbered
+  * consecutively from seq, which starts at 1 on each connection.
+  * Records which have already been received are skipped, so they
+  * can be sent again if it is not known whether they arrived.
+  */
+struct datarec_float_seq {
+    int connectionId;
+    unsigned hyper seq;
+    datarec_float recs<>;
+};
+
+/**
+  * Progress of the sequence numbered records of a connection.
+  * applied: highest sequence number written to the file.
+  * durable: highest sequence number which will survive a crash of
+  *     the server, because the file or the journal has been synced.
+  * error: empty, or the error which stopped the records after applied.
+  */
+struct ack {
+    unsigned hyper applied;
+    unsigned hyper durable;
+    string error<>;
+};
+
 /**
   * Global NetCDF string attribute, "history".
   */
@@ -102,6 +146,41 @@ struct global_int_attr {
     int connectionId;
 };
 
+/**
+  * Global NetCDF integer attribute, in a global_attrs.
+  */
+struct int_attr {
+    string name<>;
+    int value;
+};
+
+/**
+  * Global NetCDF attributes of a connection, written to the files
+  * together.
+  */
+struct global_attrs {
+    int connectionId;
+    str_attr attrs<>;
+    int_attr intAttrs<>;
+};
+
+/**
+  * Data record definitions of a connection.  The connectionId
+  * of the datadefs is ignored.
+  */
+struct datadefs {
+    int connectionId;
+    datadef defs<>;
+};
+
+/**
+  * Ids of the data records of a DEFINE_DATARECS, in the order of the
+  * datadefs, or none if one of them could not be defined.
+  */
+struct datarec_ids {
+    int ids<>;
+};
+
 struct connection {
     double filelength;
     double interval;
@@ -141,5 +220,21 @@ program NETCDFSERVERPROG {
         int SYNC_FILES(void) = 14;
 
         string CHECK_ERROR(int id) = 15;
+
+        int WRITE_DATAREC_FLOAT_ARRAY(datarec_float_array) = 16;
+
+        int WRITE_DATAREC_INT_ARRAY(datarec_int_array) = 17;
+
+        string GET_STATS(void) = 18;
+
+        string GET_TRACE(void) = 19;
+
+        void WRITE_DATAREC_FLOAT_SEQ(datarec_float_seq) = 20;
+
+        ack ACK_THROUGH(int) = 21;
+
+        datarec_ids DEFINE_DATARECS(datadefs) = 22;
+
+        int WRITE_GLOBAL_ATTRS(global_attrs) = 23;
     } = 2;
 } = 0x20000004;
@@ -9,23 +9,30 @@
 
 int *open_connection_2_svc(connection * input, struct svc_req *)
 {
+    ServerStats::HandlerTimer timer;
 
-    static int res;
+    static thread_local int res;
 
     res = -1;
 
     Connections *connections = Connections::Instance();
 
     res = connections->openConnection(input);
+    RequestCapture::capture(OPEN_CONNECTION, (xdrproc_t) xdr_connection,
+                            input, res);
+    if (res >= 0)
+        Journal::append(OPEN_CONNECTION, (xdrproc_t) xdr_connection,
+                        input, res);
 
     return &res;
 }
 
 int *define_datarec_2_svc(datadef * ddef, struct svc_req *)
 {
+    ServerStats::HandlerTimer timer;
 
-    static int res;
-    Connection *conn;
+    static thread_local int res;
+    std::shared_ptr<Connection> conn;
     Connections *connections = Connections::Instance();
 
     res = -1;
@@ -37,14 +44,21 @@ int *define_datarec_2_svc(datadef * ddef, struct svc_req *)
     }
 
     res = conn->add_var_group(ddef);
+    RequestCapture::capture(DEFINE_DATAREC, (xdrproc_t) xdr_datadef, ddef,
+                            res);
+    if (res >= 0)
+        Journal::append(DEFINE_DATAREC, (xdrproc_t) xdr_datadef, ddef, res);
     VLOG(("define_datarec_2_svc res=%d", res));
     return &res;
 }
 
 int *write_datarec_float_2_svc(datarec_float * writereq, struct svc_req *)
 {
-    static int res;
-    Connection *conn;
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_DATAREC_FLOAT,
+                            (xdrproc_t) xdr_datarec_float, writereq);
+    static thread_local int res;
+    std::shared_ptr<Connection> conn;
     Connections *connections = Connections::Instance();
 
     res = -1;
@@ -59,14 +73,20 @@ int *write_datarec_float_2_svc(datarec_float * writereq, struct svc_req *)
     VLOG(("writereq->connectionId=%d", writereq->connectionId));
 
     res = conn->put_rec(writereq);
+    if (res >= 0)
+        Journal::append(WRITE_DATAREC_FLOAT, (xdrproc_t) xdr_datarec_float,
+                        writereq);
     VLOG(("write_datarec_float_2_svc res=%d", res));
     return &res;
 }
 
 int *write_datarec_int_2_svc(datarec_int * writereq, struct svc_req *)
 {
-    static int res;
-    Connection *conn;
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_DATAREC_INT,
+                            (xdrproc_t) xdr_datarec_int, writereq);
+    static thread_local int res;
+    std::shared_ptr<Connection> conn;
     Connections *connections = Connections::Instance();
 
     res = -1;
@@ -77,6 +97,9 @@ int *write_datarec_int_2_svc(datarec_int * writereq, struct svc_req *)
         return &res;
     }
     res = conn->put_rec(writereq);
+    if (res >= 0)
+        Journal::append(WRITE_DATAREC_INT, (xdrproc_t) xdr_datarec_int,
+                        writereq);
     VLOG(("write_datarec_int_2_svc res=%d", res));
     return &res;
 }
@@ -84,8 +107,11 @@ int *write_datarec_int_2_svc(datarec_int * writereq, struct svc_req *)
 void *write_datarec_batch_float_2_svc(datarec_float * writereq,
                                     struct svc_req *)
 {
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_DATAREC_BATCH_FLOAT,
+                            (xdrproc_t) xdr_datarec_float, writereq);
     Connections *connections = Connections::Instance();
-    Connection *conn;
+    std::shared_ptr<Connection> conn;
 
     if ((conn = (*connections)[writereq->connectionId]) == 0) {
         PLOG(("write_datarecbatch_float: invalid connection ID: %d",
@@ -93,6 +119,9 @@ void *write_datarec_batch_float_2_svc(datarec_float * writereq,
         return (void *) 0;
     }
     int res = conn->put_rec(writereq);
+    if (res >= 0)
+        Journal::append(WRITE_DATAREC_BATCH_FLOAT,
+                        (xdrproc_t) xdr_datarec_float, writereq);
     /* Batch mode, return NULL, so RPC does not reply */
     VLOG(("write_datarec_batch_float_2_svc res=%d", res));
     return (void *) 0;
@@ -101,8 +130,11 @@ void *write_datarec_batch_float_2_svc(datarec_float * writereq,
 void *write_datarec_batch_int_2_svc(datarec_int * writereq,
                                    struct svc_req *)
 {
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_DATAREC_BATCH_INT,
+                            (xdrproc_t) xdr_datarec_int, writereq);
     Connections *connections = Connections::Instance();
-    Connection *conn;
+    std::shared_ptr<Connection> conn;
 
     if ((conn = (*connections)[writereq->connectionId]) == 0) {
         PLOG(("write_datarec_batch_int: invalid connection ID: %d",
@@ -110,17 +142,74 @@ void *write_datarec_batch_int_2_svc(datarec_int * writereq,
         return (void *) 0;
     }
     int res = conn->put_rec(writereq);
+    if (res >= 0)
+        Journal::append(WRITE_DATAREC_BATCH_INT,
+                        (xdrproc_t) xdr_datarec_int, writereq);
     VLOG(("write_datarec_batch_int_2_svc res=%d", res));
     /* Batch mode, return NULL, so RPC does not reply */
     return (void *) 0;
 }
 
+int *write_datarec_float_array_2_svc(datarec_float_array * writereq,
+                                     struct svc_req *)
+{
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_DATAREC_FLOAT_ARRAY,
+                            (xdrproc_t) xdr_datarec_float_array, writereq);
+    static thread_local int res;
+    std::shared_ptr<Connection> conn;
+    Connections *connections = Connections::Instance();
+
+    res = -1;
+
+    if ((conn = (*connections)[writereq->connectionId]) == 0) {
+        PLOG(("write_datarec_float_array: invalid connection ID: %d",
+                    (writereq->connectionId & 0xffff)));
+        return &res;
+    }
+    res = conn->put_recs(writereq);
+    if (res >= 0)
+        Journal::append(WRITE_DATAREC_FLOAT_ARRAY,
+                        (xdrproc_t) xdr_datarec_float_array, writereq);
+    VLOG(("write_datarec_float_array_2_svc nrecs=%u, res=%d",
+          writereq->recs.recs_len, res));
+    return &res;
+}
+
+int *write_datarec_int_array_2_svc(datarec_int_array * writereq,
+                                   struct svc_req *)
+{
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_DATAREC_INT_ARRAY,
+                            (xdrproc_t) xdr_datarec_int_array, writereq);
+    static thread_local int res;
+    std::shared_ptr<Connection> conn;
+    Connections *connections = Connections::Instance();
+
+    res = -1;
+
+    if ((conn = (*connections)[writereq->connectionId]) == 0) {
+        PLOG(("write_datarec_int_array: invalid connection ID: %d",
+                    (writereq->connectionId & 0xffff)));
+        return &res;
+    }
+    res = conn->put_recs(writereq);
+    if (res >= 0)
+        Journal::append(WRITE_DATAREC_INT_ARRAY,
+                        (xdrproc_t) xdr_datarec_int_array, writereq);
+    VLOG(("write_datarec_int_array_2_svc nrecs=%u, res=%d",
+          writereq->recs.recs_len, res));
+    return &res;
+}
+
 int *write_history_2_svc(history_attr * attr, struct svc_req *)
 {
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_HISTORY, (xdrproc_t) xdr_history_attr, attr);
 
     Connections *connections = Connections::Instance();
-    Connection *conn;
-    static int res;
+    std::shared_ptr<Connection> conn;
+    static thread_local int res;
 
     res = -1;
 
@@ -128,7 +217,7 @@ int *write_history_2_svc(history_attr * attr, struct svc_req *)
           attr->connectionId));
 
     if ((conn = (*connections)[attr->connectionId]) == 0) {
-        VLOG(("conn=%x", conn));
+        VLOG(("conn=%p", conn.get()));
         PLOG(("write_history: invalid connection ID: %d",
                     attr->connectionId));
         return &res;
@@ -136,24 +225,31 @@ int *write_history_2_svc(history_attr * attr, struct svc_req *)
     VLOG(("write_history attr->connectionId=%d",
           attr->connectionId));
     res = conn->put_history(attr->history);
+    if (res >= 0)
+        Journal::append(WRITE_HISTORY, (xdrproc_t) xdr_history_attr, attr);
     return &res;
 }
 
 void *write_history_batch_2_svc(history_attr * attr, struct svc_req *)
 {
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_HISTORY_BATCH,
+                            (xdrproc_t) xdr_history_attr, attr);
     Connections *connections = Connections::Instance();
-    Connection *conn;
+    std::shared_ptr<Connection> conn;
 
     VLOG(("attr->connectionId=%d", attr->connectionId));
 
     if ((conn = (*connections)[attr->connectionId]) == 0) {
-        VLOG(("conn=%x", conn));
+        VLOG(("conn=%p", conn.get()));
         PLOG(("write_history_batch: invalid connection ID: %d",
                     (attr->connectionId & 0xffff)));
         return (void *) 0;
     }
     VLOG(("attr->connectionId=%d", attr->connectionId));
-    conn->put_history(attr->history);
+    if (conn->put_history(attr->history) >= 0)
+        Journal::append(WRITE_HISTORY_BATCH, (xdrproc_t) xdr_history_attr,
+                        attr);
 
     /* Batch mode, return NULL, so RPC does not reply */
     return (void *) 0;
@@ -161,9 +257,12 @@ void *write_history_batch_2_svc(history_attr * attr, struct svc_req *)
 
 int *write_global_attr_2_svc(global_attr * attr, struct svc_req *)
 {
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_GLOBAL_ATTR,
+                            (xdrproc_t) xdr_global_attr, attr);
     Connections *connections = Connections::Instance();
-    Connection *conn;
-    static int res;
+    std::shared_ptr<Connection> conn;
+    static thread_local int res;
 
     res = -1;
 
@@ -171,7 +270,7 @@ int *write_global_attr_2_svc(global_attr * attr, struct svc_req *)
           attr->connectionId));
 
     if ((conn = (*connections)[attr->connectionId]) == 0) {
-        VLOG(("conn=%x", conn));
+        VLOG(("conn=%p", conn.get()));
         PLOG(("write_global_attr: invalid connection ID: %d",
                     attr->connectionId));
         return &res;
@@ -179,14 +278,19 @@ int *write_global_attr_2_svc(global_attr * attr, struct svc_req *)
     VLOG(("write_global_attr: attr->connectionId=%d",
           attr->connectionId));
     res = conn->write_global_attr(attr->attr.name,attr->attr.value);
+    if (res >= 0)
+        Journal::append(WRITE_GLOBAL_ATTR, (xdrproc_t) xdr_global_attr, attr);
     return &res;
 }
 
 int *write_global_int_attr_2_svc(global_int_attr * attr, struct svc_req *)
 {
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_GLOBAL_INT_ATTR,
+                            (xdrproc_t) xdr_global_int_attr, attr);
     Connections *connections = Connections::Instance();
-    Connection *conn;
-    static int res;
+    std::shared_ptr<Connection> conn;
+    static thread_local int res;
 
     res = -1;
 
@@ -194,7 +298,7 @@ int *write_global_int_attr_2_svc(global_int_attr * attr, struct svc_req *)
           attr->connectionId));
 
     if ((conn = (*connections)[attr->connectionId]) == 0) {
-        VLOG(("conn=%x", conn));
+        VLOG(("conn=%p", conn.get()));
         PLOG(("write_global_int_attr: invalid connection ID: %d",
                     attr->connectionId));
         return &res;
@@ -202,22 +306,34 @@ int *write_global_int_attr_2_svc(global_int_attr * attr, struct svc_req *)
     VLOG(("write_global_int_attr: attr->connectionId=%d",
           attr->connectionId));
     res = conn->write_global_attr(attr->name,attr->value);
+    if (res >= 0)
+        Journal::append(WRITE_GLOBAL_INT_ATTR,
+                        (xdrproc_t) xdr_global_int_attr, attr);
     return &res;
 }
 
 int *close_connection_2_svc(int *connectionId, struct svc_req *)
 {
-    static int res;
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(CLOSE_CONNECTION,
+                            (xdrproc_t) xdr_int, connectionId);
+    static thread_local int res;
     Connections *connections = Connections::Instance();
 
     res = connections->closeConnection(*connectionId);
+    if (res >= 0)
+        Journal::append(CLOSE_CONNECTION, (xdrproc_t) xdr_int, connectionId);
 
     return &res;
 }
 
 int *close_files_2_svc(void *, struct svc_req *)
 {
-    static int res = 0;
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(CLOSE_FILES, (xdrproc_t)(void(*)(void)) xdr_void, 0);
+    static thread_local int res = 0;
+    // write the records in the write-behind queues first
+    Connections::Instance()->flush_queues();
     AllFiles *allfiles = AllFiles::Instance();
     allfiles->close();
     Connections *connections = Connections::Instance();
@@ -228,7 +344,11 @@ int *close_files_2_svc(void *, struct svc_req *)
 
 int *sync_files_2_svc(void *, struct svc_req *)
 {
-    static int res = 0;
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(SYNC_FILES, (xdrproc_t)(void(*)(void)) xdr_void, 0);
+    static thread_local int res = 0;
+    // write the records in the write-behind queues first
+    Connections::Instance()->flush_queues();
     AllFiles *allfiles = AllFiles::Instance();
     allfiles->sync();
     Connections *connections = Connections::Instance();
@@ -238,15 +358,17 @@ int *sync_files_2_svc(void *, struct svc_req *)
 
 void *shutdown_2_svc(void *, struct svc_req *)
 {
+    ServerStats::HandlerTimer timer;
     request_shutdown();
     return (void *) 0;
 }
 
 char **check_error_2_svc(int * id,struct svc_req *)
 {
-    static char * result = 0;
+    ServerStats::HandlerTimer timer;
+    static thread_local char * result = 0;
     Connections *connections = Connections::Instance();
-    Connection *conn;
+    std::shared_ptr<Connection> conn;
 
     if ((conn = (*connections)[*id]) == 0) {
         std::ostringstream ost;
@@ -271,3 +393,154 @@ char **check_error_2_svc(int * id,struct svc_req *)
         return &result;
     }
 }
+
+char **get_stats_2_svc(void *, struct svc_req *)
+{
+    ServerStats::HandlerTimer timer;
+    static thread_local char * result = 0;
+
+    free(result);
+    result = strdup(ServerStats::Instance()->report().c_str());
+    return &result;
+}
+
+char **get_trace_2_svc(void *, struct svc_req *)
+{
+    ServerStats::HandlerTimer timer;
+    static thread_local char * result = 0;
+
+    free(result);
+    result = strdup(Trace::dump().c_str());
+    return &result;
+}
+
+void *write_datarec_float_seq_2_svc(datarec_float_seq * writereq,
+                                    struct svc_req *)
+{
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_DATAREC_FLOAT_SEQ,
+                            (xdrproc_t) xdr_datarec_float_seq, writereq);
+    Connections *connections = Connections::Instance();
+    std::shared_ptr<Connection> conn;
+
+    if ((conn = (*connections)[writereq->connectionId]) == 0) {
+        PLOG(("write_datarec_float_seq: invalid connection ID: %d",
+                    (writereq->connectionId & 0xffff)));
+        return (void *) 0;
+    }
+    int res = conn->put_recs(writereq);
+    if (res >= 0 && writereq->recs.recs_len > 0) {
+        unsigned long entry = Journal::append(WRITE_DATAREC_FLOAT_SEQ,
+            (xdrproc_t) xdr_datarec_float_seq, writereq);
+        if (entry)
+            conn->journaled(entry,
+                            writereq->seq + writereq->recs.recs_len - 1);
+    }
+    VLOG(("write_datarec_float_seq_2_svc seq=%llu, nrecs=%u, res=%d",
+          (unsigned long long) writereq->seq, writereq->recs.recs_len, res));
+    /* Batch mode, return NULL, so RPC does not reply */
+    return (void *) 0;
+}
+
+ack *ack_through_2_svc(int * id, struct svc_req *)
+{
+    ServerStats::HandlerTimer timer;
+    static thread_local ack result = { 0, 0, 0 };
+    Connections *connections = Connections::Instance();
+    std::shared_ptr<Connection> conn;
+    std::string error;
+
+    result.applied = result.durable = 0;
+    if ((conn = (*connections)[*id]) == 0) {
+        std::ostringstream ost;
+        ost << "ack_through: invalid connection ID " << (*id & 0xffff);
+        PLOG(("%s",ost.str().c_str()));
+        error = ost.str();
+    }
+    else {
+        unsigned long long applied, durable;
+        conn->get_ack(applied, durable, error);
+        result.applied = applied;
+        result.durable = durable;
+    }
+    free(result.error);
+    result.error = strdup(error.c_str());
+    return &result;
+}
+
+datarec_ids *define_datarecs_2_svc(datadefs * ddefs, struct svc_req *)
+{
+    ServerStats::HandlerTimer timer;
+
+    static thread_local datarec_ids result;
+    static thread_local std::vector<int> ids;
+    std::shared_ptr<Connection> conn;
+    Connections *connections = Connections::Instance();
+
+    ids.clear();
+    result.ids.ids_len = 0;
+    result.ids.ids_val = 0;
+
+    if ((conn = (*connections)[ddefs->connectionId]) == 0) {
+        PLOG(("define_datarecs: invalid connection ID: %d",
+                    (ddefs->connectionId & 0xffff)));
+        return &result;
+    }
+
+    if (conn->add_var_groups(ddefs, ids) == 0 && !ids.empty()) {
+        result.ids.ids_len = ids.size();
+        result.ids.ids_val = &ids.front();
+    }
+
+    // The capture and the journal keep one id per request, so the
+    // definitions are recorded as single DEFINE_DATARECs.
+    for (unsigned int i = 0; i < ids.size(); i++) {
+        datadef* ddef = ddefs->defs.defs_val + i;
+        ddef->connectionId = ddefs->connectionId;
+        RequestCapture::capture(DEFINE_DATAREC, (xdrproc_t) xdr_datadef,
+                                ddef, ids[i]);
+        Journal::append(DEFINE_DATAREC, (xdrproc_t) xdr_datadef, ddef,
+                        ids[i]);
+    }
+    VLOG(("define_datarecs_2_svc ndefs=%u, nids=%u",
+          ddefs->defs.defs_len, result.ids.ids_len));
+    return &result;
+}
+
+int *write_global_attrs_2_svc(global_attrs * attrs, struct svc_req *)
+{
+    ServerStats::HandlerTimer timer;
+    RequestCapture::capture(WRITE_GLOBAL_ATTRS,
+                            (xdrproc_t) xdr_global_attrs, attrs);
+    Connections *connections = Connections::Instance();
+    std::shared_ptr<Connection> conn;
+    static thread_local int res;
+
+    res = -1;
+
+    if ((conn = (*connections)[attrs->connectionId]) == 0) {
+        PLOG(("write_global_attrs: invalid connection ID: %d",
+                    attrs->connectionId));
+        return &res;
+    }
+    res = conn->write_global_attrs(attrs);
+    if (res < 0) return &res;
+
+    // The journal keeps the last value of each attribute of a
+    // connection, so they are journaled one at a time.
+    for (unsigned int i = 0; i < attrs->attrs.attrs_len; i++) {
+        global_attr attr;
+        attr.attr = attrs->attrs.attrs_val[i];
+        attr.connectionId = attrs->connectionId;
+        Journal::append(WRITE_GLOBAL_ATTR, (xdrproc_t) xdr_global_attr, &attr);
+    }
+    for (unsigned int i = 0; i < attrs->intAttrs.intAttrs_len; i++) {
+        global_int_attr attr;
+        attr.name = attrs->intAttrs.intAttrs_val[i].name;
+        attr.value = attrs->intAttrs.intAttrs_val[i].value;
+        attr.connectionId = attrs->connectionId;
+        Journal::append(WRITE_GLOBAL_INT_ATTR,
+                        (xdrproc_t) xdr_global_int_attr, &attr);
+    }
+    return &res;
+}
@@ -0,0 +1,58 @@
+//              Copyright (C) by UCAR
+//
+// Description:
+//   Print the statistics of an nc_server: the counters and latency
+//   histograms of its connections and file groups, in the Prometheus
+//   text format, or with -t, the trace of the stages of the recent
+//   requests handled by each thread.
+
+#include "nc_server_client.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[])
+{
+    char *host;
+    CLIENT *clnt;
+    char **res;
+    int iarg = 1;
+    bool trace = argc > iarg && !strcmp(argv[iarg], "-t");
+    if (trace) iarg++;
+
+    if (argc <= iarg) {
+        fprintf(stderr,"\
+******************************************************************\n\
+nc_stats requests the statistics of the nc_server program on a host via RPC.\n\
+The records received and written, file opens, syncs and latencies of each\n\
+connection and file group are printed in the Prometheus text format.\n\
+With -t, the trace rings of nc_server -T are printed instead.\n\
+nc_stats is part of the nc_server-auxprogs package\n\
+******************************************************************\n\n");
+        fprintf(stderr,"usage:  %s [-t] server_host\n", argv[0]);
+        exit(1);
+    }
+    host = argv[iarg];
+    clnt = nc_server_client_create(host);
+    if (clnt == (CLIENT *) NULL) {
+        clnt_pcreateerror(host);
+        exit(1);
+    }
+
+    int status = 0;
+    if (trace)
+        res = get_trace_2((void *)0, clnt);
+    else
+        res = get_stats_2((void *)0, clnt);
+    if (res == (char **) NULL) {
+        clnt_perror(clnt, "call failed");
+        status = 1;
+    }
+    else {
+        fputs(*res, stdout);
+        xdr_free((xdrproc_t) xdr_wrapstring, (char *) res);
+    }
+    nc_server_client_destroy(clnt);
+    return status;
+}
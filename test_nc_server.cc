@@ -7,13 +7,153 @@ namespace utf = boost::unit_test;
 
 #include "nc_server.h"
 #include <memory>
+#include <vector>
+#include <string.h> // memset()
 #include <stdlib.h> // system()
+#include <unistd.h> // access(), truncate()
+#include <sys/stat.h>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using std::string;
 using std::unique_ptr;
 
 using nidas::util::UTime;
 
+namespace {
+
+/**
+ * Connections to FileGroups in the current directory, for the tests which
+ * write records through a Connection.  The connections which are still
+ * open are closed when the test ends, and the settings of the server which
+ * a test may change are restored, even if a BOOST_REQUIRE failed.
+ */
+struct ServerFixture
+{
+    typedef std::vector<std::pair<string, string> > VarList;
+
+    ServerFixture():
+        connections(Connections::Instance()),ids(),
+        maxOpenFiles(AllFiles::Instance()->getMaxOpenFiles())
+    {
+    }
+
+    ~ServerFixture()
+    {
+        close_all();
+        NS_NcFile::setRecordBuffer(1, 10);
+        NS_NcFile::setNoFill(false);
+        NS_NcFile::setHeaderReserve(0, 4);
+        NS_NcFile::setStageGroups(false);
+        connections->setWriteBehindLength(0);
+        AllFiles::Instance()->setMaxOpenFiles(maxOpenFiles);
+    }
+
+    static double
+    ttime(int year, int mon, int day, int hour = 0, int min = 0)
+    {
+        return UTime(true, year, mon, day, hour, min, 0).toDoubleSecs();
+    }
+
+    static void
+    remove(const string& files)
+    {
+        system((string("/bin/rm -f ") + files).c_str());
+    }
+
+    /**
+     * Open a connection to a group of files which are one day long.
+     */
+    int
+    open_connection(const string& format, double interval,
+                    const string& cdlfile = "")
+    {
+        string fmt(format), dir("."), cdl(cdlfile);
+        connection con{ 24 * 3600, interval, &fmt[0], &dir[0], &cdl[0] };
+        int id = connections->openConnection(&con);
+        BOOST_REQUIRE(id >= 0);
+        ids.push_back(id);
+        BOOST_REQUIRE(conn(id));
+        return id;
+    }
+
+    std::shared_ptr<Connection>
+    conn(int id)
+    {
+        return (*connections)[id];
+    }
+
+    /**
+     * Define a group of float time series variables, given their names
+     * and units.
+     */
+    int
+    add_group(int id, double interval,
+              const VarList& names = VarList{ { "T", "degC" } })
+    {
+        VarList copy(names);
+        std::vector<variable> vars(copy.size());
+        for (unsigned int i = 0; i < copy.size(); i++) {
+            memset(&vars[i], 0, sizeof(vars[i]));
+            vars[i].name = &copy[i].first[0];
+            vars[i].units = &copy[i].second[0];
+        }
+        datadef dd;
+        memset(&dd, 0, sizeof(dd));
+        dd.interval = interval;
+        dd.connectionId = id;
+        dd.rectype = NS_TIMESERIES;
+        dd.datatype = NS_FLOAT;
+        dd.variables.variables_len = vars.size();
+        dd.variables.variables_val = &vars.front();
+        dd.floatFill = 1.e37;
+        int groupid = conn(id)->add_var_group(&dd);
+        BOOST_REQUIRE(groupid >= 0);
+        return groupid;
+    }
+
+    int
+    put(int id, int groupid, double dtime, std::vector<float> data)
+    {
+        datarec_float rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.time = dtime;
+        rec.connectionId = id;
+        rec.datarecId = groupid;
+        rec.data.data_len = data.size();
+        rec.data.data_val = &data.front();
+        return conn(id)->put_rec(&rec);
+    }
+
+    int
+    put(int id, int groupid, double dtime, float data)
+    {
+        return put(id, groupid, dtime, std::vector<float>(1, data));
+    }
+
+    /**
+     * Close the connections, and all the files.
+     */
+    void
+    close_all()
+    {
+        for (unsigned int i = 0; i < ids.size(); i++)
+            connections->closeConnection(ids[i]);
+        ids.clear();
+        AllFiles::Instance()->close();
+    }
+
+    Connections* connections;
+
+    std::vector<int> ids;
+
+    int maxOpenFiles;
+};
+
+}
+
 
 BOOST_AUTO_TEST_CASE(create_basic_netcdf_file)
 {
@@ -74,3 +214,1058 @@ BOOST_AUTO_TEST_CASE(test_att_as_type)
     BOOST_TEST(!att_as_type("int:", "int", ival));
     BOOST_TEST(!att_as_type("float:", "float", dval));
 }
+
+
+BOOST_FIXTURE_TEST_CASE(write_datarec_float_array, ServerFixture)
+{
+    string xfile = "./testing_array_20231206_000000.nc";
+    remove(xfile);
+
+    double interval = 300;
+    double dtime = ttime(2023, 12, 6);
+
+    int id = open_connection("testing_array_%Y%m%d_%H%M%S.nc", interval);
+    int groupid = add_group(id, interval, { { "T", "degC" }, { "RH", "%" } });
+
+    const int nrecs = 10;
+    std::vector<float> data(2 * nrecs);
+    std::vector<datarec_float> recs(nrecs);
+    for (int i = 0; i < nrecs; i++) {
+        datarec_float& rec = recs[i];
+        memset(&rec, 0, sizeof(rec));
+        rec.time = dtime + i * interval;
+        rec.connectionId = id;
+        rec.datarecId = groupid;
+        data[2 * i] = i;
+        data[2 * i + 1] = 50 + i;
+        rec.data.data_len = 2;
+        rec.data.data_val = &data[2 * i];
+    }
+    datarec_float_array array;
+    array.connectionId = id;
+    array.recs.recs_len = nrecs;
+    array.recs.recs_val = &recs.front();
+    BOOST_TEST(conn(id)->put_recs(&array) == 0);
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == nrecs);
+    NcVar* rh = ncfile.get_var("RH");
+    BOOST_REQUIRE(rh);
+    std::unique_ptr<NcValues> vals(rh->values());
+    BOOST_TEST(vals->as_float(nrecs - 1) == 50 + nrecs - 1);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(write_behind_queue, ServerFixture)
+{
+    string xfile = "./testing_queue_20231206_000000.nc";
+    remove(xfile);
+
+    double interval = 300;
+    double dtime = ttime(2023, 12, 6);
+
+    // short queue, so that put_rec() has to wait for the writer
+    connections->setWriteBehindLength(4);
+    int id = open_connection("testing_queue_%Y%m%d_%H%M%S.nc", interval);
+    connections->setWriteBehindLength(0);
+    int groupid = add_group(id, interval);
+
+    const int nrecs = 10;
+    for (int i = 0; i < nrecs; i++) {
+        // the queue keeps a copy, so the data can be reused
+        BOOST_TEST(put(id, groupid, dtime + i * interval, i) == 0);
+    }
+    conn(id)->flush_queue();
+    BOOST_TEST(conn(id)->getState() == Connection::CONN_OK);
+
+    // an invalid record is rejected before it is queued
+    BOOST_TEST(put(id, groupid + 1, dtime, 0.0) == -1);
+    BOOST_TEST(conn(id)->getState() == Connection::CONN_ERROR);
+    BOOST_TEST(!conn(id)->getErrorMsg().empty());
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == nrecs);
+    NcVar* t = ncfile.get_var("T");
+    BOOST_REQUIRE(t);
+    std::unique_ptr<NcValues> vals(t->values());
+    BOOST_TEST(vals->as_float(nrecs - 1) == nrecs - 1);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(write_behind_error, ServerFixture)
+{
+    double interval = 300;
+    double dtime = ttime(2023, 12, 6);
+    remove("./testing_queue_error_20231206_000000.nc");
+
+    connections->setWriteBehindLength(10);
+    int id = open_connection("testing_queue_error_%Y%m%d_%H%M%S.nc",
+                             interval);
+    connections->setWriteBehindLength(0);
+    int groupid = add_group(id, interval);
+
+    {
+        // Keep the writer thread out of the group, so that the records
+        // after the bad one are queued before it fails.
+        std::lock_guard<std::recursive_mutex> glock(
+            conn(id)->getFileGroup()->mutex());
+        // passes check_rec(), but has too many values for the group
+        BOOST_TEST(put(id, groupid, dtime, std::vector<float>(2, 0.0)) == 0);
+        for (int i = 1; i <= 3; i++)
+            BOOST_TEST(put(id, groupid, dtime + i * interval, i) == 0);
+    }
+    conn(id)->flush_queue();
+
+    // the next write gets the error, and CHECK_ERROR says what was lost
+    BOOST_TEST(put(id, groupid, dtime + 4 * interval, 4.0) == -1);
+    BOOST_TEST(conn(id)->getState() == Connection::CONN_ERROR);
+    char** msg = check_error_2_svc(&id, 0);
+    BOOST_TEST(string(*msg).find(", 3 queued records after it were not written")
+               != std::string::npos);
+
+    std::string report = ServerStats::Instance()->report();
+    std::string labels = MetricsReport::label("connection",
+                                               Connection::getIdStr(id));
+    BOOST_TEST(report.find("} 3\n", report.find(
+        "nc_server_records_dropped_total{" + labels)) != std::string::npos);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(record_buffer, ServerFixture)
+{
+    string xfile = "./testing_buffer_20231206_000000.nc";
+    remove(xfile);
+
+    double interval = 300;
+    double dtime = ttime(2023, 12, 6);
+
+    // 10 records are written as blocks of 4, 4 and 2
+    NS_NcFile::setRecordBuffer(4, 3600);
+
+    int id = open_connection("testing_buffer_%Y%m%d_%H%M%S.nc", interval);
+    int groupid = add_group(id, interval);
+
+    const int nrecs = 10;
+    for (int i = 0; i < nrecs; i++)
+        BOOST_TEST(put(id, groupid, dtime + i * interval, i) == 0);
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == nrecs);
+    NcVar* t = ncfile.get_var("T");
+    BOOST_REQUIRE(t);
+    std::unique_ptr<NcValues> vals(t->values());
+    NcVar* tv = ncfile.get_var("time");
+    BOOST_REQUIRE(tv);
+    std::unique_ptr<NcValues> times(tv->values());
+    for (int i = 0; i < nrecs; i++) {
+        BOOST_TEST(vals->as_float(i) == i);
+        BOOST_TEST(times->as_double(i) == i * interval);
+    }
+}
+
+
+BOOST_FIXTURE_TEST_CASE(flush_idle_record_buffer, ServerFixture)
+{
+    string xfile = "./testing_idle_20231206_000000.nc";
+    remove(xfile);
+
+    double interval = 300;
+    double dtime = ttime(2023, 12, 6);
+
+    // room for many more records, which are at most a second old
+    NS_NcFile::setRecordBuffer(100, 1);
+
+    int id = open_connection("testing_idle_%Y%m%d_%H%M%S.nc", interval);
+    int groupid = add_group(id, interval);
+
+    const int nrecs = 3;
+    for (int i = 0; i < nrecs; i++)
+        BOOST_TEST(put(id, groupid, dtime + i * interval, i) == 0);
+
+    // No more data arrives, so only the periodic check of the dispatch
+    // loop writes the records, while the file is still open.
+    sleep(2);
+    AllFiles::Instance()->flush_old_records();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == nrecs);
+    NcVar* t = ncfile.get_var("T");
+    BOOST_REQUIRE(t);
+    std::unique_ptr<NcValues> vals(t->values());
+    BOOST_TEST(vals->as_float(nrecs - 1) == nrecs - 1);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(put_time_gap, ServerFixture)
+{
+    string xfile = "./testing_gap_20231206_000000.nc";
+    remove(xfile);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 6);
+
+    int id = open_connection("testing_gap_%Y%m%d_%H%M%S.nc", interval);
+    int groupid = add_group(id, interval);
+
+    // first record, then one after a gap of 999 records
+    const int nrecs = 1001;
+    BOOST_TEST(put(id, groupid, dtime, 1.0) == 0);
+    BOOST_TEST(put(id, groupid, dtime + (nrecs - 1) * interval, 2.0) == 0);
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == nrecs);
+    NcVar* tv = ncfile.get_var("time");
+    BOOST_REQUIRE(tv);
+    std::unique_ptr<NcValues> tvals(tv->values());
+    for (int i = 0; i < nrecs; i++)
+        BOOST_TEST(tvals->as_double(i) == i * interval);
+    NcVar* t = ncfile.get_var("T");
+    BOOST_REQUIRE(t);
+    std::unique_ptr<NcValues> vals(t->values());
+    BOOST_TEST(vals->as_float(0) == 1.0);
+    BOOST_TEST(vals->as_float(nrecs / 2) > 1.e36);
+    BOOST_TEST(vals->as_float(nrecs - 1) == 2.0);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(nofill_gaps, ServerFixture)
+{
+    string xfile = "./testing_nofill_20231206_000000.nc";
+    remove(xfile);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 6);
+
+    NS_NcFile::setNoFill(true);
+
+    int id = open_connection("testing_nofill_%Y%m%d_%H%M%S.nc", interval);
+
+    // T at records 0 and 10
+    const int nrecs = 11;
+    int tgroup = add_group(id, interval, { { "T", "degC" } });
+    BOOST_TEST(put(id, tgroup, dtime, 0) == 0);
+    BOOST_TEST(put(id, tgroup, dtime + 10 * interval, 10) == 0);
+
+    // P at record 5, a variable added after the gaps were filled once
+    AllFiles::Instance()->sync();
+    int pgroup = add_group(id, interval, { { "P", "mb" } });
+    BOOST_TEST(put(id, pgroup, dtime + 5 * interval, 5) == 0);
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == nrecs);
+    std::unique_ptr<NcValues> tvals(ncfile.get_var("T")->values());
+    std::unique_ptr<NcValues> pvals(ncfile.get_var("P")->values());
+    for (int i = 0; i < nrecs; i++) {
+        if (i == 0 || i == 10)
+            BOOST_TEST(tvals->as_float(i) == i);
+        else
+            BOOST_TEST(tvals->as_float(i) > 1.e36);
+        if (i == 5)
+            BOOST_TEST(pvals->as_float(i) == i);
+        else
+            BOOST_TEST(pvals->as_float(i) > 1.e36);
+    }
+}
+
+
+BOOST_FIXTURE_TEST_CASE(precreate_next_file, ServerFixture)
+{
+    string xfile = "./testing_pre_20231207_000000.nc";
+    remove(xfile);
+
+    // left by earlier processes, removed when the group is created
+    string leftover = "./.precreate.1.testing_pre_20231207_000000.nc";
+    std::ofstream(leftover.c_str()) << "partial";
+    BOOST_REQUIRE(access(leftover.c_str(), F_OK) == 0);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 6, 23, 58);
+
+    int id = open_connection("testing_pre_%Y%m%d_%H%M%S.nc", interval);
+    int groupid = add_group(id, interval);
+    BOOST_TEST(access(leftover.c_str(), F_OK) != 0);
+    BOOST_TEST(put(id, groupid, dtime, 1.0) == 0);
+
+    // not yet within 60 seconds of the end of the day
+    AllFiles::Instance()->precreate_files(60);
+    BOOST_TEST(access(xfile.c_str(), F_OK) != 0);
+
+    AllFiles::Instance()->precreate_files(300);
+    BOOST_TEST(access(xfile.c_str(), F_OK) == 0);
+    int nfiles = AllFiles::Instance()->num_files();
+
+    // the first record of the next day goes to the pre-created file
+    BOOST_TEST(put(id, groupid, dtime + 2 * interval, 1.0) == 0);
+    BOOST_TEST(AllFiles::Instance()->num_files() == nfiles);
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.get_var("T"));
+    BOOST_TEST(ncfile.rec_dim()->size() == 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(check_truncated_file, ServerFixture)
+{
+    string xfile = "./testing_chk_20231206_000000.nc";
+    remove(xfile + " " + xfile + ".bad");
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 6);
+
+    for (int pass = 0; pass < 3; pass++) {
+        int id = open_connection("testing_chk_%Y%m%d_%H%M%S.nc", interval);
+        int groupid = add_group(id, interval);
+        for (int i = 0; i < 400; i++) {
+            BOOST_TEST(put(id, groupid,
+                           dtime + (pass * 400 + i) * interval, 1.0) == 0);
+        }
+        close_all();
+
+        if (pass == 1) {
+            // intact when reopened, now truncate it
+            struct stat st;
+            BOOST_REQUIRE(stat(xfile.c_str(), &st) == 0);
+            BOOST_REQUIRE(truncate(xfile.c_str(), st.st_size - 1000) == 0);
+        }
+    }
+    // the truncated file was renamed, and a new one created
+    BOOST_TEST(access((xfile + ".bad").c_str(), F_OK) == 0);
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == 1200);
+}
+
+BOOST_FIXTURE_TEST_CASE(create_from_cdl, ServerFixture)
+{
+    string xfile = "./testing_cdl_20231206_000000.nc";
+    string cdl = "./testing_cdl.cdl";
+    remove(xfile);
+    {
+        std::ofstream out(cdl.c_str());
+        out << "netcdf testing {\n"
+            << "dimensions:\n"
+            << "    time = UNLIMITED ; // (0 currently)\n"
+            << "    station = 2 ;\n"
+            << "variables:\n"
+            << "    double time(time) ;\n"
+            << "        time:long_name = \"time\" ;\n"
+            << "    float height(station) ;\n"
+            << "        height:units = \"m\" ;\n"
+            << "    :project = \"TEST\" ;\n"
+            << "data:\n"
+            << "    height = 2.5, 10 ;\n"
+            << "}\n";
+    }
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 6, 12);
+
+    int id = open_connection("testing_cdl_%Y%m%d_%H%M%S.nc", interval, cdl);
+    int groupid = add_group(id, interval);
+    BOOST_TEST(put(id, groupid, dtime, 1.0) == 0);
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.get_var("T"));
+    BOOST_TEST(ncfile.get_att("project"));
+    NcVar* height = ncfile.get_var("height");
+    BOOST_REQUIRE(height);
+    BOOST_TEST(height->as_float(1) == 10.0);
+}
+
+BOOST_FIXTURE_TEST_CASE(close_least_recently_used, ServerFixture)
+{
+    AllFiles* allfiles = AllFiles::Instance();
+    allfiles->setMaxOpenFiles(2);
+    BOOST_REQUIRE(allfiles->getMaxOpenFiles() == 2);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 6);
+
+    // one file group per connection
+    const char* formats[3] = { "testing_lru0_%Y%m%d.nc", "testing_lru1_%Y%m%d.nc",
+        "testing_lru2_%Y%m%d.nc" };
+    std::vector<int> groupids;
+    for (unsigned int i = 0; i < 3; i++) {
+        int id = open_connection(formats[i], interval);
+        groupids.push_back(add_group(id, interval));
+    }
+
+    for (unsigned int i = 0; i < ids.size(); i++) {
+        BOOST_TEST(put(ids[i], groupids[i], dtime, 1.0) == 0);
+        BOOST_TEST(allfiles->num_files() == std::min((int)i + 1, 2));
+    }
+    // the least recently used file was closed, and is reopened
+    BOOST_TEST(put(ids[0], groupids[0], dtime + interval, 1.0) == 0);
+    BOOST_TEST(allfiles->num_files() == 2);
+
+    close_all();
+    BOOST_TEST(allfiles->num_files() == 0);
+
+    NcFile ncfile("./testing_lru0_20231206.nc", NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(close_lru_skips_locked_groups, ServerFixture)
+{
+    AllFiles* allfiles = AllFiles::Instance();
+    allfiles->setMaxOpenFiles(1);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 6);
+    remove("./testing_lrulock*_2023120*.nc");
+
+    int ida = open_connection("testing_lrulocka_%Y%m%d.nc", interval);
+    int groupa = add_group(ida, interval);
+    int idb = open_connection("testing_lrulockb_%Y%m%d.nc", interval);
+    int groupb = add_group(idb, interval);
+
+    BOOST_TEST(put(ida, groupa, dtime, 1.0) == 0);
+    BOOST_TEST(allfiles->num_files() == 1);
+
+    // Another thread holds group a, and the file just opened by group b
+    // must not be closed either, so both stay open over the limit.
+    std::mutex mtx;
+    std::condition_variable cond;
+    bool locked = false, done = false;
+    std::thread holder([&]() {
+        std::lock_guard<std::recursive_mutex> glock(
+            conn(ida)->getFileGroup()->mutex());
+        std::unique_lock<std::mutex> lock(mtx);
+        locked = true;
+        cond.notify_all();
+        cond.wait(lock, [&]() { return done; });
+    });
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cond.wait(lock, [&]() { return locked; });
+    }
+    BOOST_TEST(put(idb, groupb, dtime, 2.0) == 0);
+    BOOST_TEST(allfiles->num_files() == 2);
+    BOOST_TEST(put(idb, groupb, dtime + interval, 3.0) == 0);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        done = true;
+        cond.notify_all();
+    }
+    holder.join();
+
+    // group a is free now, and its file is the least recently used
+    BOOST_TEST(put(idb, groupb, dtime + 86400, 4.0) == 0);
+    BOOST_TEST(allfiles->num_files() == 2);
+
+    close_all();
+    BOOST_TEST(allfiles->num_files() == 0);
+
+    NcFile ncfile("./testing_lrulockb_20231206.nc", NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == 2);
+    NcVar* var = ncfile.get_var("T");
+    BOOST_REQUIRE(var);
+    std::unique_ptr<NcValues> vals(var->values());
+    BOOST_TEST(vals->as_float(1) == 3.0);
+}
+
+BOOST_FIXTURE_TEST_CASE(interleaved_backfill, ServerFixture)
+{
+    double interval = 60;
+    double dtime = ttime(2023, 12, 1);
+    remove("./testing_bf_2023120[123].nc");
+
+    int id = open_connection("testing_bf_%Y%m%d.nc", interval);
+    int groupid = add_group(id, interval);
+
+    // records of three days, interleaved, the last day first
+    for (int i = 0; i < 10; i++) {
+        for (int day = 2; day >= 0; day--) {
+            BOOST_TEST(put(id, groupid, dtime + day * 86400 + i * interval,
+                           day * 100 + i) == 0);
+        }
+    }
+    BOOST_TEST(AllFiles::Instance()->num_files() == 3);
+
+    close_all();
+
+    for (int day = 0; day < 3; day++) {
+        std::ostringstream ost;
+        ost << "./testing_bf_2023120" << day + 1 << ".nc";
+        NcFile ncfile(ost.str().c_str(), NcFile::ReadOnly);
+        BOOST_REQUIRE(ncfile.is_valid());
+        BOOST_TEST(ncfile.rec_dim()->size() == 10);
+        NcVar* var = ncfile.get_var("T");
+        BOOST_REQUIRE(var);
+        BOOST_TEST(var->as_float(9) == day * 100 + 9);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(server_stats, ServerFixture)
+{
+    double interval = 60;
+    double dtime = ttime(2023, 12, 7);
+    remove("./testing_stats_20231207.nc");
+
+    int id = open_connection("testing_stats_%Y%m%d.nc", interval);
+    int groupid = add_group(id, interval);
+    for (int i = 0; i < 5; i++)
+        BOOST_TEST(put(id, groupid, dtime + i * interval, 1.0) == 0);
+    AllFiles::Instance()->sync();
+
+    std::string report = ServerStats::Instance()->report();
+    std::string labels = MetricsReport::label("connection",
+                                               Connection::getIdStr(id));
+    BOOST_TEST(report.find("nc_server_records_received_total{" + labels +
+                           ",") != std::string::npos);
+    BOOST_TEST(report.find("} 5\n", report.find(
+        "nc_server_records_written_total{" + labels)) != std::string::npos);
+    BOOST_TEST(report.find("nc_server_sync_seconds_count{") !=
+               std::string::npos);
+    BOOST_TEST(report.find("# TYPE nc_server_put_seconds histogram\n") !=
+               std::string::npos);
+}
+
+BOOST_FIXTURE_TEST_CASE(trace_put_rec, ServerFixture)
+{
+    double interval = 60;
+    double dtime = ttime(2023, 12, 8);
+    remove("./testing_trace_20231208.nc");
+
+    BOOST_TEST(Trace::dump().find("not enabled") != std::string::npos);
+    Trace::enable(64, 0);
+
+    int id = open_connection("testing_trace_%Y%m%d.nc", interval);
+    int groupid = add_group(id, interval);
+
+    Trace::begin();
+    BOOST_TEST(put(id, groupid, dtime, 1.0) == 0);
+    Trace::end();
+
+    std::string dump = Trace::dump();
+    const char* stages[] = { " begin ", " lookup ", " open_file ",
+        " get_file ", " get_vars ", " put_time ", " put_vars ", " end " };
+    std::string::size_type pos = 0;
+    for (unsigned int i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        pos = dump.find(stages[i], pos);
+        BOOST_TEST(pos != std::string::npos, "missing" << stages[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(trace_slow_stages)
+{
+    // in milliseconds since the begin of the request
+    Trace::Probes probes;
+    Trace::Point points[] = { Trace::BEGIN, Trace::DECODE, Trace::LOOKUP,
+        Trace::PUT_VARS, Trace::FLUSH, Trace::PUT_VARS, Trace::END };
+    long long msecs[] = { 0, 1, 3, 6, 10, 15, 16 };
+    for (unsigned int i = 0; i < sizeof(msecs) / sizeof(msecs[0]); i++)
+        probes.push_back(std::make_pair(points[i], msecs[i] * 1000000LL));
+
+    // put_vars is summed over both of its probes, and the flush of
+    // the record buffer is a stage of its own
+    BOOST_TEST(Trace::stages(probes) ==
+               " decode=0.001000 lookup=0.002000 put_vars=0.008000(2)"
+               " flush=0.004000 end=0.001000");
+    BOOST_TEST(Trace::stages(Trace::Probes()) == "");
+}
+
+BOOST_AUTO_TEST_CASE(capture_requests)
+{
+    const char* capfile = "testing_capture.dat";
+    RequestCapture* capture = RequestCapture::Instance();
+    capture->open(capfile);
+    BOOST_TEST(RequestCapture::active());
+
+    float data[2] = { 1.0, 2.0 };
+    datarec_float rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.time = UTime(true, 2023, 12, 9, 0, 0, 0).toDoubleSecs();
+    rec.connectionId = 7;
+    rec.datarecId = 3;
+    rec.data.data_len = 2;
+    rec.data.data_val = data;
+    RequestCapture::capture(WRITE_DATAREC_FLOAT,
+                            (xdrproc_t) xdr_datarec_float, &rec);
+    capture->close();
+    BOOST_TEST(!RequestCapture::active());
+
+    FILE* fp = fopen(capfile, "r");
+    BOOST_REQUIRE(fp);
+    XDR xdrs;
+    xdrstdio_create(&xdrs, fp, XDR_DECODE);
+    unsigned int magic = 0, proc = 0;
+    double t = 0.0;
+    int result = -1;
+    BOOST_TEST(xdr_u_int(&xdrs, &magic));
+    BOOST_TEST(magic == RequestCapture::MAGIC);
+    BOOST_TEST(xdr_double(&xdrs, &t));
+    BOOST_TEST(t > 0.0);
+    BOOST_TEST(xdr_u_int(&xdrs, &proc));
+    BOOST_TEST(proc == WRITE_DATAREC_FLOAT);
+    BOOST_TEST(xdr_int(&xdrs, &result));
+    BOOST_TEST(result == 0);
+
+    datarec_float rrec;
+    memset(&rrec, 0, sizeof(rrec));
+    BOOST_REQUIRE(xdr_datarec_float(&xdrs, &rrec));
+    BOOST_TEST(rrec.time == rec.time);
+    BOOST_TEST(rrec.connectionId == 7);
+    BOOST_TEST(rrec.datarecId == 3);
+    BOOST_REQUIRE(rrec.data.data_len == 2);
+    BOOST_TEST(rrec.data.data_val[1] == 2.0);
+    xdr_free((xdrproc_t) xdr_datarec_float, (char*) &rrec);
+    BOOST_TEST(!xdr_double(&xdrs, &t));
+    xdr_destroy(&xdrs);
+    fclose(fp);
+}
+
+BOOST_FIXTURE_TEST_CASE(journal_recovery, ServerFixture)
+{
+    const char* jfile = "testing_journal.dat";
+    string xfile = "./testing_journal_20231210.nc";
+    remove("testing_journal.dat* " + xfile);
+
+    Journal* journal = Journal::Instance();
+    journal->open(jfile, 3600);
+    BOOST_TEST(Journal::active());
+    BOOST_TEST(NS_NcFile::getSyncInterval() == 3600);
+
+    char filename[] = "testing_journal_%Y%m%d.nc";
+    char filedir[] = ".";
+    char cdlfile[] = "";
+    double interval = 60;
+    double dtime = ttime(2023, 12, 10);
+
+    connection con{ 24 * 3600, interval, filename, filedir, cdlfile };
+    int id = open_connection(filename, interval);
+    Journal::append(OPEN_CONNECTION, (xdrproc_t) xdr_connection, &con, id);
+
+    char tname[] = "T";
+    char tunits[] = "degC";
+    variable vars[1] = { { tname, tunits, { 0, 0 } } };
+    datadef dd;
+    memset(&dd, 0, sizeof(dd));
+    dd.interval = interval;
+    dd.connectionId = id;
+    dd.rectype = NS_TIMESERIES;
+    dd.datatype = NS_FLOAT;
+    dd.variables.variables_len = 1;
+    dd.variables.variables_val = vars;
+    dd.floatFill = 1.e37;
+    int groupid = conn(id)->add_var_group(&dd);
+    BOOST_REQUIRE(groupid >= 0);
+    Journal::append(DEFINE_DATAREC, (xdrproc_t) xdr_datadef, &dd, groupid);
+
+    // The new journal starts with the connection and its variables.
+    journal->checkpoint();
+
+    const int nrecs = 5;
+    float data = 0.0;
+    datarec_float rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.connectionId = id;
+    rec.datarecId = groupid;
+    rec.data.data_len = 1;
+    rec.data.data_val = &data;
+    for (int i = 0; i < nrecs; i++) {
+        rec.time = dtime + i * interval;
+        data = i;
+        BOOST_TEST(conn(id)->put_rec(&rec) == 0);
+        Journal::append(WRITE_DATAREC_FLOAT, (xdrproc_t) xdr_datarec_float,
+                        &rec);
+    }
+
+    // Stop as if the server crashed, and lose the file.
+    journal->close(false);
+    BOOST_TEST(!Journal::active());
+    BOOST_TEST(NS_NcFile::getSyncInterval() ==
+               NS_NcFile::SYNC_CHECK_INTERVAL_SECS);
+    close_all();
+    remove(xfile);
+
+    BOOST_TEST(journal->recover(jfile) == nrecs);
+    AllFiles::Instance()->close();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == nrecs);
+    NcVar* t = ncfile.get_var("T");
+    BOOST_REQUIRE(t);
+    std::unique_ptr<NcValues> vals(t->values());
+    BOOST_TEST(vals->as_float(nrecs - 1) == nrecs - 1);
+    ::unlink(jfile);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(sequence_ack, ServerFixture)
+{
+    string xfile = "./testing_seq_20231211.nc";
+    remove(xfile);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 11);
+
+    int id = open_connection("testing_seq_%Y%m%d.nc", interval);
+    int groupid = add_group(id, interval);
+    std::shared_ptr<Connection> cp = conn(id);
+
+    const int nrecs = 6;
+    std::vector<float> data(nrecs);
+    std::vector<datarec_float> recs(nrecs);
+    for (int i = 0; i < nrecs; i++) {
+        datarec_float& rec = recs[i];
+        memset(&rec, 0, sizeof(rec));
+        rec.time = dtime + i * interval;
+        rec.connectionId = id;
+        rec.datarecId = groupid;
+        data[i] = i;
+        rec.data.data_len = 1;
+        rec.data.data_val = &data[i];
+    }
+    datarec_float_seq seqrecs;
+    seqrecs.connectionId = id;
+    seqrecs.seq = 1;
+    seqrecs.recs.recs_len = 4;
+    seqrecs.recs.recs_val = &recs.front();
+    BOOST_TEST(cp->put_recs(&seqrecs) == 0);
+
+    unsigned long long applied, durable;
+    string error;
+    cp->get_ack(applied, durable, error);
+    BOOST_TEST(applied == 4);
+    BOOST_TEST(durable == 0);
+    BOOST_TEST(error.empty());
+
+    // Records 3 and 4 are sent again, and skipped.
+    data[2] = -1;
+    seqrecs.seq = 3;
+    seqrecs.recs.recs_len = 4;
+    seqrecs.recs.recs_val = &recs[2];
+    BOOST_TEST(cp->put_recs(&seqrecs) == 0);
+    cp->get_ack(applied, durable, error);
+    BOOST_TEST(applied == nrecs);
+
+    AllFiles::Instance()->sync();
+    cp->get_ack(applied, durable, error);
+    BOOST_TEST(durable == nrecs);
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.rec_dim()->size() == nrecs);
+    NcVar* t = ncfile.get_var("T");
+    BOOST_REQUIRE(t);
+    std::unique_ptr<NcValues> vals(t->values());
+    BOOST_TEST(vals->as_float(2) == 2);
+    BOOST_TEST(vals->as_float(nrecs - 1) == nrecs - 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(write_failure_not_durable, ServerFixture)
+{
+    remove("./testing_seqfail_20231211.nc");
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 11);
+
+    int id = open_connection("testing_seqfail_%Y%m%d.nc", interval);
+    int groupid = add_group(id, interval);
+    std::shared_ptr<Connection> cp = conn(id);
+
+    std::vector<float> data(2, 1.0);
+    std::vector<datarec_float> recs(2);
+    for (int i = 0; i < 2; i++) {
+        memset(&recs[i], 0, sizeof(recs[i]));
+        recs[i].time = dtime + i * interval;
+        recs[i].connectionId = id;
+        recs[i].datarecId = groupid;
+        recs[i].data.data_len = 1;
+        recs[i].data.data_val = &data[i];
+    }
+    datarec_float_seq seqrecs;
+    seqrecs.connectionId = id;
+    seqrecs.seq = 1;
+    seqrecs.recs.recs_len = 2;
+    seqrecs.recs.recs_val = &recs.front();
+    BOOST_TEST(cp->put_recs(&seqrecs) == 0);
+
+    // as when buffered records of the file cannot be written
+    FileGroup* group = cp->getFileGroup();
+    {
+        std::lock_guard<std::recursive_mutex> glock(group->mutex());
+        group->write_failed(group->get_file(dtime), "put_var T: disk full");
+    }
+    AllFiles::Instance()->sync();
+
+    unsigned long long applied, durable;
+    string error;
+    cp->get_ack(applied, durable, error);
+    BOOST_TEST(applied == 2);
+    BOOST_TEST(durable == 0);
+    BOOST_TEST(error == "put_var T: disk full");
+    BOOST_TEST(put(id, groupid, dtime + 2 * interval, 1.0) == -1);
+
+    // nor once the file is closed
+    AllFiles::Instance()->close();
+    cp->get_ack(applied, durable, error);
+    BOOST_TEST(durable == 0);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(bulk_setup, ServerFixture)
+{
+    string xfile = "./testing_bulk_20231212.nc";
+    remove(xfile);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 12);
+
+    int id = open_connection("testing_bulk_%Y%m%d.nc", interval);
+    std::shared_ptr<Connection> cp = conn(id);
+
+    char tname[] = "T";
+    char rhname[] = "RH";
+    char tunits[] = "degC";
+    char rhunits[] = "%";
+    variable tvars[1] = { { tname, tunits, { 0, 0 } } };
+    variable rhvars[1] = { { rhname, rhunits, { 0, 0 } } };
+    datadef dds[2];
+    for (int i = 0; i < 2; i++) {
+        datadef& dd = dds[i];
+        memset(&dd, 0, sizeof(dd));
+        dd.interval = interval;
+        dd.connectionId = id;
+        dd.rectype = NS_TIMESERIES;
+        dd.datatype = NS_FLOAT;
+        dd.variables.variables_len = 1;
+        dd.variables.variables_val = (i == 0 ? tvars : rhvars);
+        dd.floatFill = 1.e37;
+    }
+    datadefs defs;
+    defs.connectionId = id;
+    defs.defs.defs_len = 2;
+    defs.defs.defs_val = dds;
+    std::vector<int> groupids;
+    BOOST_REQUIRE(cp->add_var_groups(&defs, groupids) == 0);
+    BOOST_REQUIRE(groupids.size() == 2);
+    BOOST_TEST(groupids[0] != groupids[1]);
+    // the same definition gets the same id
+    BOOST_TEST(cp->add_var_group(&dds[1]) == groupids[1]);
+
+    float data[2] = { 1.0, 50.0 };
+    for (int i = 0; i < 2; i++)
+        BOOST_TEST(put(id, groupids[i], dtime, data[i]) == 0);
+
+    char dataset[] = "dataset";
+    char dsvalue[] = "bulk";
+    char rotation[] = "wind3d_horiz_rotation";
+    str_attr sattrs[1] = { { dataset, dsvalue } };
+    int_attr iattrs[1] = { { rotation, 1 } };
+    global_attrs attrs;
+    attrs.connectionId = id;
+    attrs.attrs.attrs_len = 1;
+    attrs.attrs.attrs_val = sattrs;
+    attrs.intAttrs.intAttrs_len = 1;
+    attrs.intAttrs.intAttrs_val = iattrs;
+    BOOST_TEST(cp->write_global_attrs(&attrs) == 0);
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.get_var("T"));
+    BOOST_TEST(ncfile.get_var("RH"));
+    std::unique_ptr<NcAtt> att(ncfile.get_att("dataset"));
+    BOOST_REQUIRE(att);
+    std::unique_ptr<char[]> value(att->as_string(0));
+    BOOST_TEST(string(value.get()) == "bulk");
+    att.reset(ncfile.get_att("wind3d_horiz_rotation"));
+    BOOST_REQUIRE(att);
+    BOOST_TEST(att->as_int(0) == 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(header_reserve, ServerFixture)
+{
+    string xfile = "./testing_reserve_20231213.nc";
+    remove(xfile);
+    NS_NcFile::setHeaderReserve(8192, 4);
+    NS_NcFile::setStageGroups(true);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 13);
+
+    int id = open_connection("testing_reserve_%Y%m%d.nc", interval);
+    int tgroup = add_group(id, interval, { { "T", "degC" } });
+    add_group(id, interval, { { "RH", "%" } });
+
+    // Only T is written, RH is added to the file with it.
+    for (int i = 0; i < 5; i++)
+        BOOST_TEST(put(id, tgroup, dtime + i * interval, 1.0) == 0);
+    AllFiles::Instance()->sync();
+
+    // The attribute fits in the free space of the header.
+    BOOST_TEST(conn(id)->write_global_attr("dataset", "reserve") == 0);
+    BOOST_TEST(put(id, tgroup, dtime + 5 * interval, 1.0) == 0);
+    AllFiles::Instance()->sync();
+    close_all();
+
+    struct stat sbuf;
+    BOOST_REQUIRE(::stat(xfile.c_str(), &sbuf) == 0);
+    BOOST_TEST(sbuf.st_size > 8192);
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.get_var("T"));
+    BOOST_TEST(ncfile.get_var("RH"));
+    std::unique_ptr<NcAtt> att(ncfile.get_att("dataset"));
+    BOOST_TEST(att.get());
+}
+
+BOOST_FIXTURE_TEST_CASE(groups_without_data, ServerFixture)
+{
+    string xfile = "./testing_nostage_20231213.nc";
+    remove(xfile);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 13);
+
+    int id = open_connection("testing_nostage_%Y%m%d.nc", interval);
+    int tgroup = add_group(id, interval, { { "T", "degC" } });
+    add_group(id, interval, { { "RH", "%" } });
+
+    // By default a group is not added to a file it has no data for.
+    BOOST_TEST(put(id, tgroup, dtime, 1.0) == 0);
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    BOOST_TEST(ncfile.get_var("T"));
+    BOOST_TEST(!ncfile.get_var("RH"));
+}
+
+BOOST_FIXTURE_TEST_CASE(attribute_cache, ServerFixture)
+{
+    string xfile = "./testing_attrs_20231214.nc";
+    remove(xfile);
+
+    double interval = 60;
+    double dtime = ttime(2023, 12, 14);
+
+    // two connections to the same group, with the same history
+    for (int i = 0; i < 2; i++) {
+        int id = open_connection("testing_attrs_%Y%m%d.nc", interval);
+        BOOST_TEST(conn(id)->put_history("attribute_cache test\n") == 0);
+    }
+    int id = ids[0];
+    int groupid = add_group(id, interval);
+    BOOST_TEST(put(id, groupid, dtime, 1.0) == 0);
+
+    // only the last value of an attribute reaches the file
+    std::shared_ptr<Connection> cp = conn(id);
+    BOOST_TEST(cp->write_global_attr("dataset", "first") == 0);
+    BOOST_TEST(cp->write_global_attr("dataset", "second") == 0);
+    BOOST_TEST(cp->write_global_attr("dataset", "second") == 0);
+    BOOST_TEST(cp->write_global_attr("wind3d_horiz_rotation", 1) == 0);
+
+    close_all();
+
+    NcFile ncfile(xfile.c_str(), NcFile::ReadOnly);
+    BOOST_REQUIRE(ncfile.is_valid());
+    std::unique_ptr<NcAtt> att(ncfile.get_att("dataset"));
+    BOOST_REQUIRE(att);
+    std::unique_ptr<char[]> value(att->as_string(0));
+    BOOST_TEST(string(value.get()) == "second");
+    att.reset(ncfile.get_att("wind3d_horiz_rotation"));
+    BOOST_REQUIRE(att);
+    BOOST_TEST(att->as_int(0) == 1);
+    att.reset(ncfile.get_att("history"));
+    BOOST_REQUIRE(att);
+    value.reset(att->as_string(0));
+    string history(value.get());
+    string::size_type i1 = history.find("attribute_cache test\n");
+    BOOST_TEST(i1 != string::npos);
+    BOOST_TEST(history.find("attribute_cache test\n", i1 + 1) == string::npos);
+}
+
+
+BOOST_FIXTURE_TEST_CASE(threaded_dispatch, ServerFixture)
+{
+    // With -t nthreads the RPC handlers run concurrently. Write to
+    // separate file groups from several threads, and close one more
+    // connection while a thread is still writing to it.
+    const int nthreads = 4;
+    const int nrecs = 50;
+    double interval = 60;
+    double dtime = ttime(2023, 12, 6);
+    remove("./testing_thread*_20231206.nc");
+
+    std::vector<int> groupids;
+    for (int i = 0; i <= nthreads; i++) {
+        string format = "testing_thread" + std::to_string(i) + "_%Y%m%d.nc";
+        int id = open_connection(format, interval);
+        groupids.push_back(add_group(id, interval));
+    }
+
+    // Boost.Test is not thread safe, so count the errors in each thread
+    std::vector<int> errors(nthreads + 1, 0);
+    auto writer = [&](int i) {
+        for (int n = 0; n < nrecs; n++) {
+            float data = i * 1000 + n;
+            datarec_float rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.time = dtime + n * interval;
+            rec.connectionId = ids[i];
+            rec.datarecId = groupids[i];
+            rec.data.data_len = 1;
+            rec.data.data_val = &data;
+            int* res = write_datarec_float_2_svc(&rec, 0);
+            if (*res != 0) errors[i]++;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i <= nthreads; i++)
+        threads.push_back(std::thread(writer, i));
+    int closeid = ids[nthreads];
+    BOOST_TEST(*close_connection_2_svc(&closeid, 0) == 0);
+    for (unsigned int i = 0; i < threads.size(); i++)
+        threads[i].join();
+    ids.pop_back();
+    BOOST_TEST(!conn(closeid));
+    // the last connection may have been closed under its writer
+    for (int i = 0; i < nthreads; i++)
+        BOOST_TEST(errors[i] == 0);
+
+    close_all();
+
+    for (int i = 0; i < nthreads; i++) {
+        string file = "./testing_thread" + std::to_string(i) + "_20231206.nc";
+        NcFile ncfile(file.c_str(), NcFile::ReadOnly);
+        BOOST_REQUIRE(ncfile.is_valid());
+        BOOST_TEST(ncfile.rec_dim()->size() == nrecs);
+        NcVar* var = ncfile.get_var("T");
+        BOOST_REQUIRE(var);
+        std::unique_ptr<NcValues> vals(var->values());
+        for (int n = 0; n < nrecs; n++)
+            BOOST_TEST(vals->as_float(n) == i * 1000 + n);
+    }
+}